@@ -9,16 +9,36 @@
 #ifndef _PUMA_H_
 #define _PUMA_H_
 
+#include <functional>
 #include <string>
 #include <vector>
 
 struct CompilerOptions {
 
-        enum GraphPartitioningScheme { GP_ROW_MAJOR, GP_COL_MAJOR, GP_KAHIP, GP_RANDOM };
+        enum GraphPartitioningScheme { GP_ROW_MAJOR, GP_COL_MAJOR, GP_KAHIP, GP_RANDOM, GP_MULTILEVEL };
+        enum NoCTopology { NOC_MESH, NOC_CMESH };
+        enum LinearizationScheme { LS_DEPTH_FIRST, LS_LIST_SCHEDULING };
 
         GraphPartitioningScheme gp_ = GP_ROW_MAJOR;
         bool coalesceMVMOperations_ = true;
+        bool packMatrixTiles_ = false; // Share the rows of one MVMU among constant matrix tiles that are less than MVMU_DIM rows high
+        LinearizationScheme ls_ = LS_DEPTH_FIRST;
         bool printDebugInfo_ = false;
+        unsigned int nThreads_ = 0; // Number of threads used by parallel compiler passes (0 uses all hardware threads)
+        unsigned int tileMemoryCapacity_ = 0; // Size of the shared memory of each tile (0 for unlimited)
+        NoCTopology noc_ = NOC_MESH;
+        unsigned int nocMeshWidth_ = 0; // Number of routers in each row of the mesh (0 for a square mesh)
+        unsigned int nocConcentration_ = 4; // Number of tiles attached to each router of a concentrated mesh
+
+};
+
+struct DataGenerationOptions {
+
+        enum WeightFormat { WF_BINARY, WF_TEXT };
+
+        WeightFormat format_ = WF_BINARY; // Binary writes a single memory-mappable image, text writes one file per MVMU
+        bool elideZeroRegions_ = true; // Only store the nonzero block of each crossbar in the binary image
+        unsigned int nInFlightBlocks_ = 0; // Number of crossbars buffered at once, bounding the memory used (0 for two per thread)
 
 };
 
@@ -220,10 +240,27 @@ class ModelInstance {
 
     public:
 
+        enum MatrixLayout { ML_ROW_MAJOR, ML_COL_MAJOR };
+        enum ElementType { ET_FLOAT32, ET_FLOAT16 };
+        // Order of the dimensions of convolution kernels, outermost first: kernel height (H), kernel width (W), output channels (O) and input channels (I)
+        enum KernelLayout { KL_HWOI, KL_HWIO /* Channel-last */, KL_OIHW /* Channel-first */ };
+
+        // Copies the nRows x nCols block of a matrix starting at (row, col) into block, whose rows are stride elements
+        // apart. Blocks are at most 128 x 128 and may be requested concurrently from several threads.
+        typedef std::function<void(unsigned int row, unsigned int col, unsigned int nRows, unsigned int nCols, float* block, unsigned int stride)> BlockReader;
+
         static ModelInstance create(Model model);
 
-        void bind(std::string tensorName, float* data);
-        void generateData();
+        // Matrices are bound as height x width matrices. A convolutional matrix in the default KL_HWOI layout is viewed as a
+        // (kernelHeight*kernelWidth*nOutChannels) x nInChannels matrix, one nOutChannels x nInChannels slice per kernel position.
+        void bind(std::string tensorName, float* data); // Row-major data that must stay valid until generateData returns
+        void bindFile(std::string tensorName, std::string fileName, size_t offset=0, MatrixLayout layout=ML_ROW_MAJOR, ElementType type=ET_FLOAT32); // Memory-mapped while generating data
+        void bindBlocks(std::string tensorName, BlockReader reader); // Pulled one block at a time while generating data
+        // Layout of the data bound to a convolutional matrix. KL_HWIO data is viewed as a
+        // (kernelHeight*kernelWidth*nInChannels) x nOutChannels matrix and KL_OIHW data as a
+        // nOutChannels x (nInChannels*kernelHeight*kernelWidth) matrix. Kernels are repacked while generating data.
+        void setKernelLayout(std::string tensorName, KernelLayout layout);
+        void generateData(DataGenerationOptions options=DataGenerationOptions());
 
         ModelInstanceImpl* unwrap();
 
@@ -0,0 +1,44 @@
+/*
+ *  Copyright (c) 2019 IMPACT Research Group, University of Illinois.
+ *  All rights reserved.
+ *
+ *  This file is covered by the LICENSE.txt license file in the root directory.
+ *
+ */
+
+#include <assert.h>
+#include <cstdlib>
+
+#include "puma.h"
+
+#include "arena.h"
+#include "model.h"
+
+Arena::~Arena() {
+    for(char* chunk : chunks_) {
+        free(chunk);
+    }
+}
+
+void* Arena::allocate(std::size_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const std::size_t alignment = alignof(std::max_align_t);
+    size = (size + alignment - 1)/alignment*alignment;
+    if(next_ == NULL || (std::size_t)(end_ - next_) < size) {
+        // Objects larger than a chunk get a chunk of their own
+        std::size_t chunkSize = (size > CHUNK_SIZE)?(size):(CHUNK_SIZE);
+        char* chunk = (char*) malloc(chunkSize);
+        assert(chunk != NULL && "Arena ran out of memory!");
+        chunks_.push_back(chunk);
+        next_ = chunk;
+        end_ = chunk + chunkSize;
+    }
+    void* ptr = next_;
+    next_ += size;
+    return ptr;
+}
+
+void* ArenaAllocated::operator new(std::size_t size, ModelImpl* model) {
+    return model->getArena().allocate(size);
+}
+
@@ -0,0 +1,61 @@
+/*
+ *  Copyright (c) 2019 IMPACT Research Group, University of Illinois.
+ *  All rights reserved.
+ *
+ *  This file is covered by the LICENSE.txt license file in the root directory.
+ *
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+#include "common.h"
+
+/*
+ * Bump allocator for the IR objects of a model. Objects are carved out of large chunks so that objects created together
+ * are adjacent in memory, and all chunks are released at once when the model is destroyed. Allocation is serialized so
+ * that passes running in parallel can create operations.
+ */
+class Arena {
+
+    private:
+
+        static const std::size_t CHUNK_SIZE = 1 << 20;
+
+        std::vector<char*> chunks_;
+        char* next_;
+        char* end_;
+        std::mutex mutex_;
+
+        Arena(const Arena&);
+        Arena& operator=(const Arena&);
+
+    public:
+
+        Arena() : next_(NULL), end_(NULL) { }
+        ~Arena();
+
+        void* allocate(std::size_t size);
+
+};
+
+/*
+ * Objects of classes deriving from ArenaAllocated must be created with new(model) and live in the model's arena.
+ * Deleting them runs their destructor but leaves their memory to be released along with the arena.
+ */
+class ArenaAllocated {
+
+    public:
+
+        static void* operator new(std::size_t size, ModelImpl* model);
+        static void operator delete(void* ptr, ModelImpl* model) { }
+        static void operator delete(void* ptr) { }
+
+};
+
+#endif
+
@@ -7,6 +7,7 @@
  */
 
 #include <assert.h>
+#include <algorithm>
 
 #include "puma.h"
 
@@ -14,8 +15,9 @@
 #include "model.h"
 #include "operations.h"
 #include "placer.h"
+#include "traversal.h"
 
-Coalescer::Coalescer(ModelImpl* model, Placer* placer, std::vector<std::set<MVMOperation*>*>& coalesceableMVMSets)
+Coalescer::Coalescer(ModelImpl* model, Placer* placer, std::vector<std::set<MVMOperation*, OperationIdLess>*>& coalesceableMVMSets)
     : model_(model), placer_(placer), coalesceableMVMSets_(coalesceableMVMSets)
 {
     if(model_->getModelType() == ModelImpl::INFERENCE) {
@@ -52,8 +54,11 @@ void Coalescer::coalesceMVMOperations() {
             unsigned int pTile = placer_->getPTile(mvm);
             if(!localCoalescedMVMSets[pTile].count(pCore)) {
                 localCoalescedMVMSets[pTile][pCore] = new CoalescedMVMSet();
+                model_->getStatistics().bumpCounter("coalesced_mvm_sets");
+            }
+            if(!localCoalescedMVMSets[pTile][pCore]->usesPMVMU(pMVMU)) { // MVMs of tiles packed in the same MVMU cannot be coalesced
+                localCoalescedMVMSets[pTile][pCore]->add(mvm, pMVMU);
             }
-            localCoalescedMVMSets[pTile][pCore]->add(mvm, pMVMU);
         }
         // Add extracted sets to full list
         for(auto it1 : localCoalescedMVMSets) {
@@ -72,164 +77,138 @@ void Coalescer::coalesceMVMOperations() {
         }
     }
 
-    // Analyze initial dependences between remaining MVM operations
-    std::map<Operation*, std::set<MVMOperation*>> mvmPredecessors;
+    // Coalesce MVMs (in linearization order)
+    OperationSet isVisited;
+    OperationTable<unsigned int> levels;
     for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
         Operation* op = *it;
-        if(dynamic_cast<ReadOutputOperation*>(op)) {
-            findMVMPredecessors(op, mvmPredecessors);
+        if(op_cast<ReadOutputOperation>(op)) {
+            coalesceMVMPredecessors(op, isVisited, levels);
         }
     }
 
-    // Extract useful information
-    std::map<MVMOperation*, std::set<MVMOperation*>> mvmPredecessorsOfMVMs;
-    std::map<MVMOperation*, std::set<MVMOperation*>> mvmSuccessorsOfMVMs;
-    for(auto it : mvmPredecessors) {
-        Operation* op = it.first;
-        if(MVMOperation* mvm = dynamic_cast<MVMOperation*>(op)) {
-            for(MVMOperation* predMVM : it.second) {
-                mvmPredecessorsOfMVMs[mvm].insert(predMVM);
-                mvmSuccessorsOfMVMs[predMVM].insert(mvm);
-            }
+}
+
+static void getDependencePredecessors(Operation* op, std::vector<Operation*>& predecessors) {
+    if(ConsumerOperation* consumer = op_cast<ConsumerOperation>(op)) {
+        for(unsigned int o = 0; o < consumer->numOperands(); ++o) {
+            predecessors.push_back(consumer->getOperand(o));
         }
     }
-
-    // Coalesce MVMs (in linearization order)
-    std::set<Operation*> isVisited;
-    for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
-        Operation* op = *it;
-        if(dynamic_cast<ReadOutputOperation*>(op)) {
-            coalesceMVMPredecessors(op, isVisited, mvmPredecessorsOfMVMs, mvmSuccessorsOfMVMs);
+    if(TileMemoryReadOperation* read = op_cast<TileMemoryReadOperation>(op)) {
+        for(unsigned int i = 0; i < read->numSrcs(); ++i) {
+            predecessors.push_back(read->getSrc(i));
         }
     }
-
+    if(ReceiveOperation* recv = op_cast<ReceiveOperation>(op)) {
+        predecessors.push_back(recv->getSrc());
+    }
 }
 
-void Coalescer::findMVMPredecessors(Operation* op, std::map<Operation*, std::set<MVMOperation*>>& mvmPredecessors) {
-    if(!mvmPredecessors.count(op)) {
-        // Visit nodes in reverse postorder (find MVM predecessors of all predecessors of the operation to determine predecessors of self)
-        mvmPredecessors[op]; // Initialize as empty
-        if(MVMOperation* mvm = dynamic_cast<MVMOperation*>(op)) {
-            CoalescedMVMSet* coalescedSet = mvm->getCoalescedSet();
-            if(coalescedSet != NULL) {
-                assert(coalescedSet->isComplete()); // All previously coalesced sets should be complete
-                for(MVMOperation* m : *coalescedSet) {
-                    // If MVM is coalesced, include predecessors of all in the coalesced set
-                    assert(m != NULL);
-                    ProducerOperation* predecessor = m->getOperand(0);
-                    findMVMPredecessors(predecessor, mvmPredecessors);
-                    mvmPredecessors[op].insert(mvmPredecessors[predecessor].begin(), mvmPredecessors[predecessor].end());
+// Same as getDependencePredecessors, except that coalesced MVMs depend on the operands of the whole coalesced set
+static void getMVMDependencePredecessors(Operation* op, std::vector<Operation*>& predecessors) {
+    if(MVMOperation* mvm = op_cast<MVMOperation>(op)) {
+        CoalescedMVMSet* coalescedSet = mvm->getCoalescedSet();
+        if(coalescedSet != NULL) {
+            assert(coalescedSet->isComplete()); // All previously coalesced sets should be complete
+            for(MVMOperation* m : *coalescedSet) {
+                // If MVM is coalesced, include predecessors of all in the coalesced set
+                assert(m != NULL);
+                for(unsigned int o = 0; o < m->numOperands(); ++o) {
+                    predecessors.push_back(m->getOperand(o));
                 }
-            } else {
-                ProducerOperation* predecessor = mvm->getOperand(0);
-                findMVMPredecessors(predecessor, mvmPredecessors);
-                mvmPredecessors[op].insert(mvmPredecessors[predecessor].begin(), mvmPredecessors[predecessor].end());
             }
-        } else if(ConsumerOperation* consumer = dynamic_cast<ConsumerOperation*>(op)) {
-            for(unsigned int o = 0; o < consumer->numOperands(); ++o) {
-                ProducerOperation* predecessor = consumer->getOperand(o);
-                findMVMPredecessors(predecessor, mvmPredecessors);
-                mvmPredecessors[op].insert(mvmPredecessors[predecessor].begin(), mvmPredecessors[predecessor].end());
-                if(MVMOperation* mvmPred = dynamic_cast<MVMOperation*>(predecessor)) {
-                    CoalescedMVMSet* coalescedSet = mvmPred->getCoalescedSet();
-                    if(coalescedSet ==  NULL) {
-                        // Only uncoalesced MVMs are interesting
-                        mvmPredecessors[op].insert(mvmPred);
-                    } else {
-                        assert(coalescedSet->isComplete()); // All previously coalesced sets should be complete
-                    }
-                }
+        } else {
+            for(unsigned int o = 0; o < mvm->numOperands(); ++o) {
+                predecessors.push_back(mvm->getOperand(o));
             }
         }
-        if(TileMemoryReadOperation* read = dynamic_cast<TileMemoryReadOperation*>(op)) {
-            for(unsigned int i = 0; i < read->numSrcs(); ++i) {
-                TileMemoryWriteOperation* predecessor = read->getSrc(i);
-                findMVMPredecessors(predecessor, mvmPredecessors);
-                mvmPredecessors[op].insert(mvmPredecessors[predecessor].begin(), mvmPredecessors[predecessor].end());
-            }
+    } else if(ConsumerOperation* consumer = op_cast<ConsumerOperation>(op)) {
+        for(unsigned int o = 0; o < consumer->numOperands(); ++o) {
+            predecessors.push_back(consumer->getOperand(o));
         }
-        if(ReceiveOperation* recv = dynamic_cast<ReceiveOperation*>(op)) {
-            SendOperation* predecessor = recv->getSrc();
-            findMVMPredecessors(predecessor, mvmPredecessors);
-            mvmPredecessors[op].insert(mvmPredecessors[predecessor].begin(), mvmPredecessors[predecessor].end());
+    }
+    if(TileMemoryReadOperation* read = op_cast<TileMemoryReadOperation>(op)) {
+        for(unsigned int i = 0; i < read->numSrcs(); ++i) {
+            predecessors.push_back(read->getSrc(i));
         }
     }
+    if(ReceiveOperation* recv = op_cast<ReceiveOperation>(op)) {
+        predecessors.push_back(recv->getSrc());
+    }
 }
 
-void Coalescer::coalesceMVMPredecessors(Operation* op, std::set<Operation*>& isVisited, std::map<MVMOperation*, std::set<MVMOperation*>>& mvmPredecessorsOfMVMs, std::map<MVMOperation*, std::set<MVMOperation*>>& mvmSuccessorsOfMVMs) {
+void Coalescer::coalesceMVMPredecessors(Operation* op, OperationSet& isVisited, OperationTable<unsigned int>& levels) {
     if(!isVisited.count(op)) {
-        // Visit nodes in reverse postorder (not necessary, but visiting in same order as linearization helps reduce register pressure)
-        if(ConsumerOperation* consumer = dynamic_cast<ConsumerOperation*>(op)) {
-            for(unsigned int o = 0; o < consumer->numOperands(); ++o) {
-                ProducerOperation* predecessor = consumer->getOperand(o);
-                coalesceMVMPredecessors(predecessor, isVisited, mvmPredecessorsOfMVMs, mvmSuccessorsOfMVMs);
-            }
-            if(MVMOperation* mvm = dynamic_cast<MVMOperation*>(consumer)) {
-                if(mvm->getCoalescedSet() == NULL) {
-                    // Find coalesced set to add to
-                    std::vector<CoalescedMVMSet*> &coreCoalescedSets = coalescedMVMSets_[placer_->getPTile(mvm)*N_CORES_PER_TILE + placer_->getPCore(mvm)];
-                    unsigned int pMVMU = placer_->getPMVMU(mvm);
-                    CoalescedMVMSet* coalescedSet = NULL;
-                    for(unsigned int coalescedSetIdx = 0; coalescedSetIdx < coreCoalescedSets.size(); ++coalescedSetIdx) {
-                        coalescedSet = coreCoalescedSets[coalescedSetIdx];
-                        if(!coalescedSet->usesPMVMU(pMVMU)) {
-                            bool hasDataHazard = false;
-                            for(MVMOperation* m : *coalescedSet) {
-                                if(mvmPredecessorsOfMVMs[mvm].count(m) || mvmSuccessorsOfMVMs[mvm].count(m)) {
-                                    hasDataHazard = true;
-                                    break;
-                                }
-                            }
-                            if(!hasDataHazard) {
-                                break; // Candidate found
-                            }
-                        }
-                        coalescedSet = NULL; // Candidate doesn't work
-                    }
+        // Visit nodes in reverse postorder (MVMs are assigned levels in topological order, and visiting in same order as linearization helps reduce register pressure)
+        auto enter = [&](Operation* successor, Operation* predecessor) {
+            return !isVisited.count(predecessor);
+        };
+        auto leave = [&](Operation* node) {
+            if(!levels.count(node)) {
+                // Find the highest level of the MVMs the operation depends on
+                std::vector<Operation*> predecessors;
+                getMVMDependencePredecessors(node, predecessors);
+                unsigned int level = 0;
+                for(Operation* predecessor : predecessors) {
+                    level = std::max(level, levels[predecessor]);
+                }
+                if(MVMOperation* mvm = op_cast<MVMOperation>(node)) {
+                    CoalescedMVMSet* coalescedSet = mvm->getCoalescedSet();
                     if(coalescedSet == NULL) {
-                        // Create new coalesced set if none found
-                        coalescedSet = new CoalescedMVMSet();
-                        coreCoalescedSets.push_back(coalescedSet);
-                    }
-                    // Add to coalesced set and update dependence information
-                    for(MVMOperation* m : *coalescedSet) {
-                        if(m != NULL) {
-                            // Make all predecessors of mvm predecessors of m and successors of m
-                            for(MVMOperation* mvmPredecessor : mvmPredecessorsOfMVMs[mvm]) {
-                                mvmPredecessorsOfMVMs[m].insert(mvmPredecessor);
-                                mvmSuccessorsOfMVMs[mvmPredecessor].insert(m);
-                                for(MVMOperation* mSuccessor : mvmSuccessorsOfMVMs[m]) {
-                                    mvmPredecessorsOfMVMs[mSuccessor].insert(mvmPredecessor);
-                                    mvmSuccessorsOfMVMs[mvmPredecessor].insert(mSuccessor);
-                                }
-                            }
-                            // Make all predecessors of m predecessors of mvm and successors of mvm
-                            for(MVMOperation* mPredecessor : mvmPredecessorsOfMVMs[m]) {
-                                mvmPredecessorsOfMVMs[mvm].insert(mPredecessor);
-                                mvmSuccessorsOfMVMs[mPredecessor].insert(mvm);
-                                for(MVMOperation* mvmSuccessor : mvmSuccessorsOfMVMs[mvm]) {
-                                    mvmPredecessorsOfMVMs[mvmSuccessor].insert(mPredecessor);
-                                    mvmSuccessorsOfMVMs[mPredecessor].insert(mvmSuccessor);
-                                }
-                            }
+                        coalesceMVM(mvm, level + 1, levels);
+                    } else {
+                        // MVMs coalesced before all take the level after their predecessors
+                        for(MVMOperation* m : *coalescedSet) {
+                            levels[m] = level + 1;
                         }
                     }
-                    coalescedSet->add(mvm, pMVMU);
+                } else {
+                    levels[node] = level;
                 }
             }
-        }
-        if(TileMemoryReadOperation* read = dynamic_cast<TileMemoryReadOperation*>(op)) {
-            for(unsigned int i = 0; i < read->numSrcs(); ++i) {
-                TileMemoryWriteOperation* predecessor = read->getSrc(i);
-                coalesceMVMPredecessors(predecessor, isVisited, mvmPredecessorsOfMVMs, mvmSuccessorsOfMVMs);
+            isVisited.insert(node);
+        };
+        walkDepthFirst<Operation*>(op, getMVMDependencePredecessors, enter, leave);
+    }
+}
+
+void Coalescer::coalesceMVM(MVMOperation* mvm, unsigned int minLevel, OperationTable<unsigned int>& levels) {
+    // Find coalesced set to add to
+    std::vector<CoalescedMVMSet*> &coreCoalescedSets = coalescedMVMSets_[placer_->getPTile(mvm)*N_CORES_PER_TILE + placer_->getPCore(mvm)];
+    unsigned int pMVMU = placer_->getPMVMU(mvm);
+    CoalescedMVMSet* coalescedSet = NULL;
+    unsigned int coalescedSetLevel = 0;
+    for(CoalescedMVMSet* candidate : coreCoalescedSets) {
+        if(!candidate->usesPMVMU(pMVMU)) {
+            MVMOperation* member = NULL;
+            for(MVMOperation* m : *candidate) {
+                if(m != NULL) {
+                    member = m;
+                    break;
+                }
+            }
+            if(!levels.count(member) || member->getStreamLoop() != mvm->getStreamLoop()) {
+                // Sets coalesced before and not visited yet may depend on mvm, and MVMs in different stream loops execute a different number of times
+                continue;
+            }
+            // A set at or above minLevel has no MVM that mvm depends on, and no MVM depending on mvm has been visited yet
+            unsigned int level = levels[member];
+            if(level >= minLevel && (coalescedSet == NULL || level < coalescedSetLevel)) {
+                coalescedSet = candidate; // Prefer the lowest level to delay the MVMs that depend on mvm the least
+                coalescedSetLevel = level;
             }
         }
-        if(ReceiveOperation* recv = dynamic_cast<ReceiveOperation*>(op)) {
-            SendOperation* predecessor = recv->getSrc();
-            coalesceMVMPredecessors(predecessor, isVisited, mvmPredecessorsOfMVMs, mvmSuccessorsOfMVMs);
-        }
-        isVisited.insert(op);
     }
+    if(coalescedSet == NULL) {
+        // Create new coalesced set if none found
+        coalescedSet = new CoalescedMVMSet();
+        model_->getStatistics().bumpCounter("coalesced_mvm_sets");
+        coreCoalescedSets.push_back(coalescedSet);
+        coalescedSetLevel = minLevel;
+    }
+    coalescedSet->add(mvm, pMVMU);
+    levels[mvm] = coalescedSetLevel;
 }
 
 void Coalescer::coalesceTrainingOperations() {
@@ -237,39 +216,40 @@ void Coalescer::coalesceTrainingOperations() {
     coalescedTrainingOperationSets_.resize(placer_->getNPCores());
 
     // Find immediate training operation predecessors of each training operation
-    std::map<TrainingMatrixOperation*, std::set<TrainingMatrixOperation*>> immediateTrainingOperationPredecessors;
+    OperationTable<std::set<TrainingMatrixOperation*, OperationIdLess>> immediateTrainingOperationPredecessors;
     for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
-        if(TrainingMatrixOperation* trainOp = dynamic_cast<TrainingMatrixOperation*>(*it)) {
+        if(TrainingMatrixOperation* trainOp = op_cast<TrainingMatrixOperation>(*it)) {
             findImmediateTrainingOperationPredecessors(trainOp, immediateTrainingOperationPredecessors[trainOp]);
         }
     }
 
     // Derive all training operation predecessors of each training operation
-    std::map<TrainingMatrixOperation*, std::set<TrainingMatrixOperation*>> trainingOperationPredecessors;
+    OperationTable<std::set<TrainingMatrixOperation*, OperationIdLess>> trainingOperationPredecessors;
     for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
-        if(TrainingMatrixOperation* trainOp = dynamic_cast<TrainingMatrixOperation*>(*it)) {
+        if(TrainingMatrixOperation* trainOp = op_cast<TrainingMatrixOperation>(*it)) {
             findAllTrainingOperationPredecessors(trainOp, trainingOperationPredecessors[trainOp], immediateTrainingOperationPredecessors);
         }
     }
 
     // Derive all training operation successors for each training operation
-    std::map<TrainingMatrixOperation*, std::set<TrainingMatrixOperation*>> trainingOperationSuccessors;
-    for(auto it : trainingOperationPredecessors) {
-        TrainingMatrixOperation* trainOp = it.first;
-        for(TrainingMatrixOperation* predecessor : it.second) {
-            trainingOperationSuccessors[predecessor].insert(trainOp);
+    OperationTable<std::set<TrainingMatrixOperation*, OperationIdLess>> trainingOperationSuccessors;
+    for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
+        if(TrainingMatrixOperation* trainOp = op_cast<TrainingMatrixOperation>(*it)) {
+            for(TrainingMatrixOperation* predecessor : trainingOperationPredecessors[trainOp]) {
+                trainingOperationSuccessors[predecessor].insert(trainOp);
+            }
         }
     }
 
     // Coalesce training operations (in linearization order)
-    std::set<Operation*> isVisited;
+    OperationSet isVisited;
     for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
         Operation* op = *it;
-        if(TrainingMatrixOperation* trainOp = dynamic_cast<TrainingMatrixOperation*>(op)) {
+        if(TrainingMatrixOperation* trainOp = op_cast<TrainingMatrixOperation>(op)) {
             if(trainOp->getOpType() == TrainingMatrixOperation::OUTER_PRODUCT) {
                 coalesceTrainingOperationPredecessors(op, isVisited, trainingOperationPredecessors, trainingOperationSuccessors);
             }
-        } else if(dynamic_cast<ReadOutputOperation*>(op)) {
+        } else if(op_cast<ReadOutputOperation>(op)) {
             coalesceTrainingOperationPredecessors(op, isVisited, trainingOperationPredecessors, trainingOperationSuccessors);
         }
     }
@@ -277,111 +257,135 @@ void Coalescer::coalesceTrainingOperations() {
 
 }
 
-void Coalescer::findImmediateTrainingOperationPredecessors(Operation* op, std::set<TrainingMatrixOperation*>& foundSet) {
-    if(ConsumerOperation* consumer = dynamic_cast<ConsumerOperation*>(op)) {
-        for(unsigned int o = 0; o < consumer->numOperands(); ++o) {
-            ProducerOperation* predecessor = consumer->getOperand(o);
-            if(TrainingMatrixOperation* trainOp = dynamic_cast<TrainingMatrixOperation*>(predecessor)) {
-                foundSet.insert(trainOp);
-            } else {
-                findImmediateTrainingOperationPredecessors(predecessor, foundSet);
-            }
+void Coalescer::findImmediateTrainingOperationPredecessors(Operation* op, std::set<TrainingMatrixOperation*, OperationIdLess>& foundSet) {
+    // Walk predecessors until reaching training operations
+    OperationSet isVisited;
+    auto enter = [&](Operation* successor, Operation* predecessor) {
+        if(TrainingMatrixOperation* trainOp = op_cast<TrainingMatrixOperation>(predecessor)) {
+            foundSet.insert(trainOp);
+            return false;
+        } else if(isVisited.count(predecessor)) {
+            return false;
         }
-    }
-    if(TileMemoryReadOperation* read = dynamic_cast<TileMemoryReadOperation*>(op)) {
-        for(unsigned int i = 0; i < read->numSrcs(); ++i) {
-            TileMemoryWriteOperation* predecessor = read->getSrc(i);
-            findImmediateTrainingOperationPredecessors(predecessor, foundSet);
-        }
-    }
-    if(ReceiveOperation* recv = dynamic_cast<ReceiveOperation*>(op)) {
-        SendOperation* predecessor = recv->getSrc();
-        findImmediateTrainingOperationPredecessors(predecessor, foundSet);
-    }
+        isVisited.insert(predecessor);
+        return true;
+    };
+    spreadDepthFirst<Operation*>(op, getDependencePredecessors, enter);
 }
 
-void Coalescer::findAllTrainingOperationPredecessors(TrainingMatrixOperation* trainOp, std::set<TrainingMatrixOperation*>& foundSet, std::map<TrainingMatrixOperation*, std::set<TrainingMatrixOperation*>>& immediateTrainingOperationPredecessors) {
-    for(TrainingMatrixOperation* predecessor : immediateTrainingOperationPredecessors[trainOp]) {
-        foundSet.insert(predecessor);
-        findAllTrainingOperationPredecessors(predecessor, foundSet, immediateTrainingOperationPredecessors);
-    }
+void Coalescer::findAllTrainingOperationPredecessors(TrainingMatrixOperation* trainOp, std::set<TrainingMatrixOperation*, OperationIdLess>& foundSet, OperationTable<std::set<TrainingMatrixOperation*, OperationIdLess>>& immediateTrainingOperationPredecessors) {
+    auto getImmediatePredecessors = [&](TrainingMatrixOperation* t, std::vector<TrainingMatrixOperation*>& predecessors) {
+        predecessors.insert(predecessors.end(), immediateTrainingOperationPredecessors[t].begin(), immediateTrainingOperationPredecessors[t].end());
+    };
+    auto enter = [&](TrainingMatrixOperation* successor, TrainingMatrixOperation* predecessor) {
+        return foundSet.insert(predecessor).second; // Predecessors of operations found before are already found
+    };
+    spreadDepthFirst(trainOp, getImmediatePredecessors, enter);
 }
 
-void Coalescer::coalesceTrainingOperationPredecessors(Operation* op, std::set<Operation*>& isVisited, std::map<TrainingMatrixOperation*, std::set<TrainingMatrixOperation*>>& trainingOperationPredecessors, std::map<TrainingMatrixOperation*, std::set<TrainingMatrixOperation*>>& trainingOperationSuccessors) {
+void Coalescer::coalesceTrainingOperationPredecessors(Operation* op, OperationSet& isVisited, OperationTable<std::set<TrainingMatrixOperation*, OperationIdLess>>& trainingOperationPredecessors, OperationTable<std::set<TrainingMatrixOperation*, OperationIdLess>>& trainingOperationSuccessors) {
     if(!isVisited.count(op)) {
         // Visit nodes in reverse postorder (not necessary, but visiting in same order as linearization helps reduce register pressure)
-        if(ConsumerOperation* consumer = dynamic_cast<ConsumerOperation*>(op)) {
-            for(unsigned int o = 0; o < consumer->numOperands(); ++o) {
-                ProducerOperation* predecessor = consumer->getOperand(o);
-                coalesceTrainingOperationPredecessors(predecessor, isVisited, trainingOperationPredecessors, trainingOperationSuccessors);
-            }
-            if(TrainingMatrixOperation* trainOp = dynamic_cast<TrainingMatrixOperation*>(consumer)) {
+        auto enter = [&](Operation* successor, Operation* predecessor) {
+            return !isVisited.count(predecessor);
+        };
+        auto leave = [&](Operation* node) {
+            if(TrainingMatrixOperation* trainOp = op_cast<TrainingMatrixOperation>(node)) {
                 if(trainOp->getCoalescedSet() == NULL) {
-                    // Find coalesced set to add to
-                    std::vector<CoalescedTrainingOperationSet*> &coreCoalescedSets = coalescedTrainingOperationSets_[placer_->getPTile(trainOp)*N_CORES_PER_TILE + placer_->getPCore(trainOp)];
-                    unsigned int pMVMU = placer_->getPMVMU(trainOp);
-                    TrainingMatrixOperation::OpType opType = trainOp->getOpType();
-                    CoalescedTrainingOperationSet* coalescedSet = NULL;
-                    for(unsigned int coalescedSetIdx = 0; coalescedSetIdx < coreCoalescedSets.size(); ++coalescedSetIdx) {
-                        coalescedSet = coreCoalescedSets[coalescedSetIdx];
-                        if(!coalescedSet->usesPMVMUForOp(pMVMU, opType)) {
-                            bool hasDataHazard = false;
-                            for(TrainingMatrixOperation* t : *coalescedSet) {
-                                if(trainingOperationPredecessors[trainOp].count(t) || trainingOperationSuccessors[trainOp].count(t)) {
-                                    hasDataHazard = true;
-                                    break;
-                                }
-                            }
-                            if(!hasDataHazard) {
-                                break; // Candidate found
-                            }
-                        }
-                        coalescedSet = NULL; // Candidate doesn't work
-                    }
-                    if(coalescedSet == NULL) {
-                        // Create new coalesced set if none found
-                        coalescedSet = new CoalescedTrainingOperationSet();
-                        coreCoalescedSets.push_back(coalescedSet);
-                    }
-                    // Add to coalesced set and update dependence information
-                    for(TrainingMatrixOperation* t : *coalescedSet) {
-                        if(t != NULL) {
-                            // Make all predecessors of trainOp predecessors of t and successors of t
-                            for(TrainingMatrixOperation* trainOpPredecessor : trainingOperationPredecessors[trainOp]) {
-                                trainingOperationPredecessors[t].insert(trainOpPredecessor);
-                                trainingOperationSuccessors[trainOpPredecessor].insert(t);
-                                for(TrainingMatrixOperation* tSuccessor : trainingOperationSuccessors[t]) {
-                                    trainingOperationPredecessors[tSuccessor].insert(trainOpPredecessor);
-                                    trainingOperationSuccessors[trainOpPredecessor].insert(tSuccessor);
-                                }
-                            }
-                            // Make all predecessors of t predecessors of trainOp and successors of trainOp
-                            for(TrainingMatrixOperation* tPredecessor : trainingOperationPredecessors[t]) {
-                                trainingOperationPredecessors[trainOp].insert(tPredecessor);
-                                trainingOperationSuccessors[tPredecessor].insert(trainOp);
-                                for(TrainingMatrixOperation* trainOpSuccessor : trainingOperationSuccessors[trainOp]) {
-                                    trainingOperationPredecessors[trainOpSuccessor].insert(tPredecessor);
-                                    trainingOperationSuccessors[tPredecessor].insert(trainOpSuccessor);
-                                }
-                            }
-                        }
-                    }
-                    coalescedSet->add(trainOp, pMVMU);
+                    coalesceTrainingOperation(trainOp, trainingOperationPredecessors, trainingOperationSuccessors);
                 }
             }
-        }
-        if(TileMemoryReadOperation* read = dynamic_cast<TileMemoryReadOperation*>(op)) {
-            for(unsigned int i = 0; i < read->numSrcs(); ++i) {
-                TileMemoryWriteOperation* predecessor = read->getSrc(i);
-                coalesceTrainingOperationPredecessors(predecessor, isVisited, trainingOperationPredecessors, trainingOperationSuccessors);
+            isVisited.insert(node);
+        };
+        walkDepthFirst<Operation*>(op, getDependencePredecessors, enter, leave);
+    }
+
+}
+
+void Coalescer::coalesceTrainingOperation(TrainingMatrixOperation* trainOp, OperationTable<std::set<TrainingMatrixOperation*, OperationIdLess>>& trainingOperationPredecessors, OperationTable<std::set<TrainingMatrixOperation*, OperationIdLess>>& trainingOperationSuccessors) {
+    // Find coalesced set to add to
+    std::vector<CoalescedTrainingOperationSet*> &coreCoalescedSets = coalescedTrainingOperationSets_[placer_->getPTile(trainOp)*N_CORES_PER_TILE + placer_->getPCore(trainOp)];
+    unsigned int pMVMU = placer_->getPMVMU(trainOp);
+    TrainingMatrixOperation::OpType opType = trainOp->getOpType();
+    CoalescedTrainingOperationSet* coalescedSet = NULL;
+    for(unsigned int coalescedSetIdx = 0; coalescedSetIdx < coreCoalescedSets.size(); ++coalescedSetIdx) {
+        coalescedSet = coreCoalescedSets[coalescedSetIdx];
+        if(!coalescedSet->usesPMVMUForOp(pMVMU, opType)) {
+            bool hasDataHazard = false;
+            for(TrainingMatrixOperation* t : *coalescedSet) {
+                if(t != NULL && (trainingOperationPredecessors[trainOp].count(t) || trainingOperationSuccessors[trainOp].count(t))) {
+                    hasDataHazard = true;
+                    break;
+                }
+            }
+            if(!hasDataHazard) {
+                break; // Candidate found
             }
         }
-        if(ReceiveOperation* recv = dynamic_cast<ReceiveOperation*>(op)) {
-            SendOperation* predecessor = recv->getSrc();
-            coalesceTrainingOperationPredecessors(predecessor, isVisited, trainingOperationPredecessors, trainingOperationSuccessors);
+        coalescedSet = NULL; // Candidate doesn't work
+    }
+    if(coalescedSet == NULL) {
+        // Create new coalesced set if none found
+        coalescedSet = new CoalescedTrainingOperationSet();
+        model_->getStatistics().bumpCounter("coalesced_training_sets");
+        coreCoalescedSets.push_back(coalescedSet);
+    }
+    // Add to coalesced set and update dependence information
+    for(TrainingMatrixOperation* t : *coalescedSet) {
+        if(t != NULL) {
+            // Make all predecessors of trainOp predecessors of t and successors of t
+            for(TrainingMatrixOperation* trainOpPredecessor : trainingOperationPredecessors[trainOp]) {
+                trainingOperationPredecessors[t].insert(trainOpPredecessor);
+                trainingOperationSuccessors[trainOpPredecessor].insert(t);
+                for(TrainingMatrixOperation* tSuccessor : trainingOperationSuccessors[t]) {
+                    trainingOperationPredecessors[tSuccessor].insert(trainOpPredecessor);
+                    trainingOperationSuccessors[trainOpPredecessor].insert(tSuccessor);
+                }
+            }
+            // Make all predecessors of t predecessors of trainOp and successors of trainOp
+            for(TrainingMatrixOperation* tPredecessor : trainingOperationPredecessors[t]) {
+                trainingOperationPredecessors[trainOp].insert(tPredecessor);
+                trainingOperationSuccessors[tPredecessor].insert(trainOp);
+                for(TrainingMatrixOperation* trainOpSuccessor : trainingOperationSuccessors[trainOp]) {
+                    trainingOperationPredecessors[trainOpSuccessor].insert(tPredecessor);
+                    trainingOperationSuccessors[tPredecessor].insert(trainOpSuccessor);
+                }
+            }
         }
-        isVisited.insert(op);
     }
-
+    coalescedSet->add(trainOp, pMVMU);
 }
 
+void Coalescer::printReport(std::ofstream& report) {
+    if(model_->getModelType() == ModelImpl::INFERENCE) {
+        unsigned int nMVMs = 0;
+        unsigned int nCoalescedSets = 0;
+        for(auto coreCoalescedSets : coalescedMVMSets_) {
+            for(CoalescedMVMSet* coalescedSet : coreCoalescedSets) {
+                for(MVMOperation* mvm : *coalescedSet) {
+                    if(mvm != NULL) {
+                        ++nMVMs;
+                    }
+                }
+                ++nCoalescedSets;
+            }
+        }
+        report << "# coalesced MVM sets = " << nCoalescedSets << std::endl;
+        report << "coalescing ratio (MVMs per set) = " << ((nCoalescedSets > 0)?((double)nMVMs/nCoalescedSets):0.0) << std::endl;
+    } else {
+        unsigned int nTrainOps = 0;
+        unsigned int nCoalescedSets = 0;
+        for(auto coreCoalescedSets : coalescedTrainingOperationSets_) {
+            for(CoalescedTrainingOperationSet* coalescedSet : coreCoalescedSets) {
+                for(TrainingMatrixOperation* trainOp : *coalescedSet) {
+                    if(trainOp != NULL) {
+                        ++nTrainOps;
+                    }
+                }
+                ++nCoalescedSets;
+            }
+        }
+        report << "# coalesced training operation sets = " << nCoalescedSets << std::endl;
+        report << "coalescing ratio (training operations per set) = " << ((nCoalescedSets > 0)?((double)nTrainOps/nCoalescedSets):0.0) << std::endl;
+    }
+}
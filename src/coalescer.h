@@ -6,11 +6,13 @@
  *
  */
 
+#include <fstream>
 #include <map>
 #include <set>
 #include <vector>
 
 #include "common.h"
+#include "optable.h"
 
 class Coalescer {
 
@@ -19,23 +21,26 @@ class Coalescer {
         ModelImpl* model_;
         Placer* placer_;
 
-        std::vector<std::set<MVMOperation*>*>& coalesceableMVMSets_;
+        std::vector<std::set<MVMOperation*, OperationIdLess>*>& coalesceableMVMSets_;
         std::vector<std::vector<CoalescedMVMSet*>> coalescedMVMSets_;
         std::vector<std::vector<CoalescedTrainingOperationSet*>> coalescedTrainingOperationSets_;
 
         void coalesceMVMOperations();
-        void findMVMPredecessors(Operation* op, std::map<Operation*, std::set<MVMOperation*>>& mvmPredecessors);
-        void coalesceMVMPredecessors(Operation* op, std::set<Operation*>& isVisited, std::map<MVMOperation*, std::set<MVMOperation*>>& mvmPredecessorsOfMVMs, std::map<MVMOperation*, std::set<MVMOperation*>>& mvmSuccessorsOfMVMs);
+        void coalesceMVMPredecessors(Operation* op, OperationSet& isVisited, OperationTable<unsigned int>& levels);
+        void coalesceMVM(MVMOperation* mvm, unsigned int minLevel, OperationTable<unsigned int>& levels);
 
         void coalesceTrainingOperations();
-        void findImmediateTrainingOperationPredecessors(Operation* op, std::set<TrainingMatrixOperation*>& foundSet);
-        void findAllTrainingOperationPredecessors(TrainingMatrixOperation* trainOp, std::set<TrainingMatrixOperation*>& foundSet, std::map<TrainingMatrixOperation*, std::set<TrainingMatrixOperation*>>& immediateTrainingOperationPredecessors);
-        void coalesceTrainingOperationPredecessors(Operation* op, std::set<Operation*>& isVisited, std::map<TrainingMatrixOperation*, std::set<TrainingMatrixOperation*>>& trainingOperationPredecessors, std::map<TrainingMatrixOperation*, std::set<TrainingMatrixOperation*>>& trainingOperationSuccessors);
+        void findImmediateTrainingOperationPredecessors(Operation* op, std::set<TrainingMatrixOperation*, OperationIdLess>& foundSet);
+        void findAllTrainingOperationPredecessors(TrainingMatrixOperation* trainOp, std::set<TrainingMatrixOperation*, OperationIdLess>& foundSet, OperationTable<std::set<TrainingMatrixOperation*, OperationIdLess>>& immediateTrainingOperationPredecessors);
+        void coalesceTrainingOperationPredecessors(Operation* op, OperationSet& isVisited, OperationTable<std::set<TrainingMatrixOperation*, OperationIdLess>>& trainingOperationPredecessors, OperationTable<std::set<TrainingMatrixOperation*, OperationIdLess>>& trainingOperationSuccessors);
+        void coalesceTrainingOperation(TrainingMatrixOperation* trainOp, OperationTable<std::set<TrainingMatrixOperation*, OperationIdLess>>& trainingOperationPredecessors, OperationTable<std::set<TrainingMatrixOperation*, OperationIdLess>>& trainingOperationSuccessors);
 
     public:
 
-        Coalescer(ModelImpl* model, Placer* placer, std::vector<std::set<MVMOperation*>*>& coalesceableMVMSets);
+        Coalescer(ModelImpl* model, Placer* placer, std::vector<std::set<MVMOperation*, OperationIdLess>*>& coalesceableMVMSets);
         ~Coalescer();
 
+        void printReport(std::ofstream& report);
+
 };
 
@@ -7,6 +7,9 @@
  */
 
 #include <assert.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <sstream>
 
@@ -18,9 +21,63 @@
 #include "memalloc.h"
 #include "model.h"
 #include "operations.h"
+#include "parallel.h"
 #include "placer.h"
 #include "regalloc.h"
 
+CodeBuffer& CodeBuffer::operator<<(char c) {
+    data_.push_back(c);
+    if(c == '\n') {
+        ++nLines_;
+    }
+    return *this;
+}
+
+CodeBuffer& CodeBuffer::operator<<(const char* str) {
+    for(; *str != '\0'; ++str) {
+        *this << *str;
+    }
+    return *this;
+}
+
+CodeBuffer& CodeBuffer::operator<<(const std::string& str) {
+    return *this << str.c_str();
+}
+
+CodeBuffer& CodeBuffer::operator<<(unsigned int value) {
+    char digits[16];
+    unsigned int n = 0;
+    do {
+        digits[n++] = '0' + value%10;
+        value /= 10;
+    } while(value != 0);
+    while(n > 0) {
+        data_.push_back(digits[--n]);
+    }
+    return *this;
+}
+
+CodeBuffer& CodeBuffer::operator<<(int value) {
+    if(value < 0) {
+        data_.push_back('-');
+        return *this << (unsigned int)(-(long long)value);
+    }
+    return *this << (unsigned int)value;
+}
+
+CodeBuffer& CodeBuffer::operator<<(float value) {
+    char str[32];
+    snprintf(str, sizeof(str), "%g", value); // Same format as std::ostream
+    return *this << str;
+}
+
+void CodeBuffer::writeToFile(std::string fileName) {
+    std::ofstream fout;
+    fout.open(fileName, std::ios::binary);
+    fout.write(data_.data(), data_.size()); // Written in one call, bypassing per-instruction stream formatting
+    fout.close();
+}
+
 CodeGenerator::CodeGenerator(ModelImpl* model, Placer* placer, MemoryAllocator* memoryAllocator, Coalescer* coalescer, Linearizer* linearizer, RegisterAllocator* registerAllocator)
     : model_(model), placer_(placer), memoryAllocator_(memoryAllocator), coalescer_(coalescer), linearizer_(linearizer), registerAllocator_(registerAllocator)
 {
@@ -31,276 +88,301 @@ void CodeGenerator::codegen() {
 
     // TODO: Define ABI for laying out the binary
 
-    for(unsigned int pTile = 0; pTile < placer_->getNPTiles(); ++pTile) {
+    // Generate code for different tiles in parallel, each thread formatting into its own reusable buffer
+    parallelFor(model_->getNThreads(), placer_->getNPTiles(), [&](unsigned int pTile) {
+        static thread_local CodeBuffer code;
+        codegen(pTile, code);
+    });
 
-        // Generate code for the tile
-        std::stringstream fileName;
-        fileName << model_->getName() << "-tile" << pTile << ".puma";
-        std::ofstream tileCode;
-        tileCode.open(fileName.str());
-        std::list<TileOperation*>& tileOperationList = linearizer_->getTileOperationList(pTile);
-        for(TileOperation* tileOp : tileOperationList) {
-            if(SendOperation* send = dynamic_cast<SendOperation*>(tileOp)) {
-                tileCode << codegen(send);
-            } else if(ReceiveOperation* recv = dynamic_cast<ReceiveOperation*>(tileOp)) {
-                tileCode << codegen(recv);
-            } else if(WriteInputOperation* write = dynamic_cast<WriteInputOperation*>(tileOp)) {
-                tileCode << codegen(write);
-            } else if(ReadOutputOperation* read = dynamic_cast<ReadOutputOperation*>(tileOp)) {
-                tileCode << codegen(read);
-            } else {
-                assert(0 && "Unsupported operation for code generation!");
-            }
+}
+
+void CodeGenerator::codegen(unsigned int pTile, CodeBuffer& code) {
+
+    // Generate code for the tile
+    std::stringstream fileName;
+    fileName << model_->getName() << "-tile" << pTile << ".puma";
+    code.clear();
+    std::list<TileOperation*>& tileOperationList = linearizer_->getTileOperationList(pTile);
+    for(TileOperation* tileOp : tileOperationList) {
+        switch(tileOp->getKind()) {
+            case Operation::OP_SEND: codegen(op_cast<SendOperation>(tileOp), code); break;
+            case Operation::OP_RECEIVE: codegen(op_cast<ReceiveOperation>(tileOp), code); break;
+            case Operation::OP_WRITE_INPUT: codegen(op_cast<WriteInputOperation>(tileOp), code); break;
+            case Operation::OP_READ_OUTPUT: codegen(op_cast<ReadOutputOperation>(tileOp), code); break;
+            default: assert(0 && "Unsupported operation for code generation!");
         }
-        tileCode << "halt()" << std::endl;
-        tileCode.close();
-
-        // Generate code for each core in the tile
-        for(unsigned int pCore = 0; pCore < N_CORES_PER_TILE; ++pCore) {
-            std::stringstream fileName;
-            fileName << model_->getName() << "-tile" << pTile << "-core" << pCore << ".puma";
-            std::ofstream coreCode;
-            coreCode.open(fileName.str());
-            std::list<CoreOperation*>& coreOperationList = linearizer_->getCoreOperationList(pTile, pCore);
-            for(CoreOperation* coreOp : coreOperationList) {
-                if(MVMOperation* mvm = dynamic_cast<MVMOperation*>(coreOp)) {
-                    coreCode << codegen(mvm);
-                } else if(TrainingMatrixOperation* trainOp = dynamic_cast<TrainingMatrixOperation*>(coreOp)) {
-                    coreCode << codegen(trainOp);
-                } else if(ALUVectorOperation* aluOp = dynamic_cast<ALUVectorOperation*>(coreOp)) {
-                    coreCode << codegen(aluOp);
-                } else if(SetImmediateOperation* seti = dynamic_cast<SetImmediateOperation*>(coreOp)) {
-                    coreCode << codegen(seti);
-                } else if(CopyOperation* copy = dynamic_cast<CopyOperation*>(coreOp)) {
-                    coreCode << codegen(copy);
-                } else if(LoadOperation* load = dynamic_cast<LoadOperation*>(coreOp)) {
-                    coreCode << codegen(load);
-                } else if(StoreOperation* store = dynamic_cast<StoreOperation*>(coreOp)) {
-                    coreCode << codegen(store);
-                } else {
-                    assert(0 && "Unsupported operation for code generation!");
-                }
+    }
+    code << "halt()\n";
+    code.writeToFile(fileName.str());
+
+    // Generate code for each core in the tile
+    for(unsigned int pCore = 0; pCore < N_CORES_PER_TILE; ++pCore) {
+        std::stringstream fileName;
+        fileName << model_->getName() << "-tile" << pTile << "-core" << pCore << ".puma";
+        code.clear(); // Branch targets are absolute instruction indices within the core's code, i.e., line numbers in the buffer
+        std::list<CoreOperation*>& coreOperationList = linearizer_->getCoreOperationList(pTile, pCore);
+        for(CoreOperation* coreOp : coreOperationList) {
+            switch(coreOp->getKind()) {
+                case Operation::OP_MVM: codegen(op_cast<MVMOperation>(coreOp), code); break;
+                case Operation::OP_TRAINING_MATRIX: codegen(op_cast<TrainingMatrixOperation>(coreOp), code); break;
+                case Operation::OP_ALU_VECTOR: codegen(op_cast<ALUVectorOperation>(coreOp), code); break;
+                case Operation::OP_SET_IMMEDIATE: codegen(op_cast<SetImmediateOperation>(coreOp), code); break;
+                case Operation::OP_COPY: codegen(op_cast<CopyOperation>(coreOp), code); break;
+                case Operation::OP_LOAD: codegen(op_cast<LoadOperation>(coreOp), code); break;
+                case Operation::OP_STORE: codegen(op_cast<StoreOperation>(coreOp), code); break;
+                case Operation::OP_LOOP_BEGIN: codegen(op_cast<LoopBeginOperation>(coreOp), code); break;
+                case Operation::OP_LOOP_END: codegen(op_cast<LoopEndOperation>(coreOp), code); break;
+                default: assert(0 && "Unsupported operation for code generation!");
             }
-            coreCode << "hlt()" << std::endl;
-            coreCode.close();
         }
-
+        code << "hlt()\n";
+        code.writeToFile(fileName.str());
     }
 
 }
 
-std::string CodeGenerator::codegen(CoalescedMVMSet* coalescedMVMSet) {
-    std::stringstream ss;
-    ss << "mvm(['";
+void CodeGenerator::codegen(CoalescedMVMSet* coalescedMVMSet, CodeBuffer& code) {
+    code << "mvm(['";
     for(unsigned int i = 0; i < N_CONSTANT_MVMUS_PER_CORE; ++i) {
         if(coalescedMVMSet->usesPMVMU(i)) {
-            ss << 1;
+            code << '1';
         } else {
-            ss << 0;
+            code << '0';
         }
     }
-    ss << "'])\n";
-    return ss.str();
+    code << "'])\n";
 }
 
-std::string CodeGenerator::codegen(CoalescedTrainingOperationSet* coalescedTrainingOperationSet) {
-    std::stringstream ss;
-    ss << "train([";
+void CodeGenerator::codegen(CoalescedTrainingOperationSet* coalescedTrainingOperationSet, CodeBuffer& code) {
+    code << "train([";
     for(unsigned int pMVMU = 0; pMVMU < N_TRAINING_MVMUS_PER_CORE; ++pMVMU) {
-        ss << "'";
+        code << "'";
         for(unsigned int t = 0; t < N_TRAINING_OPERATIONS; ++t) {
             TrainingMatrixOperation::OpType opType = (TrainingMatrixOperation::OpType)t;
             if(coalescedTrainingOperationSet->usesPMVMUForOp(pMVMU, opType)) {
-                ss << 1;
+                code << '1';
             } else {
-                ss << 0;
+                code << '0';
             }
         }
-        ss << "'";
+        code << "'";
     }
-    ss << "])\n";
-    return ss.str();
+    code << "])\n";
 }
 
-std::string CodeGenerator::codegen(MVMOperation* mvm) {
+void CodeGenerator::codegen(MVMOperation* mvm, CodeBuffer& code) {
     CoalescedMVMSet* coalescedMVMSet = mvm->getCoalescedSet();
     if(coalescedMVMSet != NULL) {
         if(coalescedMVMSet->isSetLeader(mvm)) { // Only one MVM in a coalesced set does code generation on behalf of the others
-            return codegen(coalescedMVMSet);
-        } else {
-            return "";
+            codegen(coalescedMVMSet, code);
         }
     } else {
-        std::stringstream ss;
-        ss << "mvm(['";
+        code << "mvm(['";
         for(unsigned int i = 0; i < N_CONSTANT_MVMUS_PER_CORE; ++i) {
             if(i == placer_->getPMVMU(mvm)) {
-                ss << 1;
+                code << '1';
             } else {
-                ss << 0;
+                code << '0';
             }
         }
-        ss << "'])\n";
-        return ss.str();
+        code << "'])\n";
     }
 }
 
-std::string CodeGenerator::codegen(TrainingMatrixOperation* trainOp) {
+void CodeGenerator::codegen(TrainingMatrixOperation* trainOp, CodeBuffer& code) {
     CoalescedTrainingOperationSet* coalescedTrainingOperationSet = trainOp->getCoalescedSet();
     if(coalescedTrainingOperationSet != NULL) {
         if(coalescedTrainingOperationSet->isSetLeader(trainOp)) { // Only one training operation in a coalesced set does code generation on behalf of the others
-            return codegen(coalescedTrainingOperationSet);
-        } else {
-            return "";
+            codegen(coalescedTrainingOperationSet, code);
         }
     } else {
-        std::stringstream ss;
-        ss << "train([";
+        code << "train([";
         for(unsigned int pMVMU = 0; pMVMU < N_TRAINING_MVMUS_PER_CORE; ++pMVMU) {
-            ss << "'";
+            code << "'";
             for(unsigned int t = 0; t < N_TRAINING_OPERATIONS; ++t) {
                 TrainingMatrixOperation::OpType opType = (TrainingMatrixOperation::OpType)t;
                 if(pMVMU == placer_->getPMVMU(trainOp) && opType == trainOp->getOpType()) {
-                    ss << 1;
+                    code << '1';
                 } else {
-                    ss << 0;
+                    code << '0';
                 }
             }
         }
-        ss << "])\n";
-        return ss.str();
+        code << "])\n";
     }
 }
 
-std::string CodeGenerator::codegen(ALUVectorOperation* aluOp) {
-    std::stringstream ss;
-    ss << "alu";
+void CodeGenerator::codegen(ALUVectorOperation* aluOp, CodeBuffer& code) {
+    code << "alu";
     switch(aluOp->getOpCode()) {
         case ALUVectorOperation::MULI:
-            ss << "i";
+            code << "i";
     }
-    ss << "('";
+    code << "('";
     switch(aluOp->getOpCode()) {
-        case ALUVectorOperation::ADD: ss << "add"; break;
-        case ALUVectorOperation::SUB: ss << "sub"; break;
+        case ALUVectorOperation::ADD: code << "add"; break;
+        case ALUVectorOperation::SUB: code << "sub"; break;
         case ALUVectorOperation::MUL:
-        case ALUVectorOperation::MULI: ss << "mul"; break;
-        case ALUVectorOperation::DIV: ss << "div"; break;
-        case ALUVectorOperation::AND: ss << "and"; break;
-        case ALUVectorOperation::OR: ss << "or"; break;
-        case ALUVectorOperation::NOT: ss << "not"; break;
-        case ALUVectorOperation::EQ: ss << "eq"; break;
-        case ALUVectorOperation::NEQ: ss << "neq"; break;
-        case ALUVectorOperation::LT: ss << "lt"; break;
-        case ALUVectorOperation::LEQ: ss << "leq"; break;
-        case ALUVectorOperation::GT: ss << "gt"; break;
-        case ALUVectorOperation::GEQ: ss << "geq"; break;
-        case ALUVectorOperation::MIN: ss << "min"; break;
-        case ALUVectorOperation::MAX: ss << "max"; break;
-        case ALUVectorOperation::MSE: ss << "mse"; break;
-        case ALUVectorOperation::SIG: ss << "sig"; break;
-        case ALUVectorOperation::TANH: ss << "tanh"; break;
-        case ALUVectorOperation::EXP: ss << "exp"; break;
-        case ALUVectorOperation::LOG: ss << "log"; break;
-        case ALUVectorOperation::RELU: ss << "relu"; break;
-        case ALUVectorOperation::RELUD: ss << "relud"; break;
-        case ALUVectorOperation::LOG_SOFTMAX: ss << "log_softmax"; break;
-        case ALUVectorOperation::LOG_SOFTMAXD: ss << "log_softmaxd"; break;
-        case ALUVectorOperation::RNDCMP: ss << "rndcmp"; break;
+        case ALUVectorOperation::MULI: code << "mul"; break;
+        case ALUVectorOperation::DIV: code << "div"; break;
+        case ALUVectorOperation::AND: code << "and"; break;
+        case ALUVectorOperation::OR: code << "or"; break;
+        case ALUVectorOperation::NOT: code << "not"; break;
+        case ALUVectorOperation::EQ: code << "eq"; break;
+        case ALUVectorOperation::NEQ: code << "neq"; break;
+        case ALUVectorOperation::LT: code << "lt"; break;
+        case ALUVectorOperation::LEQ: code << "leq"; break;
+        case ALUVectorOperation::GT: code << "gt"; break;
+        case ALUVectorOperation::GEQ: code << "geq"; break;
+        case ALUVectorOperation::MIN: code << "min"; break;
+        case ALUVectorOperation::MAX: code << "max"; break;
+        case ALUVectorOperation::MSE: code << "mse"; break;
+        case ALUVectorOperation::SIG: code << "sig"; break;
+        case ALUVectorOperation::TANH: code << "tanh"; break;
+        case ALUVectorOperation::EXP: code << "exp"; break;
+        case ALUVectorOperation::LOG: code << "log"; break;
+        case ALUVectorOperation::RELU: code << "relu"; break;
+        case ALUVectorOperation::RELUD: code << "relud"; break;
+        case ALUVectorOperation::LOG_SOFTMAX: code << "log_softmax"; break;
+        case ALUVectorOperation::LOG_SOFTMAXD: code << "log_softmaxd"; break;
+        case ALUVectorOperation::RNDCMP: code << "rndcmp"; break;
     }
-    ss << "', "
-       << "d1=" << registerAllocator_->getRegister(aluOp) << ", "
-       << "r1=" << registerAllocator_->getRegister(aluOp->getOperand(0)) << ", ";
+    code << "', "
+         << "d1=" << registerAllocator_->getRegister(aluOp) << ", "
+         << "r1=" << registerAllocator_->getRegister(aluOp->getOperand(0)) << ", ";
     if(aluOp->numOperands() > 1) {
-        ss << "r2=" << registerAllocator_->getRegister(aluOp->getOperand(1)) << ", ";
+        code << "r2=" << registerAllocator_->getRegister(aluOp->getOperand(1)) << ", ";
     }
     if(aluOp->isImmediate()) {
-        ss << "imm=" << aluOp->getImmediate() << ", ";
+        code << "imm=" << aluOp->getImmediate() << ", ";
     }
-    ss << "vec=" << aluOp->length()
-       << ")\n";
-    return ss.str();
+    code << "vec=" << aluOp->length()
+         << ")\n";
 }
 
-std::string CodeGenerator::codegen(SetImmediateOperation* seti) {
-    std::stringstream ss;
-    ss << "set("
-       << "d1=" << registerAllocator_->getRegister(seti) << ", "
-       << "imm=" << seti->getImmediate() << ", "
-       << "vec=" << seti->length()
-       << ")\n";
-    return ss.str();
+void CodeGenerator::codegen(SetImmediateOperation* seti, CodeBuffer& code) {
+    code << "set("
+         << "d1=" << registerAllocator_->getRegister(seti) << ", "
+         << "imm=" << seti->getImmediate() << ", "
+         << "vec=" << seti->length()
+         << ")\n";
 }
 
-std::string CodeGenerator::codegen(CopyOperation* copy) {
-    std::stringstream ss;
-    ss << "copy("
-       << "d1=" << registerAllocator_->getRegister(copy) << ", "
-       << "r1=" << registerAllocator_->getRegister(copy->getOperand(0)) << ", "
-       << "vec=" << copy->length() << ", "
-       << "src_type=" << 1
-       << ")\n";
-    return ss.str();
+void CodeGenerator::codegen(CopyOperation* copy, CodeBuffer& code) {
+    code << "copy("
+         << "d1=" << registerAllocator_->getRegister(copy) << ", "
+         << "r1=" << registerAllocator_->getRegister(copy->getOperand(0)) << ", "
+         << "vec=" << copy->length() << ", "
+         << "src_type=" << 1
+         << ")\n";
 }
 
-std::string CodeGenerator::codegen(LoadOperation* load) {
-    std::stringstream ss;
+void CodeGenerator::codegen(LoadOperation* load, CodeBuffer& code) {
     unsigned int loadWidth;
     for(loadWidth = MAX_LOAD_STORE_WIDTH; !(load->length()%loadWidth == 0); --loadWidth);
-    ss << "load("
-       << "d1=" << registerAllocator_->getRegister(load) << ", "
-       << "r1=" << registerAllocator_->getRegister(load->getOperand(0)) << ", "
-       << "load_width=" << loadWidth << ", "
-       << "vec=" << load->length()/loadWidth
-       << ")\n";
-    return ss.str();
+    code << "load("
+         << "d1=" << registerAllocator_->getRegister(load) << ", "
+         << "r1=" << registerAllocator_->getRegister(load->getOperand(0)) << ", "
+         << "load_width=" << loadWidth << ", "
+         << "vec=" << load->length()/loadWidth
+         << ")\n";
 }
 
-std::string CodeGenerator::codegen(StoreOperation* store) {
-    std::stringstream ss;
+void CodeGenerator::codegen(StoreOperation* store, CodeBuffer& code) {
     unsigned int storeWidth;
     for(storeWidth = MAX_LOAD_STORE_WIDTH; !(store->length()%storeWidth == 0); --storeWidth);
-    ss << "store(d1=" << registerAllocator_->getRegister(store->getOperand(1)) << ", "
-       << "r1=" << registerAllocator_->getRegister(store->getOperand(0)) << ", "
-       << "counter=" << store->numUsers() << ", "
-       << "store_width=" << storeWidth << ", "
-       << "vec=" << store->length()/storeWidth
-       << ")\n";
-    return ss.str();
+    code << "store(d1=" << registerAllocator_->getRegister(store->getOperand(1)) << ", "
+         << "r1=" << registerAllocator_->getRegister(store->getOperand(0)) << ", "
+         << "counter=" << memoryAllocator_->getReadCount(store) << ", "
+         << "store_width=" << storeWidth << ", "
+         << "vec=" << store->length()/storeWidth
+         << ")\n";
 }
 
-std::string CodeGenerator::codegen(SendOperation* send) {
-    std::stringstream ss;
+void CodeGenerator::codegen(SendOperation* send, CodeBuffer& code) {
     unsigned int sendWidth;
     for(sendWidth = MAX_SEND_RECV_WIDTH; !(send->length()%sendWidth == 0); --sendWidth);
-    ss << "send("
-       << "mem_addr=" << memoryAllocator_->getTileMemoryAddress(send->getSrc(0)) << ", "
-       << "vtile_id=" << placer_->getPTile(send) << ", " // FIXME: Assign sender IDs
-       << "send_width=" << sendWidth << ", "
-       << "target_addr=" << placer_->getPTile(send->getDst()) << ", "
-       << "vec=" << send->length()/sendWidth
-       << ")\n";
-    return ss.str();
+    unsigned int sendSize = memoryAllocator_->getTileMemorySize(send->getSrc(0)); // Stream buffers are sent in bulk
+    code << "send("
+         << "mem_addr=" << memoryAllocator_->getTileMemoryAddress(send->getSrc(0)) << ", "
+         << "vtile_id=" << placer_->getPTile(send) << ", " // FIXME: Assign sender IDs
+         << "send_width=" << sendWidth << ", "
+         << "target_addr=" << placer_->getPTile(send->getDst()) << ", "
+         << "vec=" << sendSize/sendWidth
+         << ")\n";
 }
 
-std::string CodeGenerator::codegen(ReceiveOperation* recv) {
-    std::stringstream ss;
+void CodeGenerator::codegen(ReceiveOperation* recv, CodeBuffer& code) {
     unsigned int recvWidth;
     for(recvWidth = MAX_SEND_RECV_WIDTH; !(recv->length()%recvWidth == 0); --recvWidth);
-    ss << "receive(mem_addr=" << memoryAllocator_->getTileMemoryAddress(recv) << ", "
-       << "vtile_id=" << placer_->getPTile(recv->getSrc()) << ", " // FIXME: Assign sender IDs
-       << "receive_width=" << recvWidth << ", "
-       << "counter=" << recv->numUsers() << ", "
-       << "vec=" << recv->length()/recvWidth
-       << ")\n";
-    return ss.str();
+    unsigned int recvSize = memoryAllocator_->getTileMemorySize(recv); // Stream buffers are received in bulk
+    code << "receive(mem_addr=" << memoryAllocator_->getTileMemoryAddress(recv) << ", "
+         << "vtile_id=" << placer_->getPTile(recv->getSrc()) << ", " // FIXME: Assign sender IDs
+         << "receive_width=" << recvWidth << ", "
+         << "counter=" << memoryAllocator_->getReadCount(recv) << ", "
+         << "vec=" << recvSize/recvWidth
+         << ")\n";
+}
+
+void CodeGenerator::codegen(LoopBeginOperation* begin, CodeBuffer& code) {
+    StreamLoop* loop = begin->getStreamLoop();
+    unsigned int reg = registerAllocator_->getRegister(begin);
+    code << "set(d1=" << reg + LoopBeginOperation::HEIGHT << ", imm=" << loop->height() << ", vec=1)\n"
+         << "set(d1=" << reg + LoopBeginOperation::WIDTH << ", imm=" << loop->width() << ", vec=1)\n"
+         << "set(d1=" << reg + LoopBeginOperation::ONE << ", imm=1, vec=1)\n";
+    for(unsigned int i = 0; i < begin->numStrides(); ++i) {
+        unsigned int stride = begin->getStride(i);
+        code << "set(d1=" << reg + begin->getStrideRegisterOffset(stride) << ", imm=" << stride << ", vec=1)\n";
+    }
+    code << "set(d1=" << reg + LoopBeginOperation::ROW << ", imm=0, vec=1)\n";
+    unsigned int rowHead = code.nLines();
+    code << "set(d1=" << reg + LoopBeginOperation::COLUMN << ", imm=0, vec=1)\n";
+    loopHeads_[begin] = std::make_pair(rowHead, code.nLines());
+}
+
+void CodeGenerator::codegen(LoopEndOperation* end, CodeBuffer& code) {
+    LoopBeginOperation* begin = end->getLoopBegin();
+    unsigned int reg = registerAllocator_->getRegister(begin);
+    unsigned int rowHead = loopHeads_[begin].first;
+    unsigned int columnHead = loopHeads_[begin].second;
+
+    // Step induction variables to the next column and loop over the columns of a row
+    for(unsigned int i = 0; i < end->numInductionVariables(); ++i) {
+        SetImmediateOperation* seti = end->getInductionVariable(i);
+        if(seti->getInnerStride() != 0) {
+            codegenStep(seti, seti->getInnerStride(), reg + begin->getStrideRegisterOffset(std::abs(seti->getInnerStride())), code);
+        }
+    }
+    unsigned int pc = code.nLines();
+    code << "alu_int('add', d1=" << reg + LoopBeginOperation::COLUMN << ", r1=" << reg + LoopBeginOperation::COLUMN << ", r2=" << reg + LoopBeginOperation::ONE << ")\n"
+         << "beq(r1=" << reg + LoopBeginOperation::COLUMN << ", r2=" << reg + LoopBeginOperation::WIDTH << ", pc=" << pc + 3 << ")\n"
+         << "jmp(pc=" << columnHead << ")\n";
+
+    // Step induction variables to the start of the next row and loop over the rows
+    for(unsigned int i = 0; i < end->numInductionVariables(); ++i) {
+        SetImmediateOperation* seti = end->getInductionVariable(i);
+        if(seti->getOuterStride() != 0) {
+            codegenStep(seti, seti->getOuterStride(), reg + begin->getStrideRegisterOffset(std::abs(seti->getOuterStride())), code);
+        }
+    }
+    pc = code.nLines();
+    code << "alu_int('add', d1=" << reg + LoopBeginOperation::ROW << ", r1=" << reg + LoopBeginOperation::ROW << ", r2=" << reg + LoopBeginOperation::ONE << ")\n"
+         << "beq(r1=" << reg + LoopBeginOperation::ROW << ", r2=" << reg + LoopBeginOperation::HEIGHT << ", pc=" << pc + 3 << ")\n"
+         << "jmp(pc=" << rowHead << ")\n";
+}
+
+void CodeGenerator::codegenStep(SetImmediateOperation* seti, int stride, unsigned int strideReg, CodeBuffer& code) {
+    unsigned int reg = registerAllocator_->getRegister(seti);
+    code << "alu_int('" << ((stride >= 0)?("add"):("sub")) << "', "
+         << "d1=" << reg << ", "
+         << "r1=" << reg << ", "
+         << "r2=" << strideReg
+         << ")\n";
 }
 
-std::string CodeGenerator::codegen(WriteInputOperation* write) {
-    return "";
+void CodeGenerator::codegen(WriteInputOperation* write, CodeBuffer& code) {
 }
 
-std::string CodeGenerator::codegen(ReadOutputOperation* read) {
-    return "";
+void CodeGenerator::codegen(ReadOutputOperation* read, CodeBuffer& code) {
 }
 
@@ -6,7 +6,36 @@
  *
  */
 
+#include <string>
+#include <vector>
+
 #include "common.h"
+#include "optable.h"
+
+/* Growable output buffer that formats code directly into memory and counts the lines (i.e., instructions) written */
+class CodeBuffer {
+
+    private:
+
+        std::vector<char> data_;
+        unsigned int nLines_;
+
+    public:
+
+        CodeBuffer() : nLines_(0) { }
+
+        unsigned int nLines() { return nLines_; }
+        void clear() { data_.clear(); nLines_ = 0; }
+        void writeToFile(std::string fileName);
+
+        CodeBuffer& operator<<(char c);
+        CodeBuffer& operator<<(const char* str);
+        CodeBuffer& operator<<(const std::string& str);
+        CodeBuffer& operator<<(unsigned int value);
+        CodeBuffer& operator<<(int value);
+        CodeBuffer& operator<<(float value);
+
+};
 
 class CodeGenerator {
 
@@ -19,20 +48,26 @@ class CodeGenerator {
         Linearizer* linearizer_;
         RegisterAllocator* registerAllocator_;
 
+        OperationTable<std::pair<unsigned int, unsigned int>> loopHeads_; /* Program counters of the row and column loop heads */
+
         void codegen();
-        std::string codegen(CoalescedMVMSet* coalescedMVMSet);
-        std::string codegen(CoalescedTrainingOperationSet* coalescedTrainingOperationSet);
-        std::string codegen(MVMOperation* mvm);
-        std::string codegen(TrainingMatrixOperation* trainOp);
-        std::string codegen(ALUVectorOperation* aluOp);
-        std::string codegen(SetImmediateOperation* seti);
-        std::string codegen(CopyOperation* copy);
-        std::string codegen(LoadOperation* load);
-        std::string codegen(StoreOperation* store);
-        std::string codegen(SendOperation* send);
-        std::string codegen(ReceiveOperation* recv);
-        std::string codegen(WriteInputOperation* write);
-        std::string codegen(ReadOutputOperation* read);
+        void codegen(unsigned int pTile, CodeBuffer& code);
+        void codegen(CoalescedMVMSet* coalescedMVMSet, CodeBuffer& code);
+        void codegen(CoalescedTrainingOperationSet* coalescedTrainingOperationSet, CodeBuffer& code);
+        void codegen(MVMOperation* mvm, CodeBuffer& code);
+        void codegen(TrainingMatrixOperation* trainOp, CodeBuffer& code);
+        void codegen(ALUVectorOperation* aluOp, CodeBuffer& code);
+        void codegen(SetImmediateOperation* seti, CodeBuffer& code);
+        void codegen(CopyOperation* copy, CodeBuffer& code);
+        void codegen(LoadOperation* load, CodeBuffer& code);
+        void codegen(StoreOperation* store, CodeBuffer& code);
+        void codegen(SendOperation* send, CodeBuffer& code);
+        void codegen(ReceiveOperation* recv, CodeBuffer& code);
+        void codegen(WriteInputOperation* write, CodeBuffer& code);
+        void codegen(ReadOutputOperation* read, CodeBuffer& code);
+        void codegen(LoopBeginOperation* begin, CodeBuffer& code);
+        void codegen(LoopEndOperation* end, CodeBuffer& code);
+        void codegenStep(SetImmediateOperation* seti, int stride, unsigned int strideReg, CodeBuffer& code);
 
     public:
 
@@ -61,6 +61,7 @@ class CoalescedMVMSet;
 class TrainingMatrixOperation;
 class CoalescedTrainingOperationSet;
 class ALUVectorOperation;
+class ReductionTree;
 class SetImmediateOperation;
 class CopyOperation;
 class LoadOperation;
@@ -71,6 +72,10 @@ class WriteInputOperation;
 class ReadOutputOperation;
 class PseudoInputOperation;
 class PseudoOutputOperation;
+class LoopBeginOperation;
+class LoopEndOperation;
+class StreamLoop;
+struct StreamAccess;
 
 /* allocator.h */
 class CoreAllocator;
@@ -82,6 +87,10 @@ class ModelImpl;
 /* partitioner.h */
 class Partitioner;
 
+/* graphpartitioner.h */
+class WeightedGraph;
+class MultilevelPartitioner;
+
 /* placer.h */
 class Placer;
 
@@ -100,8 +109,16 @@ class RegisterAllocator;
 /* codegen.h */
 class CodeGenerator;
 
+/* stats.h */
+class CompileStatistics;
+
 /* instance.h */
 class ModelInstanceImpl;
 
+/* weights.h */
+class WeightSource;
+class WeightImageWriter;
+class WeightBlockQueue;
+
 #endif
 
@@ -0,0 +1,341 @@
+/*
+ *  Copyright (c) 2019 IMPACT Research Group, University of Illinois.
+ *  All rights reserved.
+ *
+ *  This file is covered by the LICENSE.txt license file in the root directory.
+ *
+ */
+
+#include <assert.h>
+#include <algorithm>
+#include <climits>
+
+#include "puma.h"
+
+#include "graphpartitioner.h"
+#include "parallel.h"
+
+void WeightedGraph::addEdge(unsigned int node1, unsigned int node2, unsigned int weight) {
+    assert(node1 != node2 && "Graph cannot have self edges!");
+    if(!adjacency_[node1].count(node2)) {
+        ++nEdges_;
+    }
+    adjacency_[node1][node2] += weight;
+    adjacency_[node2][node1] += weight;
+}
+
+static std::vector<unsigned int> randomOrder(unsigned int n, std::mt19937& rng) {
+    // Fisher-Yates shuffle drawing directly from the generator, so the order is the same with any standard library
+    std::vector<unsigned int> order(n);
+    for(unsigned int i = 0; i < n; ++i) {
+        order[i] = i;
+    }
+    for(unsigned int i = n; i > 1; --i) {
+        std::swap(order[i - 1], order[rng()%i]);
+    }
+    return order;
+}
+
+static unsigned int getTotalWeight(std::vector<unsigned int>& nodeWeights) {
+    unsigned int total = 0;
+    for(unsigned int weight : nodeWeights) {
+        total += weight;
+    }
+    return total;
+}
+
+MultilevelPartitioner::MultilevelPartitioner(WeightedGraph& graph, unsigned int maxPartSize, unsigned int nThreads)
+    : maxPartSize_(maxPartSize), nParts_(0)
+{
+    assert(maxPartSize_ > 0 && "Parts must be able to hold at least one node!");
+
+    // Run randomized attempts in parallel and keep the one with the smallest cut
+    std::vector<std::vector<unsigned int>> attempts(N_ATTEMPTS);
+    std::vector<unsigned long> cuts(N_ATTEMPTS);
+    parallelFor(nThreads, N_ATTEMPTS, [&](unsigned int attempt) {
+        attempts[attempt] = partition(graph, attempt, cuts[attempt]);
+    });
+    unsigned int best = 0;
+    for(unsigned int attempt = 1; attempt < N_ATTEMPTS; ++attempt) {
+        if(cuts[attempt] < cuts[best]) {
+            best = attempt;
+        }
+    }
+
+    // Number parts in order of their first node so that part IDs are contiguous
+    std::map<unsigned int, unsigned int> partIDs;
+    parts_.resize(graph.numNodes());
+    for(unsigned int node = 0; node < graph.numNodes(); ++node) {
+        unsigned int part = attempts[best][node];
+        if(!partIDs.count(part)) {
+            partIDs[part] = nParts_++;
+        }
+        parts_[node] = partIDs[part];
+    }
+
+}
+
+std::vector<unsigned int> MultilevelPartitioner::partition(WeightedGraph& graph, unsigned int seed, unsigned long& cut) {
+
+    std::mt19937 rng(seed);
+
+    // Coarsen
+    std::vector<Level> levels(1);
+    levels[0].nodeWeights.assign(graph.numNodes(), 1);
+    levels[0].adjacency.resize(graph.numNodes());
+    for(unsigned int node = 0; node < graph.numNodes(); ++node) {
+        levels[0].adjacency[node] = graph.getNeighbors(node);
+    }
+    while(seed != 0) {
+        Level coarse;
+        if(!coarsen(levels.back(), coarse, rng)) {
+            break;
+        }
+        levels.push_back(std::move(coarse));
+    }
+
+    // Partition the coarsest level that can be packed into the minimum number of parts (the finest level always can).
+    // The first attempt instead starts from consecutive nodes grouped together, which is a good partition when node
+    // IDs follow the structure of the model (e.g., matrix tiles in row major order).
+    std::vector<unsigned int> parts;
+    unsigned int level = levels.size() - 1;
+    if(seed == 0) {
+        parts.resize(graph.numNodes());
+        for(unsigned int node = 0; node < graph.numNodes(); ++node) {
+            parts[node] = node/maxPartSize_;
+        }
+    } else {
+        while(!partitionCoarsest(levels[level], parts, rng)) {
+            assert(level > 0 && "Cannot pack the finest graph into parts!");
+            --level;
+        }
+    }
+
+    // Uncoarsen, refining the partition at every level
+    refine(levels[level], parts, rng);
+    while(level > 0) {
+        --level;
+        Level& fine = levels[level];
+        std::vector<unsigned int> fineParts(fine.nodeWeights.size());
+        for(unsigned int node = 0; node < fineParts.size(); ++node) {
+            fineParts[node] = parts[fine.coarseNodes[node]];
+        }
+        parts.swap(fineParts);
+        refine(fine, parts, rng);
+    }
+
+    cut = getCut(levels[0], parts);
+    return parts;
+
+}
+
+bool MultilevelPartitioner::coarsen(Level& fine, Level& coarse, std::mt19937& rng) {
+
+    // Stop when there are only a few nodes per part left
+    unsigned int nNodes = fine.nodeWeights.size();
+    unsigned int nParts = (getTotalWeight(fine.nodeWeights) + maxPartSize_ - 1)/maxPartSize_;
+    if(nNodes <= 2*nParts) {
+        return false;
+    }
+
+    // Match each node with the unmatched neighbor it shares the heaviest edge with, as long as the pair fits in a part
+    fine.coarseNodes.assign(nNodes, UINT_MAX);
+    unsigned int nCoarseNodes = 0;
+    for(unsigned int node : randomOrder(nNodes, rng)) {
+        if(fine.coarseNodes[node] != UINT_MAX) {
+            continue;
+        }
+        unsigned int match = UINT_MAX;
+        unsigned int matchWeight = 0;
+        for(auto edge : fine.adjacency[node]) {
+            unsigned int neighbor = edge.first;
+            if(fine.coarseNodes[neighbor] == UINT_MAX && fine.nodeWeights[node] + fine.nodeWeights[neighbor] <= maxPartSize_ && edge.second > matchWeight) {
+                match = neighbor;
+                matchWeight = edge.second;
+            }
+        }
+        fine.coarseNodes[node] = nCoarseNodes;
+        if(match != UINT_MAX) {
+            fine.coarseNodes[match] = nCoarseNodes;
+        }
+        ++nCoarseNodes;
+    }
+
+    // Stop when matching no longer shrinks the graph much
+    if(10*nCoarseNodes > 9*nNodes) {
+        fine.coarseNodes.clear();
+        return false;
+    }
+
+    // Contract matched nodes
+    coarse.nodeWeights.assign(nCoarseNodes, 0);
+    coarse.adjacency.resize(nCoarseNodes);
+    for(unsigned int node = 0; node < nNodes; ++node) {
+        unsigned int coarseNode = fine.coarseNodes[node];
+        coarse.nodeWeights[coarseNode] += fine.nodeWeights[node];
+        for(auto edge : fine.adjacency[node]) {
+            unsigned int coarseNeighbor = fine.coarseNodes[edge.first];
+            if(coarseNeighbor != coarseNode) {
+                coarse.adjacency[coarseNode][coarseNeighbor] += edge.second;
+            }
+        }
+    }
+    return true;
+
+}
+
+bool MultilevelPartitioner::partitionCoarsest(Level& level, std::vector<unsigned int>& parts, std::mt19937& rng) {
+
+    // Grow one part at a time from a random seed, adding the node most connected to the part until the part is full
+    unsigned int nNodes = level.nodeWeights.size();
+    unsigned int nParts = (getTotalWeight(level.nodeWeights) + maxPartSize_ - 1)/maxPartSize_;
+    std::vector<unsigned int> order = randomOrder(nNodes, rng);
+    parts.assign(nNodes, UINT_MAX);
+    for(unsigned int part = 0; part < nParts; ++part) {
+        unsigned int partWeight = 0;
+        std::map<unsigned int, unsigned int> frontier; // Unassigned neighbors of the part and their connection to it
+        while(partWeight < maxPartSize_) {
+            unsigned int next = UINT_MAX;
+            for(auto candidate : frontier) {
+                if(partWeight + level.nodeWeights[candidate.first] <= maxPartSize_ && (next == UINT_MAX || candidate.second > frontier[next])) {
+                    next = candidate.first;
+                }
+            }
+            if(next == UINT_MAX) {
+                // Start a new region of the part from the next unassigned node that fits
+                for(unsigned int node : order) {
+                    if(parts[node] == UINT_MAX && partWeight + level.nodeWeights[node] <= maxPartSize_) {
+                        next = node;
+                        break;
+                    }
+                }
+                if(next == UINT_MAX) {
+                    break;
+                }
+            }
+            parts[next] = part;
+            partWeight += level.nodeWeights[next];
+            frontier.erase(next);
+            for(auto edge : level.adjacency[next]) {
+                if(parts[edge.first] == UINT_MAX) {
+                    frontier[edge.first] += edge.second;
+                }
+            }
+        }
+    }
+
+    // Fail if the nodes could not be packed into the minimum number of parts
+    for(unsigned int node = 0; node < nNodes; ++node) {
+        if(parts[node] == UINT_MAX) {
+            return false;
+        }
+    }
+    return true;
+
+}
+
+void MultilevelPartitioner::refine(Level& level, std::vector<unsigned int>& parts, std::mt19937& rng) {
+
+    unsigned int nNodes = level.nodeWeights.size();
+    unsigned int nParts = 0;
+    for(unsigned int part : parts) {
+        nParts = std::max(nParts, part + 1);
+    }
+    std::vector<unsigned int> partWeights(nParts, 0);
+    std::vector<std::vector<unsigned int>> members(nParts);
+    for(unsigned int node = 0; node < nNodes; ++node) {
+        partWeights[parts[node]] += level.nodeWeights[node];
+        members[parts[node]].push_back(node);
+    }
+    auto moveNode = [&](unsigned int node, unsigned int to) {
+        unsigned int from = parts[node];
+        partWeights[from] -= level.nodeWeights[node];
+        members[from].erase(std::find(members[from].begin(), members[from].end(), node));
+        parts[node] = to;
+        partWeights[to] += level.nodeWeights[node];
+        members[to].push_back(node);
+    };
+
+    // Greedily apply moves, or swaps when parts are full, that reduce the cut until no more improvement is found
+    for(unsigned int pass = 0; pass < MAX_REFINEMENT_PASSES; ++pass) {
+        bool improved = false;
+        for(unsigned int node : randomOrder(nNodes, rng)) {
+            unsigned int from = parts[node];
+            std::map<unsigned int, long> connections; // Weight of the edges between the node and each part
+            for(auto edge : level.adjacency[node]) {
+                connections[parts[edge.first]] += edge.second;
+            }
+            long internal = connections[from];
+
+            // Move the node to the part it is most connected to if that part has room
+            unsigned int moveTo = UINT_MAX;
+            long moveGain = 0;
+            for(auto connection : connections) {
+                unsigned int to = connection.first;
+                if(to != from && partWeights[to] + level.nodeWeights[node] <= maxPartSize_ && connection.second - internal > moveGain) {
+                    moveTo = to;
+                    moveGain = connection.second - internal;
+                }
+            }
+            if(moveTo != UINT_MAX) {
+                moveNode(node, moveTo);
+                improved = true;
+                continue;
+            }
+
+            // Otherwise swap it with a node of a part it is connected to
+            unsigned int swapWith = UINT_MAX;
+            long swapGain = 0;
+            for(auto connection : connections) {
+                unsigned int to = connection.first;
+                if(to == from) {
+                    continue;
+                }
+                for(unsigned int other : members[to]) {
+                    if(partWeights[from] - level.nodeWeights[node] + level.nodeWeights[other] > maxPartSize_ || partWeights[to] - level.nodeWeights[other] + level.nodeWeights[node] > maxPartSize_) {
+                        continue;
+                    }
+                    long otherToFrom = 0;
+                    long otherInternal = 0;
+                    for(auto edge : level.adjacency[other]) {
+                        if(parts[edge.first] == from) {
+                            otherToFrom += edge.second;
+                        } else if(parts[edge.first] == to) {
+                            otherInternal += edge.second;
+                        }
+                    }
+                    auto between = level.adjacency[node].find(other);
+                    long betweenWeight = (between != level.adjacency[node].end())?(between->second):(0);
+                    long gain = (connection.second - internal) + (otherToFrom - otherInternal) - 2*betweenWeight;
+                    if(gain > swapGain) {
+                        swapWith = other;
+                        swapGain = gain;
+                    }
+                }
+            }
+            if(swapWith != UINT_MAX) {
+                unsigned int to = parts[swapWith];
+                moveNode(swapWith, from);
+                moveNode(node, to);
+                improved = true;
+            }
+        }
+        if(!improved) {
+            break;
+        }
+    }
+
+}
+
+unsigned long MultilevelPartitioner::getCut(Level& level, std::vector<unsigned int>& parts) {
+    unsigned long cut = 0;
+    for(unsigned int node = 0; node < level.nodeWeights.size(); ++node) {
+        for(auto edge : level.adjacency[node]) {
+            if(node < edge.first && parts[node] != parts[edge.first]) {
+                cut += edge.second;
+            }
+        }
+    }
+    return cut;
+}
+
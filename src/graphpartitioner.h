@@ -0,0 +1,81 @@
+/*
+ *  Copyright (c) 2019 IMPACT Research Group, University of Illinois.
+ *  All rights reserved.
+ *
+ *  This file is covered by the LICENSE.txt license file in the root directory.
+ *
+ */
+
+#ifndef _GRAPHPARTITIONER_H_
+#define _GRAPHPARTITIONER_H_
+
+#include <map>
+#include <random>
+#include <vector>
+
+#include "common.h"
+
+/* Undirected graph with weighted edges (parallel edges are merged by adding their weights) */
+class WeightedGraph {
+
+    private:
+
+        std::vector<std::map<unsigned int, unsigned int>> adjacency_;
+        unsigned int nEdges_;
+
+    public:
+
+        WeightedGraph(unsigned int nNodes) : adjacency_(nNodes), nEdges_(0) { }
+
+        unsigned int numNodes() { return adjacency_.size(); }
+        unsigned int numEdges() { return nEdges_; }
+        void addEdge(unsigned int node1, unsigned int node2, unsigned int weight);
+        std::map<unsigned int, unsigned int>& getNeighbors(unsigned int node) { return adjacency_[node]; }
+
+};
+
+/*
+ * Partitions the nodes of a graph into as few parts as possible given that each part holds at most maxPartSize nodes,
+ * minimizing the weight of the edges cut between parts. The graph is coarsened by repeatedly contracting heavy edges,
+ * the coarsest graph is partitioned by growing parts greedily, and the partition is projected back to the original
+ * graph, refining it at every level with moves and swaps of nodes between parts (Kernighan-Lin/Fiduccia-Mattheyses).
+ * Several randomized attempts run in parallel and the one with the smallest cut is kept. Attempts are seeded by their
+ * index, so the result does not depend on the number of threads. The first attempt refines the partition that groups
+ * consecutive nodes instead, so the cut is never larger than the cut of that partition. A smaller cut does not imply that
+ * less data is transferred once the graph is mapped back to the model, so callers compare against consecutive grouping.
+ */
+class MultilevelPartitioner {
+
+    private:
+
+        /* Graph at one level of coarsening */
+        struct Level {
+            std::vector<unsigned int> nodeWeights;
+            std::vector<std::map<unsigned int, unsigned int>> adjacency;
+            std::vector<unsigned int> coarseNodes; // Node of the next coarser level that each node is contracted into
+        };
+
+        static const unsigned int N_ATTEMPTS = 8;
+        static const unsigned int MAX_REFINEMENT_PASSES = 16;
+
+        unsigned int maxPartSize_;
+        unsigned int nParts_;
+        std::vector<unsigned int> parts_;
+
+        bool coarsen(Level& fine, Level& coarse, std::mt19937& rng);
+        bool partitionCoarsest(Level& level, std::vector<unsigned int>& parts, std::mt19937& rng);
+        void refine(Level& level, std::vector<unsigned int>& parts, std::mt19937& rng);
+        unsigned long getCut(Level& level, std::vector<unsigned int>& parts);
+        std::vector<unsigned int> partition(WeightedGraph& graph, unsigned int seed, unsigned long& cut);
+
+    public:
+
+        MultilevelPartitioner(WeightedGraph& graph, unsigned int maxPartSize, unsigned int nThreads);
+
+        unsigned int getNParts() { return nParts_; }
+        unsigned int getPart(unsigned int node) { return parts_[node]; }
+
+};
+
+#endif
+
@@ -6,14 +6,19 @@
  *
  */
 
+#include <algorithm>
 #include <assert.h>
 #include <fstream>
 #include <sstream>
+#include <thread>
 
 #include "instance.h"
 #include "model.h"
+#include "parallel.h"
+#include "partitioner.h"
 #include "placer.h"
 #include "tensors.h"
+#include "weights.h"
 
 ModelInstance ModelInstance::create(Model model) {
     ModelInstance instance;
@@ -25,90 +30,245 @@ void ModelInstance::bind(std::string tensorName, float* data) {
     impl_->bind(tensorName, data);
 }
 
-void ModelInstance::generateData() {
-    impl_->generateData();
+void ModelInstance::bindFile(std::string tensorName, std::string fileName, size_t offset, MatrixLayout layout, ElementType type) {
+    impl_->bindFile(tensorName, fileName, offset, layout, type);
+}
+
+void ModelInstance::bindBlocks(std::string tensorName, BlockReader reader) {
+    impl_->bindBlocks(tensorName, reader);
+}
+
+void ModelInstance::setKernelLayout(std::string tensorName, KernelLayout layout) {
+    impl_->setKernelLayout(tensorName, layout);
+}
+
+void ModelInstance::generateData(DataGenerationOptions options) {
+    impl_->generateData(options);
 }
 
 ModelInstanceImpl* ModelInstance::unwrap() {
     return impl_;
 }
 
-ModelInstanceImpl::ModelInstanceImpl(ModelImpl* model, Placer* placer)
-    : model_(model), placer_(placer)
+ModelInstanceImpl::ModelInstanceImpl(ModelImpl* model, Partitioner* partitioner, Placer* placer)
+    : model_(model), partitioner_(partitioner), placer_(placer)
 { }
 
 void ModelInstanceImpl::bind(std::string tensorName, float* data) {
-    tensorData_[tensorName] = data;
+    sourceFactories_[tensorName] = [=](unsigned int height, unsigned int width) {
+        return new MemoryWeightSource(data, width);
+    };
 }
 
-void ModelInstanceImpl::generateData() {
+void ModelInstanceImpl::bindFile(std::string tensorName, std::string fileName, size_t offset, ModelInstance::MatrixLayout layout, ModelInstance::ElementType type) {
+    sourceFactories_[tensorName] = [=](unsigned int height, unsigned int width) {
+        return new FileWeightSource(fileName, offset, layout, type, height, width);
+    };
+}
+
+void ModelInstanceImpl::bindBlocks(std::string tensorName, ModelInstance::BlockReader reader) {
+    sourceFactories_[tensorName] = [=](unsigned int height, unsigned int width) {
+        return new BlockWeightSource(reader);
+    };
+}
 
-    // TODO: Define ABI for laying out the data
+void ModelInstanceImpl::setKernelLayout(std::string tensorName, ModelInstance::KernelLayout layout) {
+    kernelLayouts_[tensorName] = layout;
+}
+
+void ModelInstanceImpl::generateData(DataGenerationOptions& options) {
 
     std::cout << "Generating data files... " << std::flush;
+    model_->getStatistics().beginPass("data_generation");
 
+    // Collect the tiles to copy into each MVMU, including tiles packed in the same MVMU
+    TileCopyMap tileCopies(placer_->getNPTiles());
+    std::vector<WeightSource*> sources;
     for(auto m = model_->const_mat_begin(); m != model_->const_mat_end(); ++m) {
         ConstantMatrixImpl* mat = *m;
-        std::string matName = mat->name();
-        assert(tensorData_.count(matName) && "No data provided for matrix");
-        float* matData = tensorData_[matName];
+        WeightSource* source = createSource(mat->name(), mat->height(), mat->width());
+        sources.push_back(source);
         for(unsigned int h = 0; h < mat->nHeightTiles(); ++h) {
             for(unsigned int w = 0; w < mat->nWidthTiles(); ++w) {
                 ConstantMatrixTile* matTile = mat->getTile(h, w);
-                unsigned int pTile = placer_->getPTile(matTile);
-                unsigned int pCore = placer_->getPCore(matTile);
-                unsigned int pMVMU = placer_->getPMVMU(matTile);
-                std::stringstream fileName;
-                fileName << model_->getName() << "-tile" << pTile << "-core" << pCore << "-mvmu" << pMVMU << ".weights";
-                std::ofstream mvmuData;
-                mvmuData.open(fileName.str());
-                for(unsigned int row = 0; row < MVMU_DIM; ++row) {
-                    for(unsigned int col = 0; col < MVMU_DIM; ++col) {
-                        if(row < matTile->height() && col < matTile->width()) {
-                            mvmuData << matData[(h*MVMU_DIM + row)*mat->width() + w*MVMU_DIM + col] << " ";
-                        } else {
-                            mvmuData << "0.0 ";
-                        }
-                    }
-                }
-                mvmuData.close();
+                addTile(matTile, tileCopies, [=](float* dst) {
+                    source->read(h*MVMU_DIM, w*MVMU_DIM, matTile->height(), matTile->width(), dst, MVMU_DIM);
+                });
             }
         }
     }
     for(auto m = model_->conv_mat_begin(); m != model_->conv_mat_end(); ++m) {
         ConvolutionalConstantMatrixImpl* mat = *m;
-        std::string matName = mat->name();
-        assert(tensorData_.count(matName) && "No data provided for matrix");
-        float* matData = tensorData_[matName];
-        for(unsigned int kh = 0; kh < mat->getKernelHeight(); ++kh) {
-            for(unsigned int kw = 0; kw < mat->getKernelWidth(); ++kw) {
+        unsigned int nInChannels = mat->getNInChannels();
+        unsigned int nOutChannels = mat->getNOutChannels();
+        unsigned int nKernelPositions = mat->getKernelHeight()*mat->getKernelWidth();
+        WeightSource* source = createSource(mat);
+        sources.push_back(source);
+        for(unsigned int kh = 0; kh < mat->getNKernelHeightTiles(); ++kh) {
+            for(unsigned int kw = 0; kw < mat->getNKernelWidthTiles(); ++kw) {
                 for(unsigned int h = 0; h < mat->getNOutChannelTiles(); ++h) {
                     for(unsigned int w = 0; w < mat->getNInChannelTiles(); ++w) {
                         ConstantMatrixTile* matTile = mat->getTile(kh, kw, h, w);
-                        unsigned int pTile = placer_->getPTile(matTile);
-                        unsigned int pCore = placer_->getPCore(matTile);
-                        unsigned int pMVMU = placer_->getPMVMU(matTile);
-                        std::stringstream fileName;
-                        fileName << model_->getName() << "-tile" << pTile << "-core" << pCore << "-mvmu" << pMVMU << ".weights";
-                        std::ofstream mvmuData;
-                        mvmuData.open(fileName.str());
-                        for(unsigned int row = 0; row < MVMU_DIM; ++row) {
-                            for(unsigned int col = 0; col < MVMU_DIM; ++col) {
-                                if(row < matTile->height() && col < matTile->width()) {
-                                    mvmuData << matData[((kh*mat->getKernelWidth() + kw)*mat->getNOutChannels() + h*MVMU_DIM + row)*mat->getNInChannels() + w*MVMU_DIM + col] << " ";
-                                } else {
-                                    mvmuData << "0.0 ";
+                        if(mat->isKernelFolded()) {
+                            // Folded tiles hold all kernel positions, one after the other
+                            addTile(matTile, tileCopies, [=](float* dst) {
+                                for(unsigned int kernelPos = 0; kernelPos < nKernelPositions; ++kernelPos) {
+                                    source->read(kernelPos*nOutChannels + h*MVMU_DIM, 0, matTile->height(), nInChannels, dst + kernelPos*nInChannels, MVMU_DIM);
                                 }
-                            }
+                            });
+                        } else {
+                            unsigned int kernelPos = kh*mat->getKernelWidth() + kw;
+                            addTile(matTile, tileCopies, [=](float* dst) {
+                                source->read(kernelPos*nOutChannels + h*MVMU_DIM, w*MVMU_DIM, matTile->height(), matTile->width(), dst, MVMU_DIM);
+                            });
                         }
-                        mvmuData.close();
                     }
                 }
             }
         }
     }
 
+    for(auto m = model_->train_mat_begin(); m != model_->train_mat_end(); ++m) {
+        TrainingMatrixImpl* mat = *m;
+        WeightSource* source = createSource(mat->name(), mat->height(), mat->width());
+        sources.push_back(source);
+        for(unsigned int h = 0; h < mat->nHeightTiles(); ++h) {
+            for(unsigned int w = 0; w < mat->nWidthTiles(); ++w) {
+                TrainingMatrixTile* matTile = mat->getTile(h, w);
+                addTile(matTile, tileCopies, [=](float* dst) {
+                    source->read(h*MVMU_DIM, w*MVMU_DIM, matTile->height(), matTile->width(), dst, MVMU_DIM);
+                });
+            }
+        }
+    }
+
+    // Crossbars are assembled by parallel workers, one MVMU at a time, and written by a separate thread in index order
+    WeightImageWriter* imageWriter = NULL;
+    std::function<void(unsigned int, unsigned int, unsigned int, bool, const float*)> write;
+    if(options.format_ == DataGenerationOptions::WF_TEXT) {
+        write = [&](unsigned int pTile, unsigned int pCore, unsigned int pMVMU, bool transposed, const float* crossbar) {
+            writeTextFile(pTile, pCore, pMVMU, transposed, crossbar);
+        };
+    } else {
+        imageWriter = new WeightImageWriter(model_->getName() + ".weights", options.elideZeroRegions_);
+        write = [&](unsigned int pTile, unsigned int pCore, unsigned int pMVMU, bool transposed, const float* crossbar) {
+            imageWriter->addMVMU(pTile, pCore, pMVMU, transposed, crossbar);
+        };
+    }
+    unsigned int nInFlightBlocks = options.nInFlightBlocks_;
+    if(nInFlightBlocks == 0) {
+        unsigned int nThreads = (model_->getNThreads() > 0)?model_->getNThreads():std::thread::hardware_concurrency();
+        nInFlightBlocks = 2*std::max(nThreads, 1u);
+    }
+    WeightBlockQueue queue(nInFlightBlocks, write);
+    struct MVMUJob {
+        unsigned int pTile;
+        unsigned int pCore;
+        unsigned int pMVMU;
+        MVMUCopy* mvmuCopy;
+        unsigned int firstBlock; // Index of the first crossbar of the MVMU in the image
+    };
+    std::vector<MVMUJob> jobs;
+    unsigned int nBlocks = 0;
+    for(unsigned int pTile = 0; pTile < placer_->getNPTiles(); ++pTile) {
+        for(auto& it : tileCopies[pTile]) {
+            jobs.push_back(MVMUJob{ pTile, it.first.first, it.first.second, &it.second, nBlocks });
+            nBlocks += (it.second.transposed)?2:1;
+        }
+    }
+    parallelFor(model_->getNThreads(), jobs.size(), [&](unsigned int j) {
+        MVMUJob& job = jobs[j];
+        MVMUCopy& mvmuCopy = *job.mvmuCopy;
+        if(!mvmuCopy.transposed) {
+            float* crossbar = queue.acquire(job.firstBlock);
+            for(TileCopy& tileCopy : mvmuCopy.tiles) {
+                tileCopy.copy(&crossbar[tileCopy.rowOffset*MVMU_DIM]);
+            }
+            queue.submit(job.firstBlock, job.pTile, job.pCore, job.pMVMU, false, crossbar);
+        } else {
+            // Both crossbars are derived from one assembled in a per-thread buffer, so a worker never holds two blocks
+            static thread_local std::vector<float> assembled(MVMU_DIM*MVMU_DIM);
+            std::fill(assembled.begin(), assembled.end(), 0.0f);
+            for(TileCopy& tileCopy : mvmuCopy.tiles) {
+                tileCopy.copy(&assembled[tileCopy.rowOffset*MVMU_DIM]);
+            }
+            float* crossbar = queue.acquire(job.firstBlock);
+            std::copy(assembled.begin(), assembled.end(), crossbar);
+            queue.submit(job.firstBlock, job.pTile, job.pCore, job.pMVMU, false, crossbar);
+            crossbar = queue.acquire(job.firstBlock + 1);
+            transposeBlock(assembled.data(), MVMU_DIM, MVMU_DIM, MVMU_DIM, crossbar, MVMU_DIM);
+            queue.submit(job.firstBlock + 1, job.pTile, job.pCore, job.pMVMU, true, crossbar);
+        }
+    });
+    queue.finish();
+    if(imageWriter != NULL) {
+        imageWriter->close();
+        delete imageWriter;
+    }
+    for(WeightSource* source : sources) {
+        delete source;
+    }
+
+    model_->getStatistics().endPass();
+    model_->printStatistics();
     std::cout << "done." << std::endl;
 
 }
 
+WeightSource* ModelInstanceImpl::createSource(std::string matName, unsigned int height, unsigned int width) {
+    assert(sourceFactories_.count(matName) && "No data provided for matrix");
+    return sourceFactories_[matName](height, width);
+}
+
+WeightSource* ModelInstanceImpl::createSource(ConvolutionalConstantMatrixImpl* mat) {
+    unsigned int nInChannels = mat->getNInChannels();
+    unsigned int nOutChannels = mat->getNOutChannels();
+    unsigned int nKernelPositions = mat->getKernelHeight()*mat->getKernelWidth();
+    ModelInstance::KernelLayout layout = ModelInstance::KL_HWOI;
+    if(kernelLayouts_.count(mat->name())) {
+        layout = kernelLayouts_[mat->name()];
+    }
+    switch(layout) {
+        case ModelInstance::KL_HWOI:
+            return createSource(mat->name(), nKernelPositions*nOutChannels, nInChannels);
+        case ModelInstance::KL_HWIO:
+            return new KernelLayoutWeightSource(createSource(mat->name(), nKernelPositions*nInChannels, nOutChannels), layout, nKernelPositions, nInChannels, nOutChannels);
+        case ModelInstance::KL_OIHW:
+            return new KernelLayoutWeightSource(createSource(mat->name(), nOutChannels, nInChannels*nKernelPositions), layout, nKernelPositions, nInChannels, nOutChannels);
+        default: assert(0 && "Unknown kernel layout");
+    }
+}
+
+void ModelInstanceImpl::addTile(ConstantMatrixTile* matTile, TileCopyMap& tileCopies, std::function<void(float*)> copy) {
+    unsigned int pTile = placer_->getPTile(matTile);
+    unsigned int pCore = placer_->getPCore(matTile);
+    unsigned int pMVMU = placer_->getPMVMU(matTile);
+    MVMUCopy& mvmuCopy = tileCopies[pTile][std::make_pair(pCore, pMVMU)];
+    mvmuCopy.tiles.push_back(TileCopy{ partitioner_->getRowOffset(matTile), copy });
+    mvmuCopy.transposed = false;
+}
+
+void ModelInstanceImpl::addTile(TrainingMatrixTile* matTile, TileCopyMap& tileCopies, std::function<void(float*)> copy) {
+    unsigned int pTile = placer_->getPTile(matTile);
+    unsigned int pCore = placer_->getPCore(matTile);
+    unsigned int pMVMU = placer_->getPMVMU(matTile);
+    MVMUCopy& mvmuCopy = tileCopies[pTile][std::make_pair(pCore, pMVMU)];
+    assert(mvmuCopy.tiles.empty() && "Training matrix tiles cannot share an MVMU");
+    mvmuCopy.tiles.push_back(TileCopy{ 0, copy });
+    mvmuCopy.transposed = true;
+}
+
+void ModelInstanceImpl::writeTextFile(unsigned int pTile, unsigned int pCore, unsigned int pMVMU, bool transposed, const float* crossbar) {
+    std::stringstream fileName;
+    fileName << model_->getName() << "-tile" << pTile << "-core" << pCore << "-mvmu" << pMVMU << (transposed?"-transpose":"") << ".weights";
+    std::ofstream mvmuFile;
+    mvmuFile.open(fileName.str());
+    for(unsigned int i = 0; i < MVMU_DIM*MVMU_DIM; ++i) {
+        if(crossbar[i] == 0.0f) {
+            mvmuFile << "0.0 ";
+        } else {
+            mvmuFile << crossbar[i] << " ";
+        }
+    }
+    mvmuFile.close();
+}
@@ -6,7 +6,10 @@
  *
  */
 
+#include <functional>
 #include <map>
+#include <utility>
+#include <vector>
 
 #include "common.h"
 
@@ -15,15 +18,40 @@ class ModelInstanceImpl {
     private:
 
         ModelImpl* model_;
+        Partitioner* partitioner_;
         Placer* placer_;
-        std::map<std::string, float*> tensorData_;
+        // Creates the source of a bound matrix given its height and width
+        std::map<std::string, std::function<WeightSource*(unsigned int, unsigned int)>> sourceFactories_;
+        std::map<std::string, ModelInstance::KernelLayout> kernelLayouts_;
+
+        struct TileCopy {
+            unsigned int rowOffset;
+            std::function<void(float*)> copy; // Copies the tile into the crossbar at the given address, with rows MVMU_DIM elements apart
+        };
+
+        struct MVMUCopy {
+            std::vector<TileCopy> tiles;
+            bool transposed; // Also write the transposed crossbar used by MVM_TRANSPOSE
+        };
+
+        // Tiles copied into each MVMU of each physical tile, indexed by pTile then (pCore, pMVMU)
+        typedef std::vector<std::map<std::pair<unsigned int, unsigned int>, MVMUCopy>> TileCopyMap;
+
+        WeightSource* createSource(std::string matName, unsigned int height, unsigned int width);
+        WeightSource* createSource(ConvolutionalConstantMatrixImpl* mat);
+        void addTile(ConstantMatrixTile* matTile, TileCopyMap& tileCopies, std::function<void(float*)> copy);
+        void addTile(TrainingMatrixTile* matTile, TileCopyMap& tileCopies, std::function<void(float*)> copy);
+        void writeTextFile(unsigned int pTile, unsigned int pCore, unsigned int pMVMU, bool transposed, const float* crossbar);
 
     public:
 
-        ModelInstanceImpl(ModelImpl* model, Placer* placer);
+        ModelInstanceImpl(ModelImpl* model, Partitioner* partitioner, Placer* placer);
 
         void bind(std::string tensorName, float* data);
-        void generateData();
+        void bindFile(std::string tensorName, std::string fileName, size_t offset, ModelInstance::MatrixLayout layout, ModelInstance::ElementType type);
+        void bindBlocks(std::string tensorName, ModelInstance::BlockReader reader);
+        void setKernelLayout(std::string tensorName, ModelInstance::KernelLayout layout);
+        void generateData(DataGenerationOptions& options);
 
 };
 
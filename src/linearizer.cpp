@@ -7,6 +7,10 @@
  */
 
 #include <assert.h>
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+#include <queue>
 
 #include "puma.h"
 
@@ -15,32 +19,591 @@
 #include "operations.h"
 #include "partitioner.h"
 #include "placer.h"
+#include "traversal.h"
 
-Linearizer::Linearizer(ModelImpl* model, Partitioner* partitioner, Placer* placer)
-    : model_(model), partitioner_(partitioner), placer_(placer), coreOperationLists_(placer_->getNPCores()), tileOperationLists_(placer_->getNPTiles())
+Linearizer::Linearizer(ModelImpl* model, Partitioner* partitioner, Placer* placer, CompilerOptions::LinearizationScheme ls)
+    : model_(model), partitioner_(partitioner), placer_(placer), ls_(ls), coreOperationLists_(placer_->getNPCores()), tileOperationLists_(placer_->getNPTiles()), scheduleLengths_(placer_->getNPCores())
 {
     linearize();
 }
 
 void Linearizer::linearize() {
 
-    // Begin traversal from operations that output final results, namely matrix update operations and output operations
-    std::set<Operation*> isVisited;
-    std::set<Operation*> wasAddedEarly;
+    // Begin traversal from operations that output final results, namely matrix update operations and output operations,
+    // and from operations of stream buffers that have no successors, namely padding stores and release loads
+    OperationSet isVisited;
+    OperationSet wasAddedEarly;
     for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
         Operation* op = *it;
-        if(TrainingMatrixOperation* trainOp = dynamic_cast<TrainingMatrixOperation*>(op)) {
+        if(TrainingMatrixOperation* trainOp = op_cast<TrainingMatrixOperation>(op)) {
             if(trainOp->getOpType() == TrainingMatrixOperation::OUTER_PRODUCT) {
                 linearizeWithPredecessors(op, isVisited, wasAddedEarly);
             }
-        } else if(dynamic_cast<ReadOutputOperation*>(op)) {
+        } else if(op_cast<ReadOutputOperation>(op)) {
             linearizeWithPredecessors(op, isVisited, wasAddedEarly);
+        } else if(StoreOperation* store = op_cast<StoreOperation>(op)) {
+            if(store->isPadding()) {
+                linearizeWithPredecessors(op, isVisited, wasAddedEarly);
+            }
+        } else if(LoadOperation* load = op_cast<LoadOperation>(op)) {
+            if(load->numUsers() == 0) {
+                linearizeWithPredecessors(op, isVisited, wasAddedEarly);
+            }
+        }
+    }
+
+    // Reorder the operations to overlap their latencies
+    if(ls_ == CompilerOptions::LS_LIST_SCHEDULING) {
+        scheduleWithLatencies();
+    }
+    estimateScheduleLengths();
+
+    // Group the operations of each stream loop into the body of a codegened loop
+    OperationTable<StreamLoop*> anchors;
+    findStreamLoopAnchors(anchors);
+    for(unsigned int pTile = 0; pTile < placer_->getNPTiles(); ++pTile) {
+        for(unsigned int pCore = 0; pCore < N_CORES_PER_TILE; ++pCore) {
+            formStreamLoops(getCoreOperationList(pTile, pCore), anchors);
+        }
+        orderStreamLoops(getTileOperationList(pTile), anchors);
+    }
+
+}
+
+// Latency in cycles of each kind of operation: a fixed part plus one cycle per group of elements processed together
+static const struct { unsigned int base; unsigned int elementsPerCycle; } LATENCIES[Operation::N_OP_KINDS] = {
+    { 2304, 0 },                        // OP_MVM: 16-bit inputs streamed bit-serially through the crossbar
+    { 2304, 0 },                        // OP_TRAINING_MATRIX
+    { 1, 1 },                           // OP_ALU_VECTOR
+    { 1, 0 },                           // OP_SET_IMMEDIATE
+    { 1, 1 },                           // OP_COPY
+    { 4, MAX_LOAD_STORE_WIDTH },        // OP_LOAD
+    { 4, MAX_LOAD_STORE_WIDTH },        // OP_STORE
+    { 32, MAX_SEND_RECV_WIDTH },        // OP_SEND
+    { 32, MAX_SEND_RECV_WIDTH },        // OP_RECEIVE
+    { 1, MAX_LOAD_STORE_WIDTH },        // OP_WRITE_INPUT
+    { 1, MAX_LOAD_STORE_WIDTH },        // OP_READ_OUTPUT
+    { 0, 0 },                           // OP_PSEUDO_INPUT
+    { 0, 0 },                           // OP_PSEUDO_OUTPUT
+    { 1, 0 },                           // OP_LOOP_BEGIN
+    { 1, 0 }                            // OP_LOOP_END
+};
+
+unsigned long Linearizer::getLatency(Operation* op) {
+    unsigned long latency = LATENCIES[op->getKind()].base;
+    unsigned int elementsPerCycle = LATENCIES[op->getKind()].elementsPerCycle;
+    if(elementsPerCycle > 0) {
+        latency += (op->length() + elementsPerCycle - 1)/elementsPerCycle;
+    }
+    StreamLoop* loop = op->getStreamLoop();
+    return (loop != NULL)?(latency*loop->nIterations()):(latency);
+}
+
+unsigned int Linearizer::getResource(Operation* op) {
+    if(CoreOperation* coreOp = op_cast<CoreOperation>(op)) {
+        return placer_->getPTile(coreOp)*N_CORES_PER_TILE + placer_->getPCore(coreOp);
+    } else if(TileOperation* tileOp = op_cast<TileOperation>(op)) {
+        return placer_->getNPCores() + placer_->getPTile(tileOp);
+    } else {
+        return NO_RESOURCE;
+    }
+}
+
+void Linearizer::getPredecessors(Operation* op, std::vector<Operation*>& predecessors) {
+    std::set<Operation*, OperationIdLess> unique;
+    if(ConsumerOperation* consumer = op_cast<ConsumerOperation>(op)) {
+        for(unsigned int o = 0; o < consumer->numOperands(); ++o) {
+            unique.insert(consumer->getOperand(o));
+        }
+    }
+    if(TileMemoryReadOperation* read = op_cast<TileMemoryReadOperation>(op)) {
+        for(unsigned int i = 0; i < read->numSrcs(); ++i) {
+            unique.insert(read->getSrc(i));
+        }
+    }
+    if(ReceiveOperation* recv = op_cast<ReceiveOperation>(op)) {
+        unique.insert(recv->getSrc());
+    }
+    predecessors.assign(unique.begin(), unique.end());
+}
+
+void Linearizer::scheduleWithLatencies() {
+
+    // Index the operations in their depth first order, which is topological
+    unsigned int nOps = order_.size();
+    unsigned int nResources = placer_->getNPCores() + placer_->getNPTiles();
+    OperationTable<unsigned int> op2index;
+    for(unsigned int i = 0; i < nOps; ++i) {
+        op2index[order_[i]] = i;
+    }
+    std::vector<std::vector<unsigned int>> predecessors(nOps);
+    std::vector<std::vector<unsigned int>> successors(nOps);
+    std::vector<unsigned int> resources(nOps);
+    std::vector<unsigned long> latencies(nOps);
+    for(unsigned int i = 0; i < nOps; ++i) {
+        std::vector<Operation*> preds;
+        getPredecessors(order_[i], preds);
+        for(Operation* pred : preds) {
+            if(op2index.count(pred)) {
+                predecessors[i].push_back(op2index[pred]);
+                successors[op2index[pred]].push_back(i);
+            }
+        }
+        resources[i] = getResource(order_[i]);
+        latencies[i] = getLatency(order_[i]);
+    }
+
+    // Group each matrix operation with the operations it is coalesced with, those writing its reserved input registers,
+    // and those reading its reserved output registers
+    std::vector<unsigned int> leaders(nOps);
+    for(unsigned int i = 0; i < nOps; ++i) {
+        leaders[i] = i;
+    }
+    auto findLeader = [&](unsigned int i) {
+        unsigned int leader = i;
+        while(leaders[leader] != leader) {
+            leader = leaders[leader];
+        }
+        while(leaders[i] != leader) {
+            unsigned int next = leaders[i];
+            leaders[i] = leader;
+            i = next;
+        }
+        return leader;
+    };
+    auto unite = [&](unsigned int i, unsigned int j) {
+        leaders[findLeader(i)] = findLeader(j);
+    };
+    std::vector<bool> isGrouped(nOps, false);
+    for(unsigned int i = 0; i < nOps; ++i) {
+        Operation* op = order_[i];
+        if(op_cast<MVMOperation>(op) != NULL || op_cast<TrainingMatrixOperation>(op) != NULL) {
+            isGrouped[i] = true;
+            ConsumerOperation* matOp = op_cast<ConsumerOperation>(op);
+            for(unsigned int o = 0; o < matOp->numOperands(); ++o) {
+                unsigned int p = op2index[matOp->getOperand(o)];
+                isGrouped[p] = true;
+                unite(p, i);
+            }
+            ProducerOperation* producer = op_cast<ProducerOperation>(op);
+            for(auto u = producer->user_begin(); u != producer->user_end(); ++u) {
+                unsigned int c = op2index[*u];
+                isGrouped[c] = true;
+                unite(c, i);
+            }
+            if(MVMOperation* mvm = op_cast<MVMOperation>(op)) {
+                if(mvm->getCoalescedSet() != NULL) {
+                    for(MVMOperation* m : *mvm->getCoalescedSet()) {
+                        if(m != NULL) {
+                            unite(op2index[m], i);
+                        }
+                    }
+                }
+            } else if(TrainingMatrixOperation* trainOp = op_cast<TrainingMatrixOperation>(op)) {
+                if(trainOp->getCoalescedSet() != NULL) {
+                    for(TrainingMatrixOperation* t : *trainOp->getCoalescedSet()) {
+                        if(t != NULL) {
+                            unite(op2index[t], i);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    std::vector<std::vector<unsigned int>> groupMembers(nOps); // Indexed by leader, members in depth first order
+    for(unsigned int i = 0; i < nOps; ++i) {
+        if(isGrouped[i]) {
+            std::vector<unsigned int>& members = groupMembers[findLeader(i)];
+            assert(members.empty() || resources[members.front()] == resources[i] && "Operations using the same reserved registers must be on the same core!");
+            members.push_back(i);
+        }
+    }
+
+    // Operations are waited for by the successors in their own group (and by the previous member of that group), and
+    // the first member of a group is waited for by the predecessors of the whole group from outside of it
+    std::vector<unsigned int> nPending(nOps, 0);
+    for(unsigned int i = 0; i < nOps; ++i) {
+        for(unsigned int p : predecessors[i]) {
+            unsigned int waiter = i;
+            if(isGrouped[i] && !(isGrouped[p] && findLeader(p) == findLeader(i))) {
+                waiter = groupMembers[findLeader(i)].front();
+            }
+            ++nPending[waiter];
+        }
+    }
+    std::vector<int> nextMember(nOps, -1);
+    for(unsigned int i = 0; i < nOps; ++i) {
+        if(!groupMembers[i].empty()) {
+            std::vector<unsigned int>& members = groupMembers[i];
+            for(unsigned int m = 1; m < members.size(); ++m) {
+                nextMember[members[m - 1]] = members[m];
+                ++nPending[members[m]];
+            }
+        }
+    }
+
+    // Priority is the length of the longest chain of latencies from an operation to the end of the graph
+    std::vector<unsigned long> priorities(nOps, 0);
+    for(unsigned int i = nOps; i-- > 0;) {
+        for(unsigned int s : successors[i]) {
+            priorities[i] = std::max(priorities[i], priorities[s]);
         }
+        priorities[i] += latencies[i];
     }
 
+    // Values kept in data registers, and the number of their consumers not scheduled yet
+    std::vector<bool> usesDataRegisters(nOps, false);
+    std::vector<unsigned int> nUnscheduledUsers(nOps, 0);
+    for(unsigned int i = 0; i < nOps; ++i) {
+        if(resources[i] < placer_->getNPCores() && op_cast<ProducerOperation>(order_[i]) != NULL) {
+            usesDataRegisters[i] = true;
+            for(unsigned int s : successors[i]) {
+                if(op_cast<MVMOperation>(order_[s]) != NULL || op_cast<TrainingMatrixOperation>(order_[s]) != NULL) {
+                    usesDataRegisters[i] = false;
+                }
+            }
+            if(op_cast<MVMOperation>(order_[i]) != NULL || op_cast<TrainingMatrixOperation>(order_[i]) != NULL) {
+                usesDataRegisters[i] = false;
+            }
+        }
+        nUnscheduledUsers[i] = successors[i].size();
+    }
+    auto getFreedRegisters = [&](unsigned int i) {
+        long freed = (usesDataRegisters[i])?(-(long)order_[i]->length()):(0);
+        for(unsigned int p : predecessors[i]) {
+            if(usesDataRegisters[p] && resources[p] == resources[i] && nUnscheduledUsers[p] == 1) {
+                freed += order_[p]->length();
+            }
+        }
+        return freed;
+    };
+
+    // Simulate the cores and tiles, issuing one operation per resource per cycle
+    std::vector<std::vector<unsigned int>> ready(nResources);
+    std::vector<unsigned long> earliestStart(nOps, 0);
+    std::vector<unsigned long> finish(nOps, 0);
+    std::vector<unsigned long> resourceTimes(nResources, 0);
+    std::vector<unsigned long> liveRegisters(nResources, 0);
+    std::vector<int> lockingGroups(nResources, -1); // Group using the reserved registers of each core
+    std::vector<unsigned int> schedule;
+    std::vector<unsigned int> unplaced; // Released operations that do not occupy a core or tile, issued as soon as they are released
+    // Each resource has at most one live queue entry, keyed by the start of its best ready operation, entries whose start
+    // no longer matches are stale and skipped
+    const unsigned long NOT_QUEUED = (unsigned long) -1;
+    std::vector<unsigned long> queuedStarts(nResources, NOT_QUEUED);
+    std::priority_queue<std::pair<unsigned long, unsigned int>, std::vector<std::pair<unsigned long, unsigned int>>, std::greater<std::pair<unsigned long, unsigned int>>> resourceQueue;
+    auto isEligible = [&](unsigned int i) {
+        int group = (isGrouped[i])?((int)findLeader(i)):(-1);
+        int lockingGroup = lockingGroups[resources[i]];
+        return group == -1 || lockingGroup == -1 || lockingGroup == group;
+    };
+    auto findBest = [&](unsigned int r, unsigned long& bestStart) {
+        int best = -1;
+        long bestFreed = 0;
+        bool underPressure = (liveRegisters[r] >= REGISTER_PRESSURE_LIMIT);
+        for(unsigned int c = 0; c < ready[r].size(); ++c) {
+            unsigned int i = ready[r][c];
+            if(isEligible(i)) {
+                unsigned long start = std::max(resourceTimes[r], earliestStart[i]);
+                long freed = (underPressure)?(getFreedRegisters(i)):(0);
+                if(best == -1 || freed > bestFreed || (freed == bestFreed && (start < bestStart
+                        || (start == bestStart && (priorities[i] > priorities[ready[r][best]]
+                        || (priorities[i] == priorities[ready[r][best]] && i < ready[r][best])))))) {
+                    best = c;
+                    bestStart = start;
+                    bestFreed = freed;
+                }
+            }
+        }
+        return best;
+    };
+    auto enqueue = [&](unsigned int r) {
+        unsigned long start;
+        if(findBest(r, start) == -1) {
+            queuedStarts[r] = NOT_QUEUED;
+        } else if(start != queuedStarts[r]) {
+            queuedStarts[r] = start;
+            resourceQueue.push(std::make_pair(start, r));
+        }
+    };
+    auto issue = [&](unsigned int i, unsigned long start) {
+        unsigned int r = resources[i];
+        finish[i] = start + latencies[i];
+        schedule.push_back(i);
+        if(r != NO_RESOURCE) {
+            resourceTimes[r] = start + 1;
+            if(usesDataRegisters[i]) {
+                liveRegisters[r] += order_[i]->length();
+            }
+            for(unsigned int p : predecessors[i]) {
+                if(--nUnscheduledUsers[p] == 0 && usesDataRegisters[p]) {
+                    liveRegisters[resources[p]] -= order_[p]->length();
+                }
+            }
+            if(isGrouped[i]) {
+                std::vector<unsigned int>& members = groupMembers[findLeader(i)];
+                lockingGroups[r] = (i == members.back())?(-1):((int)findLeader(i));
+            }
+        }
+        std::vector<unsigned int> released;
+        auto release = [&](unsigned int waiter) {
+            if(--nPending[waiter] == 0) {
+                released.push_back(waiter);
+            }
+        };
+        for(unsigned int s : successors[i]) {
+            earliestStart[s] = std::max(earliestStart[s], finish[i]);
+            if(isGrouped[s] && !(isGrouped[i] && findLeader(i) == findLeader(s))) {
+                unsigned int first = groupMembers[findLeader(s)].front();
+                earliestStart[first] = std::max(earliestStart[first], finish[i]);
+                release(first);
+            } else {
+                release(s);
+            }
+        }
+        if(nextMember[i] != -1) {
+            release(nextMember[i]);
+        }
+        for(unsigned int j : released) {
+            if(resources[j] == NO_RESOURCE) {
+                unplaced.push_back(j);
+            } else {
+                ready[resources[j]].push_back(j);
+                enqueue(resources[j]);
+            }
+        }
+        if(r != NO_RESOURCE) {
+            enqueue(r);
+        }
+    };
+    for(unsigned int i = 0; i < nOps; ++i) {
+        if(nPending[i] == 0) {
+            if(resources[i] == NO_RESOURCE) {
+                unplaced.push_back(i);
+            } else {
+                ready[resources[i]].push_back(i);
+            }
+        }
+    }
+    for(unsigned int r = 0; r < nResources; ++r) {
+        enqueue(r);
+    }
+    while(!unplaced.empty() || !resourceQueue.empty()) {
+        if(!unplaced.empty()) {
+            unsigned int i = unplaced.back();
+            unplaced.pop_back();
+            issue(i, earliestStart[i]);
+            continue;
+        }
+        unsigned long queuedStart = resourceQueue.top().first;
+        unsigned int r = resourceQueue.top().second;
+        resourceQueue.pop();
+        if(queuedStart != queuedStarts[r]) {
+            continue;
+        }
+        queuedStarts[r] = NOT_QUEUED;
+        unsigned long start;
+        int best = findBest(r, start);
+        if(best == -1) {
+            continue;
+        } else if(start > queuedStart) {
+            // Another resource may release an operation that starts earlier
+            queuedStarts[r] = start;
+            resourceQueue.push(std::make_pair(start, r));
+            continue;
+        }
+        unsigned int i = ready[r][best];
+        ready[r][best] = ready[r].back();
+        ready[r].pop_back();
+        issue(i, start);
+    }
+    assert(schedule.size() == nOps && "Deadlock in list scheduling!");
+
+    // Rebuild the lists in issue order
+    for(std::list<CoreOperation*>& coreOperationList : coreOperationLists_) {
+        coreOperationList.clear();
+    }
+    for(std::list<TileOperation*>& tileOperationList : tileOperationLists_) {
+        tileOperationList.clear();
+    }
+    std::vector<Operation*> order;
+    for(unsigned int i : schedule) {
+        Operation* op = order_[i];
+        if(CoreOperation* coreOp = op_cast<CoreOperation>(op)) {
+            getCoreOperationList(placer_->getPTile(coreOp), placer_->getPCore(coreOp)).push_back(coreOp);
+        }
+        if(TileOperation* tileOp = op_cast<TileOperation>(op)) {
+            getTileOperationList(placer_->getPTile(tileOp)).push_back(tileOp);
+        }
+        order.push_back(op);
+    }
+    order_ = order;
+
 }
 
-void Linearizer::linearizeWithPredecessors(Operation* op, std::set<Operation*>& isVisited, std::set<Operation*>& wasAddedEarly, bool addSelf) {
+void Linearizer::estimateScheduleLengths() {
+
+    // Issue the operations of each core and tile in list order, each one when its operands are available
+    OperationTable<unsigned long> finish;
+    std::vector<unsigned long> resourceTimes(placer_->getNPCores() + placer_->getNPTiles(), 0);
+    for(Operation* op : order_) {
+        std::vector<Operation*> preds;
+        getPredecessors(op, preds);
+        unsigned long start = 0;
+        for(Operation* pred : preds) {
+            if(finish.count(pred)) {
+                start = std::max(start, finish[pred]);
+            }
+        }
+        unsigned int r = getResource(op);
+        if(r != NO_RESOURCE) {
+            start = std::max(start, resourceTimes[r]);
+            resourceTimes[r] = start + 1;
+        }
+        finish[op] = start + getLatency(op);
+        if(r != NO_RESOURCE && r < placer_->getNPCores()) {
+            scheduleLengths_[r] = std::max(scheduleLengths_[r], finish[op]);
+        }
+    }
+
+}
+
+static bool executesBefore(StreamLoop* loop1, StreamLoop* loop2) {
+    return loop1->executesBefore(loop2);
+}
+
+void Linearizer::findStreamLoopAnchors(OperationTable<StreamLoop*>& anchors) {
+
+    // An operation that executes once must come after the latest stream loop it depends on, directly or through other
+    // operations that execute once, which is its anchor
+    for(Operation* op : order_) {
+        StreamLoop* anchor = NULL;
+        std::vector<Operation*> predecessors;
+        getPredecessors(op, predecessors);
+        for(Operation* predecessor : predecessors) {
+            StreamLoop* loop = predecessor->getStreamLoop();
+            if(loop == NULL && anchors.count(predecessor)) {
+                loop = anchors[predecessor];
+                assert((op->getStreamLoop() == NULL || loop->executesBefore(op->getStreamLoop())) && "Stream loop depends on an operation that executes after it!");
+            }
+            if(loop != NULL && (anchor == NULL || anchor->executesBefore(loop))) {
+                anchor = loop;
+            }
+        }
+        if(op->getStreamLoop() == NULL && anchor != NULL) {
+            anchors[op] = anchor;
+        }
+    }
+
+}
+
+template <typename OpType>
+static std::list<OpType*> anchorScalarOperations(std::list<OpType*>& scalarOperations, std::vector<StreamLoop*>& loops, OperationTable<StreamLoop*>& anchors, std::vector<std::list<OpType*>>& anchored) {
+    // Place each operation that executes once right after the last loop that is not later than its anchor
+    anchored.resize(loops.size());
+    std::list<OpType*> unanchored;
+    for(OpType* op : scalarOperations) {
+        unsigned int slot = 0;
+        if(anchors.count(op)) {
+            StreamLoop* anchor = anchors[op];
+            while(slot < loops.size() && !anchor->executesBefore(loops[slot])) {
+                ++slot;
+            }
+        }
+        if(slot == 0) {
+            unanchored.push_back(op);
+        } else {
+            anchored[slot - 1].push_back(op);
+        }
+    }
+    return unanchored;
+}
+
+void Linearizer::formStreamLoops(std::list<CoreOperation*>& coreOperationList, OperationTable<StreamLoop*>& anchors) {
+
+    // Separate operations that execute once from those that execute in stream loops
+    std::list<CoreOperation*> scalarOperations;
+    std::map<StreamLoop*, std::list<CoreOperation*>> loopBodies;
+    std::map<StreamLoop*, std::list<SetImmediateOperation*>> inductionVariables;
+    for(CoreOperation* op : coreOperationList) {
+        StreamLoop* loop = op->getStreamLoop();
+        SetImmediateOperation* seti = op_cast<SetImmediateOperation>(op);
+        if(loop == NULL) {
+            scalarOperations.push_back(op);
+        } else if(seti != NULL && seti->isInduction()) {
+            inductionVariables[loop].push_back(seti);
+        } else {
+            loopBodies[loop].push_back(op);
+        }
+    }
+    std::vector<StreamLoop*> loops;
+    for(auto it : loopBodies) {
+        loops.push_back(it.first);
+    }
+    std::sort(loops.begin(), loops.end(), executesBefore);
+    std::vector<std::list<CoreOperation*>> anchored;
+    std::list<CoreOperation*> unanchored = anchorScalarOperations(scalarOperations, loops, anchors, anchored);
+
+    // Rebuild the list with each loop body enclosed by loop begin and end operations, preceded by the initialization of its
+    // induction variables and followed by the operations that execute once and depend on it
+    coreOperationList = unanchored;
+    for(unsigned int l = 0; l < loops.size(); ++l) {
+        StreamLoop* loop = loops[l];
+        std::list<CoreOperation*>& loopBody = loopBodies[loop];
+        std::vector<unsigned int> strides;
+        for(SetImmediateOperation* seti : inductionVariables[loop]) {
+            unsigned int innerStride = std::abs(seti->getInnerStride());
+            unsigned int outerStride = std::abs(seti->getOuterStride());
+            if(innerStride != 0 && std::find(strides.begin(), strides.end(), innerStride) == strides.end()) {
+                strides.push_back(innerStride);
+            }
+            if(outerStride != 0 && std::find(strides.begin(), strides.end(), outerStride) == strides.end()) {
+                strides.push_back(outerStride);
+            }
+            coreOperationList.push_back(seti);
+        }
+        LoopBeginOperation* begin = new(model_) LoopBeginOperation(model_, loop, strides);
+        partitioner_->cloneAssignment(loopBody.front(), begin);
+        LoopEndOperation* end = new(model_) LoopEndOperation(model_, begin);
+        partitioner_->cloneAssignment(loopBody.front(), end);
+        for(SetImmediateOperation* seti : inductionVariables[loop]) {
+            end->addInductionVariable(seti);
+        }
+        coreOperationList.push_back(begin);
+        coreOperationList.splice(coreOperationList.end(), loopBody);
+        coreOperationList.push_back(end);
+        coreOperationList.splice(coreOperationList.end(), anchored[l]);
+    }
+
+}
+
+void Linearizer::orderStreamLoops(std::list<TileOperation*>& tileOperationList, OperationTable<StreamLoop*>& anchors) {
+
+    // Stream buffers are transferred in bulk, in the order of the loops producing and consuming them
+    std::list<TileOperation*> scalarOperations;
+    std::map<StreamLoop*, std::list<TileOperation*>> loopOperations;
+    for(TileOperation* op : tileOperationList) {
+        if(op->getStreamLoop() == NULL) {
+            scalarOperations.push_back(op);
+        } else {
+            loopOperations[op->getStreamLoop()].push_back(op);
+        }
+    }
+    std::vector<StreamLoop*> loops;
+    for(auto it : loopOperations) {
+        loops.push_back(it.first);
+    }
+    std::sort(loops.begin(), loops.end(), executesBefore);
+    std::vector<std::list<TileOperation*>> anchored;
+    tileOperationList = anchorScalarOperations(scalarOperations, loops, anchors, anchored);
+    for(unsigned int l = 0; l < loops.size(); ++l) {
+        tileOperationList.splice(tileOperationList.end(), loopOperations[loops[l]]);
+        tileOperationList.splice(tileOperationList.end(), anchored[l]);
+    }
+
+}
+
+void Linearizer::linearizeWithPredecessors(Operation* op, OperationSet& isVisited, OperationSet& wasAddedEarly, bool addSelf) {
     /*
      * Linearization follows the following guidelines:
      *  (1) All predecessors of an operation are executed before the operation to ensure that data-dependeces are satisfied (reverse postorder achieves this)
@@ -48,31 +611,86 @@ void Linearizer::linearizeWithPredecessors(Operation* op, std::set<Operation*>&
      *  (3) Consume matrix operation inputs immediately after they are produced to eliminate reserved input register live range conflicts
      *  (4) Consume matrix operation outputs immediately after they are produced to eliminate reserved output register live range conflicts
      */
-    if(!isVisited.count(op)) {
-        if(MVMOperation* mvm = dynamic_cast<MVMOperation*>(op)) {
-            assert(addSelf); // addSelf is only false for operations that feed matrix operations, and matrix operations can't feed other matrix operations
+    struct Visit {
+        Operation* op;
+        bool addSelf; // False for operations that feed matrix operations, they are added right before them
+    };
+    auto getPredecessors = [](Visit visit, std::vector<Visit>& predecessors) {
+        Operation* op = visit.op;
+        if(MVMOperation* mvm = op_cast<MVMOperation>(op)) {
+            assert(visit.addSelf); // addSelf is only false for operations that feed matrix operations, and matrix operations can't feed other matrix operations
             CoalescedMVMSet* coalescedSet = mvm->getCoalescedSet();
             if(coalescedSet != NULL) {
                 // If MVM is coalesced, visit predecessors of all coalesced MVMs together
                 for(MVMOperation* m : *coalescedSet) {
                     if(m != NULL) {
-                        assert(m->numOperands() == 1);
-                        linearizeWithPredecessors(m->getOperand(0), isVisited, wasAddedEarly, false); // Do not add inputs to instruction list yet
+                        for(unsigned int o = 0; o < m->numOperands(); ++o) {
+                            predecessors.push_back(Visit{m->getOperand(o), false}); // Do not add inputs to instruction list yet
+                        }
                     }
                 }
+            } else {
+                for(unsigned int o = 0; o < mvm->numOperands(); ++o) {
+                    predecessors.push_back(Visit{mvm->getOperand(o), true});
+                }
+            }
+        } else if(TrainingMatrixOperation* trainOp = op_cast<TrainingMatrixOperation>(op)) {
+            assert(visit.addSelf); // addSelf is only false for operations that feed matrix operations, and matrix operations can't feed other matrix operations
+            CoalescedTrainingOperationSet* coalescedSet = trainOp->getCoalescedSet();
+            if(coalescedSet != NULL) {
+                // If training matrix operation is coalesced, visit predecessors of all coalesced operations together
+                for(TrainingMatrixOperation* t : *coalescedSet) {
+                    if(t != NULL) {
+                        for(unsigned int o = 0; o < t->numOperands(); ++o) {
+                            predecessors.push_back(Visit{t->getOperand(o), false}); // Do not add inputs to instruction list yet
+                        }
+                    }
+                }
+            } else {
+                for(unsigned int o = 0; o < trainOp->numOperands(); ++o) {
+                    predecessors.push_back(Visit{trainOp->getOperand(o), true});
+                }
+            }
+        } else {
+            if(ConsumerOperation* consumer = op_cast<ConsumerOperation>(op)) {
+                for(unsigned int o = 0; o < consumer->numOperands(); ++o) {
+                    predecessors.push_back(Visit{consumer->getOperand(o), true});
+                }
+            }
+            if(TileMemoryReadOperation* read = op_cast<TileMemoryReadOperation>(op)) {
+                for(unsigned int i = 0; i < read->numSrcs(); ++i) {
+                    predecessors.push_back(Visit{read->getSrc(i), true});
+                }
+            }
+            if(ReceiveOperation* recv = op_cast<ReceiveOperation>(op)) {
+                predecessors.push_back(Visit{recv->getSrc(), true});
+            }
+        }
+    };
+    auto enter = [&](Visit successor, Visit predecessor) {
+        return !isVisited.count(predecessor.op);
+    };
+    auto leave = [&](Visit visit) {
+        Operation* op = visit.op;
+        if(MVMOperation* mvm = op_cast<MVMOperation>(op)) {
+            CoalescedMVMSet* coalescedSet = mvm->getCoalescedSet();
+            if(coalescedSet != NULL) {
                 // Add inputs immediately before they are consumed
                 for(MVMOperation* m : *coalescedSet) {
                     if(m != NULL) {
-                        assert(m->numOperands() == 1);
-                        ProducerOperation* operand = m->getOperand(0);
-                        if(wasAddedEarly.count(operand)) {
-                            // If an operand's predecessor is a matrix operation, it's predecessor will add it early. In this case, we add a copy operation.
-                            CopyOperation* copy = new CopyOperation(model_, operand);
-                            partitioner_->cloneAssignment(operand, copy);
-                            m->replaceOperand(operand, copy);
-                            operand = copy;
+                        for(unsigned int o = 0; o < m->numOperands(); ++o) {
+                            ProducerOperation* operand = m->getOperand(o);
+                            if(wasAddedEarly.count(operand)) {
+                                // If an operand's predecessor is a matrix operation, it's predecessor will add it early. In this case, we add a copy operation.
+                                CopyOperation* copy = new(model_) CopyOperation(model_, operand);
+                                model_->getStatistics().bumpCounter("copies_inserted");
+                                copy->setStreamLoop(operand->getStreamLoop());
+                                partitioner_->cloneAssignment(operand, copy);
+                                m->replaceOperand(operand, copy);
+                                operand = copy;
+                            }
+                            addToList(operand, isVisited);
                         }
-                        addToList(operand, isVisited);
                     }
                 }
                 // Add all MVMs in the coalesced set
@@ -88,24 +706,13 @@ void Linearizer::linearizeWithPredecessors(Operation* op, std::set<Operation*>&
                     }
                 }
             } else {
-                assert(mvm->numOperands() == 1);
-                linearizeWithPredecessors(mvm->getOperand(0), isVisited, wasAddedEarly);
                 addToList(mvm, isVisited);
                 // Consume outputs immediately after they are produced
                 addConsumersToList(mvm, isVisited, wasAddedEarly);
             }
-        } else if(TrainingMatrixOperation* trainOp = dynamic_cast<TrainingMatrixOperation*>(op)) {
-            assert(addSelf); // addSelf is only false for operations that feed matrix operations, and matrix operations can't feed other matrix operations
+        } else if(TrainingMatrixOperation* trainOp = op_cast<TrainingMatrixOperation>(op)) {
             CoalescedTrainingOperationSet* coalescedSet = trainOp->getCoalescedSet();
             if(coalescedSet != NULL) {
-                // If training matrix operation is coalesced, visit predecessors of all coalesced operations together
-                for(TrainingMatrixOperation* t : *coalescedSet) {
-                    if(t != NULL) {
-                        for(unsigned int o = 0; o < t->numOperands(); ++o) {
-                            linearizeWithPredecessors(t->getOperand(o), isVisited, wasAddedEarly, false); // Do not add inputs to instruction list yet
-                        }
-                    }
-                }
                 // Add inputs immediately before they are consumed
                 for(TrainingMatrixOperation* t : *coalescedSet) {
                     if(t != NULL) {
@@ -113,7 +720,9 @@ void Linearizer::linearizeWithPredecessors(Operation* op, std::set<Operation*>&
                             ProducerOperation* operand = t->getOperand(o);
                             if(wasAddedEarly.count(operand)) {
                                 // If an operand's predecessor is a matrix operation, it's predecessor will add it early. In this case, we add a copy operation.
-                                CopyOperation* copy = new CopyOperation(model_, operand);
+                                CopyOperation* copy = new(model_) CopyOperation(model_, operand);
+                                model_->getStatistics().bumpCounter("copies_inserted");
+                                copy->setStreamLoop(operand->getStreamLoop());
                                 partitioner_->cloneAssignment(operand, copy);
                                 t->replaceOperand(operand, copy);
                                 operand = copy;
@@ -135,50 +744,42 @@ void Linearizer::linearizeWithPredecessors(Operation* op, std::set<Operation*>&
                     }
                 }
             } else {
-                for(unsigned int o = 0; o < trainOp->numOperands(); ++o) {
-                    linearizeWithPredecessors(trainOp->getOperand(o), isVisited, wasAddedEarly);
-                }
                 addToList(trainOp, isVisited);
                 // Consume outputs immediately after they are produced
                 addConsumersToList(trainOp, isVisited, wasAddedEarly);
             }
         } else {
-            if(ConsumerOperation* consumer = dynamic_cast<ConsumerOperation*>(op)) {
-                for(unsigned int o = 0; o < consumer->numOperands(); ++o) {
-                    linearizeWithPredecessors(consumer->getOperand(o), isVisited, wasAddedEarly);
-                }
-            }
-            if(TileMemoryReadOperation* read = dynamic_cast<TileMemoryReadOperation*>(op)) {
-                for(unsigned int i = 0; i < read->numSrcs(); ++i) {
-                    linearizeWithPredecessors(read->getSrc(i), isVisited, wasAddedEarly);
-                }
+            if(TileMemoryReadOperation* read = op_cast<TileMemoryReadOperation>(op)) {
                 assert(!wasAddedEarly.count(read));
             }
-            if(ReceiveOperation* recv = dynamic_cast<ReceiveOperation*>(op)) {
-                linearizeWithPredecessors(recv->getSrc(), isVisited, wasAddedEarly);
+            if(ReceiveOperation* recv = op_cast<ReceiveOperation>(op)) {
                 assert(!wasAddedEarly.count(recv));
             }
-            if(addSelf) {
+            if(visit.addSelf) {
                 if(!wasAddedEarly.count(op)) { // Do not add a consumer operation if it was added early by a predecesor matrix operation
                     addToList(op, isVisited);
                 }
             }
         }
+    };
+    if(!isVisited.count(op)) {
+        walkDepthFirst(Visit{op, addSelf}, getPredecessors, enter, leave);
     }
 }
 
-void Linearizer::addToList(Operation* op, std::set<Operation*>& isVisited) {
+void Linearizer::addToList(Operation* op, OperationSet& isVisited) {
     assert(!isVisited.count(op));
-    if(CoreOperation* coreOp = dynamic_cast<CoreOperation*>(op)) {
+    if(CoreOperation* coreOp = op_cast<CoreOperation>(op)) {
         getCoreOperationList(placer_->getPTile(coreOp), placer_->getPCore(coreOp)).push_back(coreOp);
     }
-    if(TileOperation* tileOp = dynamic_cast<TileOperation*>(op)) {
+    if(TileOperation* tileOp = op_cast<TileOperation>(op)) {
         getTileOperationList(placer_->getPTile(tileOp)).push_back(tileOp);
     }
+    order_.push_back(op);
     isVisited.insert(op);
 }
 
-void Linearizer::addConsumersToList(ProducerOperation* producer, std::set<Operation*>& isVisited, std::set<Operation*>& wasAddedEarly) {
+void Linearizer::addConsumersToList(ProducerOperation* producer, OperationSet& isVisited, OperationSet& wasAddedEarly) {
     bool allConsumersCanBeAdded = true;
     for(auto u = producer->user_begin(); u != producer->user_end(); ++u) {
         ConsumerOperation* consumer = *u;
@@ -203,12 +804,13 @@ void Linearizer::addConsumersToList(ProducerOperation* producer, std::set<Operat
             }
         }
     } else {
-        CopyOperation* copy = new CopyOperation(model_, producer);
+        CopyOperation* copy = new(model_) CopyOperation(model_, producer);
+        model_->getStatistics().bumpCounter("copies_inserted");
+        copy->setStreamLoop(producer->getStreamLoop());
         partitioner_->cloneAssignment(producer, copy);
         addToList(copy, isVisited);
-        for(auto u = producer->user_begin(); u != producer->user_end(); ) {
-            ConsumerOperation* consumer = *u;
-            ++u; // replaceOperand may remove consumer from producer's users
+        std::vector<ConsumerOperation*> users(producer->user_begin(), producer->user_end()); // Copy because the loop rewrites the users of producer
+        for(ConsumerOperation* consumer : users) {
             if(consumer != copy) {
                 consumer->replaceOperand(producer, copy);
             }
@@ -224,3 +826,26 @@ std::list<TileOperation*>& Linearizer::getTileOperationList(unsigned int pTile)
     return tileOperationLists_[pTile];
 }
 
+void Linearizer::printReport(std::ofstream& report) {
+    switch(ls_) {
+        case CompilerOptions::LS_DEPTH_FIRST:
+            report << "linearization scheme = depth first" << std::endl;
+            break;
+        case CompilerOptions::LS_LIST_SCHEDULING:
+            report << "linearization scheme = list scheduling" << std::endl;
+            break;
+        default: assert(0 && "Unrecognized linearization scheme!");
+    }
+    unsigned long scheduleLength = 0;
+    for(unsigned long length : scheduleLengths_) {
+        scheduleLength = std::max(scheduleLength, length);
+    }
+    report << "# estimated schedule length = " << scheduleLength << std::endl;
+    for(unsigned int pTile = 0; pTile < placer_->getNPTiles(); ++pTile) {
+        for(unsigned int pCore = 0; pCore < N_CORES_PER_TILE; ++pCore) {
+            if(!getCoreOperationList(pTile, pCore).empty()) {
+                report << "# estimated schedule length (tile " << pTile << " core " << pCore << ") = " << scheduleLengths_[pTile*N_CORES_PER_TILE + pCore] << std::endl;
+            }
+        }
+    }
+}
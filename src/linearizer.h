@@ -6,34 +6,62 @@
  *
  */
 
+#include <fstream>
 #include <list>
 #include <set>
 #include <vector>
 
 #include "common.h"
+#include "optable.h"
 
+/*
+ * Orders the operations of each core and tile. The depth first scheme adds each operation right after its predecessors
+ * in postorder from the outputs, which keeps live ranges short. The list scheduling scheme reorders that result by
+ * simulating the cores and tiles cycle by cycle with a table of operation latencies, issuing on each core the ready
+ * operation that can start first and is furthest from the end of the graph, so that independent work fills the latency
+ * of matrix operations, loads, and receives. A matrix operation, the operations writing its reserved input registers,
+ * and those reading its reserved output registers stay in their depth first order, and no other operation using
+ * reserved registers of the same core is issued between them. When the data values live on a core exceed a share of
+ * its register file, operations that free the most registers are issued first instead.
+ */
 class Linearizer {
 
     private:
 
+        static const unsigned int NO_RESOURCE = (unsigned int) -1;
+        static const unsigned int REGISTER_PRESSURE_LIMIT = REGISTER_FILE_SIZE*3/4;
+
         ModelImpl* model_;
         Partitioner* partitioner_;
         Placer* placer_;
+        CompilerOptions::LinearizationScheme ls_;
 
         std::vector<std::list<CoreOperation*>> coreOperationLists_;
         std::vector<std::list<TileOperation*>> tileOperationLists_;
+        std::vector<Operation*> order_; // All operations added to the lists, in a topological order consistent with each list
+        std::vector<unsigned long> scheduleLengths_;
 
         void linearize();
-        void linearizeWithPredecessors(Operation* op, std::set<Operation*>& isVisited, std::set<Operation*>& wasAddedEarly, bool addSelf=true);
-        void addToList(Operation* op, std::set<Operation*>& isVisited);
-        void addConsumersToList(ProducerOperation* producer, std::set<Operation*>& isVisited, std::set<Operation*>& wasAddedEarly);
+        void scheduleWithLatencies();
+        void estimateScheduleLengths();
+        void getPredecessors(Operation* op, std::vector<Operation*>& predecessors);
+        unsigned int getResource(Operation* op);
+        unsigned long getLatency(Operation* op);
+        void linearizeWithPredecessors(Operation* op, OperationSet& isVisited, OperationSet& wasAddedEarly, bool addSelf=true);
+        void addToList(Operation* op, OperationSet& isVisited);
+        void addConsumersToList(ProducerOperation* producer, OperationSet& isVisited, OperationSet& wasAddedEarly);
+        void findStreamLoopAnchors(OperationTable<StreamLoop*>& anchors);
+        void formStreamLoops(std::list<CoreOperation*>& coreOperationList, OperationTable<StreamLoop*>& anchors);
+        void orderStreamLoops(std::list<TileOperation*>& tileOperationList, OperationTable<StreamLoop*>& anchors);
 
     public:
 
-        Linearizer(ModelImpl* model, Partitioner* partitioner, Placer* placer);
+        Linearizer(ModelImpl* model, Partitioner* partitioner, Placer* placer, CompilerOptions::LinearizationScheme ls);
 
         std::list<CoreOperation*>& getCoreOperationList(unsigned int pTile, unsigned int pCore);
         std::list<TileOperation*>& getTileOperationList(unsigned int pTile);
 
+        void printReport(std::ofstream& report);
+
 };
 
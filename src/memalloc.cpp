@@ -7,47 +7,555 @@
  */
 
 #include <assert.h>
+#include <algorithm>
+#include <climits>
 #include <sstream>
 
 #include "puma.h"
 
+#include "linearizer.h"
 #include "memalloc.h"
 #include "model.h"
 #include "operations.h"
+#include "parallel.h"
 #include "partitioner.h"
+#include "placer.h"
 
-MemoryAllocator::MemoryAllocator(ModelImpl* model, Partitioner* partitioner)
-    : model_(model), partitioner_(partitioner)
+MemoryAllocator::MemoryAllocator(ModelImpl* model, Partitioner* partitioner, Placer* placer, unsigned int tileMemoryCapacity)
+    : model_(model), partitioner_(partitioner), placer_(placer), tileMemoryCapacity_(tileMemoryCapacity), pTileMemoryUsage_(placer->getNPTiles(), 0)
 {
     memoryAllocation();
 }
 
 void MemoryAllocator::memoryAllocation() {
 
-    // Tile memory allocation
-    vTileAvailableMemory_.resize(partitioner_->getNVTiles());
+    // Stream buffer layout
+    layoutStreamBuffers();
+    insertPaddingStores();
+    insertReleaseLoads();
+
+    // Address operands (addresses are assigned after linearization by allocateTileMemory)
+    createTileMemoryAddressOperands();
+
+}
+
+void MemoryAllocator::createTileMemoryAddressOperands() {
     for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
         Operation* op = *it;
-        if(TileMemoryWriteOperation* write = dynamic_cast<TileMemoryWriteOperation*>(op)) {
-            // FIXME: Receives used by the same read output operation on tile 1 should be assigned the same memory location
-            unsigned int address = memalloc(partitioner_->getVTile(write), write->length());
-            assignTileMemoryAddress(write, address);
-            if(StoreOperation* store = dynamic_cast<StoreOperation*>(write)) {
-                SetImmediateOperation* seti = new SetImmediateOperation(model_, address);
-                partitioner_->cloneAssignment(store, seti);
-                store->addTileMemoryAddressOperand(seti);
+        if(TileMemoryWriteOperation* write = op_cast<TileMemoryWriteOperation>(op)) {
+            StoreOperation* store = op_cast<StoreOperation>(write);
+            if(store != NULL) {
+                // Padding stores write to the stream buffer of the store they pad
+                TileMemoryWriteOperation* buffer = store->isPadding()?(store->getPaddingOf()):(store);
+                store->addTileMemoryAddressOperand(createTileMemoryAddressOperand(buffer, store, store->getStreamAccess()));
+                if(store->isPadding()) {
+                    continue;
+                }
             }
             for(auto u = write->user_begin(); u != write->user_end(); ++u) {
                 TileMemoryReadOperation* read = *u;
-                if(LoadOperation* load = dynamic_cast<LoadOperation*>(read)) {
-                    SetImmediateOperation* seti = new SetImmediateOperation(model_, address);
-                    partitioner_->cloneAssignment(load, seti);
-                    load->addTileMemoryAddressOperand(seti);
+                if(LoadOperation* load = op_cast<LoadOperation>(read)) {
+                    load->addTileMemoryAddressOperand(createTileMemoryAddressOperand(write, load, load->getStreamAccess()));
+                }
+            }
+        }
+    }
+}
+
+void MemoryAllocator::allocateTileMemory(Linearizer* linearizer) {
+
+    // Memory of each tile is allocated independently, so different tiles can be allocated concurrently
+    parallelFor(model_->getNThreads(), placer_->getNPTiles(), [&](unsigned int pTile) {
+        allocateTileMemory(pTile, linearizer);
+    });
+
+    // Writes that are not in any operation list (e.g., inputs written by the host) keep their memory for the whole program
+    for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
+        if(TileMemoryWriteOperation* write = op_cast<TileMemoryWriteOperation>(*it)) {
+            StoreOperation* store = op_cast<StoreOperation>(write);
+            if((store == NULL || !store->isPadding()) && !isTileMemoryAddressAssigned(write)) {
+                // FIXME: Receives used by the same read output operation on tile 1 should be assigned the same memory location
+                assignTileMemoryAddress(write, memalloc(placer_->getPTile(write), getTileMemorySize(write)));
+            }
+        }
+    }
+    for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
+        if(StoreOperation* store = op_cast<StoreOperation>(*it)) {
+            if(store->isPadding()) {
+                assignTileMemoryAddress(store, getTileMemoryAddress(store->getPaddingOf()));
+            }
+        }
+    }
+
+    // Set the immediates of address operands now that buffers have addresses
+    for(AddressOperand& operand : addressOperands_) {
+        operand.seti->setImmediate(getTileMemoryAddress(operand.buffer) + operand.offset);
+    }
+
+}
+
+void MemoryAllocator::allocateTileMemory(unsigned int pTile, Linearizer* linearizer) {
+
+    // Gather the operation lists of the tile
+    std::vector<std::vector<Operation*>> lists(N_LISTS_PER_TILE);
+    for(unsigned int pCore = 0; pCore < N_CORES_PER_TILE; ++pCore) {
+        std::list<CoreOperation*>& coreOperationList = linearizer->getCoreOperationList(pTile, pCore);
+        lists[pCore].assign(coreOperationList.begin(), coreOperationList.end());
+    }
+    std::list<TileOperation*>& tileOperationList = linearizer->getTileOperationList(pTile);
+    lists[N_CORES_PER_TILE].assign(tileOperationList.begin(), tileOperationList.end());
+
+    // Number operations. An operation in a stream loop has only completed once the whole loop has.
+    for(unsigned int l = 0; l < N_LISTS_PER_TILE; ++l) {
+        std::vector<Operation*> loopBody;
+        for(unsigned int position = 0; position < lists[l].size(); ++position) {
+            Operation* op = lists[l][position];
+            op2list_[op] = l;
+            if(op_cast<LoopBeginOperation>(op)) {
+                loopBody.push_back(op);
+            } else if(op_cast<LoopEndOperation>(op)) {
+                for(Operation* bodyOp : loopBody) {
+                    op2retire_[bodyOp] = position + 1;
+                }
+                loopBody.clear();
+                op2retire_[op] = position + 1;
+            } else if(!loopBody.empty()) {
+                loopBody.push_back(op);
+            } else {
+                op2retire_[op] = position + 1;
+            }
+        }
+    }
+
+    // Walk the lists in an order that respects the dependences through tile memory, allocating writes as they start
+    std::map<unsigned int, TileMemoryBlock> blocks;
+    std::vector<unsigned int> next(N_LISTS_PER_TILE, 0);
+    std::vector<std::vector<unsigned int>> clock(N_LISTS_PER_TILE, std::vector<unsigned int>(N_LISTS_PER_TILE, 0));
+    std::vector<std::vector<unsigned int>> loopClock(N_LISTS_PER_TILE); // Clock of each list when its current stream loop started
+    bool progress = true;
+    while(progress) {
+        progress = false;
+        for(unsigned int l = 0; l < N_LISTS_PER_TILE; ++l) {
+            for(; next[l] < lists[l].size(); ++next[l], progress = true) {
+                Operation* op = lists[l][next[l]];
+                std::vector<unsigned int>& opClock = clock[l];
+
+                // Reads wait for the writes they read from
+                TileMemoryReadOperation* read = op_cast<TileMemoryReadOperation>(op);
+                bool isReady = true;
+                for(unsigned int s = 0; read != NULL && s < read->numSrcs(); ++s) {
+                    TileMemoryWriteOperation* src = read->getSrc(s);
+                    if(placer_->getPTile(src) == pTile && op2list_.count(src) && !write2clock_.count(src)) {
+                        isReady = false;
+                    }
+                }
+                if(!isReady) {
+                    break;
+                }
+                for(unsigned int s = 0; read != NULL && s < read->numSrcs(); ++s) {
+                    TileMemoryWriteOperation* src = read->getSrc(s);
+                    if(placer_->getPTile(src) == pTile && write2clock_.count(src)) {
+                        std::vector<unsigned int>& srcClock = write2clock_[src];
+                        for(unsigned int i = 0; i < N_LISTS_PER_TILE; ++i) {
+                            opClock[i] = std::max(opClock[i], srcClock[i]);
+                        }
+                    }
+                }
+                opClock[l] = next[l];
+
+                // Track stream loops
+                if(op_cast<LoopBeginOperation>(op)) {
+                    loopClock[l] = opClock;
+                    loopClock[l][l] = next[l] + 1;
+                } else if(op_cast<LoopEndOperation>(op)) {
+                    loopClock[l].clear();
+                }
+
+                // Allocate writes when they (or the first iteration of their stream loop) start
+                if(TileMemoryWriteOperation* write = op_cast<TileMemoryWriteOperation>(op)) {
+                    bool isInLoop = !loopClock[l].empty();
+                    std::vector<unsigned int>& birth = isInLoop?(loopClock[l]):(opClock);
+                    TileMemoryWriteOperation* buffer = getStreamBufferOwner(write);
+                    if(op_cast<StoreOperation>(write) && !isTileMemoryAddressAssigned(buffer)) {
+                        std::vector<unsigned int> retire = getRetirePositions(buffer, pTile);
+                        assignTileMemoryAddress(buffer, allocateBlock(blocks, pTile, getTileMemorySize(buffer), birth, retire));
+                    } else if(op_cast<ReceiveOperation>(write)) {
+                        std::vector<unsigned int> retire = getRetirePositions(write, pTile);
+                        assignTileMemoryAddress(write, allocateBlock(blocks, pTile, getTileMemorySize(write), birth, retire));
+                    }
+                    // Readers can start once the write (or its whole stream loop) has completed
+                    if(isInLoop) {
+                        write2clock_[write] = loopClock[l];
+                    } else {
+                        write2clock_[write] = opClock;
+                        write2clock_[write][l] = next[l] + 1;
+                    }
+                }
+
+            }
+        }
+    }
+    for(unsigned int l = 0; l < N_LISTS_PER_TILE; ++l) {
+        assert(next[l] == lists[l].size() && "Tile memory allocation error: operation lists of the tile wait for each other!");
+    }
+
+}
+
+std::vector<unsigned int> MemoryAllocator::getRetirePositions(TileMemoryWriteOperation* buffer, unsigned int pTile) {
+
+    // Memory is in use until the buffer, its padding and all of its readers have completed
+    std::vector<unsigned int> retire(N_LISTS_PER_TILE, 0);
+    std::vector<Operation*> accesses(1, buffer);
+    if(paddingStores_.count(buffer)) {
+        accesses.insert(accesses.end(), paddingStores_[buffer].begin(), paddingStores_[buffer].end());
+    }
+    accesses.insert(accesses.end(), buffer->user_begin(), buffer->user_end());
+    for(Operation* access : accesses) {
+        if(op_cast<InputOperation>(access) || op_cast<OutputOperation>(access) || placer_->getPTile(access) != pTile || !op2retire_.count(access)) {
+            // Memory accessed by the host or by operations outside of the lists is never reused
+            std::fill(retire.begin(), retire.end(), UINT_MAX);
+            break;
+        }
+        unsigned int l = op2list_[access];
+        retire[l] = std::max(retire[l], op2retire_[access]);
+    }
+    return retire;
+
+}
+
+unsigned int MemoryAllocator::allocateBlock(std::map<unsigned int, TileMemoryBlock>& blocks, unsigned int pTile, unsigned int size, std::vector<unsigned int>& birth, std::vector<unsigned int>& retire) {
+
+    // Find the lowest run of contiguous blocks that are free at birth, merging neighboring free blocks along the way
+    auto isFree = [&](TileMemoryBlock& block) {
+        for(unsigned int l = 0; l < N_LISTS_PER_TILE; ++l) {
+            if(block.retire[l] > birth[l]) {
+                return false;
+            }
+        }
+        return true;
+    };
+    unsigned int runStart = pTileMemoryUsage_[pTile];
+    unsigned int runSize = 0;
+    auto previous = blocks.end();
+    for(auto block = blocks.begin(); block != blocks.end() && runSize < size; ) {
+        if(isFree(block->second)) {
+            if(runSize == 0) {
+                runStart = block->first;
+                runSize = block->second.size;
+                previous = block++;
+            } else {
+                previous->second.size += block->second.size;
+                for(unsigned int l = 0; l < N_LISTS_PER_TILE; ++l) {
+                    previous->second.retire[l] = std::max(previous->second.retire[l], block->second.retire[l]);
+                }
+                runSize += block->second.size;
+                block = blocks.erase(block);
+            }
+        } else {
+            runSize = 0;
+            ++block;
+        }
+    }
+    if(runSize == 0) {
+        runStart = pTileMemoryUsage_[pTile];
+    } else {
+        model_->getStatistics().bumpCounter("tile_memory_reuses");
+    }
+
+    // Take the start of the run, growing the tile's memory if the run is at the top and too short
+    if(runSize > size) {
+        TileMemoryBlock rest = blocks[runStart];
+        rest.size = runSize - size;
+        blocks[runStart + size] = rest;
+    }
+    TileMemoryBlock& block = blocks[runStart];
+    block.size = size;
+    block.retire = retire;
+    pTileMemoryUsage_[pTile] = std::max(pTileMemoryUsage_[pTile], runStart + size);
+    assert((tileMemoryCapacity_ == 0 || pTileMemoryUsage_[pTile] <= tileMemoryCapacity_) && "Tile memory allocation error: out of tile memory!");
+    return runStart;
+
+}
+
+void MemoryAllocator::layoutStreamBuffers() {
+
+    // Each stream buffer holds one pixel for every iteration of the loop writing it
+    for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
+        if(TileMemoryWriteOperation* write = op_cast<TileMemoryWriteOperation>(*it)) {
+            StreamLoop* loop = write->getStreamLoop();
+            if(loop != NULL && getStreamBufferOwner(write) == write) {
+                streamBuffers_[write] = StreamBufferLayout(loop->height(), loop->width());
+            }
+        }
+    }
+
+    // Padding that is read both as zeros and as copies of the edges of the image cannot be shared, so the loads that copy
+    // the edges read their own copy of the buffer instead, which is written by their core right after the buffer
+    OperationTable<bool> readsZeroPadding;
+    std::vector<LoadOperation*> replicatingLoads;
+    for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
+        if(LoadOperation* load = op_cast<LoadOperation>(*it)) {
+            TileMemoryWriteOperation* buffer = getStreamBufferOwner(load->getSrc(0));
+            if(load->getStreamLoop() != NULL && streamBuffers_.count(buffer) && streamBuffers_[buffer].readsPadding(load->getStreamLoop(), load->getStreamAccess())) {
+                if(load->getStreamAccess().replicatesEdges) {
+                    replicatingLoads.push_back(load);
+                } else {
+                    readsZeroPadding[buffer] = true;
                 }
             }
         }
     }
+    OperationTable<std::map<unsigned int, StoreOperation*>> copies;
+    for(LoadOperation* load : replicatingLoads) {
+        TileMemoryWriteOperation* src = load->getSrc(0);
+        if(!readsZeroPadding.count(getStreamBufferOwner(src))) {
+            continue;
+        }
+        StoreOperation*& copy = copies[src][partitioner_->getVCore(load)];
+        if(copy == NULL) {
+            StreamLoop* loop = new StreamLoop(src->getStreamLoop(), src->getStreamLoop()->height(), src->getStreamLoop()->width());
+            LoadOperation* image = new(model_) LoadOperation(model_, src);
+            image->setStreamLoop(loop);
+            partitioner_->cloneAssignment(load, image);
+            copy = new(model_) StoreOperation(model_, image);
+            copy->setStreamLoop(loop);
+            partitioner_->cloneAssignment(load, copy);
+            streamBuffers_[copy] = StreamBufferLayout(loop->height(), loop->width());
+            model_->getStatistics().bumpCounter("stream_buffer_copies");
+        }
+        load->replaceSrc(src, copy);
+    }
+
+    // Pad stream buffers so that every pixel accessed by a load is within the buffer
+    for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
+        if(LoadOperation* load = op_cast<LoadOperation>(*it)) {
+            TileMemoryWriteOperation* buffer = getStreamBufferOwner(load->getSrc(0));
+            if(load->getStreamLoop() != NULL && streamBuffers_.count(buffer)) {
+                streamBuffers_[buffer].addAccess(load->getStreamLoop(), load->getStreamAccess());
+            }
+        }
+    }
+
+}
 
+/* Rectangle of pixels of a stream buffer, relative to the first pixel of the image, that are all read the same number of times */
+struct PixelRectangle {
+    int offsetH;
+    int offsetW;
+    unsigned int height;
+    unsigned int width;
+    unsigned int reads;
+};
+
+static void splitByReads(StreamBufferLayout& layout, std::vector<unsigned int>& reads, int offsetH, int offsetW, int height, int width, std::vector<PixelRectangle>& rectangles) {
+    // Split each row into runs of pixels with the same number of reads, and extend the rectangles of the previous row with identical runs
+    std::vector<unsigned int> open;
+    for(int h = offsetH; h < offsetH + height; ++h) {
+        std::vector<unsigned int> stillOpen;
+        for(int w = offsetW; w < offsetW + width; ) {
+            unsigned int count = reads[layout.getPixelOffset(h, w)];
+            int runStart = w;
+            while(w < offsetW + width && reads[layout.getPixelOffset(h, w)] == count) {
+                ++w;
+            }
+            unsigned int runWidth = w - runStart;
+            auto match = std::find_if(open.begin(), open.end(), [&](unsigned int r) {
+                return rectangles[r].offsetW == runStart && rectangles[r].width == runWidth && rectangles[r].reads == count;
+            });
+            if(match != open.end()) {
+                ++rectangles[*match].height;
+                stillOpen.push_back(*match);
+            } else {
+                stillOpen.push_back(rectangles.size());
+                rectangles.push_back({h, runStart, 1, runWidth, count});
+            }
+        }
+        open = stillOpen;
+    }
+}
+
+void MemoryAllocator::insertPaddingStores() {
+
+    // Fill the padding of stream buffers right after the loop writing the buffer, skipping the pixels that are never read
+    for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
+        if(!streamBuffers_.count(*it)) {
+            continue;
+        }
+        StreamBufferLayout& layout = streamBuffers_[*it];
+        if(layout.isPadded()) {
+            StoreOperation* store = op_cast<StoreOperation>(*it);
+            assert(store != NULL && "Only stream buffers written by stores can be padded!");
+            int height = layout.height();
+            int width = layout.width();
+            std::vector<unsigned int> reads;
+            countPixelReads(store, reads);
+            // Padding is covered by rectangles for the corners and the sides, so that each rectangle is next to a single
+            // edge or corner of the image, which are split further so that each padding store has a single counter
+            int bandsH[3][2] = { { -(int)layout.padTop(), (int)layout.padTop() }, { 0, height }, { height, (int)layout.padBottom() } };
+            int bandsW[3][2] = { { -(int)layout.padLeft(), (int)layout.padLeft() }, { 0, width }, { width, (int)layout.padRight() } };
+            for(unsigned int bh = 0; bh < 3; ++bh) {
+                for(unsigned int bw = 0; bw < 3; ++bw) {
+                    if(bh == 1 && bw == 1) {
+                        continue;
+                    }
+                    std::vector<PixelRectangle> rectangles;
+                    splitByReads(layout, reads, bandsH[bh][0], bandsW[bw][0], bandsH[bh][1], bandsW[bw][1], rectangles);
+                    for(PixelRectangle& rectangle : rectangles) {
+                        if(rectangle.reads == 0) {
+                            continue;
+                        }
+                        StreamLoop* loop = new StreamLoop(store->getStreamLoop(), rectangle.height, rectangle.width);
+                        ProducerOperation* value;
+                        if(layout.replicatesEdges()) {
+                            // Copy the nearest pixels of the image, which stay the same along the rows or columns that are outside of it
+                            LoadOperation* edge = new(model_) LoadOperation(model_, store);
+                            edge->setStreamLoop(loop);
+                            StreamAccess edgeAccess;
+                            edgeAccess.offsetH = std::min(std::max(rectangle.offsetH, 0), height - 1);
+                            edgeAccess.offsetW = std::min(std::max(rectangle.offsetW, 0), width - 1);
+                            edgeAccess.strideH = (bh == 1)?1:0;
+                            edgeAccess.strideW = (bw == 1)?1:0;
+                            edge->setStreamAccess(edgeAccess);
+                            partitioner_->cloneAssignment(store, edge);
+                            value = edge;
+                        } else {
+                            value = new(model_) SetImmediateOperation(model_, 0, store->length());
+                            value->setStreamLoop(loop);
+                            partitioner_->cloneAssignment(store, value);
+                        }
+                        StoreOperation* padding = new(model_) StoreOperation(model_, value);
+                        padding->setStreamLoop(loop);
+                        padding->setPaddingOf(store);
+                        StreamAccess access;
+                        access.offsetH = rectangle.offsetH;
+                        access.offsetW = rectangle.offsetW;
+                        padding->setStreamAccess(access);
+                        partitioner_->cloneAssignment(store, padding);
+                        paddingStores_[store].push_back(padding);
+                        readCounts_[padding] = rectangle.reads;
+                    }
+                }
+            }
+        }
+    }
+
+}
+
+void MemoryAllocator::insertReleaseLoads() {
+
+    // A write to a stream buffer sets the same counter for all of the pixels it writes, which is the largest number of
+    // reads of any of them. Pixels that are read fewer times (e.g., on the edges of the image) are read again by loads
+    // whose values are discarded, so that the counters of all pixels reach zero and the memory can be reused.
+    for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
+        TileMemoryWriteOperation* write = op_cast<TileMemoryWriteOperation>(*it);
+        StoreOperation* store = op_cast<StoreOperation>(*it);
+        if(write == NULL || !isStreamBuffer(write) || (store == NULL && op_cast<ReceiveOperation>(write) == NULL) || (store != NULL && store->isPadding())) {
+            continue;
+        }
+        StreamBufferLayout& layout = streamBuffers_[getStreamBufferOwner(write)];
+        std::vector<unsigned int> reads;
+        countPixelReads(write, reads);
+
+        // Stores write the image and receives write a copy of the whole buffer
+        std::vector<PixelRectangle> rectangles;
+        if(store != NULL) {
+            splitByReads(layout, reads, 0, 0, layout.height(), layout.width(), rectangles);
+        } else {
+            splitByReads(layout, reads, -(int)layout.padTop(), -(int)layout.padLeft(), layout.paddedHeight(), layout.paddedWidth(), rectangles);
+        }
+        unsigned int counter = 0;
+        for(PixelRectangle& rectangle : rectangles) {
+            counter = std::max(counter, rectangle.reads);
+        }
+        readCounts_[write] = counter;
+
+        // Release loads run on the core of the store, or on the core of a load from the receive, right after its loop
+        Operation* reference = store;
+        for(auto u = write->user_begin(); reference == NULL && u != write->user_end(); ++u) {
+            if(op_cast<LoadOperation>(*u) != NULL && (*u)->getStreamLoop() != NULL) {
+                reference = *u;
+            }
+        }
+        for(PixelRectangle& rectangle : rectangles) {
+            if(rectangle.reads < counter) {
+                assert(reference != NULL && "Pixels of a stream buffer that are read unevenly must be read by loads!");
+                StreamLoop* loop = new StreamLoop(reference->getStreamLoop(), rectangle.height, rectangle.width);
+                for(unsigned int r = rectangle.reads; r < counter; ++r) {
+                    LoadOperation* release = new(model_) LoadOperation(model_, write);
+                    release->setStreamLoop(loop);
+                    StreamAccess access;
+                    access.offsetH = rectangle.offsetH;
+                    access.offsetW = rectangle.offsetW;
+                    release->setStreamAccess(access);
+                    partitioner_->cloneAssignment(reference, release);
+                    model_->getStatistics().bumpCounter("release_loads");
+                }
+            }
+        }
+    }
+
+}
+
+void MemoryAllocator::countPixelReads(TileMemoryWriteOperation* write, std::vector<unsigned int>& reads) {
+
+    // Loads in stream loops read the pixels they step through, while other readers (e.g., sends) read the whole buffer
+    StreamBufferLayout& layout = streamBuffers_[getStreamBufferOwner(write)];
+    reads.assign(layout.nPixels(), 0);
+    for(auto u = write->user_begin(); u != write->user_end(); ++u) {
+        LoadOperation* load = op_cast<LoadOperation>(*u);
+        StreamLoop* loop = (*u)->getStreamLoop();
+        if(load != NULL && loop != NULL) {
+            StreamAccess& access = load->getStreamAccess();
+            for(unsigned int h = 0; h < loop->height(); ++h) {
+                for(unsigned int w = 0; w < loop->width(); ++w) {
+                    ++reads[layout.getPixelOffset(h*access.strideH + access.offsetH, w*access.strideW + access.offsetW)];
+                }
+            }
+        } else {
+            for(unsigned int& count : reads) {
+                ++count;
+            }
+        }
+    }
+
+}
+
+TileMemoryWriteOperation* MemoryAllocator::getStreamBufferOwner(TileMemoryWriteOperation* op) {
+    // Receives hold a copy of the stream buffer that was sent to them, and padding stores write to the buffer they pad
+    if(ReceiveOperation* recv = op_cast<ReceiveOperation>(op)) {
+        return recv->getSrc()->getSrc(0);
+    } else if(StoreOperation* store = op_cast<StoreOperation>(op)) {
+        if(store->isPadding()) {
+            return store->getPaddingOf();
+        }
+    }
+    return op;
+}
+
+bool MemoryAllocator::isStreamBuffer(TileMemoryWriteOperation* op) {
+    return streamBuffers_.count(getStreamBufferOwner(op));
+}
+
+SetImmediateOperation* MemoryAllocator::createTileMemoryAddressOperand(TileMemoryWriteOperation* buffer, Operation* access, StreamAccess& streamAccess) {
+    unsigned int offset = 0;
+    SetImmediateOperation* seti;
+    StreamLoop* loop = access->getStreamLoop();
+    if(loop != NULL && isStreamBuffer(buffer)) {
+        // Stream accesses start at the pixel accessed on the first iteration and are stepped by the loop
+        StreamBufferLayout& layout = streamBuffers_[getStreamBufferOwner(buffer)];
+        int length = access->length();
+        int innerStride = streamAccess.strideW*length;
+        int outerStride = ((int)(streamAccess.strideH*layout.paddedWidth()) - (int)(loop->width()*streamAccess.strideW))*length;
+        offset = layout.getPixelOffset(streamAccess.offsetH, streamAccess.offsetW)*length;
+        seti = new(model_) SetImmediateOperation(model_, 0);
+        seti->setInduction(innerStride, outerStride);
+    } else {
+        seti = new(model_) SetImmediateOperation(model_, 0);
+    }
+    seti->setStreamLoop(loop);
+    partitioner_->cloneAssignment(access, seti);
+    addressOperands_.push_back({seti, buffer, offset});
+    return seti;
 }
 
 bool MemoryAllocator::isTileMemoryAddressAssigned(TileMemoryWriteOperation* op) {
@@ -64,15 +572,49 @@ unsigned int MemoryAllocator::getTileMemoryAddress(TileMemoryWriteOperation* op)
     return op2mem_[op];
 }
 
-unsigned int MemoryAllocator::memalloc(unsigned int vTile, unsigned int size) {
-    unsigned int address = vTileAvailableMemory_[vTile];
-    vTileAvailableMemory_[vTile] += size;
+unsigned int MemoryAllocator::getTileMemorySize(TileMemoryWriteOperation* op) {
+    if(isStreamBuffer(op)) {
+        return streamBuffers_[getStreamBufferOwner(op)].nPixels()*op->length();
+    } else {
+        return op->length();
+    }
+}
+
+unsigned int MemoryAllocator::getReadCount(TileMemoryWriteOperation* op) {
+    if(readCounts_.count(op)) {
+        return readCounts_[op];
+    }
+    // Other writes are read once by each reader, or once per iteration by loads in stream loops that do not write them
+    unsigned int count = 0;
+    for(auto u = op->user_begin(); u != op->user_end(); ++u) {
+        StreamLoop* loop = (*u)->getStreamLoop();
+        count += (op_cast<LoadOperation>(*u) != NULL && loop != NULL && loop != op->getStreamLoop())?(loop->nIterations()):(1);
+    }
+    return count;
+}
+
+// Allocates memory that is never reused (e.g., spill slots) above the memory allocated to the writes of the tile
+unsigned int MemoryAllocator::memalloc(unsigned int pTile, unsigned int size) {
+    unsigned int address = pTileMemoryUsage_[pTile];
+    pTileMemoryUsage_[pTile] += size;
+    assert((tileMemoryCapacity_ == 0 || pTileMemoryUsage_[pTile] <= tileMemoryCapacity_) && "Tile memory allocation error: out of tile memory!");
     return address;
 }
 
+void MemoryAllocator::printReport(std::ofstream& report) {
+    unsigned int peakTileMemoryUsage = 0;
+    for(unsigned int pTile = 0; pTile < placer_->getNPTiles(); ++pTile) {
+        peakTileMemoryUsage = std::max(peakTileMemoryUsage, pTileMemoryUsage_[pTile]);
+    }
+    report << "# peak tile memory usage = " << peakTileMemoryUsage << std::endl;
+    for(unsigned int pTile = 0; pTile < placer_->getNPTiles(); ++pTile) {
+        report << "# peak tile memory usage (tile " << pTile << ") = " << pTileMemoryUsage_[pTile] << std::endl;
+    }
+}
+
 std::string MemoryAllocator::printAssignment(Operation* op) {
     std::stringstream ss;
-    if(TileMemoryWriteOperation* write = dynamic_cast<TileMemoryWriteOperation*>(op)) {
+    if(TileMemoryWriteOperation* write = op_cast<TileMemoryWriteOperation>(op)) {
         if(isTileMemoryAddressAssigned(write)) {
             ss << "\ntileMemoryAddress = " << getTileMemoryAddress(write);
         }
@@ -80,3 +622,28 @@ std::string MemoryAllocator::printAssignment(Operation* op) {
     return ss.str();
 }
 
+void StreamBufferLayout::addAccess(StreamLoop* loop, StreamAccess& access) {
+    int lastH = (loop->height() - 1)*access.strideH + access.offsetH;
+    int lastW = (loop->width() - 1)*access.strideW + access.offsetW;
+    padTop_ = std::max((int)padTop_, -access.offsetH);
+    padLeft_ = std::max((int)padLeft_, -access.offsetW);
+    padBottom_ = std::max((int)padBottom_, lastH - (int)height_ + 1);
+    padRight_ = std::max((int)padRight_, lastW - (int)width_ + 1);
+    if(readsPadding(loop, access)) {
+        assert((!isPaddingRead_ || replicatesEdges_ == access.replicatesEdges) && "Padding of a stream buffer cannot be read both as zeros and as copies of the edges of the image!");
+        isPaddingRead_ = true;
+        replicatesEdges_ = access.replicatesEdges;
+    }
+}
+
+bool StreamBufferLayout::readsPadding(StreamLoop* loop, StreamAccess& access) {
+    int lastH = (loop->height() - 1)*access.strideH + access.offsetH;
+    int lastW = (loop->width() - 1)*access.strideW + access.offsetW;
+    return access.offsetH < 0 || access.offsetW < 0 || lastH >= (int)height_ || lastW >= (int)width_;
+}
+
+unsigned int StreamBufferLayout::getPixelOffset(int h, int w) {
+    assert(h + (int)padTop_ >= 0 && w + (int)padLeft_ >= 0 && "Pixel is outside of the stream buffer!");
+    return (h + padTop_)*paddedWidth() + (w + padLeft_);
+}
+
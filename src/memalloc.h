@@ -6,31 +6,122 @@
  *
  */
 
+#include <fstream>
 #include <map>
+#include <string>
+#include <vector>
 
 #include "common.h"
+#include "optable.h"
 
+/*
+ * Tile memory layout of a stream buffer: one pixel per iteration of the loop writing it, in row major order, surrounded
+ * by padding that holds either zeros or copies of the nearest pixels on the edge of the image
+ */
+class StreamBufferLayout {
+
+    private:
+
+        unsigned int height_;
+        unsigned int width_;
+        unsigned int padTop_;
+        unsigned int padBottom_;
+        unsigned int padLeft_;
+        unsigned int padRight_;
+        bool isPaddingRead_;
+        bool replicatesEdges_;
+
+    public:
+
+        StreamBufferLayout(unsigned int height=0, unsigned int width=0) : height_(height), width_(width), padTop_(0), padBottom_(0), padLeft_(0), padRight_(0), isPaddingRead_(false), replicatesEdges_(false) { }
+
+        unsigned int height() { return height_; }
+        unsigned int width() { return width_; }
+        unsigned int padTop() { return padTop_; }
+        unsigned int padBottom() { return padBottom_; }
+        unsigned int padLeft() { return padLeft_; }
+        unsigned int padRight() { return padRight_; }
+        unsigned int paddedHeight() { return padTop_ + height_ + padBottom_; }
+        unsigned int paddedWidth() { return padLeft_ + width_ + padRight_; }
+        unsigned int nPixels() { return paddedHeight()*paddedWidth(); }
+        bool isPadded() { return paddedHeight() != height_ || paddedWidth() != width_; }
+        bool replicatesEdges() { return replicatesEdges_; }
+
+        void addAccess(StreamLoop* loop, StreamAccess& access);
+        bool readsPadding(StreamLoop* loop, StreamAccess& access);
+        unsigned int getPixelOffset(int h, int w);
+
+};
+
+/*
+ * Allocator of the shared memory of each tile. Address operands of loads and stores are created before linearization,
+ * but addresses are only assigned once the tile and core operation lists are known. The lists of a tile are walked in
+ * an order consistent with both program order and the dependences through tile memory, tracking for every list how far
+ * it is known to have executed (a vector clock). The space of a write can then be reused by a later write as soon as all
+ * of its readers, and the write itself, are known to have executed before the later write starts.
+ */
 class MemoryAllocator {
 
     private:
 
+        /* Address operand whose immediate is the address of a buffer plus an offset, set once the buffer is allocated */
+        struct AddressOperand {
+            SetImmediateOperation* seti;
+            TileMemoryWriteOperation* buffer;
+            unsigned int offset;
+        };
+
+        /* Allocated range of tile memory, which is free for any write that starts after the given positions */
+        struct TileMemoryBlock {
+            unsigned int size;
+            std::vector<unsigned int> retire; // Number of operations of each list of the tile that must have executed
+        };
+
+        static const unsigned int N_LISTS_PER_TILE = N_CORES_PER_TILE + 1; // Cores and the tile control unit
+
         ModelImpl* model_;
         Partitioner* partitioner_;
+        Placer* placer_;
+        unsigned int tileMemoryCapacity_;
+
+        OperationTable<unsigned int> op2mem_;
+        std::vector<unsigned int> pTileMemoryUsage_; // Peak memory usage, above which spill slots are allocated
+        OperationTable<StreamBufferLayout> streamBuffers_;
+        OperationTable<std::vector<StoreOperation*>> paddingStores_;
+        OperationTable<unsigned int> readCounts_; /* Number of times each pixel written by a write to a stream buffer is read */
+        std::vector<AddressOperand> addressOperands_;
 
-        std::map<TileMemoryWriteOperation*, unsigned int> op2mem_;
-        std::vector<unsigned int> vTileAvailableMemory_;
+        // Progress of the operation lists of each tile, used while allocating tile memory
+        OperationTable<unsigned int> op2list_;
+        OperationTable<unsigned int> op2retire_; /* Number of operations of its list executed once an operation (or its whole stream loop) has executed */
+        OperationTable<std::vector<unsigned int>> write2clock_; /* Number of operations of each list executed before readers of a write can start */
 
         bool isTileMemoryAddressAssigned(TileMemoryWriteOperation* op);
         void memoryAllocation();
+        void layoutStreamBuffers();
+        void insertPaddingStores();
+        void insertReleaseLoads();
+        void countPixelReads(TileMemoryWriteOperation* write, std::vector<unsigned int>& reads);
+        void createTileMemoryAddressOperands();
+        void allocateTileMemory(unsigned int pTile, Linearizer* linearizer);
+        std::vector<unsigned int> getRetirePositions(TileMemoryWriteOperation* buffer, unsigned int pTile);
+        unsigned int allocateBlock(std::map<unsigned int, TileMemoryBlock>& blocks, unsigned int pTile, unsigned int size, std::vector<unsigned int>& birth, std::vector<unsigned int>& retire);
+        TileMemoryWriteOperation* getStreamBufferOwner(TileMemoryWriteOperation* op);
+        bool isStreamBuffer(TileMemoryWriteOperation* op);
+        SetImmediateOperation* createTileMemoryAddressOperand(TileMemoryWriteOperation* buffer, Operation* access, StreamAccess& streamAccess);
 
     public:
 
-        MemoryAllocator(ModelImpl* model, Partitioner* partitioner);
+        MemoryAllocator(ModelImpl* model, Partitioner* partitioner, Placer* placer, unsigned int tileMemoryCapacity);
 
+        void allocateTileMemory(Linearizer* linearizer);
         void assignTileMemoryAddress(TileMemoryWriteOperation* op, unsigned int address);
         unsigned int getTileMemoryAddress(TileMemoryWriteOperation* op);
-        unsigned int memalloc(unsigned int vTile, unsigned int size);
+        unsigned int getTileMemorySize(TileMemoryWriteOperation* op);
+        unsigned int getReadCount(TileMemoryWriteOperation* op);
+        unsigned int memalloc(unsigned int pTile, unsigned int size);
 
+        void printReport(std::ofstream& report);
         std::string printAssignment(Operation* op);
 
 };
@@ -44,7 +44,7 @@ void Model::compile(CompilerOptions options) {
 }
 
 ModelImpl::ModelImpl(std::string name)
-    : name_(name), modelType_(UNSPECIALIZED), partitioner_(NULL), placer_(NULL), memoryAllocator_(NULL), coalescer_(NULL), linearizer_(NULL), registerAllocator_(NULL), codeGenerator_(NULL)
+    : name_(name), modelType_(UNSPECIALIZED), nThreads_(0), stats_(this), partitioner_(NULL), placer_(NULL), memoryAllocator_(NULL), coalescer_(NULL), linearizer_(NULL), registerAllocator_(NULL), codeGenerator_(NULL)
 { }
 
 ModelImpl::~ModelImpl() {
@@ -97,11 +97,22 @@ ModelImpl::~ModelImpl() {
         delete matrix;
     }
     for(Operation* op : operations_) {
+        if(op != NULL) {
+            delete op;
+        }
+    }
+    for(Operation* op : tombstones_) {
         delete op;
     }
     for(auto coalesceableMVMSet : coalesceableMVMSets_) {
         delete coalesceableMVMSet;
     }
+    for(StreamLoop* loop : streamLoops_) {
+        delete loop;
+    }
+    for(ReductionTree* tree : reductionTrees_) {
+        delete tree;
+    }
     for(auto instance : instances_) {
         delete instance;
     }
@@ -158,17 +169,29 @@ void ModelImpl::addTrainingMatrixImpl(TrainingMatrixImpl* mat) {
     trainingMatrices_.push_back(mat);
 }
 
-void ModelImpl::addOperation(Operation* op) {
-    operations_.insert(op);
+unsigned int ModelImpl::addOperation(Operation* op) {
+    std::lock_guard<std::mutex> lock(operationsMutex_);
+    operations_.push_back(op);
+    return operations_.size() - 1;
 }
 
-void ModelImpl::addCoalesceableMVMSet(std::set<MVMOperation*>* coalesceableMVMSet) {
+void ModelImpl::addCoalesceableMVMSet(std::set<MVMOperation*, OperationIdLess>* coalesceableMVMSet) {
     coalesceableMVMSets_.push_back(coalesceableMVMSet);
 }
 
+void ModelImpl::addStreamLoop(StreamLoop* loop) {
+    streamLoops_.push_back(loop);
+}
+
+void ModelImpl::addReductionTree(ReductionTree* tree) {
+    reductionTrees_.push_back(tree);
+}
+
 void ModelImpl::unlink(Operation* op) {
-    operations_.erase(op);
-    delete op;
+    // Unlinked operations are tombstoned rather than freed so stale references remain safe until the model is destroyed
+    operations_[op->getId()] = NULL;
+    op->setTombstone();
+    tombstones_.push_back(op);
 }
 
 void ModelImpl::printGraph(std::string fileName) {
@@ -187,8 +210,8 @@ void ModelImpl::printGraph(std::string fileName) {
     for(OutputImagePixelStreamImpl* stream : outputImagePixelStreams_) {
         stream->printNodeAndEdges(fout);
     }
-    for(Operation* op : operations_) {
-        op->printNodeAndEdges(fout);
+    for(auto it = op_begin(); it != op_end(); ++it) {
+        (*it)->printNodeAndEdges(fout);
     }
     fout << "}" << std::endl;
     fout.close();
@@ -211,15 +234,26 @@ std::string ModelImpl::printAssignment(Operation* op) {
     return ss.str();
 }
 
+void ModelImpl::printStatistics() {
+    std::ofstream fout;
+    fout.open(name_ + "-stats.json");
+    stats_.printJSON(fout);
+    fout.close();
+}
+
 void ModelImpl::compile(CompilerOptions& options) {
 
+    nThreads_ = options.nThreads_;
+
     if(options.printDebugInfo_) {
         printGraph(name_ + "-graph0.dot");
     }
 
     // Model partitioning
     std::cout << "Partitioning graph... " << std::flush;
-    partitioner_ = new Partitioner(this, options.gp_);
+    stats_.beginPass("partitioning");
+    partitioner_ = new Partitioner(this, options.gp_, options.packMatrixTiles_);
+    stats_.endPass();
     std::cout << "done." << std::endl;
     if(options.printDebugInfo_) {
         printGraph(name_ + "-graph1-partitioned.dot");
@@ -227,7 +261,9 @@ void ModelImpl::compile(CompilerOptions& options) {
 
     // Physical layout
     std::cout << "Physical layout... " << std::flush;
-    placer_ = new Placer(this, partitioner_);
+    stats_.beginPass("placement");
+    placer_ = new Placer(this, partitioner_, options.noc_, options.nocMeshWidth_, options.nocConcentration_);
+    stats_.endPass();
     std::cout << "done." << std::endl;
     if(options.printDebugInfo_) {
         printGraph(name_ + "-graph2-virtual-to-physical.dot");
@@ -235,7 +271,9 @@ void ModelImpl::compile(CompilerOptions& options) {
 
     // Memory allocation
     std::cout << "Memory allocation... " << std::flush;
-    memoryAllocator_ = new MemoryAllocator(this, partitioner_);
+    stats_.beginPass("memory_allocation");
+    memoryAllocator_ = new MemoryAllocator(this, partitioner_, placer_, options.tileMemoryCapacity_);
+    stats_.endPass();
     std::cout << "done." << std::endl;
     if(options.printDebugInfo_) {
         printGraph(name_ + "-graph3-memory-allocation.dot");
@@ -244,21 +282,34 @@ void ModelImpl::compile(CompilerOptions& options) {
     // Coalescing
     if(options.coalesceMVMOperations_) {
         std::cout << "MVM coalescing... " << std::flush;
+        stats_.beginPass("coalescing");
         coalescer_ = new Coalescer(this, placer_, coalesceableMVMSets_);
+        stats_.endPass();
         std::cout << "done." << std::endl;
     }
 
     // Linearization
     std::cout << "Linearizing graph... " << std::flush;
-    linearizer_ = new Linearizer(this, partitioner_, placer_);
+    stats_.beginPass("linearization");
+    linearizer_ = new Linearizer(this, partitioner_, placer_, options.ls_);
+    stats_.endPass();
     std::cout << "done." << std::endl;
     if(options.printDebugInfo_) {
         printGraph(name_ + "-graph4-linearization.dot");
     }
 
+    // Tile memory allocation
+    std::cout << "Tile memory allocation... " << std::flush;
+    stats_.beginPass("tile_memory_allocation");
+    memoryAllocator_->allocateTileMemory(linearizer_);
+    stats_.endPass();
+    std::cout << "done." << std::endl;
+
     // Register allocation
     std::cout << "Register allocation... " << std::flush;
+    stats_.beginPass("register_allocation");
     registerAllocator_ = new RegisterAllocator(this, partitioner_, placer_, memoryAllocator_, linearizer_);
+    stats_.endPass();
     std::cout << "done." << std::endl;
     if(options.printDebugInfo_) {
         printGraph(name_ + "-graph5-register-allocation.dot");
@@ -266,19 +317,28 @@ void ModelImpl::compile(CompilerOptions& options) {
 
     // Code generation
     std::cout << "Code generation... " << std::flush;
+    stats_.beginPass("code_generation");
     codeGenerator_ = new CodeGenerator(this, placer_, memoryAllocator_, coalescer_, linearizer_, registerAllocator_);
+    stats_.endPass();
     std::cout << "done." << std::endl;
 
     // Report
     std::ofstream report(name_ + "-report.out");
     partitioner_->printReport(report);
+    placer_->printReport(report);
+    if(coalescer_ != NULL) {
+        coalescer_->printReport(report);
+    }
+    linearizer_->printReport(report);
+    memoryAllocator_->printReport(report);
     registerAllocator_->printReport(report);
     report.close();
+    printStatistics();
 
 }
 
 ModelInstanceImpl* ModelImpl::createInstance() {
-    ModelInstanceImpl* instance = new ModelInstanceImpl(this, placer_);
+    ModelInstanceImpl* instance = new ModelInstanceImpl(this, partitioner_, placer_);
     instances_.insert(instance);
     return instance;
 }
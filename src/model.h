@@ -8,11 +8,15 @@
 
 #include <list>
 #include <map>
+#include <mutex>
 #include <set>
 #include <string>
 #include <vector>
 
+#include "arena.h"
 #include "common.h"
+#include "optable.h"
+#include "stats.h"
 
 class ModelImpl {
 
@@ -20,10 +24,34 @@ class ModelImpl {
 
         enum ModelType { UNSPECIALIZED, INFERENCE, TRAINING };
 
+        /* Visits operations in ID order, skipping unlinked ones; operations added during the iteration are visited too */
+        class op_iterator {
+
+            private:
+
+                std::vector<Operation*>* operations_;
+                unsigned int id_;
+
+                void skipUnlinked() { while(id_ < operations_->size() && (*operations_)[id_] == NULL) { ++id_; } }
+
+            public:
+
+                op_iterator(std::vector<Operation*>* operations, unsigned int id) : operations_(operations), id_(id) { skipUnlinked(); }
+
+                Operation* operator*() { return (*operations_)[id_]; }
+                op_iterator& operator++() { ++id_; skipUnlinked(); return *this; }
+                bool operator==(const op_iterator& it) const { return id_ == it.id_; }
+                bool operator!=(const op_iterator& it) const { return id_ != it.id_; }
+
+        };
+
     private:
 
         std::string name_;
         ModelType modelType_;
+        unsigned int nThreads_;
+        Arena arena_; /* Owns the memory of operations and tensor tiles */
+        CompileStatistics stats_;
         std::vector<InputVectorImpl*> inputVectors_;
         std::vector<InputImagePixelStreamImpl*> inputImagePixelStreams_;
         std::vector<VectorImpl*> vectors_;
@@ -33,8 +61,12 @@ class ModelImpl {
         std::vector<ConstantMatrixImpl*> constantMatrices_;
         std::vector<ConvolutionalConstantMatrixImpl*> convolutionMatrices_;
         std::vector<TrainingMatrixImpl*> trainingMatrices_;
-        std::set<Operation*> operations_;
-        std::vector<std::set<MVMOperation*>*> coalesceableMVMSets_;
+        std::vector<Operation*> operations_; /* Indexed by operation ID, NULL once an operation is unlinked */
+        std::mutex operationsMutex_; /* Operations may be created by passes running in parallel */
+        std::vector<Operation*> tombstones_; /* Operations unlinked from the graph, destroyed with the model */
+        std::vector<std::set<MVMOperation*, OperationIdLess>*> coalesceableMVMSets_;
+        std::vector<StreamLoop*> streamLoops_;
+        std::vector<ReductionTree*> reductionTrees_;
 
         Partitioner* partitioner_;
         Placer* placer_;
@@ -63,8 +95,10 @@ class ModelImpl {
         void addConstantMatrixImpl(ConstantMatrixImpl* mat);
         void addConvolutionalConstantMatrixImpl(ConvolutionalConstantMatrixImpl* mat);
         void addTrainingMatrixImpl(TrainingMatrixImpl* mat);
-        void addOperation(Operation* op);
-        void addCoalesceableMVMSet(std::set<MVMOperation*>* coalesceableMVMSet);
+        unsigned int addOperation(Operation* op);
+        void addCoalesceableMVMSet(std::set<MVMOperation*, OperationIdLess>* coalesceableMVMSet);
+        void addStreamLoop(StreamLoop* loop);
+        void addReductionTree(ReductionTree* tree);
 
         void unlink(Operation* op);
 
@@ -73,7 +107,12 @@ class ModelImpl {
         ModelInstanceImpl* createInstance();
 
         std::string getName() { return name_; }
+        unsigned int getNOperationIds() { return operations_.size(); }
         ModelType getModelType() { return modelType_; }
+        unsigned int getNThreads() { return nThreads_; }
+        Arena& getArena() { return arena_; }
+        CompileStatistics& getStatistics() { return stats_; }
+        unsigned int getNStreamLoops() { return streamLoops_.size(); }
 
         // Iterators
         std::vector<ConstantMatrixImpl*>::iterator const_mat_begin() { return constantMatrices_.begin(); }
@@ -82,11 +121,14 @@ class ModelImpl {
         std::vector<ConvolutionalConstantMatrixImpl*>::iterator conv_mat_end() { return convolutionMatrices_.end(); }
         std::vector<TrainingMatrixImpl*>::iterator train_mat_begin() { return trainingMatrices_.begin(); }
         std::vector<TrainingMatrixImpl*>::iterator train_mat_end() { return trainingMatrices_.end(); }
-        std::set<Operation*>::iterator op_begin() { return operations_.begin(); }
-        std::set<Operation*>::iterator op_end() { return operations_.end(); }
+        op_iterator op_begin() { return op_iterator(&operations_, 0); }
+        op_iterator op_end() { return op_iterator(&operations_, operations_.size()); }
+        std::vector<ReductionTree*>::iterator reduction_begin() { return reductionTrees_.begin(); }
+        std::vector<ReductionTree*>::iterator reduction_end() { return reductionTrees_.end(); }
 
         // Debug information
         std::string printAssignment(Operation* op);
+        void printStatistics();
 
 };
 
@@ -6,6 +6,7 @@
  *
  */
 
+#include <algorithm>
 #include <assert.h>
 #include <sstream>
 
@@ -20,7 +21,7 @@ void OutputVector::operator=(Vector xparam) {
     for(unsigned int t = 0; t < x->nTiles(); ++t) {
         ProducerOperation* producer = x->getTile(t);
         OutputVectorTile* output = y->getTile(t);
-        new PseudoOutputOperation(producer->getModel(), producer, output);
+        new(producer->getModel()) PseudoOutputOperation(producer->getModel(), producer, output);
     }
 }
 
@@ -31,14 +32,9 @@ void OutputImagePixelStream::operator=(ImagePixelStream xsparam) {
     for(unsigned int t = 0; t < xs->nTiles(); ++t) {
         ImagePixelStreamTile* xsTile = xs->getTile(t);
         OutputImagePixelStreamTile* ysTile = ys->getTile(t);
-        // TODO: Convert the following into a single operation with codegened loops
-        for(unsigned int h = 0; h < xs->imageHeight(); ++h) {
-            for(unsigned int w = 0; w < xs->imageWidth(); ++w) {
-                ProducerOperation* x = xsTile->get(h, w);
-                OutputVectorTile* y = ysTile->get(h, w);
-                new PseudoOutputOperation(x->getModel(), x, y);
-            }
-        }
+        ProducerOperation* x = xsTile->get();
+        PseudoOutputOperation* y = new(x->getModel()) PseudoOutputOperation(x->getModel(), x, ysTile->get());
+        y->setStreamLoop(x->getStreamLoop());
     }
 }
 
@@ -47,7 +43,7 @@ Vector::Vector(InputVector xparam) {
     VectorImpl* y = new VectorImpl(x->getModel(), x->length());
     y->checkCompatibility(x);
     for(unsigned int t = 0; t < x->nTiles(); ++t) {
-        ProducerOperation* producer = new PseudoInputOperation(x->getModel(), x->getTile(t));
+        ProducerOperation* producer = new(x->getModel()) PseudoInputOperation(x->getModel(), x->getTile(t));
         y->setTile(t, producer);
     }
     impl_ = y;
@@ -57,17 +53,14 @@ ImagePixelStream::ImagePixelStream(InputImagePixelStream xsparam) {
     InputImagePixelStreamImpl* xs = xsparam.unwrap();
     ImagePixelStreamImpl* ys = new ImagePixelStreamImpl(xs->getModel(), xs->imageWidth(), xs->imageHeight(), xs->nChannels());
     ys->checkCompatibility(xs);
+    StreamLoop* loop = new StreamLoop(xs->getModel(), xs->imageHeight(), xs->imageWidth());
     for(unsigned int t = 0; t < xs->nTiles(); ++t) {
         InputImagePixelStreamTile* xsTile = xs->getTile(t);
         ImagePixelStreamTile* ysTile = ys->getTile(t);
-        // TODO: Convert the following into a single operation with codegened loops
-        for(unsigned int h = 0; h < xs->imageHeight(); ++ h) {
-            for(unsigned int w = 0; w < xs->imageWidth(); ++ w) {
-                InputVectorTile* x = xsTile->get(h, w);
-                ProducerOperation* y = new PseudoInputOperation(x->getModel(), x);
-                ysTile->add(h, w, y);
-            }
-        }
+        InputVectorTile* x = xsTile->get();
+        ProducerOperation* y = new(x->getModel()) PseudoInputOperation(x->getModel(), x);
+        y->setStreamLoop(loop);
+        ysTile->set(y);
     }
     impl_ = ys;
 }
@@ -77,7 +70,7 @@ Vector unaryOp(Vector xparam, ALUVectorOperation::OpCode op) {
     VectorImpl* y = new VectorImpl(x->getModel(), x->length());
     y->checkCompatibility(x);
     for(unsigned int t = 0; t < x->nTiles(); ++t) {
-        ProducerOperation* producer = new ALUVectorOperation(x->getModel(), op, x->getTile(t));
+        ProducerOperation* producer = new(x->getModel()) ALUVectorOperation(x->getModel(), op, x->getTile(t));
         y->setTile(t, producer);
     }
     return Vector(y);
@@ -130,7 +123,7 @@ Vector binaryOp(Vector x1param, Vector x2param, ALUVectorOperation::OpCode op) {
     y->checkCompatibility(x1);
     y->checkCompatibility(x2);
     for(unsigned int t = 0; t < x1->nTiles(); ++t) {
-        ProducerOperation* producer = new ALUVectorOperation(x1->getModel(), op, x1->getTile(t), x2->getTile(t));
+        ProducerOperation* producer = new(x1->getModel()) ALUVectorOperation(x1->getModel(), op, x1->getTile(t), x2->getTile(t));
         y->setTile(t, producer);
     }
     return Vector(y);
@@ -201,7 +194,7 @@ Vector immediateOp(Vector xparam, float imm, ALUVectorOperation::OpCode op) {
     VectorImpl* y = new VectorImpl(x->getModel(), x->length());
     y->checkCompatibility(x);
     for(unsigned int t = 0; t < x->nTiles(); ++t) {
-        ProducerOperation* producer = new ALUVectorOperation(x->getModel(), op, x->getTile(t), imm);
+        ProducerOperation* producer = new(x->getModel()) ALUVectorOperation(x->getModel(), op, x->getTile(t), imm);
         y->setTile(t, producer);
     }
     return Vector(y);
@@ -218,14 +211,10 @@ ImagePixelStream sig(ImagePixelStream xsparam) {
     for(unsigned int t = 0; t < xs->nTiles(); ++t) {
         ImagePixelStreamTile* xsTile = xs->getTile(t);
         ImagePixelStreamTile* ysTile = ys->getTile(t);
-        // TODO: Convert the following into a single operation with codegened loops
-        for(unsigned int h = 0; h < xs->imageHeight(); ++h) {
-            for(unsigned int w = 0; w < xs->imageWidth(); ++w) {
-                ProducerOperation* x = xsTile->get(h, w);
-                ProducerOperation* y = new ALUVectorOperation(x->getModel(), ALUVectorOperation::SIG, x);
-                ysTile->add(h, w, y);
-            }
-        }
+        ProducerOperation* x = xsTile->get();
+        ProducerOperation* y = new(x->getModel()) ALUVectorOperation(x->getModel(), ALUVectorOperation::SIG, x);
+        y->setStreamLoop(x->getStreamLoop()); // Element-wise operations execute in the same loop as their operand
+        ysTile->set(y);
     }
     return ImagePixelStream(ys);
 }
@@ -234,30 +223,30 @@ ImagePixelStream maxpool(ImagePixelStream xsparam, unsigned int hspan, unsigned
     ImagePixelStreamImpl* xs = xsparam.unwrap();
     unsigned int ysWidth = (xs->imageWidth() - 1)/wspan + 1;
     unsigned int ysHeight = (xs->imageHeight() - 1)/hspan + 1;
-    ImagePixelStreamImpl* ys = new ImagePixelStreamImpl(xs->getModel(), ysWidth, ysHeight, xs->nChannels());
+    ModelImpl* model = xs->getModel();
+    ImagePixelStreamImpl* ys = new ImagePixelStreamImpl(model, ysWidth, ysHeight, xs->nChannels());
+    StreamLoop* loop = new StreamLoop(model, ysHeight, ysWidth);
     for(unsigned int t = 0; t < xs->nTiles(); ++t) {
         ImagePixelStreamTile* xsTile = xs->getTile(t);
         ImagePixelStreamTile* ysTile = ys->getTile(t);
-        // TODO: Convert the following into a single operation with codegened loops
-        ProducerOperation* accum[ysHeight][ysWidth][hspan*wspan];
-        for(unsigned int hi = 0; hi < xs->imageHeight(); ++hi) {
-            for(unsigned int wi = 0; wi < xs->imageWidth(); ++wi) {
-                ProducerOperation* xTile = xsTile->get(hi, wi);
-                unsigned int ho = hi/hspan;
-                unsigned int hh = hi%hspan;
-                unsigned int wo = wi/wspan;
-                unsigned int ww = wi%wspan;
-                unsigned int accumIdx = hh*wspan + ww;
-                if(accumIdx == 0) {
-                    accum[ho][wo][accumIdx] = xTile;
-                } else {
-                    accum[ho][wo][accumIdx] = new ALUVectorOperation(accum[ho][wo][accumIdx - 1]->getModel(), ALUVectorOperation::MAX, accum[ho][wo][accumIdx - 1], xTile);
-                }
-                if((hh == hspan - 1 || hi == xs->imageHeight() - 1) && (ww == wspan - 1 || wi == xs->imageWidth() - 1)) {
-                    ysTile->add(ho, wo, accum[ho][wo][accumIdx]);
-                }
+        std::vector<ProducerOperation*> window;
+        for(unsigned int hh = 0; hh < hspan; ++hh) {
+            for(unsigned int ww = 0; ww < wspan; ++ww) {
+                // NOTE: Windows that overhang the image read copies of the pixels on its edge, which are already in the window
+                LoadOperation* xTile = new(model) LoadOperation(model, xsTile->getBuffer());
+                StreamAccess access;
+                access.offsetH = hh;
+                access.offsetW = ww;
+                access.strideH = hspan;
+                access.strideW = wspan;
+                access.replicatesEdges = true;
+                xTile->setStreamAccess(access);
+                xTile->setStreamLoop(loop);
+                window.push_back(xTile);
             }
         }
+        ReductionTree* max = new ReductionTree(model, ALUVectorOperation::MAX, window, loop);
+        ysTile->set(max->getRoot());
     }
     return ImagePixelStream(ys);
 }
@@ -268,19 +257,16 @@ Vector operator*(ConstantMatrix Mparam, Vector xparam) {
     VectorImpl* x = xparam.unwrap();
     VectorImpl* y = new VectorImpl(model, M->height());
     M->checkCompatibilityForMVM(x);
-    std::set<MVMOperation*>* coalesceableMVMSet = new std::set<MVMOperation*>();
+    std::set<MVMOperation*, OperationIdLess>* coalesceableMVMSet = new std::set<MVMOperation*, OperationIdLess>();
     for(unsigned int h = 0; h < y->nTiles(); ++h) {
-        ProducerOperation* accum[x->nTiles()]; // TODO: The following implements a sequential reduction; a tree reduction would be more efficient
+        std::vector<ProducerOperation*> partialSums;
         for(unsigned int w = 0; w < x->nTiles(); ++w) {
-            MVMOperation* mvm = new MVMOperation(model, M->getTile(h, w), x->getTile(w));
+            MVMOperation* mvm = new(model) MVMOperation(model, M->getTile(h, w), x->getTile(w));
             coalesceableMVMSet->insert(mvm);
-            if(w == 0) {
-                accum[w] = mvm;
-            } else {
-                accum[w] = new ALUVectorOperation(model, ALUVectorOperation::ADD, mvm, accum[w - 1]);
-            }
+            partialSums.push_back(mvm);
         }
-        y->setTile(h, accum[x->nTiles() - 1]);
+        ReductionTree* sum = new ReductionTree(model, ALUVectorOperation::ADD, partialSums);
+        y->setTile(h, sum->getRoot());
     }
     model->addCoalesceableMVMSet(coalesceableMVMSet);
     return Vector(y);
@@ -296,55 +282,60 @@ ImagePixelStream operator*(ConvolutionalConstantMatrix Mparam, ImagePixelStream
     int nInChannelTiles = M->getNInChannelTiles();
     int imageWidth = xs->imageWidth();
     int imageHeight = xs->imageHeight();
-    ImagePixelStreamImpl* ys[kernelHeight*kernelWidth*nInChannelTiles];
-    for(int kh = 0; kh < kernelHeight; ++kh) { // Instantiates tiles within the same accumulation
-        for(int kw = 0; kw < kernelWidth; ++kw) { // Instantiates tiles within the same accumulation
-            for(int w = 0; w < nInChannelTiles; ++w) { // Instantiates tiles within the same accumulation
-                int accumIdx = (kh*kernelWidth + kw)*nInChannelTiles + w;
-                ys[accumIdx] = new ImagePixelStreamImpl(model, imageWidth, imageHeight, M->getNOutChannels());
-                for(int h = 0; h < M->getNOutChannelTiles(); ++h) { // Instantiates independent tiles
-                    ConstantMatrixTile* mat = M->getTile(kh, kw, h, w);
-                    ImagePixelStreamTile* imageStream = xs->getTile(w);
-                    ImagePixelStreamTile* accumStreamIn = (accumIdx == 0)?NULL:ys[accumIdx - 1]->getTile(h); // Partial sum feeding in from previous tile in the same accumulation
-                    ImagePixelStreamTile* accumStreamOut = ys[accumIdx]->getTile(h); // Partial sum feeding out to the next tile in the same accumulation
-                    // TODO: Convert the following into a single operation with codegened loops
-                    for(int hi = -kernelHeight/2; hi < imageHeight + kernelHeight/2; ++hi) { // Loops over padded pixels of streamed input image
-                        for(int wi = -kernelHeight/2; wi < imageWidth + kernelHeight/2; ++wi) { // Loops over padded pixels of streamed input image
-                            int ho = hi + kernelHeight/2 - kh;
-                            int wo = wi + kernelWidth/2 - kw;
-                            bool inputInBounds = hi >= 0
-                                                && hi < imageHeight
-                                                && wi >= 0
-                                                && wi < imageWidth;
-                            bool outputInBounds = ho >= 0
-                                                && ho < imageHeight
-                                                && wo >= 0
-                                                && wo < imageWidth;
-                            ProducerOperation* pixel = NULL;
-                            if(inputInBounds) {
-                                pixel = imageStream->get(hi, wi);
-                            }
-                            if(outputInBounds) {
-                                ProducerOperation* producer;
-                                if(inputInBounds) {
-                                    producer = new MVMOperation(model, mat, pixel);
-                                } else {
-                                    producer = new SetImmediateOperation(model, 0, mat->height()); // Use 0 for input padding
-                                }
-                                // TODO: The following implements a sequential reduction; it would be more efficient to implement a tree reduction
-                                if(accumIdx == 0) {
-                                    accumStreamOut->add(ho, wo, producer);
-                                } else {
-                                    accumStreamOut->add(ho, wo, new ALUVectorOperation(model, ALUVectorOperation::ADD, producer, accumStreamIn->get(ho, wo)));
-                                }
-                            }
-                        }
+    ImagePixelStreamImpl* ys = new ImagePixelStreamImpl(model, imageWidth, imageHeight, M->getNOutChannels());
+    StreamLoop* loop = new StreamLoop(model, imageHeight, imageWidth); // Output pixel (ho, wo) is computed on iteration (ho, wo)
+    std::vector<std::vector<ProducerOperation*>> partialSums(M->getNOutChannelTiles());
+    if(M->isKernelFolded()) {
+        // All kernel positions share one MVM, whose input vector is assembled from the neighboring pixels
+        std::set<MVMOperation*, OperationIdLess>* coalesceableMVMSet = new std::set<MVMOperation*, OperationIdLess>();
+        for(int h = 0; h < M->getNOutChannelTiles(); ++h) { // Instantiates independent tiles
+            std::vector<ProducerOperation*> pixels;
+            for(int kh = 0; kh < kernelHeight; ++kh) {
+                for(int kw = 0; kw < kernelWidth; ++kw) {
+                    LoadOperation* pixel = new(model) LoadOperation(model, xs->getTile(0)->getBuffer());
+                    StreamAccess access;
+                    access.offsetH = kh - kernelHeight/2;
+                    access.offsetW = kw - kernelWidth/2;
+                    pixel->setStreamAccess(access);
+                    pixel->setStreamLoop(loop);
+                    pixels.push_back(pixel);
+                }
+            }
+            MVMOperation* mvm = new(model) MVMOperation(model, M->getTile(0, 0, h, 0), pixels);
+            mvm->setStreamLoop(loop);
+            coalesceableMVMSet->insert(mvm);
+            partialSums[h].push_back(mvm);
+        }
+        model->addCoalesceableMVMSet(coalesceableMVMSet);
+    } else {
+        for(int kh = 0; kh < kernelHeight; ++kh) { // Instantiates tiles within the same accumulation
+            for(int kw = 0; kw < kernelWidth; ++kw) { // Instantiates tiles within the same accumulation
+                for(int w = 0; w < nInChannelTiles; ++w) { // Instantiates tiles within the same accumulation
+                    std::set<MVMOperation*, OperationIdLess>* coalesceableMVMSet = new std::set<MVMOperation*, OperationIdLess>();
+                    for(int h = 0; h < M->getNOutChannelTiles(); ++h) { // Instantiates independent tiles
+                        ConstantMatrixTile* mat = M->getTile(kh, kw, h, w);
+                        // Iteration (ho, wo) reads input pixel (ho + kh - kernelHeight/2, wo + kw - kernelWidth/2), which is zero padding if out of bounds
+                        LoadOperation* pixel = new(model) LoadOperation(model, xs->getTile(w)->getBuffer());
+                        StreamAccess access;
+                        access.offsetH = kh - kernelHeight/2;
+                        access.offsetW = kw - kernelWidth/2;
+                        pixel->setStreamAccess(access);
+                        pixel->setStreamLoop(loop);
+                        MVMOperation* mvm = new(model) MVMOperation(model, mat, pixel);
+                        mvm->setStreamLoop(loop);
+                        coalesceableMVMSet->insert(mvm);
+                        partialSums[h].push_back(mvm);
                     }
+                    model->addCoalesceableMVMSet(coalesceableMVMSet);
                 }
             }
         }
     }
-    return ImagePixelStream(ys[kernelHeight*kernelWidth*nInChannelTiles - 1]);
+    for(int h = 0; h < M->getNOutChannelTiles(); ++h) {
+        ReductionTree* sum = new ReductionTree(model, ALUVectorOperation::ADD, partialSums[h], loop);
+        ys->getTile(h)->set(sum->getRoot());
+    }
+    return ImagePixelStream(ys);
 }
 
 Vector operator*(TrainingMatrix Mparam, Vector xparam) {
@@ -355,16 +346,13 @@ Vector operator*(TrainingMatrix Mparam, Vector xparam) {
     M->checkCompatibilityForMVM(x);
     // TODO: Track coalesceable operations
     for(unsigned int h = 0; h < y->nTiles(); ++h) {
-        ProducerOperation* accum[x->nTiles()]; // TODO: The following implements a sequential reduction; a tree reduction would be more efficient
+        std::vector<ProducerOperation*> partialSums;
         for(unsigned int w = 0; w < x->nTiles(); ++w) {
-            TrainingMatrixOperation* trainingOp = new TrainingMatrixOperation(model, M->getTile(h, w), TrainingMatrixOperation::MVM, x->getTile(w));
-            if(w == 0) {
-                accum[w] = trainingOp;
-            } else {
-                accum[w] = new ALUVectorOperation(model, ALUVectorOperation::ADD, trainingOp, accum[w - 1]);
-            }
+            TrainingMatrixOperation* trainingOp = new(model) TrainingMatrixOperation(model, M->getTile(h, w), TrainingMatrixOperation::MVM, x->getTile(w));
+            partialSums.push_back(trainingOp);
         }
-        y->setTile(h, accum[x->nTiles() - 1]);
+        ReductionTree* sum = new ReductionTree(model, ALUVectorOperation::ADD, partialSums);
+        y->setTile(h, sum->getRoot());
     }
     return Vector(y);
 }
@@ -377,16 +365,13 @@ Vector operator*(Transpose Mparam, Vector xparam) {
     M->checkCompatibilityForMVMTranspose(x);
     // TODO: Track coalesceable operations
     for(unsigned int h = 0; h < y->nTiles(); ++h) {
-        ProducerOperation* accum[x->nTiles()]; // TODO: The following implements a sequential reduction; a tree reduction would be more efficient
+        std::vector<ProducerOperation*> partialSums;
         for(unsigned int w = 0; w < x->nTiles(); ++w) {
-            TrainingMatrixOperation* trainingOp = new TrainingMatrixOperation(model, M->getTile(w, h), TrainingMatrixOperation::MVM_TRANSPOSE, x->getTile(w));
-            if(w == 0) {
-                accum[w] = trainingOp;
-            } else {
-                accum[w] = new ALUVectorOperation(model, ALUVectorOperation::ADD, trainingOp, accum[w - 1]);
-            }
+            TrainingMatrixOperation* trainingOp = new(model) TrainingMatrixOperation(model, M->getTile(w, h), TrainingMatrixOperation::MVM_TRANSPOSE, x->getTile(w));
+            partialSums.push_back(trainingOp);
         }
-        y->setTile(h, accum[x->nTiles() - 1]);
+        ReductionTree* sum = new ReductionTree(model, ALUVectorOperation::ADD, partialSums);
+        y->setTile(h, sum->getRoot());
     }
     return Vector(y);
 }
@@ -400,14 +385,46 @@ void operator-=(TrainingMatrix Mparam, OuterProduct op) {
     // TODO: Track coalesceable operations
     for(unsigned int h = 0; h < M->nHeightTiles(); ++h) {
         for(unsigned int w = 0; w < M->nWidthTiles(); ++w) {
-            TrainingMatrixOperation* trainingOp = new TrainingMatrixOperation(model, M->getTile(h, w), TrainingMatrixOperation::OUTER_PRODUCT, x1->getTile(h), x2->getTile(w));
+            TrainingMatrixOperation* trainingOp = new(model) TrainingMatrixOperation(model, M->getTile(h, w), TrainingMatrixOperation::OUTER_PRODUCT, x1->getTile(h), x2->getTile(w));
         }
     }
 }
 
-Operation::Operation(ModelImpl* model, unsigned int length) : model_(model), length_(length) {
+StreamLoop::StreamLoop(ModelImpl* model, unsigned int height, unsigned int width) : model_(model), id_(model->getNStreamLoops()), stage_(id_), phase_(0), height_(height), width_(width) {
+    model->addStreamLoop(this);
+}
+
+StreamLoop::StreamLoop(StreamLoop* loop, unsigned int height, unsigned int width) : model_(loop->model_), id_(model_->getNStreamLoops()), stage_(loop->stage_), phase_(loop->phase_), height_(height), width_(width) {
+    model_->addStreamLoop(this);
+}
+
+StreamLoop::StreamLoop(StreamLoop* loop, unsigned int phase) : model_(loop->model_), id_(model_->getNStreamLoops()), stage_(loop->stage_), phase_(phase), height_(loop->height_), width_(loop->width_) {
+    model_->addStreamLoop(this);
+}
+
+StreamLoop* StreamLoop::getPhase(unsigned int phase) {
+    if(phase == phase_) {
+        return this;
+    }
+    if(!phases_.count(phase)) {
+        phases_[phase] = new StreamLoop(this, phase);
+    }
+    return phases_[phase];
+}
+
+bool StreamLoop::executesBefore(StreamLoop* loop) {
+    if(stage_ != loop->stage_) {
+        return stage_ < loop->stage_;
+    } else if(phase_ != loop->phase_) {
+        return phase_ < loop->phase_;
+    } else {
+        return id_ < loop->id_;
+    }
+}
+
+Operation::Operation(ModelImpl* model, OpKind kind, unsigned int length) : model_(model), kind_(kind), length_(length), loop_(NULL), isTombstone_(false) {
     assert(model != NULL);
-    model->addOperation(this);
+    id_ = model->addOperation(this);
 }
 
 ConsumerOperation::ConsumerOperation(ProducerOperation* op1, ProducerOperation* op2) {
@@ -441,13 +458,27 @@ OutputOperation::OutputOperation(OutputVectorTile* dst) : dst_(dst) {
     assert(dst != NULL);
 }
 
-MVMOperation::MVMOperation(ModelImpl* model, ConstantMatrixTile* mat, ProducerOperation* op) : Operation(model, mat->height()), ConsumerOperation(op), mat_(mat), coalescedSet_(NULL) {
+MVMOperation::MVMOperation(ModelImpl* model, ConstantMatrixTile* mat, ProducerOperation* op) : Operation(model, OP_MVM, mat->height()), ConsumerOperation(op), mat_(mat), coalescedSet_(NULL) {
     assert(mat != NULL && op != NULL && mat->width() == op->length());
     assert(mat->width() <= MVMU_DIM && mat->height() <= MVMU_DIM && "MVM operations larger than one MVMU are not supported");
     mat->addUser(this);
 }
 
-TrainingMatrixOperation::TrainingMatrixOperation(ModelImpl* model, TrainingMatrixTile* mat, OpType opType, ProducerOperation* src1, ProducerOperation* src2) : Operation(model, (opType != MVM_TRANSPOSE)?(mat->height()):(mat->width())), ConsumerOperation(src1, src2), mat_(mat), opType_(opType), coalescedSet_(NULL) {
+MVMOperation::MVMOperation(ModelImpl* model, ConstantMatrixTile* mat, std::vector<ProducerOperation*>& srcs) : Operation(model, OP_MVM, mat->height()), ConsumerOperation(), mat_(mat), coalescedSet_(NULL) {
+    assert(mat != NULL && !srcs.empty());
+    assert(mat->width() <= MVMU_DIM && mat->height() <= MVMU_DIM && "MVM operations larger than one MVMU are not supported");
+    unsigned int width = 0;
+    for(ProducerOperation* src : srcs) {
+        assert(src != NULL);
+        operands_.push_back(src);
+        src->addUser(this);
+        width += src->length();
+    }
+    assert(mat->width() == width);
+    mat->addUser(this);
+}
+
+TrainingMatrixOperation::TrainingMatrixOperation(ModelImpl* model, TrainingMatrixTile* mat, OpType opType, ProducerOperation* src1, ProducerOperation* src2) : Operation(model, OP_TRAINING_MATRIX, (opType != MVM_TRANSPOSE)?(mat->height()):(mat->width())), ConsumerOperation(src1, src2), mat_(mat), opType_(opType), coalescedSet_(NULL) {
     assert(mat != NULL && src1 != NULL);
     assert(mat->width() <= MVMU_DIM && mat->height() <= MVMU_DIM && "MVM operations larger than one MVMU are not supported");
     if(opType == MVM) {
@@ -465,7 +496,7 @@ TrainingMatrixOperation::TrainingMatrixOperation(ModelImpl* model, TrainingMatri
     mat->addUser(this);
 }
 
-ALUVectorOperation::ALUVectorOperation(ModelImpl* model, OpCode opCode, ProducerOperation* src1, ProducerOperation* src2) : Operation(model, src1->length()), ConsumerOperation(src1, src2), opCode_(opCode), imm_(0.0f) {
+ALUVectorOperation::ALUVectorOperation(ModelImpl* model, OpCode opCode, ProducerOperation* src1, ProducerOperation* src2) : Operation(model, OP_ALU_VECTOR, src1->length()), ConsumerOperation(src1, src2), opCode_(opCode), imm_(0.0f) {
     assert(!isImmediate());
     assert(src1 != NULL);
     switch(opCode_) {
@@ -488,46 +519,55 @@ ALUVectorOperation::ALUVectorOperation(ModelImpl* model, OpCode opCode, Producer
     }
 }
 
-ALUVectorOperation::ALUVectorOperation(ModelImpl* model, OpCode opCode, ProducerOperation* src1, float imm) : Operation(model, src1->length()), ConsumerOperation(src1), opCode_(opCode), imm_(imm) {
+ALUVectorOperation::ALUVectorOperation(ModelImpl* model, OpCode opCode, ProducerOperation* src1, float imm) : Operation(model, OP_ALU_VECTOR, src1->length()), ConsumerOperation(src1), opCode_(opCode), imm_(imm) {
     assert(isImmediate());
     assert(src1 != NULL);
 }
 
-SetImmediateOperation::SetImmediateOperation(ModelImpl* model, unsigned int imm, unsigned int length) : Operation(model, length), imm_(imm) {
+SetImmediateOperation::SetImmediateOperation(ModelImpl* model, unsigned int imm, unsigned int length) : Operation(model, OP_SET_IMMEDIATE, length), imm_(imm), isInduction_(false), innerStride_(0), outerStride_(0) {
 }
 
-CopyOperation::CopyOperation(ModelImpl* model, ProducerOperation* src) : Operation(model, src->length()), ConsumerOperation(src) {
+CopyOperation::CopyOperation(ModelImpl* model, ProducerOperation* src) : Operation(model, OP_COPY, src->length()), ConsumerOperation(src) {
     assert(src != NULL);
 }
 
-LoadOperation::LoadOperation(ModelImpl* model, TileMemoryWriteOperation* src) : Operation(model, src->length()), TileMemoryReadOperation(src) {
+LoadOperation::LoadOperation(ModelImpl* model, TileMemoryWriteOperation* src) : Operation(model, OP_LOAD, src->length()), TileMemoryReadOperation(src) {
 }
 
-StoreOperation::StoreOperation(ModelImpl* model, ProducerOperation* src) : Operation(model, src->length()), ConsumerOperation(src) {
+StoreOperation::StoreOperation(ModelImpl* model, ProducerOperation* src) : Operation(model, OP_STORE, src->length()), ConsumerOperation(src), paddingOf_(NULL) {
     assert(src != NULL);
 }
 
-SendOperation::SendOperation(ModelImpl* model, TileMemoryWriteOperation* src) : Operation(model, src->length()), TileMemoryReadOperation(src), dst_(NULL) {
+SendOperation::SendOperation(ModelImpl* model, TileMemoryWriteOperation* src) : Operation(model, OP_SEND, src->length()), TileMemoryReadOperation(src), dst_(NULL) {
 }
 
-ReceiveOperation::ReceiveOperation(ModelImpl* model, SendOperation* src) : Operation(model, src->length()), src_(src) {
+ReceiveOperation::ReceiveOperation(ModelImpl* model, SendOperation* src) : Operation(model, OP_RECEIVE, src->length()), src_(src) {
     src->setDst(this);
 }
 
-WriteInputOperation::WriteInputOperation(ModelImpl* model, InputVectorTile* src) : Operation(model, src->length()), InputOperation(src) {
+WriteInputOperation::WriteInputOperation(ModelImpl* model, InputVectorTile* src) : Operation(model, OP_WRITE_INPUT, src->length()), InputOperation(src) {
 }
 
-ReadOutputOperation::ReadOutputOperation(ModelImpl* model, TileMemoryWriteOperation* src, OutputVectorTile* dst) : Operation(model, src->length()), TileMemoryReadOperation(src), OutputOperation(dst) {
+ReadOutputOperation::ReadOutputOperation(ModelImpl* model, TileMemoryWriteOperation* src, OutputVectorTile* dst) : Operation(model, OP_READ_OUTPUT, src->length()), TileMemoryReadOperation(src), OutputOperation(dst) {
     assert(src->length() == dst->length());
 }
 
-PseudoInputOperation::PseudoInputOperation(ModelImpl* model, InputVectorTile* src) : Operation(model, src->length()), InputOperation(src) {
+PseudoInputOperation::PseudoInputOperation(ModelImpl* model, InputVectorTile* src) : Operation(model, OP_PSEUDO_INPUT, src->length()), InputOperation(src) {
 }
 
-PseudoOutputOperation::PseudoOutputOperation(ModelImpl* model, ProducerOperation* op, OutputVectorTile* dst) : Operation(model, op->length()), ConsumerOperation(op), OutputOperation(dst) {
+PseudoOutputOperation::PseudoOutputOperation(ModelImpl* model, ProducerOperation* op, OutputVectorTile* dst) : Operation(model, OP_PSEUDO_OUTPUT, op->length()), ConsumerOperation(op), OutputOperation(dst) {
     assert(op != NULL && op->length() == dst->length());
 }
 
+LoopBeginOperation::LoopBeginOperation(ModelImpl* model, StreamLoop* loop, std::vector<unsigned int>& strides) : Operation(model, OP_LOOP_BEGIN, N_CONTROL_REGISTERS + strides.size()), strides_(strides) {
+    assert(loop != NULL);
+    setStreamLoop(loop);
+}
+
+LoopEndOperation::LoopEndOperation(ModelImpl* model, LoopBeginOperation* begin) : Operation(model, OP_LOOP_END, 0), ConsumerOperation(begin), begin_(begin) {
+    setStreamLoop(begin->getStreamLoop());
+}
+
 void LoadOperation::addTileMemoryAddressOperand(ProducerOperation* address) {
     assert(operands_.size() == 0 && "Cannot set tile memory address operand!");
     assert(address->length() == 1 && "Address must be of length 1!");
@@ -542,11 +582,71 @@ void StoreOperation::addTileMemoryAddressOperand(ProducerOperation* address) {
     address->addUser(this);
 }
 
+void StoreOperation::setPaddingOf(StoreOperation* store) {
+    assert(paddingOf_ == NULL && "Cannot reassign padded store");
+    assert(store->length() == length() && !store->isPadding());
+    paddingOf_ = store;
+}
+
+void SetImmediateOperation::setInduction(int innerStride, int outerStride) {
+    assert(length() == 1 && "Induction variables must be scalars!");
+    isInduction_ = true;
+    innerStride_ = innerStride;
+    outerStride_ = outerStride;
+}
+
+unsigned int LoopBeginOperation::getStrideRegisterOffset(unsigned int stride) {
+    for(unsigned int i = 0; i < strides_.size(); ++i) {
+        if(strides_[i] == stride) {
+            return N_CONTROL_REGISTERS + i;
+        }
+    }
+    assert(0 && "Stride not found!");
+}
+
+void LoopEndOperation::addInductionVariable(SetImmediateOperation* seti) {
+    assert(seti->isInduction() && seti->getStreamLoop() == getStreamLoop());
+    operands_.push_back(seti);
+    seti->addUser(this);
+}
+
+SetImmediateOperation* LoopEndOperation::getInductionVariable(unsigned int i) {
+    return op_cast<SetImmediateOperation>(operands_[i + 1]);
+}
+
 void SendOperation::setDst(ReceiveOperation* dst) {
     assert(dst_ == NULL && "Cannot reset destination of send operation");
     dst_ = dst;
 }
 
+void ProducerOperation::addUser(ConsumerOperation* user) {
+    auto u = std::lower_bound(users_.begin(), users_.end(), user, OperationIdLess());
+    if(u == users_.end() || *u != user) {
+        users_.insert(u, user);
+    }
+}
+
+void ProducerOperation::removeUser(ConsumerOperation* user) {
+    auto u = std::lower_bound(users_.begin(), users_.end(), user, OperationIdLess());
+    if(u != users_.end() && *u == user) {
+        users_.erase(u);
+    }
+}
+
+void TileMemoryWriteOperation::addUser(TileMemoryReadOperation* user) {
+    auto u = std::lower_bound(users_.begin(), users_.end(), user, OperationIdLess());
+    if(u == users_.end() || *u != user) {
+        users_.insert(u, user);
+    }
+}
+
+void TileMemoryWriteOperation::removeUser(TileMemoryReadOperation* user) {
+    auto u = std::lower_bound(users_.begin(), users_.end(), user, OperationIdLess());
+    if(u != users_.end() && *u == user) {
+        users_.erase(u);
+    }
+}
+
 bool ConsumerOperation::uses(ProducerOperation* op) {
     for(unsigned int i = 0; i < operands_.size(); ++i) {
         if(operands_[i] == op) {
@@ -556,7 +656,16 @@ bool ConsumerOperation::uses(ProducerOperation* op) {
     return false;
 }
 
+unsigned int MVMOperation::getOperandOffset(unsigned int o) {
+    unsigned int offset = 0;
+    for(unsigned int i = 0; i < o; ++i) {
+        offset += operands_[i]->length();
+    }
+    return offset;
+}
+
 void ConsumerOperation::replaceOperand(ProducerOperation* op, ProducerOperation* replacement) {
+    assert(!replacement->isTombstone() && "Cannot use an operation that was unlinked from the graph!");
     for(unsigned int i = 0; i < operands_.size(); ++i) {
         if(operands_[i] == op) {
             operands_[i] = replacement;
@@ -566,6 +675,15 @@ void ConsumerOperation::replaceOperand(ProducerOperation* op, ProducerOperation*
     }
 }
 
+void ConsumerOperation::setOperand(unsigned int i, ProducerOperation* op) {
+    ProducerOperation* old = operands_[i];
+    operands_[i] = op;
+    if(old != NULL && !uses(old)) {
+        old->removeUser(this);
+    }
+    op->addUser(this);
+}
+
 void TileMemoryReadOperation::replaceSrc(TileMemoryWriteOperation* old, TileMemoryWriteOperation* replacement) {
     for(unsigned int i = 0; i < srcs_.size(); ++i) {
         if(srcs_[i] == old) {
@@ -587,6 +705,39 @@ void MVMOperation::resetCoalescedSet() {
     coalescedSet_ = NULL;
 }
 
+ReductionTree::ReductionTree(ModelImpl* model, ALUVectorOperation::OpCode opCode, std::vector<ProducerOperation*>& leaves, StreamLoop* loop) : model_(model), opCode_(opCode), loop_(loop), leaves_(leaves), nReduced_(0) {
+    assert(!leaves.empty() && "Cannot reduce an empty set of operations!");
+    reduce(leaves_);
+    model->addReductionTree(this);
+}
+
+ProducerOperation* ReductionTree::reduce(std::vector<ProducerOperation*>& srcs) {
+    // Combine pairs of partial results level by level so the depth is logarithmic in the number of sources
+    std::vector<ProducerOperation*> level = srcs;
+    while(level.size() > 1) {
+        std::vector<ProducerOperation*> nextLevel;
+        for(unsigned int i = 0; i + 1 < level.size(); i += 2) {
+            ALUVectorOperation* node;
+            if(nReduced_ < nodes_.size()) {
+                node = nodes_[nReduced_];
+                node->setOperand(0, level[i]);
+                node->setOperand(1, level[i + 1]);
+            } else {
+                node = new(model_) ALUVectorOperation(model_, opCode_, level[i], level[i + 1]);
+                node->setStreamLoop(loop_);
+                nodes_.push_back(node);
+            }
+            ++nReduced_;
+            nextLevel.push_back(node);
+        }
+        if(level.size()%2 == 1) {
+            nextLevel.push_back(level.back());
+        }
+        level = nextLevel;
+    }
+    return level[0];
+}
+
 void CoalescedMVMSet::add(MVMOperation* mvm, unsigned int pMVMU) {
     assert(mvms_[pMVMU] == NULL);
     mvms_[pMVMU] = mvm;
@@ -667,9 +818,35 @@ bool CoalescedTrainingOperationSet::isComplete() {
     return true;
 }
 
+std::string Operation::printKind(OpKind kind) {
+    switch(kind) {
+        case OP_MVM: return "mvm";
+        case OP_TRAINING_MATRIX: return "training_matrix";
+        case OP_ALU_VECTOR: return "alu_vector";
+        case OP_SET_IMMEDIATE: return "set_immediate";
+        case OP_COPY: return "copy";
+        case OP_LOAD: return "load";
+        case OP_STORE: return "store";
+        case OP_SEND: return "send";
+        case OP_RECEIVE: return "receive";
+        case OP_WRITE_INPUT: return "write_input";
+        case OP_READ_OUTPUT: return "read_output";
+        case OP_PSEUDO_INPUT: return "pseudo_input";
+        case OP_PSEUDO_OUTPUT: return "pseudo_output";
+        case OP_LOOP_BEGIN: return "loop_begin";
+        case OP_LOOP_END: return "loop_end";
+        default: assert(0 && "Unrecognized operation kind!");
+    }
+    return "";
+}
+
 std::string Operation::printNodeName() {
     std::stringstream ss;
-    ss << '"' << printOperationType() << "\n" << this << model_->printAssignment(this) << '"';
+    ss << '"' << printOperationType() << "\n" << this;
+    if(loop_ != NULL) {
+        ss << "\nloop = " << loop_->printName();
+    }
+    ss << model_->printAssignment(this) << '"';
     return ss.str();
 }
 
@@ -756,6 +933,15 @@ std::string ALUVectorOperation::printOperationType() {
 std::string SetImmediateOperation::printOperationType() {
     std::stringstream ss;
     ss << "Set " << imm_;
+    if(isInduction_) {
+        ss << " (+" << innerStride_ << ", +" << outerStride_ << ")";
+    }
+    return ss.str();
+}
+
+std::string StreamLoop::printName() {
+    std::stringstream ss;
+    ss << stage_ << "." << phase_ << "." << id_ << " (" << height_ << "x" << width_ << ")";
     return ss.str();
 }
 
@@ -787,6 +973,14 @@ std::string ReadOutputOperation::printOperationType() {
     return "ReadOutput";
 }
 
+std::string LoopBeginOperation::printOperationType() {
+    return "LoopBegin";
+}
+
+std::string LoopEndOperation::printOperationType() {
+    return "LoopEnd";
+}
+
 std::string PseudoInputOperation::printOperationType() {
     return "PseudoInput";
 }
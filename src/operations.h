@@ -7,29 +7,126 @@
  */
 
 #include <iostream>
+#include <map>
 #include <set>
 #include <string>
+#include <type_traits>
 #include <vector>
 
+#include "arena.h"
 #include "common.h"
+#include "optable.h"
+#include "smallvector.h"
 
-class Operation {
+/*
+ * Operations on image pixel streams are not replicated for every pixel. Each one is created once and tagged with the
+ * stream loop that repeats it over the pixels of the image. Operations of the same loop that end up on the same core
+ * are code generated as the body of a single loop.
+ */
+class StreamLoop {
+
+    private:
+
+        ModelImpl* model_;
+        unsigned int id_;
+        unsigned int stage_;    /* Loops execute in increasing order of stage, then phase, then creation */
+        unsigned int phase_;    /* Loops are split into phases where they cross tiles because transfers between tiles are done in bulk */
+        unsigned int height_;
+        unsigned int width_;
+        std::map<unsigned int, StreamLoop*> phases_;
+
+        StreamLoop(StreamLoop* loop, unsigned int phase);
+
+    public:
+
+        StreamLoop(ModelImpl* model, unsigned int height, unsigned int width);
+        StreamLoop(StreamLoop* loop, unsigned int height, unsigned int width); // Executes right after loop, in the same stage and phase
+
+        unsigned int getStage() { return stage_; }
+        unsigned int getPhase() { return phase_; }
+        unsigned int height() { return height_; }
+        unsigned int width() { return width_; }
+        unsigned int nIterations() { return height_*width_; }
+
+        StreamLoop* getPhase(unsigned int phase);
+        bool executesBefore(StreamLoop* loop);
+
+        std::string printName();
+
+};
+
+/* Maps iteration (h, w) of a stream loop to pixel (h*strideH + offsetH, w*strideW + offsetW) of a stream buffer */
+struct StreamAccess {
+    int offsetH = 0;
+    int offsetW = 0;
+    unsigned int strideH = 1;
+    unsigned int strideW = 1;
+    bool replicatesEdges = false; // Pixels outside of the image read the nearest pixel of the image instead of zero
+};
+
+/* Dispatches on the concrete type of an operation with a single virtual call instead of a cascade of dynamic casts */
+class OperationVisitor {
+
+    public:
+
+        virtual ~OperationVisitor() { }
+
+        virtual void visit(MVMOperation* op) { }
+        virtual void visit(TrainingMatrixOperation* op) { }
+        virtual void visit(ALUVectorOperation* op) { }
+        virtual void visit(SetImmediateOperation* op) { }
+        virtual void visit(CopyOperation* op) { }
+        virtual void visit(LoadOperation* op) { }
+        virtual void visit(StoreOperation* op) { }
+        virtual void visit(SendOperation* op) { }
+        virtual void visit(ReceiveOperation* op) { }
+        virtual void visit(WriteInputOperation* op) { }
+        virtual void visit(ReadOutputOperation* op) { }
+        virtual void visit(PseudoInputOperation* op) { }
+        virtual void visit(PseudoOutputOperation* op) { }
+        virtual void visit(LoopBeginOperation* op) { }
+        virtual void visit(LoopEndOperation* op) { }
+
+};
+
+class Operation : public ArenaAllocated {
+
+    public:
+
+        enum OpKind {
+            OP_MVM, OP_TRAINING_MATRIX, OP_ALU_VECTOR, OP_SET_IMMEDIATE, OP_COPY,
+            OP_LOAD, OP_STORE, OP_SEND, OP_RECEIVE, OP_WRITE_INPUT, OP_READ_OUTPUT,
+            OP_PSEUDO_INPUT, OP_PSEUDO_OUTPUT, OP_LOOP_BEGIN, OP_LOOP_END,
+            N_OP_KINDS
+        };
 
     protected:
 
         ModelImpl* model_;
+        unsigned int id_; /* Dense index of the operation within its model, in order of creation */
+        OpKind kind_;
         unsigned int length_;
+        StreamLoop* loop_; /* Stream loop that repeats the operation for every pixel (NULL if executed once) */
+        bool isTombstone_; /* Set once the operation has been unlinked from the graph */
 
         Operation() { }
 
-        Operation(ModelImpl* model, unsigned int length);
+        Operation(ModelImpl* model, OpKind kind, unsigned int length);
 
     public:
 
         virtual ~Operation() { }
 
         ModelImpl* getModel() const { return model_; }
+        unsigned int getId() const { return id_; }
+        OpKind getKind() const { return kind_; }
+        static std::string printKind(OpKind kind);
+        virtual void accept(OperationVisitor& visitor)=0;
         unsigned int length() const { return length_; }
+        StreamLoop* getStreamLoop() { return loop_; }
+        void setStreamLoop(StreamLoop* loop) { loop_ = loop; }
+        bool isTombstone() { return isTombstone_; }
+        void setTombstone() { isTombstone_ = true; }
 
         std::string printNodeName();
         virtual std::string printNodeStyle();
@@ -42,16 +139,16 @@ class ProducerOperation : public virtual Operation {
 
     protected:
 
-        std::set<ConsumerOperation*> users_;
+        SmallVector<ConsumerOperation*, 2> users_; // Sorted by operation ID
 
         ProducerOperation() { }
 
     public:
 
-        void addUser(ConsumerOperation* user) { users_.insert(user); }
-        void removeUser(ConsumerOperation* user) { users_.erase(user); }
+        void addUser(ConsumerOperation* user);
+        void removeUser(ConsumerOperation* user);
 
-        typedef std::set<ConsumerOperation*>::iterator user_iterator;
+        typedef SmallVector<ConsumerOperation*, 2>::iterator user_iterator;
         user_iterator user_begin() { return users_.begin(); }
         user_iterator user_end() { return users_.end(); }
         unsigned int numUsers() { return users_.size(); }
@@ -64,7 +161,7 @@ class ConsumerOperation : public virtual Operation {
 
     protected:
 
-        std::vector<ProducerOperation*> operands_;
+        SmallVector<ProducerOperation*, 2> operands_;
 
         ConsumerOperation(ProducerOperation* op1=NULL, ProducerOperation* op2=NULL);
 
@@ -74,6 +171,7 @@ class ConsumerOperation : public virtual Operation {
         ProducerOperation* getOperand(unsigned int i) { return operands_[i]; }
         bool uses(ProducerOperation* op);
         void replaceOperand(ProducerOperation* op, ProducerOperation* replacement);
+        void setOperand(unsigned int i, ProducerOperation* op);
 
 };
 
@@ -81,17 +179,17 @@ class TileMemoryWriteOperation : public virtual Operation {
 
     protected:
 
-        std::set<TileMemoryReadOperation*> users_;
+        SmallVector<TileMemoryReadOperation*, 2> users_; // Sorted by operation ID
 
         TileMemoryWriteOperation() { }
 
     public:
 
         unsigned int numUsers() { return users_.size(); }
-        void addUser(TileMemoryReadOperation* user) { users_.insert(user); }
-        void removeUser(TileMemoryReadOperation* user) { users_.erase(user); }
+        void addUser(TileMemoryReadOperation* user);
+        void removeUser(TileMemoryReadOperation* user);
 
-        typedef std::set<TileMemoryReadOperation*>::iterator user_iterator;
+        typedef SmallVector<TileMemoryReadOperation*, 2>::iterator user_iterator;
         user_iterator user_begin() { return users_.begin(); }
         user_iterator user_end() { return users_.end(); }
 
@@ -103,7 +201,7 @@ class TileMemoryReadOperation : public virtual Operation {
 
     protected:
 
-        std::vector<TileMemoryWriteOperation*> srcs_;
+        SmallVector<TileMemoryWriteOperation*, 2> srcs_;
 
         TileMemoryReadOperation(TileMemoryWriteOperation* src1, TileMemoryWriteOperation* src2=NULL);
 
@@ -165,6 +263,11 @@ class MVMOperation : public ProducerOperation, public ConsumerOperation, public
     public:
 
         MVMOperation(ModelImpl* model, ConstantMatrixTile* mat, ProducerOperation* src);
+        MVMOperation(ModelImpl* model, ConstantMatrixTile* mat, std::vector<ProducerOperation*>& srcs); /* Input vector is the concatenation of srcs */
+
+        ConstantMatrixTile* getMatrixTile() { return mat_; }
+
+        unsigned int getOperandOffset(unsigned int o); /* Offset of operand o in the input vector */
 
         void setCoalescedSet(CoalescedMVMSet* coalescedSet);
         void resetCoalescedSet();
@@ -172,6 +275,7 @@ class MVMOperation : public ProducerOperation, public ConsumerOperation, public
 
         std::string printNodeStyle();
         std::string printOperationType();
+        void accept(OperationVisitor& visitor) { visitor.visit(this); }
         void printNodeAndEdges(std::ostream& fout) { ProducerOperation::printNodeAndEdges(fout); }
 
 };
@@ -225,6 +329,7 @@ class TrainingMatrixOperation : public ProducerOperation, public ConsumerOperati
 
         std::string printNodeStyle();
         std::string printOperationType();
+        void accept(OperationVisitor& visitor) { visitor.visit(this); }
         void printNodeAndEdges(std::ostream& fout) { ProducerOperation::printNodeAndEdges(fout); }
 
 };
@@ -280,23 +385,68 @@ class ALUVectorOperation : public ProducerOperation, public ConsumerOperation, p
 
         std::string printNodeStyle();
         std::string printOperationType();
+        void accept(OperationVisitor& visitor) { visitor.visit(this); }
         void printNodeAndEdges(std::ostream& fout) { ProducerOperation::printNodeAndEdges(fout); }
 
 };
 
+/*
+ * Reduces a set of partial results with a binary associative operation. The tree is built balanced over the leaves
+ * and later reshaped by the partitioner so that leaves on the same core and tile are combined before leaving them.
+ */
+class ReductionTree {
+
+    private:
+
+        ModelImpl* model_;
+        ALUVectorOperation::OpCode opCode_;
+        StreamLoop* loop_;
+        std::vector<ProducerOperation*> leaves_;
+        std::vector<ALUVectorOperation*> nodes_; /* Internal nodes in bottom-up order, the last of which is the root */
+        unsigned int nReduced_; /* Internal nodes used so far while (re)shaping the tree */
+
+    public:
+
+        ReductionTree(ModelImpl* model, ALUVectorOperation::OpCode opCode, std::vector<ProducerOperation*>& leaves, StreamLoop* loop=NULL);
+
+        ALUVectorOperation::OpCode getOpCode() { return opCode_; }
+        unsigned int numLeaves() { return leaves_.size(); }
+        ProducerOperation* getLeaf(unsigned int i) { return leaves_[i]; }
+        unsigned int numNodes() { return nodes_.size(); }
+        ALUVectorOperation* getNode(unsigned int i) { return nodes_[i]; }
+        ProducerOperation* getRoot() { return (nodes_.empty())?(leaves_[0]):(nodes_.back()); }
+
+        // Reshaping rewires the existing internal nodes, in bottom-up order, as groups of partial results are reduced
+        void startReshape() { nReduced_ = 0; }
+        ProducerOperation* reduce(std::vector<ProducerOperation*>& srcs);
+        bool isReshaped() { return nReduced_ == nodes_.size(); }
+
+};
+
 class SetImmediateOperation : public ProducerOperation, public CoreOperation {
 
     protected:
 
         unsigned int imm_;
+        bool isInduction_;
+        int innerStride_;
+        int outerStride_;
 
     public:
 
         SetImmediateOperation(ModelImpl* model, unsigned int imm, unsigned int length=1);
 
         unsigned int getImmediate() { return imm_; }
+        void setImmediate(unsigned int imm) { imm_ = imm; }
+
+        // Induction variables are stepped by the enclosing stream loop instead of being set on every iteration
+        void setInduction(int innerStride, int outerStride);
+        bool isInduction() { return isInduction_; }
+        int getInnerStride() { return innerStride_; }
+        int getOuterStride() { return outerStride_; }
 
         std::string printOperationType();
+        void accept(OperationVisitor& visitor) { visitor.visit(this); }
         void printNodeAndEdges(std::ostream& fout) { ProducerOperation::printNodeAndEdges(fout); }
 
 };
@@ -308,34 +458,56 @@ class CopyOperation : public ProducerOperation, public ConsumerOperation, public
         CopyOperation(ModelImpl* model, ProducerOperation* src);
 
         std::string printOperationType();
+        void accept(OperationVisitor& visitor) { visitor.visit(this); }
         void printNodeAndEdges(std::ostream& fout) { ProducerOperation::printNodeAndEdges(fout); }
 
 };
 
 class LoadOperation : public ProducerOperation, public ConsumerOperation, public TileMemoryReadOperation, public CoreOperation {
 
+    protected:
+
+        StreamAccess access_;
+
     public:
 
         LoadOperation(ModelImpl* model, TileMemoryWriteOperation* src);
 
         void addTileMemoryAddressOperand(ProducerOperation* address);
 
+        StreamAccess& getStreamAccess() { return access_; }
+        void setStreamAccess(StreamAccess& access) { access_ = access; }
+
         std::string printNodeStyle();
         std::string printOperationType();
+        void accept(OperationVisitor& visitor) { visitor.visit(this); }
         void printNodeAndEdges(std::ostream& fout) { ProducerOperation::printNodeAndEdges(fout); }
 
 };
 
 class StoreOperation : public ConsumerOperation, public TileMemoryWriteOperation, public CoreOperation {
 
+    protected:
+
+        StreamAccess access_;
+        StoreOperation* paddingOf_; /* Store whose stream buffer padding is filled by this store (NULL if not a padding store) */
+
     public:
 
         StoreOperation(ModelImpl* model, ProducerOperation* src);
 
         void addTileMemoryAddressOperand(ProducerOperation* address);
 
+        StreamAccess& getStreamAccess() { return access_; }
+        void setStreamAccess(StreamAccess& access) { access_ = access; }
+
+        bool isPadding() { return paddingOf_ != NULL; }
+        StoreOperation* getPaddingOf() { return paddingOf_; }
+        void setPaddingOf(StoreOperation* store);
+
         std::string printNodeStyle();
         std::string printOperationType();
+        void accept(OperationVisitor& visitor) { visitor.visit(this); }
         void printNodeAndEdges(std::ostream& fout) { TileMemoryWriteOperation::printNodeAndEdges(fout); }
 
 };
@@ -355,6 +527,7 @@ class SendOperation : public TileMemoryReadOperation, public TileOperation {
 
         std::string printNodeStyle();
         std::string printOperationType();
+        void accept(OperationVisitor& visitor) { visitor.visit(this); }
         void printNodeAndEdges(std::ostream& fout);
 
 };
@@ -373,6 +546,7 @@ class ReceiveOperation : public TileMemoryWriteOperation, public TileOperation {
 
         std::string printNodeStyle();
         std::string printOperationType();
+        void accept(OperationVisitor& visitor) { visitor.visit(this); }
         void printNodeAndEdges(std::ostream& fout) { TileMemoryWriteOperation::printNodeAndEdges(fout); }
 
 };
@@ -384,6 +558,7 @@ class WriteInputOperation : public InputOperation, public TileMemoryWriteOperati
         WriteInputOperation(ModelImpl* model, InputVectorTile* src);
 
         std::string printOperationType();
+        void accept(OperationVisitor& visitor) { visitor.visit(this); }
         void printNodeAndEdges(std::ostream& fout);
 
 };
@@ -395,10 +570,56 @@ class ReadOutputOperation : public OutputOperation, public TileMemoryReadOperati
         ReadOutputOperation(ModelImpl* model, TileMemoryWriteOperation* src, OutputVectorTile* dst);
 
         std::string printOperationType();
+        void accept(OperationVisitor& visitor) { visitor.visit(this); }
         void printNodeAndEdges(std::ostream& fout);
 
 };
 
+class LoopBeginOperation : public ProducerOperation, public CoreOperation {
+
+    public:
+
+        /* Loop control registers, followed by one register for each stride that steps an induction variable */
+        enum ControlRegister { ROW, COLUMN, HEIGHT, WIDTH, ONE, N_CONTROL_REGISTERS };
+
+    protected:
+
+        std::vector<unsigned int> strides_;
+
+    public:
+
+        LoopBeginOperation(ModelImpl* model, StreamLoop* loop, std::vector<unsigned int>& strides);
+
+        unsigned int numStrides() { return strides_.size(); }
+        unsigned int getStride(unsigned int i) { return strides_[i]; }
+        unsigned int getStrideRegisterOffset(unsigned int stride);
+
+        std::string printOperationType();
+        void accept(OperationVisitor& visitor) { visitor.visit(this); }
+        void printNodeAndEdges(std::ostream& fout) { ProducerOperation::printNodeAndEdges(fout); }
+
+};
+
+class LoopEndOperation : public ConsumerOperation, public CoreOperation {
+
+    protected:
+
+        LoopBeginOperation* begin_;
+
+    public:
+
+        LoopEndOperation(ModelImpl* model, LoopBeginOperation* begin);
+
+        LoopBeginOperation* getLoopBegin() { return begin_; }
+        void addInductionVariable(SetImmediateOperation* seti);
+        unsigned int numInductionVariables() { return operands_.size() - 1; }
+        SetImmediateOperation* getInductionVariable(unsigned int i);
+
+        std::string printOperationType();
+        void accept(OperationVisitor& visitor) { visitor.visit(this); }
+
+};
+
 /* Psudeo-operations: Not real operations. Will be replaced before code generation. */
 
 class PseudoInputOperation : public InputOperation, public ProducerOperation {
@@ -408,6 +629,7 @@ class PseudoInputOperation : public InputOperation, public ProducerOperation {
         PseudoInputOperation(ModelImpl* model, InputVectorTile* src);
 
         std::string printOperationType();
+        void accept(OperationVisitor& visitor) { visitor.visit(this); }
         void printNodeAndEdges(std::ostream& fout);
 
 };
@@ -419,7 +641,78 @@ class PseudoOutputOperation : public OutputOperation, public ConsumerOperation {
         PseudoOutputOperation(ModelImpl* model, ProducerOperation* src, OutputVectorTile* dst);
 
         std::string printOperationType();
+        void accept(OperationVisitor& visitor) { visitor.visit(this); }
         void printNodeAndEdges(std::ostream& fout);
 
 };
 
+/* Kinds of the concrete operations that derive from T */
+template <class T>
+constexpr unsigned int opKindMask() {
+    return (std::is_base_of<T, MVMOperation>::value?(1u << Operation::OP_MVM):(0u))
+         | (std::is_base_of<T, TrainingMatrixOperation>::value?(1u << Operation::OP_TRAINING_MATRIX):(0u))
+         | (std::is_base_of<T, ALUVectorOperation>::value?(1u << Operation::OP_ALU_VECTOR):(0u))
+         | (std::is_base_of<T, SetImmediateOperation>::value?(1u << Operation::OP_SET_IMMEDIATE):(0u))
+         | (std::is_base_of<T, CopyOperation>::value?(1u << Operation::OP_COPY):(0u))
+         | (std::is_base_of<T, LoadOperation>::value?(1u << Operation::OP_LOAD):(0u))
+         | (std::is_base_of<T, StoreOperation>::value?(1u << Operation::OP_STORE):(0u))
+         | (std::is_base_of<T, SendOperation>::value?(1u << Operation::OP_SEND):(0u))
+         | (std::is_base_of<T, ReceiveOperation>::value?(1u << Operation::OP_RECEIVE):(0u))
+         | (std::is_base_of<T, WriteInputOperation>::value?(1u << Operation::OP_WRITE_INPUT):(0u))
+         | (std::is_base_of<T, ReadOutputOperation>::value?(1u << Operation::OP_READ_OUTPUT):(0u))
+         | (std::is_base_of<T, PseudoInputOperation>::value?(1u << Operation::OP_PSEUDO_INPUT):(0u))
+         | (std::is_base_of<T, PseudoOutputOperation>::value?(1u << Operation::OP_PSEUDO_OUTPUT):(0u))
+         | (std::is_base_of<T, LoopBeginOperation>::value?(1u << Operation::OP_LOOP_BEGIN):(0u))
+         | (std::is_base_of<T, LoopEndOperation>::value?(1u << Operation::OP_LOOP_END):(0u));
+}
+
+template <class T>
+class OperationCaster : public OperationVisitor {
+
+    private:
+
+        T* result_;
+
+        template <class U> void cast(U* op, std::true_type) { result_ = op; }
+        template <class U> void cast(U* op, std::false_type) { }
+
+    public:
+
+        OperationCaster() : result_(NULL) { }
+
+        T* getResult() { return result_; }
+
+        void visit(MVMOperation* op) { cast(op, std::is_base_of<T, MVMOperation>()); }
+        void visit(TrainingMatrixOperation* op) { cast(op, std::is_base_of<T, TrainingMatrixOperation>()); }
+        void visit(ALUVectorOperation* op) { cast(op, std::is_base_of<T, ALUVectorOperation>()); }
+        void visit(SetImmediateOperation* op) { cast(op, std::is_base_of<T, SetImmediateOperation>()); }
+        void visit(CopyOperation* op) { cast(op, std::is_base_of<T, CopyOperation>()); }
+        void visit(LoadOperation* op) { cast(op, std::is_base_of<T, LoadOperation>()); }
+        void visit(StoreOperation* op) { cast(op, std::is_base_of<T, StoreOperation>()); }
+        void visit(SendOperation* op) { cast(op, std::is_base_of<T, SendOperation>()); }
+        void visit(ReceiveOperation* op) { cast(op, std::is_base_of<T, ReceiveOperation>()); }
+        void visit(WriteInputOperation* op) { cast(op, std::is_base_of<T, WriteInputOperation>()); }
+        void visit(ReadOutputOperation* op) { cast(op, std::is_base_of<T, ReadOutputOperation>()); }
+        void visit(PseudoInputOperation* op) { cast(op, std::is_base_of<T, PseudoInputOperation>()); }
+        void visit(PseudoOutputOperation* op) { cast(op, std::is_base_of<T, PseudoOutputOperation>()); }
+        void visit(LoopBeginOperation* op) { cast(op, std::is_base_of<T, LoopBeginOperation>()); }
+        void visit(LoopEndOperation* op) { cast(op, std::is_base_of<T, LoopEndOperation>()); }
+
+};
+
+/* Replacement for dynamic_cast on operations: the kind tag rejects mismatches without touching RTTI */
+template <class T>
+bool op_isa(Operation* op) {
+    return op != NULL && (opKindMask<T>() & (1u << op->getKind()));
+}
+
+template <class T>
+T* op_cast(Operation* op) {
+    if(!op_isa<T>(op)) {
+        return NULL;
+    }
+    OperationCaster<T> caster;
+    op->accept(caster);
+    return caster.getResult();
+}
+
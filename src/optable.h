@@ -0,0 +1,141 @@
+/*
+ *  Copyright (c) 2019 IMPACT Research Group, University of Illinois.
+ *  All rights reserved.
+ *
+ *  This file is covered by the LICENSE.txt license file in the root directory.
+ *
+ */
+
+#ifndef _OPTABLE_H_
+#define _OPTABLE_H_
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "common.h"
+
+/* Orders operations by ID so that iterating over a set of operations does not depend on heap addresses */
+struct OperationIdLess {
+    template <class T>
+    bool operator()(T* op1, T* op2) const { return op1->getId() < op2->getId(); }
+};
+
+/*
+ * Side table that associates a value with operations, indexed by operation ID. Values are stored in segments of doubling
+ * size that are never moved, so references to values stay valid when the table grows, and operations with different IDs
+ * can be accessed concurrently (e.g., by passes running on different cores in parallel). Members are templated on the
+ * operation type so that they can be used with pointers to any class of the operation hierarchy.
+ */
+template <class T>
+class OperationTable {
+
+    private:
+
+        static const unsigned int FIRST_SEGMENT_BITS = 10;
+        static const unsigned int N_SEGMENTS = 32 - FIRST_SEGMENT_BITS;
+
+        struct Entry {
+            T value;
+            bool isSet;
+            Entry() : value(), isSet(false) { }
+        };
+
+        std::atomic<Entry*> segments_[N_SEGMENTS]; // Segment s holds the 2^(s + FIRST_SEGMENT_BITS) entries after those of segment s - 1
+        std::mutex growMutex_;
+
+        OperationTable(const OperationTable&);
+        OperationTable& operator=(const OperationTable&);
+
+        static unsigned int getSegment(unsigned int id) { return 31 - __builtin_clz(id + (1u << FIRST_SEGMENT_BITS)) - FIRST_SEGMENT_BITS; }
+        static unsigned int getOffset(unsigned int id, unsigned int segment) { return id + (1u << FIRST_SEGMENT_BITS) - (1u << (segment + FIRST_SEGMENT_BITS)); }
+
+        Entry* findEntry(unsigned int id) const {
+            unsigned int segment = getSegment(id);
+            Entry* entries = segments_[segment].load(std::memory_order_acquire);
+            return (entries != NULL)?(&entries[getOffset(id, segment)]):(NULL);
+        }
+
+        Entry* getEntry(unsigned int id) {
+            unsigned int segment = getSegment(id);
+            Entry* entries = segments_[segment].load(std::memory_order_acquire);
+            if(entries == NULL) {
+                std::lock_guard<std::mutex> lock(growMutex_);
+                entries = segments_[segment].load(std::memory_order_relaxed);
+                if(entries == NULL) {
+                    entries = new Entry[1u << (segment + FIRST_SEGMENT_BITS)];
+                    segments_[segment].store(entries, std::memory_order_release);
+                }
+            }
+            return &entries[getOffset(id, segment)];
+        }
+
+    public:
+
+        OperationTable() {
+            for(unsigned int s = 0; s < N_SEGMENTS; ++s) {
+                segments_[s].store(NULL, std::memory_order_relaxed);
+            }
+        }
+
+        ~OperationTable() {
+            for(unsigned int s = 0; s < N_SEGMENTS; ++s) {
+                delete[] segments_[s].load(std::memory_order_relaxed);
+            }
+        }
+
+        template <class Op>
+        bool count(Op* op) const {
+            Entry* entry = findEntry(op->getId());
+            return entry != NULL && entry->isSet;
+        }
+
+        template <class Op>
+        T& operator[](Op* op) {
+            Entry* entry = getEntry(op->getId());
+            entry->isSet = true;
+            return entry->value;
+        }
+
+        template <class Op>
+        void erase(Op* op) {
+            Entry* entry = findEntry(op->getId());
+            if(entry != NULL && entry->isSet) {
+                entry->isSet = false;
+                entry->value = T();
+            }
+        }
+
+};
+
+/* Set of operations stored as a bit vector indexed by operation ID (not safe for concurrent updates) */
+class OperationSet {
+
+    private:
+
+        std::vector<bool> isMember_;
+
+    public:
+
+        template <class Op>
+        bool count(Op* op) const { return op->getId() < isMember_.size() && isMember_[op->getId()]; }
+
+        template <class Op>
+        void insert(Op* op) {
+            if(op->getId() >= isMember_.size()) {
+                isMember_.resize(op->getId() + 1, false);
+            }
+            isMember_[op->getId()] = true;
+        }
+
+        template <class Op>
+        void erase(Op* op) {
+            if(count(op)) {
+                isMember_[op->getId()] = false;
+            }
+        }
+
+};
+
+#endif
+
@@ -0,0 +1,45 @@
+/*
+ *  Copyright (c) 2019 IMPACT Research Group, University of Illinois.
+ *  All rights reserved.
+ *
+ *  This file is covered by the LICENSE.txt license file in the root directory.
+ *
+ */
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "puma.h"
+
+#include "parallel.h"
+
+void parallelFor(unsigned int nThreads, unsigned int n, const std::function<void(unsigned int)>& body) {
+    if(nThreads == 0) {
+        nThreads = std::thread::hardware_concurrency();
+    }
+    if(nThreads > n) {
+        nThreads = n;
+    }
+    if(nThreads <= 1) {
+        for(unsigned int i = 0; i < n; ++i) {
+            body(i);
+        }
+        return;
+    }
+    std::atomic<unsigned int> next(0);
+    auto worker = [&]() {
+        for(unsigned int i = next++; i < n; i = next++) {
+            body(i);
+        }
+    };
+    std::vector<std::thread> threads;
+    for(unsigned int t = 1; t < nThreads; ++t) {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for(std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
@@ -0,0 +1,24 @@
+/*
+ *  Copyright (c) 2019 IMPACT Research Group, University of Illinois.
+ *  All rights reserved.
+ *
+ *  This file is covered by the LICENSE.txt license file in the root directory.
+ *
+ */
+
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+#include <functional>
+
+#include "common.h"
+
+/*
+ * Runs body(i) for every i in [0, n) on a pool of up to nThreads threads (all hardware threads if nThreads is 0).
+ * Iterations are handed out in order but may complete in any order, so each iteration must only modify state that
+ * belongs to it or that is safe for concurrent use.
+ */
+void parallelFor(unsigned int nThreads, unsigned int n, const std::function<void(unsigned int)>& body);
+
+#endif
+
@@ -9,17 +9,21 @@
 #include <assert.h>
 #include <algorithm>
 #include <fstream>
+#include <functional>
+#include <set>
 #include <sstream>
 
 #include "puma.h"
 
+#include "graphpartitioner.h"
 #include "model.h"
 #include "operations.h"
 #include "partitioner.h"
 #include "tensors.h"
+#include "traversal.h"
 
-Partitioner::Partitioner(ModelImpl* model, CompilerOptions::GraphPartitioningScheme gp)
-    : model_(model), gp_(gp)
+Partitioner::Partitioner(ModelImpl* model, CompilerOptions::GraphPartitioningScheme gp, bool packMatrixTiles)
+    : model_(model), gp_(gp), packMatrixTiles_(packMatrixTiles)
 {
     switch(gp_) {
         case CompilerOptions::GP_ROW_MAJOR:
@@ -32,10 +36,14 @@ Partitioner::Partitioner(ModelImpl* model, CompilerOptions::GraphPartitioningSch
             assignVCoresInVMVMUOrder();
             assignVTilesInVMVMUOrder();
             break;
-        case CompilerOptions::GP_KAHIP: // FIXME: check whether KaHIP exists
-            assignVMVMUsInRowMajor(); // Doesn't matter which order is used because KaHIP will partition agnostically
-            assignVCoresWithKaHIP();
-            assignVTilesWithKaHIP();
+        case CompilerOptions::GP_KAHIP:
+        case CompilerOptions::GP_MULTILEVEL:
+            assignVMVMUsInRowMajor(); // Doesn't matter which order is used because the graph partitioner will partition agnostically
+            assignVCoresWithGraphPartitioner();
+            assignVTilesWithGraphPartitioner();
+            if(gp_ == CompilerOptions::GP_MULTILEVEL) {
+                keepVMVMUOrderIfCheaper(); // KaHIP results are used as they are
+            }
             break;
         case CompilerOptions::GP_RANDOM:
             assignVMVMUsRandomly();
@@ -44,10 +52,12 @@ Partitioner::Partitioner(ModelImpl* model, CompilerOptions::GraphPartitioningSch
             break;
         default: assert(0 && "Unrecognized graph partitioning scheme!");
     }
+    shapeReductionTrees();
     insertLoadsAndStores();
     insertSendsAndRecives();
     insertInputAndOutput();
     insertCopies();
+    assignStreamLoopPhases();
 }
 
 bool Partitioner::isVMVMUAssigned(Operation* op) {
@@ -70,6 +80,11 @@ unsigned int Partitioner::getVMVMU(ConstantMatrixTile* tile) {
     return cmat2vmvmu_[tile];
 }
 
+unsigned int Partitioner::getRowOffset(ConstantMatrixTile* tile) {
+    assert(cmat2rowoffset_.count(tile) && "Virtual MVMU not assigned!");
+    return cmat2rowoffset_[tile];
+}
+
 unsigned int Partitioner::getVCore(ConstantMatrixTile* tile) {
     return vmvmu2vcore_[getVMVMU(tile)];
 }
@@ -118,8 +133,8 @@ void Partitioner::assignVMVMUsInRowMajor() {
         }
         for(auto m = model_->conv_mat_begin(); m != model_->conv_mat_end(); ++m) {
             ConvolutionalConstantMatrixImpl* mat = *m;
-            for(unsigned int kh = 0; kh < mat->getKernelHeight(); ++kh) {
-                for(unsigned int kw = 0; kw < mat->getKernelWidth(); ++kw) {
+            for(unsigned int kh = 0; kh < mat->getNKernelHeightTiles(); ++kh) {
+                for(unsigned int kw = 0; kw < mat->getNKernelWidthTiles(); ++kw) {
                     for(unsigned int h = 0; h < mat->getNOutChannelTiles(); ++h) {
                         for(unsigned int w = 0; w < mat->getNInChannelTiles(); ++w) {
                             cmatTiles_.push_back(mat->getTile(kh, kw, h, w));
@@ -157,8 +172,8 @@ void Partitioner::assignVMVMUsInColMajor() {
         }
         for(auto m = model_->conv_mat_begin(); m != model_->conv_mat_end(); ++m) {
             ConvolutionalConstantMatrixImpl* mat = *m;
-            for(unsigned int kh = 0; kh < mat->getKernelHeight(); ++kh) {
-                for(unsigned int kw = 0; kw < mat->getKernelWidth(); ++kw) {
+            for(unsigned int kh = 0; kh < mat->getNKernelHeightTiles(); ++kh) {
+                for(unsigned int kw = 0; kw < mat->getNKernelWidthTiles(); ++kw) {
                     for(unsigned int w = 0; w < mat->getNInChannelTiles(); ++w) {
                         for(unsigned int h = 0; h < mat->getNOutChannelTiles(); ++h) {
                             cmatTiles_.push_back(mat->getTile(kh, kw, h, w));
@@ -196,8 +211,8 @@ void Partitioner::assignVMVMUsRandomly() {
         }
         for(auto m = model_->conv_mat_begin(); m != model_->conv_mat_end(); ++m) {
             ConvolutionalConstantMatrixImpl* mat = *m;
-            for(unsigned int kh = 0; kh < mat->getKernelHeight(); ++kh) {
-                for(unsigned int kw = 0; kw < mat->getKernelWidth(); ++kw) {
+            for(unsigned int kh = 0; kh < mat->getNKernelHeightTiles(); ++kh) {
+                for(unsigned int kw = 0; kw < mat->getNKernelWidthTiles(); ++kw) {
                     for(unsigned int h = 0; h < mat->getNOutChannelTiles(); ++h) {
                         for(unsigned int w = 0; w < mat->getNInChannelTiles(); ++w) {
                             cmatTiles_.push_back(mat->getTile(kh, kw, h, w));
@@ -235,9 +250,27 @@ void Partitioner::assignVMVMUsAndSpreadAffinity() {
 
     // Assign matrix tiles to virtual MVMUs
     if(model_->getModelType() == ModelImpl::INFERENCE) {
+        std::vector<unsigned int> freeRows; // Indexed by virtual MVMU, excluding the reserved ones
         for(ConstantMatrixTile* tile : cmatTiles_) {
-            unsigned int vMVMU = nVMVMUs_++;
+            // An MVM computes every row of its crossbar but only reads its own rows from the output registers, so tiles
+            // with disjoint rows can share an MVMU (each tile's columns start at 0 and read its own input vector)
+            unsigned int vMVMU = nVMVMUs_;
+            if(packMatrixTiles_) {
+                for(unsigned int i = 0; i < freeRows.size(); ++i) {
+                    if(freeRows[i] >= tile->height()) {
+                        vMVMU = 2 + i; // First fit
+                        break;
+                    }
+                }
+            }
+            if(vMVMU == nVMVMUs_) {
+                ++nVMVMUs_;
+                freeRows.push_back(MVMU_DIM);
+            }
             cmat2vmvmu_[tile] = vMVMU;
+            cmat2rowoffset_[tile] = MVMU_DIM - freeRows[vMVMU - 2];
+            freeRows[vMVMU - 2] -= tile->height();
+            numMatrixCells_ += tile->height()*tile->width();
             for(unsigned int u = 0; u < tile->numUsers(); ++u) {
                 MVMOperation* mvm = tile->getUser(u);
                 assignVMVMU(mvm, vMVMU);
@@ -245,6 +278,7 @@ void Partitioner::assignVMVMUsAndSpreadAffinity() {
                 spreadVMVMUAffinityToUsers(mvm);
             }
         }
+        numConstantVMVMUs_ = freeRows.size();
     } else if(model_->getModelType() == ModelImpl::TRAINING) {
         for(TrainingMatrixTile* tile : tmatTiles_) {
             unsigned int vMVMU = nVMVMUs_++;
@@ -259,23 +293,48 @@ void Partitioner::assignVMVMUsAndSpreadAffinity() {
     }
 
     // Resolve assignment for operations with operands from different virtual MVMUs
-    for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
-        Operation* op = *it;
-        if(ConsumerOperation* consumer = dynamic_cast<ConsumerOperation*>(op)) {
-            if(!isVMVMUAssigned(consumer)) {
-                for(unsigned int o = 0; o < consumer->numOperands(); ++o) {
-                    ProducerOperation* operand = consumer->getOperand(o);
-                    if(isVMVMUAssigned(operand)) {
-                        // TODO: Heuristic for which MVMU to assign to if not all operands are assigned to MVMUs.
-                        //       Currently assigning to MVMU of first operand that is assigned (if any).
-                        cloneAssignment(operand, consumer);
-                        spreadVMVMUAffinityToOperands(consumer);
-                        if(ProducerOperation* producer = dynamic_cast<ProducerOperation*>(consumer)) {
-                            spreadVMVMUAffinityToUsers(producer);
+    bool assignmentChanged = true;
+    while(assignmentChanged) {
+        assignmentChanged = false;
+        for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
+            Operation* op = *it;
+            if(!isVMVMUAssigned(op)) {
+                // TODO: Heuristic for which MVMU to assign to if not all operands are assigned to MVMUs.
+                //       Currently assigning to MVMU of first operand that is assigned (if any).
+                Operation* assignFrom = NULL;
+                if(ConsumerOperation* consumer = op_cast<ConsumerOperation>(op)) {
+                    for(unsigned int o = 0; o < consumer->numOperands(); ++o) {
+                        if(isVMVMUAssigned(consumer->getOperand(o))) {
+                            assignFrom = consumer->getOperand(o);
+                            break;
                         }
-                        break;
                     }
                 }
+                // Stream buffers are connected to their readers through tile memory rather than registers
+                if(assignFrom == NULL) {
+                    if(LoadOperation* load = op_cast<LoadOperation>(op)) {
+                        if(isVMVMUAssigned(load->getSrc(0))) {
+                            assignFrom = load->getSrc(0);
+                        }
+                    } else if(StoreOperation* store = op_cast<StoreOperation>(op)) {
+                        for(auto u = store->user_begin(); u != store->user_end(); ++u) {
+                            if(isVMVMUAssigned(*u)) {
+                                assignFrom = *u;
+                                break;
+                            }
+                        }
+                    }
+                }
+                if(assignFrom != NULL) {
+                    cloneAssignment(assignFrom, op);
+                    if(ConsumerOperation* consumer = op_cast<ConsumerOperation>(op)) {
+                        spreadVMVMUAffinityToOperands(consumer);
+                    }
+                    if(ProducerOperation* producer = op_cast<ProducerOperation>(op)) {
+                        spreadVMVMUAffinityToUsers(producer);
+                    }
+                    assignmentChanged = true;
+                }
             }
         }
     }
@@ -283,13 +342,18 @@ void Partitioner::assignVMVMUsAndSpreadAffinity() {
 }
 
 void Partitioner::spreadVMVMUAffinityToOperands(ConsumerOperation* op) {
-    for(unsigned int o = 0; o < op->numOperands(); ++o) {
-        ProducerOperation* producer = op->getOperand(o);
-        if(!isVMVMUAssigned(producer) && !dynamic_cast<MVMOperation*>(producer) && !dynamic_cast<TrainingMatrixOperation*>(producer)) {
+    auto getOperands = [](Operation* node, std::vector<Operation*>& operands) {
+        ConsumerOperation* consumer = op_cast<ConsumerOperation>(node);
+        for(unsigned int o = 0; o < consumer->numOperands(); ++o) {
+            operands.push_back(consumer->getOperand(o));
+        }
+    };
+    auto spreadToOperand = [&](Operation* consumer, Operation* operand) {
+        ProducerOperation* producer = op_cast<ProducerOperation>(operand);
+        if(!isVMVMUAssigned(producer) && !op_cast<MVMOperation>(producer) && !op_cast<TrainingMatrixOperation>(producer)) {
             bool allUsersAssigned = true;
             for(auto u = producer->user_begin(); u != producer->user_end(); ++u) {
-                ConsumerOperation* consumer = *u;
-                if(!isVMVMUAssigned(consumer)) {
+                if(!isVMVMUAssigned(*u)) {
                     allUsersAssigned = false;
                     break;
                 }
@@ -297,23 +361,26 @@ void Partitioner::spreadVMVMUAffinityToOperands(ConsumerOperation* op) {
             if(allUsersAssigned) {
                 // TODO: Heuristic for which MVMU to select if users assigned to different MVMUs.
                 //       Currently just assigning to same MVMU as last user processed.
-                cloneAssignment(op, producer);
-                if(ConsumerOperation* consumer = dynamic_cast<ConsumerOperation*>(producer)) {
-                    spreadVMVMUAffinityToOperands(consumer);
-                }
+                cloneAssignment(consumer, producer);
+                return op_cast<ConsumerOperation>(producer) != NULL; // Continue spreading to its operands
             }
         }
-    }
+        return false;
+    };
+    spreadDepthFirst<Operation*>(op, getOperands, spreadToOperand);
 }
 
 void Partitioner::spreadVMVMUAffinityToUsers(ProducerOperation* op) {
-    for(auto u = op->user_begin(); u != op->user_end(); ++u) {
-        ConsumerOperation* consumer = *u;
-        if(!isVMVMUAssigned(consumer) && !dynamic_cast<MVMOperation*>(consumer) && !dynamic_cast<TrainingMatrixOperation*>(consumer)) {
+    auto getUsers = [](Operation* node, std::vector<Operation*>& users) {
+        ProducerOperation* producer = op_cast<ProducerOperation>(node);
+        users.insert(users.end(), producer->user_begin(), producer->user_end());
+    };
+    auto spreadToUser = [&](Operation* producer, Operation* user) {
+        ConsumerOperation* consumer = op_cast<ConsumerOperation>(user);
+        if(!isVMVMUAssigned(consumer) && !op_cast<MVMOperation>(consumer) && !op_cast<TrainingMatrixOperation>(consumer)) {
             bool allOperandsAssigned = true;
             for(unsigned int o = 0; o < consumer->numOperands(); ++o) {
-                ProducerOperation* producer = consumer->getOperand(o);
-                if(!isVMVMUAssigned(producer)) {
+                if(!isVMVMUAssigned(consumer->getOperand(o))) {
                     allOperandsAssigned = false;
                     break;
                 }
@@ -321,14 +388,13 @@ void Partitioner::spreadVMVMUAffinityToUsers(ProducerOperation* op) {
             if(allOperandsAssigned) {
                 // TODO: Heuristic for which MVMU to select if operands assigned to different MVMUs.
                 //       Currently just assigning to same MVMU as last operand processed.
-                cloneAssignment(op, consumer);
-                if(ProducerOperation* producer = dynamic_cast<ProducerOperation*>(consumer)) {
-                    spreadVMVMUAffinityToUsers(producer);
-                }
+                cloneAssignment(producer, consumer);
+                return op_cast<ProducerOperation>(consumer) != NULL; // Continue spreading to its users
             }
         }
-    }
-
+        return false;
+    };
+    spreadDepthFirst<Operation*>(op, getUsers, spreadToUser);
 }
 
 void Partitioner::assignVCoresInVMVMUOrder() {
@@ -366,14 +432,82 @@ void Partitioner::assignVTilesInVMVMUOrder() {
 
 }
 
-void partitionGraphWithKaHIP(unsigned int numNodes, unsigned int numEdges, unsigned int numNodesPerPartition, std::vector<std::pair<unsigned int, unsigned int>>* edges, std::vector<unsigned int>& result) {
+void Partitioner::shapeReductionTrees() {
+
+    // Reduce partial results within each core first, then within each tile, and only then across tiles
+    for(auto it = model_->reduction_begin(); it != model_->reduction_end(); ++it) {
+        ReductionTree* tree = *it;
+        if(tree->numNodes() < 2) {
+            continue;
+        }
+        bool allLeavesAssigned = true;
+        for(unsigned int i = 0; i < tree->numLeaves(); ++i) {
+            allLeavesAssigned = allLeavesAssigned && isVMVMUAssigned(tree->getLeaf(i));
+        }
+        if(!allLeavesAssigned) {
+            continue;
+        }
+
+        // Group leaves by virtual tile and virtual core
+        std::map<unsigned int, std::map<unsigned int, std::vector<ProducerOperation*>>> leaves;
+        for(unsigned int i = 0; i < tree->numLeaves(); ++i) {
+            ProducerOperation* leaf = tree->getLeaf(i);
+            leaves[getVTile(leaf)][getVCore(leaf)].push_back(leaf);
+        }
+
+        // Start from the root's own tile and core so the final result is produced where its users were assigned
+        ProducerOperation* root = tree->getRoot();
+        std::vector<unsigned int> vTiles;
+        for(auto t : leaves) {
+            vTiles.push_back(t.first);
+        }
+        orderReductionGroups(vTiles, getVTile(root));
+        tree->startReshape();
+        std::vector<ProducerOperation*> tileSums;
+        for(unsigned int vTile : vTiles) {
+            std::vector<unsigned int> vCores;
+            for(auto c : leaves[vTile]) {
+                vCores.push_back(c.first);
+            }
+            orderReductionGroups(vCores, getVCore(root));
+            std::vector<ProducerOperation*> coreSums;
+            for(unsigned int vCore : vCores) {
+                coreSums.push_back(tree->reduce(leaves[vTile][vCore]));
+            }
+            tileSums.push_back(tree->reduce(coreSums));
+        }
+        tree->reduce(tileSums);
+        assert(tree->isReshaped() && "Reduction tree must use all of its nodes!");
+
+        // Each internal node executes with its first operand, which is where the partial results are local
+        for(unsigned int n = 0; n < tree->numNodes(); ++n) {
+            op2vmvmu_.erase(tree->getNode(n));
+        }
+        for(unsigned int n = 0; n < tree->numNodes(); ++n) {
+            ALUVectorOperation* node = tree->getNode(n);
+            assignVMVMU(node, getVMVMU(node->getOperand(0)));
+        }
+    }
+
+}
+
+void Partitioner::orderReductionGroups(std::vector<unsigned int>& groups, unsigned int first) {
+    // Move the group of the root to the front, keeping the others in order
+    auto it = std::find(groups.begin(), groups.end(), first);
+    if(it != groups.end()) {
+        std::rotate(groups.begin(), it, it + 1);
+    }
+}
+
+static void partitionGraphWithKaHIP(WeightedGraph& graph, unsigned int numNodesPerPartition, std::vector<unsigned int>& result) {
 
     // Output graph file
+    unsigned int numNodes = graph.numNodes();
     std::ofstream graphOut("kahip_input.graph", std::ofstream::out);
-    graphOut << numNodes << " " << numEdges << " 11" << std::endl;
+    graphOut << numNodes << " " << graph.numEdges() << " 11" << std::endl;
     for(unsigned int node = 0; node < numNodes; ++node) {
         graphOut << "1 "; // All nodes have weight 1
-        for(auto edge : edges[node]) {
+        for(auto edge : graph.getNeighbors(node)) {
             graphOut << edge.first + 1 /* destination node */ << " " << edge.second /* edge weight */ << " ";
         }
         graphOut << std::endl;
@@ -386,116 +520,250 @@ void partitionGraphWithKaHIP(unsigned int numNodes, unsigned int numEdges, unsig
     double imbalance = (double)(numPartitions*numNodesPerPartition)/((double)(numNodes)) - 1;
     cmd << "kaffpaE ./kahip_input.graph --k=" << numPartitions << " --imbalance="<< imbalance
         << " --preconfiguration=strong --output_filename=kahip_partition_result"; 
-    system(cmd.str().c_str());
+    int status = system(cmd.str().c_str());
+    assert(status == 0 && "Graph partitioning error: kaffpaE failed, make sure that KaHIP is installed!");
 
     // Input result file
     std::ifstream resultIn("kahip_partition_result", std::ifstream::in);
     for(unsigned int node = 0; node < numNodes; ++node) {
         resultIn >> result[node];
     }
+    assert(resultIn && "Graph partitioning error: cannot read the partition computed by KaHIP!");
     resultIn.close();
 
 }
 
-void Partitioner::assignVCoresWithKaHIP() {
+void Partitioner::buildCommunicationGraph(WeightedGraph& graph, const std::function<unsigned int(Operation*)>& getUnit) {
 
-    // Build graph
-    unsigned int numNodes = nVMVMUs_ - 2;
-    unsigned int numEdges = 0;
-    std::vector<std::pair<unsigned int, unsigned int>> edges[numNodes];
+    // Graph nodes are the units (virtual MVMUs or cores) that operations are assigned to, excluding units 0 and 1 which
+    // are reserved for input and output
+    auto addEdge = [&](unsigned int unit1, unsigned int unit2, unsigned int weight) {
+        if(unit1 >= 2 && unit2 >= 2 && unit1 != unit2) {
+            graph.addEdge(unit1 - 2, unit2 - 2, weight);
+        }
+    };
+
+    // A value used on several units costs one transfer for each extra unit it is spread over, which is approximated by
+    // connecting every pair of these units so that splitting them into n groups costs about n - 1 transfers
+    auto addClique = [&](std::set<unsigned int>& units, unsigned int length) {
+        unsigned int weight = std::max(1u, length/std::max(1u, (unsigned int)units.size() - 1));
+        for(unsigned int unit1 : units) {
+            for(unsigned int unit2 : units) {
+                if(unit1 < unit2) {
+                    addEdge(unit1, unit2, weight);
+                }
+            }
+        }
+    };
+
+    // Reduction trees are reshaped to reduce within cores and tiles first, so their leaves only need to be kept together
+    OperationSet isReductionNode;
+    for(auto it = model_->reduction_begin(); it != model_->reduction_end(); ++it) {
+        ReductionTree* tree = *it;
+        if(tree->numNodes() < 2) {
+            continue;
+        }
+        for(unsigned int n = 0; n < tree->numNodes(); ++n) {
+            isReductionNode.insert(tree->getNode(n));
+        }
+        std::set<unsigned int> units;
+        for(unsigned int i = 0; i < tree->numLeaves(); ++i) {
+            units.insert(getUnit(tree->getLeaf(i)));
+        }
+        addClique(units, tree->getRoot()->length());
+    }
+
+    // Other values are spread over the unit producing them and the units using them
     for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
-        Operation* op = *it;
-        if(ProducerOperation* producer = dynamic_cast<ProducerOperation*>(op)) {
-            unsigned int producerNodeID = getVMVMU(producer) - 2;
+        if(ProducerOperation* producer = op_cast<ProducerOperation>(*it)) {
+            std::set<unsigned int> units;
             for(auto u = producer->user_begin(); u != producer->user_end(); ++u) {
-                ConsumerOperation* consumer = *u;
-                unsigned int consumerNodeID = getVMVMU(consumer) - 2;
-                if(producerNodeID != consumerNodeID) {
-                    edges[producerNodeID].push_back(std::make_pair(consumerNodeID, producer->length()));
-                    edges[consumerNodeID].push_back(std::make_pair(producerNodeID, producer->length()));
-                    ++numEdges;
+                if(!isReductionNode.count(*u)) {
+                    units.insert(getUnit(*u));
                 }
             }
+            if(!units.empty()) {
+                units.insert(getUnit(producer));
+                addClique(units, producer->length());
+            }
+        }
+    }
+
+}
+
+unsigned int Partitioner::partitionGraph(WeightedGraph& graph, unsigned int numNodesPerPartition, std::vector<unsigned int>& result) {
+    result.resize(graph.numNodes());
+    if(gp_ == CompilerOptions::GP_KAHIP) {
+        partitionGraphWithKaHIP(graph, numNodesPerPartition, result);
+        return (graph.numNodes() - 1)/numNodesPerPartition + 1;
+    } else {
+        MultilevelPartitioner partitioner(graph, numNodesPerPartition, model_->getNThreads());
+        for(unsigned int node = 0; node < graph.numNodes(); ++node) {
+            result[node] = partitioner.getPart(node);
         }
+        return partitioner.getNParts();
     }
+}
+
+void Partitioner::assignVCoresWithGraphPartitioner() {
+
+    // Build graph of the data exchanged between virtual MVMUs
+    WeightedGraph graph(nVMVMUs_ - 2);
+    buildCommunicationGraph(graph, [&](Operation* op) { return getVMVMU(op); });
 
-    // Call KaHIP
+    // Partition graph
     unsigned int nMVMUSPerCore = (model_->getModelType() == ModelImpl::INFERENCE)?(N_CONSTANT_MVMUS_PER_CORE):(N_TRAINING_MVMUS_PER_CORE);
-    unsigned int numNodesPerPartition = nMVMUSPerCore;
-    std::vector<unsigned int> result(numNodes);
-    partitionGraphWithKaHIP(numNodes, numEdges, numNodesPerPartition, edges, result);
+    std::vector<unsigned int> result;
+    unsigned int numPartitions = partitionGraph(graph, nMVMUSPerCore, result);
 
     // Process result
-    unsigned int numPartitions = (numNodes - 1)/numNodesPerPartition + 1;
     nVCores_ = numPartitions + 2;
     vmvmu2vcore_.resize(nVMVMUs_);
     vmvmu2vcore_[0] = 0;
     vmvmu2vcore_[1] = 1;
-    for(unsigned int node = 0; node < numNodes; ++node) {
+    for(unsigned int node = 0; node < graph.numNodes(); ++node) {
         vmvmu2vcore_[node + 2] = result[node] + 2;
     }
 
 }
 
-void Partitioner::assignVTilesWithKaHIP() {
+void Partitioner::assignVTilesWithGraphPartitioner() {
 
-    // Build graph
-    unsigned int numNodes = nVCores_ - 2;
-    unsigned int numEdges = 0;
-    std::vector<std::pair<unsigned int, unsigned int>> edges[numNodes];
-    for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
-        Operation* op = *it;
-        if(ProducerOperation* producer = dynamic_cast<ProducerOperation*>(op)) {
-            unsigned int producerNodeID = getVCore(producer) - 2;
-            for(auto u = producer->user_begin(); u != producer->user_end(); ++u) {
-                ConsumerOperation* consumer = *u;
-                unsigned int consumerNodeID = getVCore(producer) - 2;
-                if(producerNodeID != consumerNodeID) {
-                    edges[producerNodeID].push_back(std::make_pair(consumerNodeID, producer->length()));
-                    edges[consumerNodeID].push_back(std::make_pair(producerNodeID, producer->length()));
-                    ++numEdges;
-                }
-            }
-        }
-    }
+    // Build graph of the data exchanged between virtual cores
+    WeightedGraph graph(nVCores_ - 2);
+    buildCommunicationGraph(graph, [&](Operation* op) { return getVCore(op); });
 
-    // Call KaHIP
-    unsigned int numNodesPerPartition = N_CORES_PER_TILE;
-    std::vector<unsigned int> result(numNodes);
-    partitionGraphWithKaHIP(numNodes, numEdges, numNodesPerPartition, edges, result);
+    // Partition graph
+    std::vector<unsigned int> result;
+    unsigned int numPartitions = partitionGraph(graph, N_CORES_PER_TILE, result);
 
     // Process result
-    unsigned int numPartitions = (numNodes - 1)/numNodesPerPartition + 1;
     nVTiles_ = numPartitions + 2;
     vcore2vtile_.resize(nVCores_);
     vcore2vtile_[0] = 0;
     vcore2vtile_[1] = 1;
-    for(unsigned int node = 0; node < numNodes; ++node) {
+    for(unsigned int node = 0; node < graph.numNodes(); ++node) {
         vcore2vtile_[node + 2] = result[node] + 2;
     }
 
 }
 
+void Partitioner::keepVMVMUOrderIfCheaper() {
+
+    // The cut of the communication graph only approximates the data transferred, so fall back to assigning virtual MVMUs
+    // in order when that is estimated to transfer less
+    unsigned long partitionedSize = estimateTransferSize();
+    std::vector<unsigned int> vmvmu2vcore = vmvmu2vcore_;
+    std::vector<unsigned int> vcore2vtile = vcore2vtile_;
+    unsigned int nVCores = nVCores_;
+    unsigned int nVTiles = nVTiles_;
+    assignVCoresInVMVMUOrder();
+    assignVTilesInVMVMUOrder();
+    if(estimateTransferSize() < partitionedSize) {
+        model_->getStatistics().bumpCounter("vmvmu_order_partitions_kept");
+    } else {
+        vmvmu2vcore_ = vmvmu2vcore;
+        vcore2vtile_ = vcore2vtile;
+        nVCores_ = nVCores;
+        nVTiles_ = nVTiles;
+    }
+
+}
+
+unsigned long Partitioner::estimateTransferSize() {
+
+    // Count the data that insertLoadsAndStores and insertSendsAndRecives would transfer for the current assignment
+    auto getSize = [](ProducerOperation* producer, Operation* op) {
+        StreamLoop* loop = op->getStreamLoop();
+        return (unsigned long)producer->length()*((loop != NULL)?(loop->nIterations()):(1));
+    };
+    unsigned long size = 0;
+
+    // Reduction trees will be reshaped to reduce within cores, then within tiles, so the partial result of each extra core
+    // in a tile costs a store and a load, and the partial result of each extra tile costs a store, a send, a receive, and a load
+    OperationSet isReductionNode;
+    OperationTable<unsigned int> rootVCores;
+    for(auto it = model_->reduction_begin(); it != model_->reduction_end(); ++it) {
+        ReductionTree* tree = *it;
+        if(tree->numNodes() < 2) {
+            continue;
+        }
+        bool allLeavesAssigned = true;
+        for(unsigned int i = 0; i < tree->numLeaves(); ++i) {
+            allLeavesAssigned = allLeavesAssigned && isVMVMUAssigned(tree->getLeaf(i));
+        }
+        if(!allLeavesAssigned) {
+            continue;
+        }
+        std::map<unsigned int, std::set<unsigned int>> vCores;
+        for(unsigned int i = 0; i < tree->numLeaves(); ++i) {
+            ProducerOperation* leaf = tree->getLeaf(i);
+            vCores[getVTile(leaf)].insert(getVCore(leaf));
+        }
+        for(unsigned int n = 0; n < tree->numNodes(); ++n) {
+            isReductionNode.insert(tree->getNode(n));
+        }
+        ProducerOperation* root = tree->getRoot();
+        unsigned int rootVTile = vCores.count(getVTile(root))?getVTile(root):vCores.begin()->first;
+        rootVCores[root] = vCores[rootVTile].count(getVCore(root))?getVCore(root):*vCores[rootVTile].begin();
+        for(auto t : vCores) {
+            size += (t.second.size() - 1)*2*getSize(root, root);
+        }
+        size += (vCores.size() - 1)*4*getSize(root, root);
+    }
+
+    // Other values are stored once, loaded once on every other core using them, and sent to every other tile using them
+    for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
+        if(ProducerOperation* producer = op_cast<ProducerOperation>(*it)) {
+            if(isReductionNode.count(producer) && !rootVCores.count(producer)) {
+                continue;
+            }
+            unsigned int vCore = rootVCores.count(producer)?rootVCores[producer]:getVCore(producer);
+            std::map<unsigned int, ConsumerOperation*> loads;
+            for(auto u = producer->user_begin(); u != producer->user_end(); ++u) {
+                ConsumerOperation* consumer = *u;
+                if(!isReductionNode.count(consumer) && getVCore(consumer) != vCore && !loads.count(getVCore(consumer))) {
+                    loads[getVCore(consumer)] = consumer;
+                }
+            }
+            if(!loads.empty()) {
+                size += getSize(producer, producer);
+                std::set<unsigned int> vTiles;
+                for(auto load : loads) {
+                    size += getSize(producer, load.second);
+                    vTiles.insert(getVTile(load.first));
+                }
+                vTiles.erase(getVTile(vCore));
+                size += vTiles.size()*2*getSize(producer, producer);
+            }
+        }
+    }
+
+    return size;
+
+}
+
 void Partitioner::insertLoadsAndStores() {
 
     // Insert loads and stores across cores
     for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
         Operation* op = *it;
-        if(ProducerOperation* producer = dynamic_cast<ProducerOperation*>(op)) {
+        if(ProducerOperation* producer = op_cast<ProducerOperation>(op)) {
             StoreOperation* store = NULL;
             std::map<unsigned int, LoadOperation*> loads;
-            for(auto u = producer->user_begin(); u != producer->user_end(); ) {
-                ConsumerOperation* consumer = *u;
-                ++u; // replaceOperand may remove consumer from producer's users
+            std::vector<ConsumerOperation*> users(producer->user_begin(), producer->user_end()); // Copy because the loop rewrites the users of producer
+            for(ConsumerOperation* consumer : users) {
                 if(getVCore(producer) != getVCore(consumer)) {
                     if(store == NULL) {
-                        store = new StoreOperation(model_, producer);
-                        numStores_ += store->length();
+                        store = new(model_) StoreOperation(model_, producer);
+                        store->setStreamLoop(producer->getStreamLoop());
+                        numStores_ += getTransferSize(store);
                         cloneAssignment(producer, store);
                     }
                     if(loads[getVCore(consumer)] == NULL) {
-                        LoadOperation* load = new LoadOperation(model_, store);
-                        numLoads_ += load->length();
+                        LoadOperation* load = new(model_) LoadOperation(model_, store);
+                        load->setStreamLoop(consumer->getStreamLoop());
+                        numLoads_ += getTransferSize(load);
                         cloneAssignment(consumer, load);
                         loads[getVCore(consumer)] = load;
                     }
@@ -512,18 +780,19 @@ void Partitioner::insertSendsAndRecives() {
     // Insert sends and receives across tiles
     for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
         Operation* op = *it;
-        if(StoreOperation* store = dynamic_cast<StoreOperation*>(op)) {
+        if(StoreOperation* store = op_cast<StoreOperation>(op)) {
             std::map<unsigned int, ReceiveOperation*> recvs;
-            for(auto u = store->user_begin(); u != store->user_end(); ) {
-                TileMemoryReadOperation* read = *u;
-                ++u; // replaceSrc may remove read from store's users
+            std::vector<TileMemoryReadOperation*> users(store->user_begin(), store->user_end()); // Copy because the loop rewrites the users of store
+            for(TileMemoryReadOperation* read : users) {
                 if(getVTile(store) != getVTile(read)) {
                     if(recvs[getVTile(read)] == NULL) {
-                        SendOperation* send = new SendOperation(model_, store);
-                        numSends_ += send->length();
+                        SendOperation* send = new(model_) SendOperation(model_, store);
+                        send->setStreamLoop(store->getStreamLoop());
+                        numSends_ += getTransferSize(send);
                         cloneAssignment(store, send);
-                        ReceiveOperation* recv = new ReceiveOperation(model_, send);
-                        numReceives_ += recv->length();
+                        ReceiveOperation* recv = new(model_) ReceiveOperation(model_, send);
+                        recv->setStreamLoop(store->getStreamLoop());
+                        numReceives_ += getTransferSize(recv);
                         cloneAssignment(read, recv);
                         recvs[getVTile(read)] = recv;
                     }
@@ -544,48 +813,55 @@ void Partitioner::insertInputAndOutput() {
     for(auto it = model_->op_begin(); it != model_->op_end(); ) {
         Operation* op = *it;
         ++it; // op might get removed from the graph
-        if(PseudoInputOperation* pseudoInput = dynamic_cast<PseudoInputOperation*>(op)) {
+        if(PseudoInputOperation* pseudoInput = op_cast<PseudoInputOperation>(op)) {
             InputVectorTile* src = pseudoInput->getSrc();
-            for(auto u = pseudoInput->user_begin(); u != pseudoInput->user_end(); ) {
-                ConsumerOperation* consumer = *u;
-                ++u; // replaceOperand may remove consumer from pseudoInput's users
+            std::vector<ConsumerOperation*> users(pseudoInput->user_begin(), pseudoInput->user_end()); // Copy because the loop rewrites the users of pseudoInput
+            for(ConsumerOperation* consumer : users) {
                 if(loads[src][getVCore(consumer)] == NULL) {
                     if(recvs[src][getVTile(consumer)] == NULL) {
                         if(inputs[src] == NULL) {
-                            WriteInputOperation* input = new WriteInputOperation(model_, src);
+                            WriteInputOperation* input = new(model_) WriteInputOperation(model_, src);
+                            input->setStreamLoop(pseudoInput->getStreamLoop());
                             assignVMVMU(input, 0);
                             inputs[src] = input;
                         }
-                        SendOperation* send = new SendOperation(model_, inputs[src]);
-                        numSends_ += send->length();
+                        SendOperation* send = new(model_) SendOperation(model_, inputs[src]);
+                        send->setStreamLoop(pseudoInput->getStreamLoop());
+                        numSends_ += getTransferSize(send);
                         cloneAssignment(inputs[src], send);
-                        ReceiveOperation* recv = new ReceiveOperation(model_, send);
-                        numReceives_ += recv->length();
+                        ReceiveOperation* recv = new(model_) ReceiveOperation(model_, send);
+                        recv->setStreamLoop(pseudoInput->getStreamLoop());
+                        numReceives_ += getTransferSize(recv);
                         cloneAssignment(consumer, recv);
                         recvs[src][getVTile(consumer)] = recv;
                     }
-                    LoadOperation* load = new LoadOperation(model_, recvs[src][getVTile(consumer)]);
-                    numLoads_ += load->length();
+                    LoadOperation* load = new(model_) LoadOperation(model_, recvs[src][getVTile(consumer)]);
+                    load->setStreamLoop(pseudoInput->getStreamLoop());
+                    numLoads_ += getTransferSize(load);
                     cloneAssignment(consumer, load);
                     loads[src][getVCore(consumer)] = load;
                 }
                 consumer->replaceOperand(pseudoInput, loads[src][getVCore(consumer)]);
             }
             unlink(pseudoInput);
-        } else if(PseudoOutputOperation* pseudoOutput = dynamic_cast<PseudoOutputOperation*>(op)) {
+        } else if(PseudoOutputOperation* pseudoOutput = op_cast<PseudoOutputOperation>(op)) {
             OutputVectorTile* dst = pseudoOutput->getDst();
             for(unsigned int o = 0; o < pseudoOutput->numOperands(); ++o) {
                 ProducerOperation* producer = pseudoOutput->getOperand(o);
-                StoreOperation* store = new StoreOperation(model_, producer);
-                numStores_ += store->length();
+                StoreOperation* store = new(model_) StoreOperation(model_, producer);
+                store->setStreamLoop(pseudoOutput->getStreamLoop());
+                numStores_ += getTransferSize(store);
                 cloneAssignment(pseudoOutput, store);
-                SendOperation* send = new SendOperation(model_, store);
-                numSends_ += send->length();
+                SendOperation* send = new(model_) SendOperation(model_, store);
+                send->setStreamLoop(pseudoOutput->getStreamLoop());
+                numSends_ += getTransferSize(send);
                 cloneAssignment(pseudoOutput, send);
-                ReceiveOperation* recv = new ReceiveOperation(model_, send);
-                numReceives_ += recv->length();
+                ReceiveOperation* recv = new(model_) ReceiveOperation(model_, send);
+                recv->setStreamLoop(pseudoOutput->getStreamLoop());
+                numReceives_ += getTransferSize(recv);
                 assignVMVMU(recv, 1);
-                ReadOutputOperation* output = new ReadOutputOperation(model_, recv, dst);
+                ReadOutputOperation* output = new(model_) ReadOutputOperation(model_, recv, dst);
+                output->setStreamLoop(pseudoOutput->getStreamLoop());
                 cloneAssignment(recv, output);
                 producer->removeUser(pseudoOutput);
             }
@@ -600,12 +876,12 @@ void Partitioner::insertCopies() {
     // Insert copy operations across producers and consumers that use different register spaces
     for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
         Operation* op = *it;
-        if(ConsumerOperation* consumer = dynamic_cast<ConsumerOperation*>(op)) {
-            bool isMatrixOperation = (dynamic_cast<MVMOperation*>(consumer) != NULL) || (dynamic_cast<TrainingMatrixOperation*>(consumer) != NULL);
+        if(ConsumerOperation* consumer = op_cast<ConsumerOperation>(op)) {
+            bool isMatrixOperation = (op_cast<MVMOperation>(consumer) != NULL) || (op_cast<TrainingMatrixOperation>(consumer) != NULL);
             if(isMatrixOperation) {
                 for(unsigned int o = 0; o < consumer->numOperands(); ++o) {
                     ProducerOperation* producer = consumer->getOperand(o);
-                    bool producerIsMatrixOperation = (dynamic_cast<MVMOperation*>(consumer) != NULL) || (dynamic_cast<TrainingMatrixOperation*>(consumer) != NULL);
+                    bool producerIsMatrixOperation = (op_cast<MVMOperation>(consumer) != NULL) || (op_cast<TrainingMatrixOperation>(consumer) != NULL);
                     bool producerHasMultipleUsers = (producer->numUsers() > 1);
                     if(producerIsMatrixOperation || producerHasMultipleUsers) {
                         /*
@@ -619,7 +895,9 @@ void Partitioner::insertCopies() {
                          * operation because the other users also need to access it. Therefore, a copy is inserted to the matix
                          * operation.
                          */
-                        CopyOperation* copy = new CopyOperation(model_, producer);
+                        CopyOperation* copy = new(model_) CopyOperation(model_, producer);
+                        model_->getStatistics().bumpCounter("copies_inserted");
+                        copy->setStreamLoop(consumer->getStreamLoop());
                         cloneAssignment(consumer, copy);
                         consumer->replaceOperand(producer, copy);
                     }
@@ -630,6 +908,102 @@ void Partitioner::insertCopies() {
 
 }
 
+void Partitioner::assignStreamLoopPhases() {
+
+    // Split stream loops where data crosses tiles, because sends and receives transfer whole stream buffers once the loop producing them is done
+    OperationTable<unsigned int> phases;
+    for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
+        Operation* op = *it;
+        if(op->getStreamLoop() != NULL) {
+            findStreamLoopPhase(op, phases);
+        }
+    }
+
+    // Values that cross phases go through tile memory, because a register only holds the value of the last iteration once
+    // the loop of the earlier phase is done
+    for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
+        Operation* op = *it;
+        if(ProducerOperation* producer = op_cast<ProducerOperation>(op)) {
+            if(phases.count(producer)) {
+                StoreOperation* store = NULL;
+                std::map<unsigned int, LoadOperation*> loads;
+                std::vector<ConsumerOperation*> users(producer->user_begin(), producer->user_end()); // Copy because the loop rewrites the users of producer
+                for(ConsumerOperation* consumer : users) {
+                    if(phases.count(consumer) && consumer->getStreamLoop() == producer->getStreamLoop() && phases[consumer] != phases[producer]) {
+                        if(store == NULL) {
+                            store = new(model_) StoreOperation(model_, producer);
+                            store->setStreamLoop(producer->getStreamLoop());
+                            numStores_ += getTransferSize(store);
+                            cloneAssignment(producer, store);
+                            phases[store] = phases[producer];
+                        }
+                        if(loads[phases[consumer]] == NULL) {
+                            LoadOperation* load = new(model_) LoadOperation(model_, store);
+                            load->setStreamLoop(consumer->getStreamLoop());
+                            numLoads_ += getTransferSize(load);
+                            cloneAssignment(consumer, load);
+                            phases[load] = phases[consumer];
+                            loads[phases[consumer]] = load;
+                        }
+                        consumer->replaceOperand(producer, loads[phases[consumer]]);
+                    }
+                }
+            }
+        }
+    }
+
+    for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
+        Operation* op = *it;
+        if(phases.count(op)) {
+            op->setStreamLoop(op->getStreamLoop()->getPhase(phases[op]));
+        }
+    }
+
+}
+
+unsigned int Partitioner::findStreamLoopPhase(Operation* op, OperationTable<unsigned int>& phases) {
+    if(!phases.count(op)) {
+        // An operation executes in the latest phase of its predecessors in the same loop, or one phase later if the predecessor is on another tile
+        auto getPredecessorsInLoop = [](Operation* node, std::vector<Operation*>& predecessors) {
+            if(ConsumerOperation* consumer = op_cast<ConsumerOperation>(node)) {
+                for(unsigned int o = 0; o < consumer->numOperands(); ++o) {
+                    predecessors.push_back(consumer->getOperand(o));
+                }
+            }
+            if(TileMemoryReadOperation* read = op_cast<TileMemoryReadOperation>(node)) {
+                for(unsigned int i = 0; i < read->numSrcs(); ++i) {
+                    predecessors.push_back(read->getSrc(i));
+                }
+            }
+            if(ReceiveOperation* recv = op_cast<ReceiveOperation>(node)) {
+                predecessors.push_back(recv->getSrc());
+            }
+            predecessors.erase(std::remove_if(predecessors.begin(), predecessors.end(), [&](Operation* predecessor) {
+                return predecessor->getStreamLoop() != node->getStreamLoop();
+            }), predecessors.end());
+        };
+        auto enter = [&](Operation* successor, Operation* predecessor) {
+            return !phases.count(predecessor);
+        };
+        auto leave = [&](Operation* node) {
+            unsigned int phase = 0;
+            std::vector<Operation*> predecessors;
+            getPredecessorsInLoop(node, predecessors);
+            for(Operation* predecessor : predecessors) {
+                phase = std::max(phase, phases[predecessor] + ((op_cast<SendOperation>(predecessor) != NULL)?1:0));
+            }
+            phases[node] = phase;
+        };
+        walkDepthFirst<Operation*>(op, getPredecessorsInLoop, enter, leave);
+    }
+    return phases[op];
+}
+
+unsigned int Partitioner::getTransferSize(Operation* op) {
+    StreamLoop* loop = op->getStreamLoop();
+    return (loop != NULL)?(op->length()*loop->nIterations()):(op->length());
+}
+
 void Partitioner::unlink(Operation* op) {
     op2vmvmu_.erase(op);
     model_->unlink(op);
@@ -657,9 +1031,12 @@ void Partitioner::printReport(std::ofstream& report) {
         case CompilerOptions::GP_COL_MAJOR:
             report << "graph partitioning scheme = column major" << std::endl;
             break;
-        case CompilerOptions::GP_KAHIP: // FIXME: check whether KaHIP exists
+        case CompilerOptions::GP_KAHIP:
             report << "graph partitioning scheme = KaHIP" << std::endl;
             break;
+        case CompilerOptions::GP_MULTILEVEL:
+            report << "graph partitioning scheme = multilevel" << std::endl;
+            break;
         case CompilerOptions::GP_RANDOM:
             report << "graph partitioning scheme = random" << std::endl;
             break;
@@ -671,5 +1048,11 @@ void Partitioner::printReport(std::ofstream& report) {
     report << "# send bytes = " << numSends_ << std::endl;
     report << "# receive bytes = " << numReceives_ << std::endl;
     report << "# send + receive bytes = " << numSends_ + numReceives_ << std::endl;
+    if(model_->getModelType() == ModelImpl::INFERENCE) {
+        report << "# MVMUs before matrix tile packing = " << cmatTiles_.size() << std::endl;
+        report << "# MVMUs after matrix tile packing = " << numConstantVMVMUs_ << std::endl;
+        report << "% crossbar occupancy before matrix tile packing = " << ((cmatTiles_.size() > 0)?(100.0*numMatrixCells_/(cmatTiles_.size()*MVMU_DIM*MVMU_DIM)):0.0) << "%" << std::endl;
+        report << "% crossbar occupancy after matrix tile packing = " << ((numConstantVMVMUs_ > 0)?(100.0*numMatrixCells_/(numConstantVMVMUs_*MVMU_DIM*MVMU_DIM)):0.0) << "%" << std::endl;
+    }
 }
 
@@ -7,11 +7,13 @@
  */
 
 #include <fstream>
+#include <functional>
 #include <map>
 #include <vector>
 #include <string>
 
 #include "common.h"
+#include "optable.h"
 
 class Partitioner {
 
@@ -20,6 +22,7 @@ class Partitioner {
 
         ModelImpl* model_;
         CompilerOptions::GraphPartitioningScheme gp_;
+        bool packMatrixTiles_;
 
         unsigned int nVMVMUs_;
         unsigned int nVCores_;
@@ -27,8 +30,9 @@ class Partitioner {
 
         std::vector<ConstantMatrixTile*> cmatTiles_;
         std::vector<TrainingMatrixTile*> tmatTiles_;
-        std::map<Operation*, unsigned int> op2vmvmu_;
+        OperationTable<unsigned int> op2vmvmu_;
         std::map<ConstantMatrixTile*, unsigned int> cmat2vmvmu_;
+        std::map<ConstantMatrixTile*, unsigned int> cmat2rowoffset_; /* First row of the tile in the crossbar of its MVMU */
         std::map<TrainingMatrixTile*, unsigned int> tmat2vmvmu_;
         std::vector<unsigned int> vmvmu2vcore_;
         std::vector<unsigned int> vcore2vtile_;
@@ -43,30 +47,42 @@ class Partitioner {
         unsigned int numStores_ = 0;
         unsigned int numSends_ = 0;
         unsigned int numReceives_ = 0;
+        unsigned long numMatrixCells_ = 0;
+        unsigned int numConstantVMVMUs_ = 0;
 
         void assignVMVMUsInRowMajor();
         void assignVMVMUsInColMajor();
         void assignVMVMUsRandomly();
         void assignVCoresInVMVMUOrder();
-        void assignVCoresWithKaHIP(); 
+        void assignVCoresWithGraphPartitioner();
         void assignVTilesInVMVMUOrder();
-        void assignVTilesWithKaHIP();
+        void assignVTilesWithGraphPartitioner();
+        void buildCommunicationGraph(WeightedGraph& graph, const std::function<unsigned int(Operation*)>& getUnit);
+        unsigned int partitionGraph(WeightedGraph& graph, unsigned int numNodesPerPartition, std::vector<unsigned int>& result);
+        void keepVMVMUOrderIfCheaper();
+        unsigned long estimateTransferSize();
+
+        void shapeReductionTrees();
+        void orderReductionGroups(std::vector<unsigned int>& groups, unsigned int first);
 
         void insertLoadsAndStores();
         void insertSendsAndRecives();
         void insertInputAndOutput();
         void insertCopies();
+        void assignStreamLoopPhases();
+        unsigned int findStreamLoopPhase(Operation* op, OperationTable<unsigned int>& phases);
 
         void unlink(Operation* op);
 
     public:
 
-        Partitioner(ModelImpl* model, CompilerOptions::GraphPartitioningScheme gp);
+        Partitioner(ModelImpl* model, CompilerOptions::GraphPartitioningScheme gp, bool packMatrixTiles);
 
         unsigned int getNVMVMUs() { return nVMVMUs_; }
         unsigned int getNVCores() { return nVCores_; }
         unsigned int getNVTiles() { return nVTiles_; }
         unsigned int getVMVMU(ConstantMatrixTile* tile);
+        unsigned int getRowOffset(ConstantMatrixTile* tile);
         unsigned int getVCore(ConstantMatrixTile* tile);
         unsigned int getVTile(ConstantMatrixTile* tile);
         unsigned int getVMVMU(TrainingMatrixTile* tile);
@@ -78,6 +94,8 @@ class Partitioner {
         unsigned int getVCore(unsigned int vMVMU) { return vmvmu2vcore_[vMVMU]; }
         unsigned int getVTile(unsigned int vCore) { return vcore2vtile_[vCore]; }
 
+        unsigned int getTransferSize(Operation* op);
+
         void cloneAssignment(Operation* cloneFrom, Operation* cloneTo);
 
         std::string printAssignment(Operation* op);
@@ -7,6 +7,7 @@
  */
 
 #include <assert.h>
+#include <cmath>
 #include <sstream>
 
 #include "puma.h"
@@ -16,8 +17,8 @@
 #include "partitioner.h"
 #include "placer.h"
 
-Placer::Placer(ModelImpl* model,Partitioner* partitioner)
-    : model_(model), partitioner_(partitioner)
+Placer::Placer(ModelImpl* model, Partitioner* partitioner, CompilerOptions::NoCTopology noc, unsigned int nocMeshWidth, unsigned int nocConcentration)
+    : model_(model), partitioner_(partitioner), noc_(noc), nocMeshWidth_(nocMeshWidth), nocConcentration_(nocConcentration)
 {
     assignPTiles();
     assignPCores();
@@ -26,17 +27,126 @@ Placer::Placer(ModelImpl* model,Partitioner* partitioner)
 
 void Placer::assignPTiles() {
 
-    // Assign virtual tiles to physical tiles
+    // Assign virtual tiles to physical tiles, starting from the identity assignment
     nPTiles_ = partitioner_->getNVTiles();
     vtile2ptile_.resize(partitioner_->getNVTiles());
-    vtile2ptile_[0] = 0; // Reserve tile 0 for sending inputs
-    vtile2ptile_[1] = 1; // Reserve tile 1 for receiving outputs
-    for(unsigned int vTile = 2; vTile < partitioner_->getNVTiles(); ++vTile) {
-        // TODO: implement a more intelligent virtual to physical tile assignment
-        unsigned int pTile = vTile;
-        vtile2ptile_[vTile] = pTile;
+    std::vector<unsigned int> ptile2vtile(nPTiles_);
+    for(unsigned int vTile = 0; vTile < partitioner_->getNVTiles(); ++vTile) {
+        vtile2ptile_[vTile] = vTile;
+        ptile2vtile[vTile] = vTile;
     }
+    std::vector<std::map<unsigned int, unsigned long>> traffic = getTileTraffic();
+    hopBytesBefore_ = getHopBytes(traffic);
+    hopBytesAfter_ = hopBytesBefore_;
+
+    // Tile 0 is reserved for sending inputs and tile 1 for receiving outputs, the others can be swapped
+    const unsigned int firstMovable = 2;
+    if(nPTiles_ < firstMovable + 2) {
+        return;
+    }
+    unsigned int nMovable = nPTiles_ - firstMovable;
+    std::mt19937 rng(0);
+    std::uniform_int_distribution<unsigned int> randomTile(firstMovable, nPTiles_ - 1);
+    std::uniform_real_distribution<double> randomProbability(0.0, 1.0);
+
+    // Change in hop-bytes when virtual tiles vTile1 and vTile2 swap physical tiles
+    auto getSwapDelta = [&](unsigned int vTile1, unsigned int vTile2) {
+        unsigned int pTile1 = vtile2ptile_[vTile1];
+        unsigned int pTile2 = vtile2ptile_[vTile2];
+        long delta = 0;
+        delta -= getHopBytes(vTile1, pTile1, traffic) + getHopBytes(vTile2, pTile2, traffic);
+        vtile2ptile_[vTile1] = pTile2;
+        vtile2ptile_[vTile2] = pTile1;
+        delta += getHopBytes(vTile1, pTile2, traffic) + getHopBytes(vTile2, pTile1, traffic);
+        vtile2ptile_[vTile1] = pTile1;
+        vtile2ptile_[vTile2] = pTile2;
+        return delta; // The traffic between vTile1 and vTile2 travels the same distance either way
+    };
+    auto swap = [&](unsigned int vTile1, unsigned int vTile2) {
+        std::swap(vtile2ptile_[vTile1], vtile2ptile_[vTile2]);
+        ptile2vtile[vtile2ptile_[vTile1]] = vTile1;
+        ptile2vtile[vtile2ptile_[vTile2]] = vTile2;
+    };
+
+    // Start at a temperature that accepts most uphill swaps
+    double temperature = 0.0;
+    for(unsigned int i = 0; i < nMovable; ++i) {
+        temperature += std::abs(getSwapDelta(randomTile(rng), randomTile(rng)));
+    }
+    temperature = 2.0*temperature/nMovable;
+
+    // Anneal, keeping the best assignment seen
+    long hopBytes = hopBytesBefore_;
+    std::vector<unsigned int> bestAssignment = vtile2ptile_;
+    double cooling = std::pow(0.001, 1.0/N_TEMPERATURES); // Cool down to a thousandth of the initial temperature
+    for(unsigned int t = 0; t < N_TEMPERATURES && temperature > 0.0; ++t) {
+        for(unsigned int m = 0; m < N_MOVES_PER_TILE_PER_TEMPERATURE*nMovable; ++m) {
+            unsigned int vTile1 = ptile2vtile[randomTile(rng)];
+            unsigned int vTile2 = ptile2vtile[randomTile(rng)];
+            if(vTile1 != vTile2) {
+                long delta = getSwapDelta(vTile1, vTile2);
+                if(delta <= 0 || randomProbability(rng) < std::exp(-delta/temperature)) {
+                    swap(vTile1, vTile2);
+                    hopBytes += delta;
+                    if(hopBytes < (long)hopBytesAfter_) {
+                        hopBytesAfter_ = hopBytes;
+                        bestAssignment = vtile2ptile_;
+                    }
+                }
+            }
+        }
+        temperature *= cooling;
+    }
+    vtile2ptile_ = bestAssignment;
+    assert(getHopBytes(traffic) == hopBytesAfter_ && "Inconsistent hop-bytes after tile placement!");
+
+}
+
+std::vector<std::map<unsigned int, unsigned long>> Placer::getTileTraffic() {
+
+    // Bytes sent between each pair of virtual tiles, in both directions
+    std::vector<std::map<unsigned int, unsigned long>> traffic(partitioner_->getNVTiles());
+    for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
+        if(SendOperation* send = op_cast<SendOperation>(*it)) {
+            unsigned int srcVTile = partitioner_->getVTile(send);
+            unsigned int dstVTile = partitioner_->getVTile(send->getDst());
+            if(srcVTile != dstVTile) {
+                unsigned int bytes = partitioner_->getTransferSize(send);
+                traffic[srcVTile][dstVTile] += bytes;
+                traffic[dstVTile][srcVTile] += bytes;
+            }
+        }
+    }
+    return traffic;
+
+}
 
+unsigned int Placer::getHops(unsigned int pTile1, unsigned int pTile2) {
+    unsigned int concentration = (noc_ == CompilerOptions::NOC_CMESH)?nocConcentration_:1;
+    assert(concentration > 0 && "Concentrated mesh needs at least one tile per router!");
+    unsigned int nRouters = (nPTiles_ + concentration - 1)/concentration;
+    unsigned int width = (nocMeshWidth_ > 0)?nocMeshWidth_:(unsigned int)std::ceil(std::sqrt((double)nRouters));
+    unsigned int router1 = pTile1/concentration;
+    unsigned int router2 = pTile2/concentration;
+    unsigned int x1 = router1%width, y1 = router1/width;
+    unsigned int x2 = router2%width, y2 = router2/width;
+    return ((x1 > x2)?(x1 - x2):(x2 - x1)) + ((y1 > y2)?(y1 - y2):(y2 - y1));
+}
+
+unsigned long Placer::getHopBytes(unsigned int vTile, unsigned int pTile, std::vector<std::map<unsigned int, unsigned long>>& traffic) {
+    unsigned long hopBytes = 0;
+    for(auto& neighbor : traffic[vTile]) {
+        hopBytes += neighbor.second*getHops(pTile, vtile2ptile_[neighbor.first]);
+    }
+    return hopBytes;
+}
+
+unsigned long Placer::getHopBytes(std::vector<std::map<unsigned int, unsigned long>>& traffic) {
+    unsigned long hopBytes = 0;
+    for(unsigned int vTile = 0; vTile < traffic.size(); ++vTile) {
+        hopBytes += getHopBytes(vTile, vtile2ptile_[vTile], traffic);
+    }
+    return hopBytes/2; // Each pair of tiles is counted from both ends
 }
 
 void Placer::assignPCores() {
@@ -125,3 +235,17 @@ std::string Placer::printAssignment(Operation* op) {
     return ss.str();
 }
 
+void Placer::printReport(std::ofstream& report) {
+    switch(noc_) {
+        case CompilerOptions::NOC_MESH:
+            report << "network topology = mesh" << std::endl;
+            break;
+        case CompilerOptions::NOC_CMESH:
+            report << "network topology = concentrated mesh (" << nocConcentration_ << " tiles per router)" << std::endl;
+            break;
+        default: assert(0 && "Unrecognized network topology!");
+    }
+    report << "# hop bytes before tile placement = " << hopBytesBefore_ << std::endl;
+    report << "# hop bytes after tile placement = " << hopBytesAfter_ << std::endl;
+}
+
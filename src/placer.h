@@ -6,15 +6,35 @@
  *
  */
 
+#include <fstream>
+#include <map>
+#include <random>
+#include <vector>
+
 #include "common.h"
 
+/*
+ * Assigns virtual tiles, cores, and MVMUs to physical ones. Physical tiles sit on a 2D mesh network (or a concentrated
+ * mesh where several tiles share a router), numbered in row major order of their routers. Tiles 0 and 1 are reserved
+ * for inputs and outputs; the other virtual tiles are placed by simulated annealing over swaps of their physical tiles,
+ * minimizing the hop-bytes of the sends between tiles (bytes sent times the number of router hops they travel).
+ */
 class Placer {
 
     private:
 
+        static const unsigned int N_MOVES_PER_TILE_PER_TEMPERATURE = 16;
+        static const unsigned int N_TEMPERATURES = 64;
+
         ModelImpl* model_;
         Partitioner* partitioner_;
 
+        CompilerOptions::NoCTopology noc_;
+        unsigned int nocMeshWidth_;
+        unsigned int nocConcentration_;
+        unsigned long hopBytesBefore_;
+        unsigned long hopBytesAfter_;
+
         unsigned int nPTiles_;
         unsigned int nPCores_;
         unsigned int nPMVMUs_;
@@ -24,12 +44,16 @@ class Placer {
         std::vector<unsigned int> vmvmu2pmvmu_;
 
         void assignPTiles();
+        std::vector<std::map<unsigned int, unsigned long>> getTileTraffic();
+        unsigned int getHops(unsigned int pTile1, unsigned int pTile2);
+        unsigned long getHopBytes(unsigned int vTile, unsigned int pTile, std::vector<std::map<unsigned int, unsigned long>>& traffic);
+        unsigned long getHopBytes(std::vector<std::map<unsigned int, unsigned long>>& traffic);
         void assignPCores();
         void assignPMVMUs();
 
     public:
 
-        Placer(ModelImpl* model, Partitioner* partitioner);
+        Placer(ModelImpl* model, Partitioner* partitioner, CompilerOptions::NoCTopology noc, unsigned int nocMeshWidth, unsigned int nocConcentration);
 
         unsigned int getNPMVMUs() { return nPMVMUs_; }
         unsigned int getNPCores() { return nPCores_; }
@@ -45,6 +69,7 @@ class Placer {
         unsigned int getPCore(Operation* op);
 
         std::string printAssignment(Operation* op);
+        void printReport(std::ofstream& report);
 
 };
 
@@ -6,8 +6,11 @@
  *
  */
 
+#include <algorithm>
 #include <assert.h>
-#include <bitset>
+#include <climits>
+#include <map>
+#include <set>
 #include <sstream>
 
 #include "puma.h"
@@ -16,78 +19,140 @@
 #include "memalloc.h"
 #include "model.h"
 #include "operations.h"
+#include "parallel.h"
 #include "partitioner.h"
 #include "placer.h"
 #include "regalloc.h"
 
+/*
+ * Allocator of the data registers of a core. Free registers are kept as extents indexed both by address (to merge
+ * neighbors on free) and by size (for best fit), so allocation and free take logarithmic time. Vectors whose length is
+ * a multiple of MVMU_DIM are placed at MVMU_DIM aligned addresses, starting from the bottom of the register file, while
+ * shorter vectors are taken from the top of the extent that fits them best, so that scalars (e.g., address immediates)
+ * do not break up the aligned blocks that full vectors need.
+ */
 class CoreAllocator {
 
     private:
 
-        std::bitset<REGISTERS_PER_CORE> memPool_;
+        std::map<unsigned int, unsigned int> freeByStart_; // Free extents (start -> size)
+        std::set<std::pair<unsigned int, unsigned int>> freeBySize_; // Free extents ordered by (size, start)
+        unsigned int nFreeRegisters_;
+        unsigned int nFailedAllocations_;
+        unsigned int nFragmentedAllocations_; // Failed allocations for which enough registers were free, but not contiguous
+
+        void addExtent(unsigned int start, unsigned int size);
+        void removeExtent(unsigned int start, unsigned int size);
 
     public:
 
         static const unsigned int OUT_OF_REGISTERS = REGISTERS_PER_CORE;
 
+        CoreAllocator();
+
         unsigned int allocate(unsigned int size);
         void free(unsigned int pos, unsigned int size);
 
+        unsigned int getNFailedAllocations() { return nFailedAllocations_; }
+        unsigned int getNFragmentedAllocations() { return nFragmentedAllocations_; }
+
 };
 
+/*
+ * Tracks values that have been evicted from registers. A spilled value has been stored to tile memory and is reloaded
+ * from there, while a rematerializable value (a constant) is evicted without a store and is reloaded by re-emitting the
+ * set immediate operation that defines it. A reload stays live until it is no longer needed or is evicted itself.
+ */
 class SpillTracker {
 
     private:
 
-        std::map<ProducerOperation*, StoreOperation*> producer2spill;
-        std::map<ProducerOperation*, LoadOperation*> producer2reload;
-        std::map<LoadOperation*, ProducerOperation*> reload2producer;
+        std::map<ProducerOperation*, StoreOperation*, OperationIdLess> producer2spill;
+        std::set<ProducerOperation*, OperationIdLess> rematerializable;
+        std::map<ProducerOperation*, ProducerOperation*, OperationIdLess> producer2reload;
+        std::map<ProducerOperation*, ProducerOperation*, OperationIdLess> reload2producer;
 
     public:
 
         bool isSpilled(ProducerOperation* producer) { return producer2spill.count(producer); }
+        bool isRematerializable(ProducerOperation* producer) { return rematerializable.count(producer); }
         bool hasLiveNowReload(ProducerOperation* producer) { return producer2reload.count(producer); }
-        bool isLiveNowReload(LoadOperation* load) { return reload2producer.count(load); }
+        bool isLiveNowReload(ProducerOperation* reload) { return reload != NULL && reload2producer.count(reload); }
 
         StoreOperation* getSpillOperation(ProducerOperation* producer);
-        LoadOperation* getLiveNowReload(ProducerOperation* producer);
-        ProducerOperation* getOriginalProducer(LoadOperation* load);
+        ProducerOperation* getLiveNowReload(ProducerOperation* producer);
+        ProducerOperation* getOriginalProducer(ProducerOperation* reload);
 
         void setSpillOperation(ProducerOperation* producer, StoreOperation* store);
-        void setLiveNowReload(ProducerOperation* producer, LoadOperation* load);
-        void killLiveNowReload(LoadOperation* load);
+        void setRematerializable(ProducerOperation* producer);
+        void setLiveNowReload(ProducerOperation* producer, ProducerOperation* reload);
+        void killLiveNowReload(ProducerOperation* reload);
 
-        std::map<ProducerOperation*, LoadOperation*>::iterator reloads_begin() { return producer2reload.begin(); }
-        std::map<ProducerOperation*, LoadOperation*>::iterator reloads_end() { return producer2reload.end(); }
+        std::map<ProducerOperation*, ProducerOperation*, OperationIdLess>::iterator reloads_begin() { return producer2reload.begin(); }
+        std::map<ProducerOperation*, ProducerOperation*, OperationIdLess>::iterator reloads_end() { return producer2reload.end(); }
 
 };
 
+CoreAllocator::CoreAllocator() : nFreeRegisters_(0), nFailedAllocations_(0), nFragmentedAllocations_(0) {
+    addExtent(0, REGISTER_FILE_SIZE);
+}
+
+void CoreAllocator::addExtent(unsigned int start, unsigned int size) {
+    freeByStart_[start] = size;
+    freeBySize_.insert(std::make_pair(size, start));
+    nFreeRegisters_ += size;
+}
+
+void CoreAllocator::removeExtent(unsigned int start, unsigned int size) {
+    freeByStart_.erase(start);
+    freeBySize_.erase(std::make_pair(size, start));
+    nFreeRegisters_ -= size;
+}
+
 unsigned int CoreAllocator::allocate(unsigned int size) {
-    for(unsigned int i = 0; i <= REGISTER_FILE_SIZE - size; ++i) {
-        unsigned int j;
-        for(j = i; j < i + size; ++j) {
-            if(memPool_[j]) {
-                break;
+    bool isAligned = (size%MVMU_DIM == 0);
+    for(auto it = freeBySize_.lower_bound(std::make_pair(size, 0u)); it != freeBySize_.end(); ++it) {
+        unsigned int extentSize = it->first;
+        unsigned int extentStart = it->second;
+        unsigned int pos = (isAligned)?((extentStart + MVMU_DIM - 1)/MVMU_DIM*MVMU_DIM):(extentStart + extentSize - size);
+        if(pos + size <= extentStart + extentSize) {
+            removeExtent(extentStart, extentSize);
+            if(pos > extentStart) {
+                addExtent(extentStart, pos - extentStart);
             }
-        }
-        if(j == i + size) {
-            for(unsigned int k = i; k < j; ++k) {
-                memPool_.set(k);
+            if(pos + size < extentStart + extentSize) {
+                addExtent(pos + size, extentStart + extentSize - (pos + size));
             }
-            return REGISTER_FILE_START_ADDRESS + i;
-        } else {
-            i = j;
+            return REGISTER_FILE_START_ADDRESS + pos;
         }
     }
+    ++nFailedAllocations_;
+    if(nFreeRegisters_ >= size) {
+        ++nFragmentedAllocations_;
+    }
     return OUT_OF_REGISTERS;
 }
 
 void CoreAllocator::free(unsigned int reg, unsigned int size) {
-    unsigned int pos = reg - REGISTER_FILE_START_ADDRESS;
-    for(unsigned int i = pos; i < pos + size; ++i) {
-        assert(memPool_[i] && "Attempt to free unallocated registers!");
-        memPool_.reset(i);
+    unsigned int start = reg - REGISTER_FILE_START_ADDRESS;
+    auto next = freeByStart_.lower_bound(start);
+    assert((next == freeByStart_.end() || start + size <= next->first) && "Attempt to free unallocated registers!");
+    // Merge with the free extents before and after
+    if(next != freeByStart_.end() && next->first == start + size) {
+        size += next->second;
+        removeExtent(next->first, next->second);
+    }
+    auto prev = freeByStart_.lower_bound(start);
+    if(prev != freeByStart_.begin()) {
+        --prev;
+        assert(prev->first + prev->second <= start && "Attempt to free unallocated registers!");
+        if(prev->first + prev->second == start) {
+            start = prev->first;
+            size += prev->second;
+            removeExtent(prev->first, prev->second);
+        }
     }
+    addExtent(start, size);
 }
 
 StoreOperation* SpillTracker::getSpillOperation(ProducerOperation* producer) {
@@ -95,14 +160,14 @@ StoreOperation* SpillTracker::getSpillOperation(ProducerOperation* producer) {
     return producer2spill[producer];
 }
 
-LoadOperation* SpillTracker::getLiveNowReload(ProducerOperation* producer) {
+ProducerOperation* SpillTracker::getLiveNowReload(ProducerOperation* producer) {
     assert(hasLiveNowReload(producer));
     return producer2reload[producer];
 }
 
-ProducerOperation* SpillTracker::getOriginalProducer(LoadOperation* load) {
-    assert(isLiveNowReload(load));
-    return reload2producer[load];
+ProducerOperation* SpillTracker::getOriginalProducer(ProducerOperation* reload) {
+    assert(isLiveNowReload(reload));
+    return reload2producer[reload];
 }
 
 void SpillTracker::setSpillOperation(ProducerOperation* producer, StoreOperation* store) {
@@ -110,17 +175,22 @@ void SpillTracker::setSpillOperation(ProducerOperation* producer, StoreOperation
     producer2spill[producer] = store;
 }
 
-void SpillTracker::setLiveNowReload(ProducerOperation* producer, LoadOperation* load) {
+void SpillTracker::setRematerializable(ProducerOperation* producer) {
+    assert(!rematerializable.count(producer) && "Register allocation error: evicting a constant that has already been evicted!");
+    rematerializable.insert(producer);
+}
+
+void SpillTracker::setLiveNowReload(ProducerOperation* producer, ProducerOperation* reload) {
     assert(!hasLiveNowReload(producer) && "Register allocation error: reloading a spilled register that has already been reloaded!");
-    producer2reload[producer] = load;
-    reload2producer[load] = producer;
+    producer2reload[producer] = reload;
+    reload2producer[reload] = producer;
 }
 
-void SpillTracker::killLiveNowReload(LoadOperation* load) {
-    assert(isLiveNowReload(load));
-    ProducerOperation* producer = reload2producer[load];
+void SpillTracker::killLiveNowReload(ProducerOperation* reload) {
+    assert(isLiveNowReload(reload));
+    ProducerOperation* producer = reload2producer[reload];
     producer2reload.erase(producer);
-    reload2producer.erase(load);
+    reload2producer.erase(reload);
 }
 
 RegisterAllocator::RegisterAllocator(ModelImpl* model, Partitioner* partitioner, Placer* placer, MemoryAllocator* memoryAllocator, Linearizer* linearizer)
@@ -143,9 +213,16 @@ void RegisterAllocator::assignReservedInputRegister(ProducerOperation* producer)
     assert(producer->numUsers() == 1 && "Producer serving a matrix operation can only have one user");
     ConsumerOperation* consumer = *(producer->user_begin());
     unsigned int reg;
-    if(MVMOperation* mvm = dynamic_cast<MVMOperation*>(consumer)) {
+    if(MVMOperation* mvm = op_cast<MVMOperation>(consumer)) {
         reg = INPUT_REGISTERS_START_ADDRESS + placer_->getPMVMU(mvm)*MVMU_DIM;
-    } else if(TrainingMatrixOperation* trainOp = dynamic_cast<TrainingMatrixOperation*>(consumer)) {
+        // Operands of MVMs with concatenated inputs write to consecutive windows of the input registers
+        for(unsigned int o = 0; o < mvm->numOperands(); ++o) {
+            if(producer == mvm->getOperand(o)) {
+                reg += mvm->getOperandOffset(o);
+                break;
+            }
+        }
+    } else if(TrainingMatrixOperation* trainOp = op_cast<TrainingMatrixOperation>(consumer)) {
         switch(trainOp->getOpType()) {
             case TrainingMatrixOperation::MVM:
                 reg = INPUT_REGISTERS_START_ADDRESS + placer_->getPMVMU(trainOp)*N_TRAINING_OPERATIONS*MVMU_DIM;
@@ -176,9 +253,9 @@ void RegisterAllocator::assignReservedInputRegister(ProducerOperation* producer)
 void RegisterAllocator::assignReservedOutputRegister(ProducerOperation* producer) {
     assert(writesToReservedOutputRegister(producer) && "Cannot assign reserved output registers to non-matrix operations");
     unsigned int reg;
-    if(MVMOperation* mvm = dynamic_cast<MVMOperation*>(producer)) {
-        reg = OUTPUT_REGISTERS_START_ADDRESS + placer_->getPMVMU(mvm)*MVMU_DIM;
-    } else if(TrainingMatrixOperation* trainOp = dynamic_cast<TrainingMatrixOperation*>(producer)) {
+    if(MVMOperation* mvm = op_cast<MVMOperation>(producer)) {
+        reg = OUTPUT_REGISTERS_START_ADDRESS + placer_->getPMVMU(mvm)*MVMU_DIM + partitioner_->getRowOffset(mvm->getMatrixTile()); // Tiles packed in the same MVMU use different rows
+    } else if(TrainingMatrixOperation* trainOp = op_cast<TrainingMatrixOperation>(producer)) {
         switch(trainOp->getOpType()) {
             case TrainingMatrixOperation::MVM:
                 reg = OUTPUT_REGISTERS_START_ADDRESS + placer_->getPMVMU(trainOp)*N_TRAINING_OPERATIONS*MVMU_DIM;
@@ -196,18 +273,18 @@ void RegisterAllocator::assignReservedOutputRegister(ProducerOperation* producer
 }
 
 bool RegisterAllocator::readsFromReservedInputRegister(ConsumerOperation* consumer) {
-    return (dynamic_cast<MVMOperation*>(consumer) != NULL)
-            || (dynamic_cast<TrainingMatrixOperation*>(consumer) != NULL);
+    return (op_cast<MVMOperation>(consumer) != NULL)
+            || (op_cast<TrainingMatrixOperation>(consumer) != NULL);
 }
 
 bool RegisterAllocator::writesToReservedOutputRegister(ProducerOperation* producer) {
-    return (dynamic_cast<MVMOperation*>(producer) != NULL)
-            || ((dynamic_cast<TrainingMatrixOperation*>(producer) != NULL)
+    return (op_cast<MVMOperation>(producer) != NULL)
+            || ((op_cast<TrainingMatrixOperation>(producer) != NULL)
                 && !producerDoesNotWriteToRegister(producer));
 }
 
 bool RegisterAllocator::producerDoesNotWriteToRegister(ProducerOperation* producer) {
-    if(TrainingMatrixOperation* trainOp = dynamic_cast<TrainingMatrixOperation*>(producer)) {
+    if(TrainingMatrixOperation* trainOp = op_cast<TrainingMatrixOperation>(producer)) {
         if(trainOp->getOpType() == TrainingMatrixOperation::OUTER_PRODUCT) {
             // NOTE: Outer products are declared as producer operations so they can be coalesced with other training operations, but they do not write to any registers
             return true;
@@ -216,6 +293,22 @@ bool RegisterAllocator::producerDoesNotWriteToRegister(ProducerOperation* produc
     return false;
 }
 
+bool RegisterAllocator::isLiveAfter(ProducerOperation* producer, unsigned int position) {
+    return op2uses_.count(producer) && !op2uses_[producer].empty() && op2uses_[producer].back() > position;
+}
+
+unsigned int RegisterAllocator::getNextUse(ProducerOperation* producer, unsigned int position) {
+    std::vector<unsigned int>& uses = op2uses_[producer];
+    auto next = std::upper_bound(uses.begin(), uses.end(), position);
+    return (next != uses.end())?(*next):(UINT_MAX);
+}
+
+bool RegisterAllocator::isRematerializable(ProducerOperation* producer) {
+    // Induction variables are updated at the end of each loop iteration, so only plain constants can be re-emitted
+    SetImmediateOperation* seti = op_cast<SetImmediateOperation>(producer);
+    return seti != NULL && !seti->isInduction();
+}
+
 unsigned int RegisterAllocator::getRegister(ProducerOperation* producer) {
     assert(isRegisterAssigned(producer) && "Register has not been assigned!");
     return op2reg_[producer];
@@ -223,26 +316,28 @@ unsigned int RegisterAllocator::getRegister(ProducerOperation* producer) {
 
 void RegisterAllocator::registerAllocation() {
 
-    // Allocate registers
-    for(unsigned int pTile = 0; pTile < placer_->getNPTiles(); ++pTile) {
+    // Allocate registers of different tiles in parallel
+    // NOTE: Cores of the same tile are allocated in order because their spill code shares the tile's memory, which
+    //       keeps spill addresses (and therefore the generated code) identical to a sequential allocation
+    parallelFor(model_->getNThreads(), placer_->getNPTiles(), [&](unsigned int pTile) {
         for(unsigned int pCore = 0; pCore < N_CORES_PER_TILE; ++pCore) {
             allocateReservedInputRegisters(pTile, pCore);
             allocateReservedOutputRegisters(pTile, pCore);
             allocateDataRegisters(pTile, pCore);
         }
-    }
+    });
 
 }
 
 void RegisterAllocator::allocateReservedInputRegisters(unsigned int pTile, unsigned int pCore) {
     // Assign reserved input registers and ensure no overlap in live ranges
-    std::set<ProducerOperation*> liveNow;
+    std::set<ProducerOperation*, OperationIdLess> liveNow;
     std::list<CoreOperation*>& coreOperationList = linearizer_->getCoreOperationList(pTile, pCore);
     for(auto op = coreOperationList.rbegin(); op != coreOperationList.rend(); ++op) {
-        if(ProducerOperation* producer = dynamic_cast<ProducerOperation*>(*op)) {
+        if(ProducerOperation* producer = op_cast<ProducerOperation>(*op)) {
             liveNow.erase(producer);
         }
-        if(ConsumerOperation* consumer = dynamic_cast<ConsumerOperation*>(*op)) {
+        if(ConsumerOperation* consumer = op_cast<ConsumerOperation>(*op)) {
             if(readsFromReservedInputRegister(consumer)) {
                 for(unsigned int o = 0; o < consumer->numOperands(); ++o) {
                     ProducerOperation* producer = consumer->getOperand(o);
@@ -264,13 +359,13 @@ void RegisterAllocator::allocateReservedInputRegisters(unsigned int pTile, unsig
 
 void RegisterAllocator::allocateReservedOutputRegisters(unsigned int pTile, unsigned int pCore) {
     // Assign reserved output registers and ensure no overlap in live ranges
-    std::set<ProducerOperation*> liveNow;
+    std::set<ProducerOperation*, OperationIdLess> liveNow;
     std::list<CoreOperation*>& coreOperationList = linearizer_->getCoreOperationList(pTile, pCore);
     for(auto op = coreOperationList.rbegin(); op != coreOperationList.rend(); ++op) {
-        if(ProducerOperation* producer = dynamic_cast<ProducerOperation*>(*op)) {
+        if(ProducerOperation* producer = op_cast<ProducerOperation>(*op)) {
             liveNow.erase(producer);
         }
-        if(ConsumerOperation* consumer = dynamic_cast<ConsumerOperation*>(*op)) {
+        if(ConsumerOperation* consumer = op_cast<ConsumerOperation>(*op)) {
             for(unsigned int o = 0; o < consumer->numOperands(); ++o) {
                 ProducerOperation* producer = consumer->getOperand(o);
                 if(writesToReservedOutputRegister(producer)) {
@@ -293,76 +388,112 @@ void RegisterAllocator::allocateReservedOutputRegisters(unsigned int pTile, unsi
 void RegisterAllocator::allocateDataRegisters(unsigned int pTile, unsigned int pCore) {
 
     // Live range analysis
+    // NOTE: Values are defined once and the only branches in the core's code are the back edges of stream loops, so a value
+    //       is live out of the operation at a position if and only if its last use comes after that position. A value that
+    //       is defined before a stream loop and used in its body is also used by the loop end, because the body runs once
+    //       per iteration. All use positions are kept so that spilling can tell how far away the next use of a value is.
     std::list<CoreOperation*>& coreOperationList = linearizer_->getCoreOperationList(pTile, pCore);
-    std::map<Operation*, std::set<ProducerOperation*>> liveIn;
-    Operation* nextOp = NULL;
-    for(auto op = coreOperationList.rbegin(); op != coreOperationList.rend(); ++op) {
-
-        // Clone the live in set of the next operation
-        liveIn[*op].insert(liveIn[nextOp].begin(), liveIn[nextOp].end());
-
-        // Remove operations produced by this operation
-        if(ProducerOperation* producer = dynamic_cast<ProducerOperation*>(*op)) {
-            liveIn[*op].erase(producer);
+    std::set<ProducerOperation*, OperationIdLess> definedInLoop;
+    std::set<ProducerOperation*, OperationIdLess> usedInLoop;
+    bool inLoop = false;
+    unsigned int position = 0;
+    for(auto op = coreOperationList.begin(); op != coreOperationList.end(); ++op, ++position) {
+        if(op_cast<LoopBeginOperation>(*op)) {
+            inLoop = true;
         }
-
-        // Add operations consumed by the operation
-        if(ConsumerOperation* consumer = dynamic_cast<ConsumerOperation*>(*op)) {
+        if(ConsumerOperation* consumer = op_cast<ConsumerOperation>(*op)) {
             if(!readsFromReservedInputRegister(consumer)) {
                 for(unsigned int o = 0; o < consumer->numOperands(); ++o) {
                     ProducerOperation* producer = consumer->getOperand(o);
                     if(!writesToReservedOutputRegister(producer)) {
-                        liveIn[*op].insert(producer);
+                        op2uses_[producer].push_back(position);
+                        if(inLoop && !definedInLoop.count(producer)) {
+                            usedInLoop.insert(producer);
+                        }
                     }
                 }
             }
         }
-
-        nextOp = *op;
-
+        if(ProducerOperation* producer = op_cast<ProducerOperation>(*op)) {
+            if(inLoop) {
+                definedInLoop.insert(producer);
+            }
+        }
+        if(op_cast<LoopEndOperation>(*op)) {
+            for(ProducerOperation* producer : usedInLoop) {
+                if(op2uses_[producer].back() != position) {
+                    op2uses_[producer].push_back(position);
+                }
+            }
+            definedInLoop.clear();
+            usedInLoop.clear();
+            inLoop = false;
+        }
     }
 
     // Allocate data registers
     CoreAllocator allocator;
     SpillTracker spillTracker;
-    std::set<ProducerOperation*> liveNow;
+    std::set<ProducerOperation*, OperationIdLess> liveNow;
+    std::set<ProducerOperation*, OperationIdLess> unspillable;
     unsigned int spillAddressReg = allocator.allocate(1);
-    for(auto op = coreOperationList.begin(); op != coreOperationList.end(); ++op) {
-
-        auto next = op; ++next;
-        Operation* nextOp = (next != coreOperationList.end())?(*next):(NULL);
-        std::set<ProducerOperation*>& liveOut = liveIn[nextOp];
+    position = 0;
+    for(auto op = coreOperationList.begin(); op != coreOperationList.end(); ++op, ++position) {
+        // NOTE: Spill code is inserted before the current operation, so only the numbered operations are visited
+
+        // Values live on entry to a stream loop are needed on every iteration, so they cannot be spilled inside the loop body
+        if(LoopBeginOperation* begin = op_cast<LoopBeginOperation>(*op)) {
+            unspillable = liveNow;
+            unspillable.insert(begin);
+            for(auto reload = spillTracker.reloads_begin(); reload != spillTracker.reloads_end(); ++reload) {
+                unspillable.insert(reload->second);
+            }
+        }
 
         // Process operands
-        if(ConsumerOperation* consumer = dynamic_cast<ConsumerOperation*>(*op)) {
+        if(ConsumerOperation* consumer = op_cast<ConsumerOperation>(*op)) {
             if(!readsFromReservedInputRegister(consumer)) {
 
                 // Make sure all operands are available
                 for(unsigned int o = 0; o < consumer->numOperands(); ++o) {
                     ProducerOperation* producer = consumer->getOperand(o);
                     if(!writesToReservedOutputRegister(producer)) {
-                        if(liveNow.count(producer) || spillTracker.isLiveNowReload(dynamic_cast<LoadOperation*>(producer))) {
+                        if(liveNow.count(producer) || spillTracker.isLiveNowReload(producer)) {
                             numUnspilledRegAccesses_ += producer->length();
                         } else {
-                            // Reload operands that have been spilled
-                            assert(spillTracker.isSpilled(producer));
+                            // Reload operands that have been spilled or evicted
+                            assert(spillTracker.isSpilled(producer) || spillTracker.isRematerializable(producer));
                             if(spillTracker.hasLiveNowReload(producer)) {
                                 // If already reloaded, reuse reload
                                 numUnspilledRegAccesses_ += producer->length();
-                                LoadOperation* load = spillTracker.getLiveNowReload(producer);
-                                consumer->replaceOperand(producer, load);
+                                ProducerOperation* reload = spillTracker.getLiveNowReload(producer);
+                                consumer->replaceOperand(producer, reload);
+                            } else if(spillTracker.isRematerializable(producer)) {
+                                // Rematerialize evicted constant
+                                numUnspilledRegAccesses_ += producer->length();
+                                SetImmediateOperation* seti = op_cast<SetImmediateOperation>(producer);
+                                SetImmediateOperation* remat = new(model_) SetImmediateOperation(model_, seti->getImmediate(), seti->length());
+                                model_->getStatistics().bumpCounter("rematerializations");
+                                partitioner_->cloneAssignment(producer, remat);
+                                unsigned int reg = allocateRegistersWithSpilling(remat->length(), allocator, liveNow, unspillable, spillTracker, spillAddressReg, coreOperationList, op, position);
+                                assignRegister(remat, reg);
+                                consumer->replaceOperand(producer, remat);
+                                coreOperationList.insert(op, remat);
+                                spillTracker.setLiveNowReload(producer, remat);
                             } else {
                                 // Reload from spilled register
                                 numSpilledRegAccesses_ += producer->length();
                                 StoreOperation* spillOp = spillTracker.getSpillOperation(producer);
-                                SetImmediateOperation* seti = new SetImmediateOperation(model_, memoryAllocator_->getTileMemoryAddress(spillOp));
+                                SetImmediateOperation* seti = new(model_) SetImmediateOperation(model_, memoryAllocator_->getTileMemoryAddress(spillOp));
                                 partitioner_->cloneAssignment(producer, seti);
                                 assignRegister(seti, spillAddressReg);
-                                LoadOperation* load = new LoadOperation(model_, spillOp);
+                                LoadOperation* load = new(model_) LoadOperation(model_, spillOp);
+                                load->setStreamLoop(consumer->getStreamLoop()); // Reloads in a loop body read the spilled value on every iteration
                                 numLoadsFromSpilling_ += load->length();
+                                model_->getStatistics().bumpCounter("reloads");
                                 load->addTileMemoryAddressOperand(seti);
                                 partitioner_->cloneAssignment(producer, load);
-                                unsigned int reg = allocateRegistersWithSpilling(load->length(), allocator, liveNow, spillTracker, spillAddressReg, coreOperationList, op);
+                                unsigned int reg = allocateRegistersWithSpilling(load->length(), allocator, liveNow, unspillable, spillTracker, spillAddressReg, coreOperationList, op, position);
                                 assignRegister(load, reg);
                                 consumer->replaceOperand(producer, load);
                                 coreOperationList.insert(op, seti);
@@ -378,19 +509,18 @@ void RegisterAllocator::allocateDataRegisters(unsigned int pTile, unsigned int p
                     ProducerOperation* producer = consumer->getOperand(o);
                     if(!writesToReservedOutputRegister(producer)) {
                         if(liveNow.count(producer)) {
-                            if(!liveOut.count(producer)) {
+                            if(!isLiveAfter(producer, position)) {
                                 liveNow.erase(producer);
                                 allocator.free(getRegister(producer), producer->length());
                             }
-                        } else if(LoadOperation* load = dynamic_cast<LoadOperation*>(producer)) {
-                            assert(spillTracker.isLiveNowReload(load));
-                            ProducerOperation* originalProducer = spillTracker.getOriginalProducer(load);
-                            if(!liveOut.count(originalProducer)) {
-                                spillTracker.killLiveNowReload(load);
-                                allocator.free(getRegister(load), load->length());
+                        } else if(spillTracker.isLiveNowReload(producer)) {
+                            ProducerOperation* originalProducer = spillTracker.getOriginalProducer(producer);
+                            if(!isLiveAfter(originalProducer, position)) {
+                                spillTracker.killLiveNowReload(producer);
+                                allocator.free(getRegister(producer), producer->length());
                             }
                         } else {
-                            assert(0 && "Operand must either be a live operation or a spilled register load!");
+                            assert(0 && "Operand must either be a live operation or a reload of a spilled register!");
                         }
                     }
                 }
@@ -399,69 +529,133 @@ void RegisterAllocator::allocateDataRegisters(unsigned int pTile, unsigned int p
         }
 
         // Allocate register for new operation
-        if(ProducerOperation* producer = dynamic_cast<ProducerOperation*>(*op)) {
-            assert(!liveIn[*op].count(producer));
-            if(liveOut.count(producer)) {
-                unsigned int reg = allocateRegistersWithSpilling(producer->length(), allocator, liveNow, spillTracker, spillAddressReg, coreOperationList, op);
+        if(ProducerOperation* producer = op_cast<ProducerOperation>(*op)) {
+            if(isLiveAfter(producer, position)) {
+                unsigned int reg = allocateRegistersWithSpilling(producer->length(), allocator, liveNow, unspillable, spillTracker, spillAddressReg, coreOperationList, op, position);
                 assignRegister(producer, reg);
                 liveNow.insert(producer);
+            } else if(producer->numUsers() == 0 && !isRegisterAssigned(producer) && !producerDoesNotWriteToRegister(producer)) {
+                // Values that are never used (e.g., of loads that only release tile memory) are written to registers that are free right away
+                unsigned int reg = allocateRegistersWithSpilling(producer->length(), allocator, liveNow, unspillable, spillTracker, spillAddressReg, coreOperationList, op, position);
+                assignRegister(producer, reg);
+                allocator.free(reg, producer->length());
             } else {
                 // Producer already assigned to a reserved input or output register
                 assert(isRegisterAssigned(producer) || producerDoesNotWriteToRegister(producer));
             }
         }
 
+        // Free registers for values that were last used inside the loop body
+        if(op_cast<LoopEndOperation>(*op)) {
+            std::vector<ProducerOperation*> dead;
+            for(ProducerOperation* live : liveNow) {
+                if(!isLiveAfter(live, position)) {
+                    dead.push_back(live);
+                }
+            }
+            for(ProducerOperation* live : dead) {
+                liveNow.erase(live);
+                allocator.free(getRegister(live), live->length());
+            }
+            std::vector<ProducerOperation*> deadReloads;
+            for(auto reload = spillTracker.reloads_begin(); reload != spillTracker.reloads_end(); ++reload) {
+                if(!isLiveAfter(reload->first, position)) {
+                    deadReloads.push_back(reload->second);
+                }
+            }
+            for(ProducerOperation* reload : deadReloads) {
+                spillTracker.killLiveNowReload(reload);
+                allocator.free(getRegister(reload), reload->length());
+            }
+            unspillable.clear();
+        }
+
     }
 
+    numFailedRegAllocations_ += allocator.getNFailedAllocations();
+    numFragmentedRegAllocations_ += allocator.getNFragmentedAllocations();
+
 }
 
-unsigned int RegisterAllocator::allocateRegistersWithSpilling(unsigned int length, CoreAllocator& allocator, std::set<ProducerOperation*>& liveNow, SpillTracker& spillTracker, unsigned int spillAddressReg, std::list<CoreOperation*>& coreOperationList, std::list<CoreOperation*>::iterator& op) {
+unsigned int RegisterAllocator::allocateRegistersWithSpilling(unsigned int length, CoreAllocator& allocator, std::set<ProducerOperation*, OperationIdLess>& liveNow, std::set<ProducerOperation*, OperationIdLess>& unspillable, SpillTracker& spillTracker, unsigned int spillAddressReg, std::list<CoreOperation*>& coreOperationList, std::list<CoreOperation*>::iterator& op, unsigned int position) {
 
-    // TODO: Better heuristic for which is the best register to free (e.g., the one which will be used the latest into the future)
-    ConsumerOperation* consumer = dynamic_cast<ConsumerOperation*>(*op);
+    ConsumerOperation* consumer = op_cast<ConsumerOperation>(*op);
     unsigned int reg = allocator.allocate(length);
     if(reg != CoreAllocator::OUT_OF_REGISTERS) {
         return reg;
-    } else {
-        // First try to free registers by killing live reloads that are not used by this operation
-        for(auto killCandidate = spillTracker.reloads_begin(); killCandidate != spillTracker.reloads_end(); ++killCandidate) {
-            ProducerOperation* producerToKill = killCandidate->first;
-            LoadOperation* reloadToKill = killCandidate->second;
-            if(consumer == NULL || !consumer->uses(producerToKill) && !consumer->uses(reloadToKill)) {
-                spillTracker.killLiveNowReload(reloadToKill);
-                allocator.free(getRegister(reloadToKill), reloadToKill->length());
-                reg = allocator.allocate(length);
-                if(reg != CoreAllocator::OUT_OF_REGISTERS) {
-                    return reg;
-                }
+    }
+
+    // Collect the values that can be evicted, which are those not used by this operation. Evicting a live reload or a
+    // constant is clean (nothing needs to be stored because the value can be reloaded or re-emitted), while evicting
+    // any other live value requires a spill store.
+    struct EvictionCandidate {
+        ProducerOperation* value;
+        unsigned int nextUse;
+        bool isClean;
+        bool operator<(const EvictionCandidate& other) const {
+            // Clean evictions first, then furthest next use first (Belady), then by ID for determinism
+            if(isClean != other.isClean) {
+                return isClean;
+            } else if(nextUse != other.nextUse) {
+                return nextUse > other.nextUse;
+            } else {
+                return value->getId() < other.value->getId();
             }
         }
-        // If unable to kill enough reloads, then spill live operations that are not used by this operation
-        for(ProducerOperation* spillCandidate : liveNow) {
-            if(consumer == NULL || !consumer->uses(spillCandidate)) {
-                unsigned int address = memoryAllocator_->memalloc(partitioner_->getVTile(spillCandidate), spillCandidate->length());
-                SetImmediateOperation* setiStore = new SetImmediateOperation(model_, address);
-                partitioner_->cloneAssignment(spillCandidate, setiStore);
-                assignRegister(setiStore, spillAddressReg);
-                StoreOperation* store = new StoreOperation(model_, spillCandidate);
-                numStoresFromSpilling_ += store->length();
-                partitioner_->cloneAssignment(spillCandidate, store);
-                memoryAllocator_->assignTileMemoryAddress(store, address);
-                store->addTileMemoryAddressOperand(setiStore);
-                coreOperationList.insert(op, setiStore);
-                coreOperationList.insert(op, store);
-                liveNow.erase(spillCandidate);
-                spillTracker.setSpillOperation(spillCandidate, store);
-                allocator.free(getRegister(spillCandidate), spillCandidate->length());
-                reg = allocator.allocate(length);
-                if(reg != CoreAllocator::OUT_OF_REGISTERS) {
-                    return reg;
-                }
-            }
+    };
+    std::vector<EvictionCandidate> candidates;
+    for(auto reload = spillTracker.reloads_begin(); reload != spillTracker.reloads_end(); ++reload) {
+        ProducerOperation* originalProducer = reload->first;
+        ProducerOperation* reloadToKill = reload->second;
+        if((consumer == NULL || !consumer->uses(originalProducer) && !consumer->uses(reloadToKill)) && !unspillable.count(reloadToKill)) {
+            candidates.push_back({reloadToKill, getNextUse(originalProducer, position), true});
         }
-        // If unable to spill enough live operations, then fail
-        assert(0 && "Register allocation error: cannot find enough registers to spill!");
     }
+    for(ProducerOperation* live : liveNow) {
+        if((consumer == NULL || !consumer->uses(live)) && !unspillable.count(live)) {
+            candidates.push_back({live, getNextUse(live, position), isRematerializable(live)});
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    // Evict candidates in order until the allocation succeeds
+    for(EvictionCandidate& candidate : candidates) {
+        ProducerOperation* victim = candidate.value;
+        if(spillTracker.isLiveNowReload(victim)) {
+            // Kill live reload (the value is still in memory or can be rematerialized again)
+            spillTracker.killLiveNowReload(victim);
+        } else if(candidate.isClean) {
+            // Evict constant without storing it, it is rematerialized when needed again
+            liveNow.erase(victim);
+            spillTracker.setRematerializable(victim);
+        } else {
+            // Spill live value to tile memory
+            unsigned int address = memoryAllocator_->memalloc(placer_->getPTile(victim), victim->length());
+            SetImmediateOperation* setiStore = new(model_) SetImmediateOperation(model_, address);
+            partitioner_->cloneAssignment(victim, setiStore);
+            assignRegister(setiStore, spillAddressReg);
+            StoreOperation* store = new(model_) StoreOperation(model_, victim);
+            store->setStreamLoop((op_cast<LoopBeginOperation>(*op) == NULL)?((*op)->getStreamLoop()):(NULL)); // Spill code goes before the current operation
+            numStoresFromSpilling_ += store->length();
+            model_->getStatistics().bumpCounter("spills");
+            partitioner_->cloneAssignment(victim, store);
+            memoryAllocator_->assignTileMemoryAddress(store, address);
+            store->addTileMemoryAddressOperand(setiStore);
+            coreOperationList.insert(op, setiStore);
+            coreOperationList.insert(op, store);
+            liveNow.erase(victim);
+            spillTracker.setSpillOperation(victim, store);
+        }
+        allocator.free(getRegister(victim), victim->length());
+        reg = allocator.allocate(length);
+        if(reg != CoreAllocator::OUT_OF_REGISTERS) {
+            return reg;
+        }
+    }
+
+    // If unable to evict enough values, then fail
+    assert(0 && "Register allocation error: cannot find enough registers to spill!");
+    return CoreAllocator::OUT_OF_REGISTERS;
 
 }
 
@@ -472,11 +666,13 @@ void RegisterAllocator::printReport(std::ofstream& report) {
     report << "# unspilled register accesses = " << numUnspilledRegAccesses_ << std::endl;
     report << "# spilled register accesses = " << numSpilledRegAccesses_ << std::endl;
     report << "% spilled register accesses = " << 100.0*numSpilledRegAccesses_/(numSpilledRegAccesses_ + numUnspilledRegAccesses_) << "%" << std::endl;
+    report << "# failed register allocations = " << numFailedRegAllocations_ << std::endl;
+    report << "# failed register allocations due to fragmentation = " << numFragmentedRegAllocations_ << std::endl;
 }
 
 std::string RegisterAllocator::printAssignment(Operation* op) {
     std::stringstream ss;
-    if(ProducerOperation* producer = dynamic_cast<ProducerOperation*>(op)) {
+    if(ProducerOperation* producer = op_cast<ProducerOperation>(op)) {
         if(isRegisterAssigned(producer)) {
             ss << "\nregister = " << getRegister(producer);
         }
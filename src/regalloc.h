@@ -6,12 +6,15 @@
  *
  */
 
+#include <atomic>
 #include <fstream>
 #include <list>
 #include <map>
 #include <string>
+#include <vector>
 
 #include "common.h"
+#include "optable.h"
 
 class RegisterAllocator {
 
@@ -23,12 +26,16 @@ class RegisterAllocator {
         MemoryAllocator* memoryAllocator_;
         Linearizer* linearizer_;
 
-        std::map<ProducerOperation*, unsigned int> op2reg_;
+        OperationTable<unsigned int> op2reg_;
+        OperationTable<std::vector<unsigned int>> op2uses_; /* Positions of the uses of a value in its core's operation list, in increasing order */
 
-        unsigned int numLoadsFromSpilling_ = 0;
-        unsigned int numStoresFromSpilling_ = 0;
-        unsigned int numUnspilledRegAccesses_ = 0;
-        unsigned int numSpilledRegAccesses_ = 0;
+        // Updated by all tiles, which are allocated in parallel
+        std::atomic<unsigned int> numLoadsFromSpilling_{0};
+        std::atomic<unsigned int> numStoresFromSpilling_{0};
+        std::atomic<unsigned int> numUnspilledRegAccesses_{0};
+        std::atomic<unsigned int> numSpilledRegAccesses_{0};
+        std::atomic<unsigned int> numFailedRegAllocations_{0};
+        std::atomic<unsigned int> numFragmentedRegAllocations_{0};
 
         void assignRegister(ProducerOperation* producer, unsigned int reg);
         void assignReservedInputRegister(ProducerOperation* producer);
@@ -37,11 +44,14 @@ class RegisterAllocator {
         bool writesToReservedOutputRegister(ProducerOperation* producer);
         bool producerDoesNotWriteToRegister(ProducerOperation* producer);
         bool isRegisterAssigned(ProducerOperation* producer);
+        bool isLiveAfter(ProducerOperation* producer, unsigned int position);
+        unsigned int getNextUse(ProducerOperation* producer, unsigned int position);
+        bool isRematerializable(ProducerOperation* producer);
         void registerAllocation();
         void allocateReservedInputRegisters(unsigned int pTile, unsigned int pCore);
         void allocateReservedOutputRegisters(unsigned int pTile, unsigned int pCore);
         void allocateDataRegisters(unsigned int pTile, unsigned int pCore);
-        unsigned int allocateRegistersWithSpilling(unsigned int length, CoreAllocator& allocator, std::set<ProducerOperation*>& liveNow, SpillTracker& spillTracker, unsigned int spillAddressReg, std::list<CoreOperation*>& coreOperationList, std::list<CoreOperation*>::iterator& op);
+        unsigned int allocateRegistersWithSpilling(unsigned int length, CoreAllocator& allocator, std::set<ProducerOperation*, OperationIdLess>& liveNow, std::set<ProducerOperation*, OperationIdLess>& unspillable, SpillTracker& spillTracker, unsigned int spillAddressReg, std::list<CoreOperation*>& coreOperationList, std::list<CoreOperation*>::iterator& op, unsigned int position);
 
     public:
 
@@ -0,0 +1,90 @@
+/*
+ *  Copyright (c) 2019 IMPACT Research Group, University of Illinois.
+ *  All rights reserved.
+ *
+ *  This file is covered by the LICENSE.txt license file in the root directory.
+ *
+ */
+
+#ifndef _SMALLVECTOR_H_
+#define _SMALLVECTOR_H_
+
+#include <cassert>
+#include <cstring>
+
+/*
+ * Vector of trivially copyable elements (used for edges between operations) that stores up to N elements inline and
+ * only goes to the heap when it grows beyond that. Most operations have one or two operands and users, so their edges
+ * are stored within the operation itself.
+ */
+template <class T, unsigned int N>
+class SmallVector {
+
+    private:
+
+        T* data_;
+        unsigned int size_;
+        unsigned int capacity_;
+        T inline_[N];
+
+        SmallVector(const SmallVector&);
+        SmallVector& operator=(const SmallVector&);
+
+        void grow() {
+            capacity_ *= 2;
+            T* data = new T[capacity_];
+            memcpy(data, data_, size_*sizeof(T));
+            if(data_ != inline_) {
+                delete[] data_;
+            }
+            data_ = data;
+        }
+
+    public:
+
+        typedef T* iterator;
+
+        SmallVector() : data_(inline_), size_(0), capacity_(N) { }
+        ~SmallVector() {
+            if(data_ != inline_) {
+                delete[] data_;
+            }
+        }
+
+        unsigned int size() const { return size_; }
+        bool empty() const { return size_ == 0; }
+        T& operator[](unsigned int i) { return data_[i]; }
+        iterator begin() { return data_; }
+        iterator end() { return data_ + size_; }
+
+        void push_back(const T& value) {
+            if(size_ == capacity_) {
+                grow();
+            }
+            data_[size_++] = value;
+        }
+
+        iterator insert(iterator pos, const T& value) {
+            unsigned int i = pos - data_;
+            assert(i <= size_ && "Insertion position out of range!");
+            if(size_ == capacity_) {
+                grow();
+            }
+            memmove(data_ + i + 1, data_ + i, (size_ - i)*sizeof(T));
+            data_[i] = value;
+            ++size_;
+            return data_ + i;
+        }
+
+        iterator erase(iterator pos) {
+            unsigned int i = pos - data_;
+            assert(i < size_ && "Erasure position out of range!");
+            memmove(data_ + i, data_ + i + 1, (size_ - i - 1)*sizeof(T));
+            --size_;
+            return data_ + i;
+        }
+
+};
+
+#endif
+
@@ -0,0 +1,124 @@
+/*
+ *  Copyright (c) 2019 IMPACT Research Group, University of Illinois.
+ *  All rights reserved.
+ *
+ *  This file is covered by the LICENSE.txt license file in the root directory.
+ *
+ */
+
+#include <assert.h>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <sys/resource.h>
+
+#include "puma.h"
+
+#include "model.h"
+#include "operations.h"
+#include "stats.h"
+
+static double getWallSeconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double getCPUSeconds() {
+    return (double) std::clock()/CLOCKS_PER_SEC;
+}
+
+static long getPeakRSSKB() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/* Quotes a string for JSON, escaping the characters that cannot appear in it as they are (e.g., in user-provided model names) */
+static std::string printJSONString(const std::string& str) {
+    std::string quoted = "\"";
+    for(char c : str) {
+        if(c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if((unsigned char) c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", (unsigned int) c);
+            quoted += escape;
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+std::vector<unsigned int> CompileStatistics::countOperations() {
+    std::vector<unsigned int> counts(Operation::N_OP_KINDS, 0);
+    for(auto it = model_->op_begin(); it != model_->op_end(); ++it) {
+        ++counts[(*it)->getKind()];
+    }
+    return counts;
+}
+
+void CompileStatistics::beginPass(std::string name) {
+    assert(!inPass_ && "Cannot begin a pass while another pass is in progress!");
+    inPass_ = true;
+    PassRecord pass;
+    pass.name = name;
+    pass.peakRSSBeforeKB = getPeakRSSKB();
+    pass.opsBefore = countOperations();
+    passes_.push_back(pass);
+    passWallStart_ = getWallSeconds();
+    passCPUStart_ = getCPUSeconds();
+}
+
+void CompileStatistics::endPass() {
+    assert(inPass_ && "No pass in progress!");
+    inPass_ = false;
+    PassRecord& pass = passes_.back();
+    pass.wallSeconds = getWallSeconds() - passWallStart_;
+    pass.cpuSeconds = getCPUSeconds() - passCPUStart_;
+    pass.peakRSSAfterKB = getPeakRSSKB();
+    pass.opsAfter = countOperations();
+}
+
+static void printOperationCounts(std::ostream& out, std::vector<unsigned int>& counts) {
+    out << "{";
+    for(unsigned int k = 0; k < counts.size(); ++k) {
+        out << ((k == 0)?"":", ") << printJSONString(Operation::printKind((Operation::OpKind) k)) << ": " << counts[k];
+    }
+    out << "}";
+}
+
+void CompileStatistics::bumpCounter(std::string name, unsigned long amount) {
+    std::lock_guard<std::mutex> lock(countersMutex_);
+    counters_[name] += amount;
+}
+
+void CompileStatistics::printJSON(std::ostream& out) {
+    out << "{" << std::endl;
+    out << "  \"model\": " << printJSONString(model_->getName()) << "," << std::endl;
+    out << "  \"passes\": [" << std::endl;
+    for(unsigned int p = 0; p < passes_.size(); ++p) {
+        PassRecord& pass = passes_[p];
+        out << "    {" << std::endl;
+        out << "      \"name\": " << printJSONString(pass.name) << "," << std::endl;
+        out << "      \"wall_seconds\": " << pass.wallSeconds << "," << std::endl;
+        out << "      \"cpu_seconds\": " << pass.cpuSeconds << "," << std::endl;
+        out << "      \"peak_rss_kb\": " << pass.peakRSSAfterKB << "," << std::endl;
+        out << "      \"peak_rss_delta_kb\": " << pass.peakRSSAfterKB - pass.peakRSSBeforeKB << "," << std::endl;
+        out << "      \"ops_before\": ";
+        printOperationCounts(out, pass.opsBefore);
+        out << "," << std::endl;
+        out << "      \"ops_after\": ";
+        printOperationCounts(out, pass.opsAfter);
+        out << std::endl;
+        out << "    }" << ((p + 1 < passes_.size())?",":"") << std::endl;
+    }
+    out << "  ]," << std::endl;
+    out << "  \"counters\": {";
+    for(auto it = counters_.begin(); it != counters_.end(); ++it) {
+        out << ((it == counters_.begin())?"":",") << std::endl << "    " << printJSONString(it->first) << ": " << it->second;
+    }
+    out << std::endl << "  }" << std::endl;
+    out << "}" << std::endl;
+}
+
@@ -0,0 +1,63 @@
+/*
+ *  Copyright (c) 2019 IMPACT Research Group, University of Illinois.
+ *  All rights reserved.
+ *
+ *  This file is covered by the LICENSE.txt license file in the root directory.
+ *
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+/*
+ * Compile statistics of a model. Each compiler pass is bracketed by beginPass and endPass, which record its wall time,
+ * CPU time, growth of the peak resident set size, and the number of operations of each kind before and after the pass.
+ * Passes can also bump named counters for events they perform (copies inserted, spills, etc.).
+ */
+class CompileStatistics {
+
+    private:
+
+        struct PassRecord {
+            std::string name;
+            double wallSeconds;
+            double cpuSeconds;
+            long peakRSSBeforeKB;
+            long peakRSSAfterKB;
+            std::vector<unsigned int> opsBefore;
+            std::vector<unsigned int> opsAfter;
+        };
+
+        ModelImpl* model_;
+        std::vector<PassRecord> passes_;
+        std::map<std::string, unsigned long> counters_;
+        std::mutex countersMutex_;
+        bool inPass_;
+        double passWallStart_;
+        double passCPUStart_;
+
+        std::vector<unsigned int> countOperations();
+
+    public:
+
+        CompileStatistics(ModelImpl* model) : model_(model), inPass_(false) { }
+
+        void beginPass(std::string name);
+        void endPass();
+
+        void bumpCounter(std::string name, unsigned long amount=1);
+
+        void printJSON(std::ostream& out);
+
+};
+
+#endif
+
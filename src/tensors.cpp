@@ -128,7 +128,7 @@ InputVectorImpl::InputVectorImpl(ModelImpl* model, std::string name, unsigned in
         if(i == nTiles() - 1 && length%MVMU_DIM > 0) {
             tileSize = length%MVMU_DIM;
         }
-        tiles_[i] = new InputVectorTile(model, name + "[" + std::to_string(i) + "]", tileSize);
+        tiles_[i] = new(model) InputVectorTile(model, name + "[" + std::to_string(i) + "]", tileSize);
     }
     model->addInputVectorImpl(this);
 }
@@ -136,13 +136,7 @@ InputVectorImpl::InputVectorImpl(ModelImpl* model, std::string name, unsigned in
 InputImagePixelStreamTile::InputImagePixelStreamTile(ModelImpl* model, std::string name, unsigned int imageWidth, unsigned int imageHeight, unsigned int nChannels)
     : AbstractImagePixelStream(model, name, imageWidth, imageHeight, nChannels)
 {
-    stream_.resize(imageHeight);
-    for(unsigned int h = 0; h < imageHeight; ++h) {
-        stream_[h].resize(imageWidth);
-        for(unsigned int w = 0; w < imageWidth; ++w) {
-            stream_[h][w] = new InputVectorTile(model, name + "[" + std::to_string(h) + "][" + std::to_string(w) + "]", nChannels);
-        }
-    }
+    element_ = new(model) InputVectorTile(model, name + "[h][w]", nChannels);
 }
 
 InputImagePixelStreamImpl::InputImagePixelStreamImpl(ModelImpl* model, std::string name, unsigned int imageWidth, unsigned int imageHeight, unsigned int nChannels)
@@ -154,7 +148,7 @@ InputImagePixelStreamImpl::InputImagePixelStreamImpl(ModelImpl* model, std::stri
         if(i == nTiles() - 1 && nChannels%MVMU_DIM > 0) {
             tileSize = nChannels%MVMU_DIM;
         }
-        tiles_[i] = new InputImagePixelStreamTile(model, name + "[" + std::to_string(i) + "]", imageWidth, imageHeight, tileSize);
+        tiles_[i] = new(model) InputImagePixelStreamTile(model, name + "[" + std::to_string(i) + "]", imageWidth, imageHeight, tileSize);
     }
     model->addInputImagePixelStreamImpl(this);
 }
@@ -168,7 +162,7 @@ OutputVectorImpl::OutputVectorImpl(ModelImpl* model, std::string name, unsigned
         if(i == nTiles() - 1 && length%MVMU_DIM > 0) {
             tileSize = length%MVMU_DIM;
         }
-        tiles_[i] = new OutputVectorTile(model, name + "[" + std::to_string(i) + "]", tileSize);
+        tiles_[i] = new(model) OutputVectorTile(model, name + "[" + std::to_string(i) + "]", tileSize);
     }
     model->addOutputVectorImpl(this);
 }
@@ -176,13 +170,7 @@ OutputVectorImpl::OutputVectorImpl(ModelImpl* model, std::string name, unsigned
 OutputImagePixelStreamTile::OutputImagePixelStreamTile(ModelImpl* model, std::string name, unsigned int imageWidth, unsigned int imageHeight, unsigned int nChannels)
     : AbstractImagePixelStream(model, name, imageWidth, imageHeight, nChannels)
 {
-    stream_.resize(imageHeight);
-    for(unsigned int h = 0; h < imageHeight; ++h) {
-        stream_[h].resize(imageWidth);
-        for(unsigned int w = 0; w < imageWidth; ++w) {
-            stream_[h][w] = new OutputVectorTile(model, name + "[" + std::to_string(h) + "][" + std::to_string(w) + "]", nChannels);
-        }
-    }
+    element_ = new(model) OutputVectorTile(model, name + "[h][w]", nChannels);
 }
 
 OutputImagePixelStreamImpl::OutputImagePixelStreamImpl(ModelImpl* model, std::string name, unsigned int imageWidth, unsigned int imageHeight, unsigned int nChannels)
@@ -194,7 +182,7 @@ OutputImagePixelStreamImpl::OutputImagePixelStreamImpl(ModelImpl* model, std::st
         if(i == nTiles() - 1 && nChannels%MVMU_DIM > 0) {
             tileSize = nChannels%MVMU_DIM;
         }
-        tiles_[i] = new OutputImagePixelStreamTile(model, name + "[" + std::to_string(i) + "]", imageWidth, imageHeight, tileSize);
+        tiles_[i] = new(model) OutputImagePixelStreamTile(model, name + "[" + std::to_string(i) + "]", imageWidth, imageHeight, tileSize);
     }
     model->addOutputImagePixelStreamImpl(this);
 }
@@ -214,7 +202,7 @@ ConstantMatrixImpl::ConstantMatrixImpl(ModelImpl* model, std::string name, unsig
             if(w == nWidthTiles() - 1 && width%MVMU_DIM > 0) {
                 tileWidth = width%MVMU_DIM;
             }
-            tiles_[h][w] = new ConstantMatrixTile(model, name + "[" + std::to_string(h) + "][" + std::to_string(w) + "]", tileWidth, tileHeight);
+            tiles_[h][w] = new(model) ConstantMatrixTile(model, name + "[" + std::to_string(h) + "][" + std::to_string(w) + "]", tileWidth, tileHeight);
         }
     }
     model->addConstantMatrixImpl(this);
@@ -223,10 +211,10 @@ ConstantMatrixImpl::ConstantMatrixImpl(ModelImpl* model, std::string name, unsig
 ConvolutionalConstantMatrixImpl::ConvolutionalConstantMatrixImpl(ModelImpl* model, std::string name, unsigned int kernelWidth, unsigned int kernelHeight, unsigned int nInChannels, unsigned int nOutChannels)
     : AbstractTensor(model, name), kernelWidth_(kernelWidth), kernelHeight_(kernelHeight), nInChannels_(nInChannels), nOutChannels_(nOutChannels)
 {
-    tiles_.resize(kernelHeight);
-    for(unsigned int kh = 0; kh < kernelHeight; ++kh) {
-        tiles_[kh].resize(kernelWidth);
-        for(unsigned int kw = 0; kw < kernelWidth; ++kw) {
+    tiles_.resize(getNKernelHeightTiles());
+    for(unsigned int kh = 0; kh < getNKernelHeightTiles(); ++kh) {
+        tiles_[kh].resize(getNKernelWidthTiles());
+        for(unsigned int kw = 0; kw < getNKernelWidthTiles(); ++kw) {
             tiles_[kh][kw].resize(getNOutChannelTiles());
             for(unsigned int h = 0; h < getNOutChannelTiles(); ++h) {
                 unsigned int tileHeight = MVMU_DIM;
@@ -236,10 +224,12 @@ ConvolutionalConstantMatrixImpl::ConvolutionalConstantMatrixImpl(ModelImpl* mode
                 tiles_[kh][kw][h].resize(getNInChannelTiles());
                 for(unsigned int w = 0; w < getNInChannelTiles(); ++w) {
                     unsigned int tileWidth = MVMU_DIM;
-                    if(w == getNInChannelTiles() - 1 && nInChannels%MVMU_DIM > 0) {
+                    if(isKernelFolded()) {
+                        tileWidth = kernelHeight*kernelWidth*nInChannels; // Column (kh*kernelWidth + kw)*nInChannels + c holds input channel c at kernel position (kh, kw)
+                    } else if(w == getNInChannelTiles() - 1 && nInChannels%MVMU_DIM > 0) {
                         tileWidth = nInChannels%MVMU_DIM;
                     }
-                    tiles_[kh][kw][h][w] = new ConstantMatrixTile(model, name + "[" + std::to_string(kh) + "][" + std::to_string(kw) + "][" + std::to_string(h) + "][" + std::to_string(w) + "]", tileWidth, tileHeight);
+                    tiles_[kh][kw][h][w] = new(model) ConstantMatrixTile(model, name + "[" + std::to_string(kh) + "][" + std::to_string(kw) + "][" + std::to_string(h) + "][" + std::to_string(w) + "]", tileWidth, tileHeight);
                 }
             }
         }
@@ -262,7 +252,7 @@ TrainingMatrixImpl::TrainingMatrixImpl(ModelImpl* model, std::string name, unsig
             if(w == nWidthTiles() - 1 && width%MVMU_DIM > 0) {
                 tileWidth = width%MVMU_DIM;
             }
-            tiles_[h][w] = new TrainingMatrixTile(model, name + "[" + std::to_string(h) + "][" + std::to_string(w) + "]", tileWidth, tileHeight);
+            tiles_[h][w] = new(model) TrainingMatrixTile(model, name + "[" + std::to_string(h) + "][" + std::to_string(w) + "]", tileWidth, tileHeight);
         }
     }
     model->addTrainingMatrixImpl(this);
@@ -275,12 +265,8 @@ VectorImpl::VectorImpl(ModelImpl* model, unsigned int length)
 }
 
 ImagePixelStreamTile::ImagePixelStreamTile(ModelImpl* model, unsigned int imageWidth, unsigned int imageHeight, unsigned int nChannels)
-    : AbstractImagePixelStream(model, "", imageWidth, imageHeight, nChannels)
+    : AbstractImagePixelStream(model, "", imageWidth, imageHeight, nChannels), element_(NULL), buffer_(NULL)
 {
-    stream_.resize(imageHeight);
-    for(unsigned int h = 0; h < imageHeight; ++h) {
-        stream_[h].resize(imageWidth);
-    }
 }
 
 ImagePixelStreamImpl::ImagePixelStreamImpl(ModelImpl* model, unsigned int imageWidth, unsigned int imageHeight, unsigned int nChannels)
@@ -292,7 +278,7 @@ ImagePixelStreamImpl::ImagePixelStreamImpl(ModelImpl* model, unsigned int imageW
         if(i == nTiles() - 1 && nChannels%MVMU_DIM > 0) {
             tileSize = nChannels%MVMU_DIM;
         }
-        tiles_[i] = new ImagePixelStreamTile(model, imageWidth, imageHeight, tileSize);
+        tiles_[i] = new(model) ImagePixelStreamTile(model, imageWidth, imageHeight, tileSize);
     }
     model->addImagePixelStreamImpl(this);
 }
@@ -385,21 +371,19 @@ void VectorImpl::setTile(unsigned int t, ProducerOperation* producer) {
     tiles_[t] = producer;
 }
 
-void ImagePixelStreamTile::add(unsigned int h, unsigned int w, ProducerOperation* vec) {
-    assert(vec->length() == nChannels());
-    stream_[h][w] = vec;;
+void ImagePixelStreamTile::set(ProducerOperation* element) {
+    assert(element_ == NULL && "Cannot reassign stream element");
+    assert(element->length() == nChannels());
+    assert(element->getStreamLoop() != NULL && element->getStreamLoop()->height() == imageHeight() && element->getStreamLoop()->width() == imageWidth());
+    element_ = element;
 }
 
-InputVectorTile* InputImagePixelStreamTile::get(unsigned int h, unsigned int w) {
-    return stream_[h][w];
-}
-
-ProducerOperation* ImagePixelStreamTile::get(unsigned int h, unsigned int w) {
-    return stream_[h][w];
-}
-
-OutputVectorTile* OutputImagePixelStreamTile::get(unsigned int h, unsigned int w) {
-    return stream_[h][w];
+StoreOperation* ImagePixelStreamTile::getBuffer() {
+    if(buffer_ == NULL) {
+        buffer_ = new(model_) StoreOperation(model_, element_);
+        buffer_->setStreamLoop(element_->getStreamLoop());
+    }
+    return buffer_;
 }
 
 InputVectorImpl::~InputVectorImpl() {
@@ -409,11 +393,7 @@ InputVectorImpl::~InputVectorImpl() {
 }
 
 InputImagePixelStreamTile::~InputImagePixelStreamTile() {
-    for(auto it : stream_) {
-        for(InputVectorTile* tile : it) {
-            delete tile;
-        }
-    }
+    delete element_;
 }
 
 InputImagePixelStreamImpl::~InputImagePixelStreamImpl() {
@@ -435,11 +415,7 @@ OutputVectorImpl::~OutputVectorImpl() {
 }
 
 OutputImagePixelStreamTile::~OutputImagePixelStreamTile() {
-    for(auto it : stream_) {
-        for(OutputVectorTile* tile : it) {
-            delete tile;
-        }
-    }
+    delete element_;
 }
 
 OutputImagePixelStreamImpl::~OutputImagePixelStreamImpl() {
@@ -602,14 +578,10 @@ void InputImagePixelStreamImpl::printNodeAndEdges(std::ostream& fout) {
     for(InputImagePixelStreamTile* tile : tiles_) {
         fout << tile->printNodeName() << " " << tile->printNodeStyle() << ";" << std::endl;
         fout << printNodeName() << " -> " << tile->printNodeName() << " [style=dotted];" << std::endl;
-        for(unsigned int h = 0; h < tile->imageHeight(); ++h) {
-            for(unsigned int w = 0; w < tile->imageWidth(); ++w) {
-                InputVectorTile* streamElement = tile->get(h, w);
-                fout << streamElement->printNodeName() << " " << streamElement->printNodeStyle() << ";" << std::endl;
-                fout << tile->printNodeName() << " -> " << streamElement->printNodeName() << " [style=dotted];" << std::endl;
-                // NOTE: edges from stream elements to their users are printed by the users in InputOperation::printNodeAndEdges
-            }
-        }
+        InputVectorTile* streamElement = tile->get();
+        fout << streamElement->printNodeName() << " " << streamElement->printNodeStyle() << ";" << std::endl;
+        fout << tile->printNodeName() << " -> " << streamElement->printNodeName() << " [style=dotted];" << std::endl;
+        // NOTE: edges from stream elements to their users are printed by the users in InputOperation::printNodeAndEdges
     }
 }
 
@@ -627,14 +599,10 @@ void OutputImagePixelStreamImpl::printNodeAndEdges(std::ostream& fout) {
     for(OutputImagePixelStreamTile* tile : tiles_) {
         fout << tile->printNodeName() << " " << tile->printNodeStyle() << ";" << std::endl;
         fout << tile->printNodeName() << " -> " << printNodeName() << " [style=dotted];" << std::endl;
-        for(unsigned int h = 0; h < tile->imageHeight(); ++h) {
-            for(unsigned int w = 0; w < tile->imageWidth(); ++w) {
-                OutputVectorTile* streamElement = tile->get(h, w);
-                fout << streamElement->printNodeName() << " " << streamElement->printNodeStyle() << ";" << std::endl;
-                fout << streamElement->printNodeName() << " -> " << tile->printNodeName() << " [style=dotted];" << std::endl;
-                // NOTE: edges to stream elements from their sources are printed by the users in OutputOperation::printNodeAndEdges
-            }
-        }
+        OutputVectorTile* streamElement = tile->get();
+        fout << streamElement->printNodeName() << " " << streamElement->printNodeStyle() << ";" << std::endl;
+        fout << streamElement->printNodeName() << " -> " << tile->printNodeName() << " [style=dotted];" << std::endl;
+        // NOTE: edges to stream elements from their sources are printed by the users in OutputOperation::printNodeAndEdges
     }
 }
 
@@ -10,6 +10,7 @@
 #include <string>
 #include <vector>
 
+#include "arena.h"
 #include "common.h"
 
 class AbstractTensor {
@@ -93,7 +94,7 @@ class AbstractImagePixelStream : public AbstractTensor {
 
 };
 
-class InputVectorTile : public AbstractVector {
+class InputVectorTile : public AbstractVector, public ArenaAllocated {
 
     public:
 
@@ -124,18 +125,18 @@ class InputVectorImpl : public AbstractVector {
 
 };
 
-class InputImagePixelStreamTile : public AbstractImagePixelStream {
+class InputImagePixelStreamTile : public AbstractImagePixelStream, public ArenaAllocated {
 
     protected:
 
-        std::vector< std::vector<InputVectorTile*> > stream_;
+        InputVectorTile* element_; /* Written by the host once for every pixel of the stream */
 
     public:
 
         InputImagePixelStreamTile(ModelImpl* model, std::string name, unsigned int imageWidth, unsigned int imageHeight, unsigned int nChannels);
         ~InputImagePixelStreamTile();
 
-        InputVectorTile* get(unsigned int h, unsigned int w);
+        InputVectorTile* get() { return element_; }
 
         std::string printNodeStyle();
         std::string printTensorType();
@@ -180,18 +181,20 @@ class VectorImpl : public AbstractVector {
 
 };
 
-class ImagePixelStreamTile : public AbstractImagePixelStream {
+class ImagePixelStreamTile : public AbstractImagePixelStream, public ArenaAllocated {
 
     protected:
 
-        std::vector< std::vector<ProducerOperation*> > stream_;
+        ProducerOperation* element_;    /* Produces every pixel of the stream, one per iteration of its stream loop */
+        StoreOperation* buffer_;        /* Stores the pixels to tile memory for consumers that access them out of order */
 
     public:
 
         ImagePixelStreamTile(ModelImpl* model, unsigned int imageWidth, unsigned int imageHeight, unsigned int nChannels);
 
-        void add(unsigned int h, unsigned int w, ProducerOperation* vec);
-        ProducerOperation* get(unsigned int h, unsigned int w);
+        void set(ProducerOperation* element);
+        ProducerOperation* get() { return element_; }
+        StoreOperation* getBuffer();
 
         std::string printTensorType();
 
@@ -215,7 +218,7 @@ class ImagePixelStreamImpl : public AbstractImagePixelStream {
 
 };
 
-class OutputVectorTile : public AbstractVector {
+class OutputVectorTile : public AbstractVector, public ArenaAllocated {
 
     public:
 
@@ -246,18 +249,18 @@ class OutputVectorImpl : public AbstractVector {
 
 };
 
-class OutputImagePixelStreamTile : public AbstractImagePixelStream {
+class OutputImagePixelStreamTile : public AbstractImagePixelStream, public ArenaAllocated {
 
     protected:
 
-        std::vector< std::vector<OutputVectorTile*> > stream_;
+        OutputVectorTile* element_; /* Read by the host once for every pixel of the stream */
 
     public:
 
         OutputImagePixelStreamTile(ModelImpl* model, std::string name, unsigned int imageWidth, unsigned int imageHeight, unsigned int nChannels);
         ~OutputImagePixelStreamTile();
 
-        OutputVectorTile* get(unsigned int h, unsigned int w);
+        OutputVectorTile* get() { return element_; }
 
         std::string printNodeStyle();
         std::string printTensorType();
@@ -284,7 +287,7 @@ class OutputImagePixelStreamImpl : public AbstractImagePixelStream {
 
 };
 
-class ConstantMatrixTile : public AbstractMatrix {
+class ConstantMatrixTile : public AbstractMatrix, public ArenaAllocated {
 
     protected:
 
@@ -344,6 +347,10 @@ class ConvolutionalConstantMatrixImpl : public AbstractTensor {
         unsigned int getNOutChannels() { return nOutChannels_; }
         unsigned int getNInChannelTiles() { return (nInChannels_ - 1)/MVMU_DIM + 1; }
         unsigned int getNOutChannelTiles() { return (nOutChannels_ - 1)/MVMU_DIM + 1; }
+        /* Kernels whose positions all fit in the rows of one MVMU are folded into a single tile per output channel tile (im2col) */
+        bool isKernelFolded() { return kernelHeight_*kernelWidth_ > 1 && kernelHeight_*kernelWidth_*nInChannels_ <= MVMU_DIM; }
+        unsigned int getNKernelHeightTiles() { return isKernelFolded()?1:kernelHeight_; }
+        unsigned int getNKernelWidthTiles() { return isKernelFolded()?1:kernelWidth_; }
         ConstantMatrixTile* getTile(unsigned int kh, unsigned int kw, unsigned int h, unsigned int w);
         void checkCompatibility(AbstractImagePixelStream* vs);
 
@@ -351,7 +358,7 @@ class ConvolutionalConstantMatrixImpl : public AbstractTensor {
 
 };
 
-class TrainingMatrixTile : public AbstractMatrix {
+class TrainingMatrixTile : public AbstractMatrix, public ArenaAllocated {
 
     protected:
 
@@ -0,0 +1,68 @@
+/*
+ *  Copyright (c) 2019 IMPACT Research Group, University of Illinois.
+ *  All rights reserved.
+ *
+ *  This file is covered by the LICENSE.txt license file in the root directory.
+ *
+ */
+
+#ifndef _TRAVERSAL_H_
+#define _TRAVERSAL_H_
+
+#include <vector>
+
+/*
+ * Depth first walk of a graph from root that keeps its path on an explicit stack, so that its depth is not limited by
+ * the process stack. It does exactly what this recursive walk would do:
+ *
+ *     walk(node): getChildren(node, children); for each child: if(enter(node, child)) walk(child); leave(node)
+ *
+ * Each child is offered to enter only after the walk of its previous sibling has finished, so enter sees the effects
+ * of those walks. The root is always walked. Walking the predecessors of operations and acting in leave visits them in
+ * postorder (a topological order of the graph, i.e. reverse postorder over successors), while acting in enter spreads
+ * a property from each node to its children as long as enter accepts them.
+ */
+template <class Node, class GetChildren, class Enter, class Leave>
+void walkDepthFirst(Node root, GetChildren getChildren, Enter enter, Leave leave) {
+    struct Frame {
+        Node node;
+        unsigned int firstChild; // Children of node are children[firstChild, endChild)
+        unsigned int nextChild; // Next child of node to offer to enter
+        unsigned int endChild;
+    };
+    std::vector<Frame> stack;
+    std::vector<Node> children; // Children of the nodes on the stack, in stack order
+    std::vector<Node> nodeChildren;
+    auto push = [&](Node node) {
+        nodeChildren.clear();
+        getChildren(node, nodeChildren);
+        unsigned int firstChild = children.size();
+        children.insert(children.end(), nodeChildren.begin(), nodeChildren.end());
+        stack.push_back(Frame{node, firstChild, firstChild, (unsigned int) children.size()});
+    };
+    push(root);
+    while(!stack.empty()) {
+        Frame& frame = stack.back();
+        if(frame.nextChild < frame.endChild) {
+            Node parent = frame.node;
+            Node child = children[frame.nextChild++];
+            if(enter(parent, child)) {
+                push(child);
+            }
+        } else {
+            Node node = frame.node;
+            children.erase(children.begin() + frame.firstChild, children.end()); // The top frame's children are the last ones
+            stack.pop_back();
+            leave(node);
+        }
+    }
+}
+
+/* Depth first walk that only spreads from nodes to the children enter accepts, see walkDepthFirst */
+template <class Node, class GetChildren, class Enter>
+void spreadDepthFirst(Node root, GetChildren getChildren, Enter enter) {
+    walkDepthFirst(root, getChildren, enter, [](Node) { });
+}
+
+#endif
+
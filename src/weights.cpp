@@ -0,0 +1,407 @@
+/*
+ *  Copyright (c) 2019 IMPACT Research Group, University of Illinois.
+ *  All rights reserved.
+ *
+ *  This file is covered by the LICENSE.txt license file in the root directory.
+ *
+ */
+
+#include <algorithm>
+#include <assert.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "weights.h"
+
+#define WEIGHT_IMAGE_HEADER_SIZE    32
+#define WEIGHT_IMAGE_ENTRY_SIZE     32
+
+// Fields are serialized byte by byte so that the image is little-endian regardless of the host
+static void putU16(std::vector<unsigned char>& buffer, uint16_t value) {
+    for(unsigned int i = 0; i < 2; ++i) {
+        buffer.push_back((value >> 8*i) & 0xff);
+    }
+}
+
+static void putU32(std::vector<unsigned char>& buffer, uint32_t value) {
+    for(unsigned int i = 0; i < 4; ++i) {
+        buffer.push_back((value >> 8*i) & 0xff);
+    }
+}
+
+static void putU64(std::vector<unsigned char>& buffer, uint64_t value) {
+    for(unsigned int i = 0; i < 8; ++i) {
+        buffer.push_back((value >> 8*i) & 0xff);
+    }
+}
+
+static void putF32(std::vector<unsigned char>& buffer, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    putU32(buffer, bits);
+}
+
+MemoryWeightSource::MemoryWeightSource(float* data, unsigned int width)
+    : data_(data), width_(width)
+{ }
+
+void MemoryWeightSource::read(unsigned int row, unsigned int col, unsigned int nRows, unsigned int nCols, float* dst, unsigned int stride) {
+    for(unsigned int r = 0; r < nRows; ++r) {
+        const float* src = &data_[((size_t) row + r)*width_ + col];
+        std::copy(src, src + nCols, &dst[r*stride]);
+    }
+}
+
+static float halfToFloat(uint16_t half) {
+    uint32_t sign = (uint32_t) (half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1f;
+    uint32_t mantissa = half & 0x3ff;
+    uint32_t bits;
+    if(exponent == 0x1f) {
+        // Infinity or NaN
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    } else if(exponent != 0) {
+        bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    } else if(mantissa != 0) {
+        // Subnormal half, normalized in single precision
+        exponent = 127 - 15 + 1;
+        while(!(mantissa & 0x400)) {
+            mantissa <<= 1;
+            --exponent;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    } else {
+        bits = sign;
+    }
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+FileWeightSource::FileWeightSource(std::string fileName, size_t offset, ModelInstance::MatrixLayout layout, ModelInstance::ElementType type, unsigned int height, unsigned int width)
+    : mapping_(NULL), mappingSize_(0), data_(NULL), layout_(layout), type_(type), height_(height), width_(width)
+{
+    int fd = open(fileName.c_str(), O_RDONLY);
+    assert(fd >= 0 && "Failed to open weight file");
+    struct stat fileStat;
+    int status = fstat(fd, &fileStat);
+    assert(status == 0);
+    size_t elementSize = (type == ModelInstance::ET_FLOAT16)?2:4;
+    assert(offset + (size_t) height*width*elementSize <= (size_t) fileStat.st_size && "Weight file too small for matrix");
+    mappingSize_ = fileStat.st_size;
+    if(mappingSize_ > 0) {
+        mapping_ = mmap(NULL, mappingSize_, PROT_READ, MAP_PRIVATE, fd, 0);
+        assert(mapping_ != MAP_FAILED && "Failed to map weight file");
+        data_ = (const unsigned char*) mapping_ + offset;
+    }
+    close(fd);
+}
+
+FileWeightSource::~FileWeightSource() {
+    if(mapping_ != NULL) {
+        munmap(mapping_, mappingSize_);
+    }
+}
+
+float FileWeightSource::getElement(size_t index) {
+    if(type_ == ModelInstance::ET_FLOAT16) {
+        uint16_t half;
+        memcpy(&half, &data_[2*index], sizeof(half));
+        return halfToFloat(half);
+    } else {
+        float value;
+        memcpy(&value, &data_[4*index], sizeof(value));
+        return value;
+    }
+}
+
+void FileWeightSource::read(unsigned int row, unsigned int col, unsigned int nRows, unsigned int nCols, float* dst, unsigned int stride) {
+    if(layout_ == ModelInstance::ML_ROW_MAJOR) {
+        for(unsigned int r = 0; r < nRows; ++r) {
+            size_t index = ((size_t) row + r)*width_ + col;
+            if(type_ == ModelInstance::ET_FLOAT32) {
+                memcpy(&dst[r*stride], &data_[4*index], nCols*sizeof(float));
+            } else {
+                for(unsigned int c = 0; c < nCols; ++c) {
+                    dst[r*stride + c] = getElement(index + c);
+                }
+            }
+        }
+    } else {
+        // Read each column contiguously, the destination block is small enough to stay in cache
+        for(unsigned int c = 0; c < nCols; ++c) {
+            size_t index = ((size_t) col + c)*height_ + row;
+            for(unsigned int r = 0; r < nRows; ++r) {
+                dst[r*stride + c] = getElement(index + r);
+            }
+        }
+    }
+}
+
+KernelLayoutWeightSource::KernelLayoutWeightSource(WeightSource* source, ModelInstance::KernelLayout layout, unsigned int nKernelPositions, unsigned int nInChannels, unsigned int nOutChannels)
+    : source_(source), layout_(layout), nKernelPositions_(nKernelPositions), nInChannels_(nInChannels), nOutChannels_(nOutChannels)
+{ }
+
+KernelLayoutWeightSource::~KernelLayoutWeightSource() {
+    delete source_;
+}
+
+void KernelLayoutWeightSource::read(unsigned int row, unsigned int col, unsigned int nRows, unsigned int nCols, float* dst, unsigned int stride) {
+    // Split the block at kernel position boundaries
+    while(nRows > 0) {
+        unsigned int kernelPos = row/nOutChannels_;
+        unsigned int outChannel = row%nOutChannels_;
+        unsigned int nKernelPosRows = std::min(nRows, nOutChannels_ - outChannel);
+        readKernelPosition(kernelPos, outChannel, col, nKernelPosRows, nCols, dst, stride);
+        row += nKernelPosRows;
+        nRows -= nKernelPosRows;
+        dst += nKernelPosRows*stride;
+    }
+}
+
+void KernelLayoutWeightSource::readKernelPosition(unsigned int kernelPos, unsigned int outChannel, unsigned int inChannel, unsigned int nRows, unsigned int nCols, float* dst, unsigned int stride) {
+    static thread_local std::vector<float> scratch(MVMU_DIM*MVMU_DIM);
+    for(unsigned int r = 0; r < nRows; r += MVMU_DIM) {
+        for(unsigned int c = 0; c < nCols; c += MVMU_DIM) {
+            unsigned int nBlockRows = std::min(nRows - r, (unsigned int) MVMU_DIM);
+            unsigned int nBlockCols = std::min(nCols - c, (unsigned int) MVMU_DIM);
+            float* blockDst = &dst[r*stride + c];
+            if(layout_ == ModelInstance::KL_HWIO) {
+                // Input channels are rows and output channels are columns, read the block transposed
+                source_->read(kernelPos*nInChannels_ + inChannel + c, outChannel + r, nBlockCols, nBlockRows, scratch.data(), MVMU_DIM);
+                transposeBlock(scratch.data(), MVMU_DIM, nBlockCols, nBlockRows, blockDst, stride);
+            } else if(layout_ == ModelInstance::KL_OIHW) {
+                // Kernel positions are innermost, read the input channels of the block in chunks and pick this kernel position
+                unsigned int nChunkChannels = std::max(MVMU_DIM/nKernelPositions_, 1u);
+                for(unsigned int cc = 0; cc < nBlockCols; cc += nChunkChannels) {
+                    unsigned int nChannels = std::min(nBlockCols - cc, nChunkChannels);
+                    unsigned int firstCol = (inChannel + c + cc)*nKernelPositions_ + kernelPos;
+                    unsigned int nChunkCols = (nChannels - 1)*nKernelPositions_ + 1;
+                    source_->read(outChannel + r, firstCol, nBlockRows, nChunkCols, scratch.data(), MVMU_DIM);
+                    for(unsigned int br = 0; br < nBlockRows; ++br) {
+                        for(unsigned int ch = 0; ch < nChannels; ++ch) {
+                            blockDst[br*stride + cc + ch] = scratch[br*MVMU_DIM + ch*nKernelPositions_];
+                        }
+                    }
+                }
+            } else {
+                source_->read(kernelPos*nOutChannels_ + outChannel + r, inChannel + c, nBlockRows, nBlockCols, blockDst, stride);
+            }
+        }
+    }
+}
+
+BlockWeightSource::BlockWeightSource(ModelInstance::BlockReader reader)
+    : reader_(reader)
+{ }
+
+void BlockWeightSource::read(unsigned int row, unsigned int col, unsigned int nRows, unsigned int nCols, float* dst, unsigned int stride) {
+    reader_(row, col, nRows, nCols, dst, stride);
+}
+
+void transposeBlock(const float* src, unsigned int srcStride, unsigned int nRows, unsigned int nCols, float* dst, unsigned int dstStride) {
+    // Transpose in small square blocks so that both the reads and the writes stay within a few cache lines
+    const unsigned int blockDim = 16;
+    for(unsigned int r0 = 0; r0 < nRows; r0 += blockDim) {
+        for(unsigned int c0 = 0; c0 < nCols; c0 += blockDim) {
+            unsigned int rEnd = std::min(r0 + blockDim, nRows);
+            unsigned int cEnd = std::min(c0 + blockDim, nCols);
+            for(unsigned int r = r0; r < rEnd; ++r) {
+                for(unsigned int c = c0; c < cEnd; ++c) {
+                    dst[c*dstStride + r] = src[r*srcStride + c];
+                }
+            }
+        }
+    }
+}
+
+WeightImageWriter::WeightImageWriter(std::string fileName, bool elideZeroRegions)
+    : elideZeroRegions_(elideZeroRegions), offset_(0)
+{
+    out_.open(fileName, std::ios::out | std::ios::binary | std::ios::trunc);
+    assert(out_.is_open() && "Failed to open weight image");
+
+    // The header is rewritten with the final index location on close
+    std::vector<unsigned char> header(WEIGHT_IMAGE_HEADER_SIZE, 0);
+    out_.write((const char*) header.data(), header.size());
+    offset_ = WEIGHT_IMAGE_HEADER_SIZE;
+}
+
+void WeightImageWriter::pad() {
+    uint64_t padding = (WEIGHT_IMAGE_ALIGNMENT - offset_%WEIGHT_IMAGE_ALIGNMENT)%WEIGHT_IMAGE_ALIGNMENT;
+    if(padding > 0) {
+        std::vector<unsigned char> zeros(padding, 0);
+        out_.write((const char*) zeros.data(), padding);
+        offset_ += padding;
+    }
+}
+
+void WeightImageWriter::addMVMU(unsigned int pTile, unsigned int pCore, unsigned int pMVMU, bool transposed, const float* crossbar) {
+
+    // Find the bounding box of the nonzero elements
+    unsigned int rowBegin = 0;
+    unsigned int rowEnd = MVMU_DIM;
+    unsigned int colBegin = 0;
+    unsigned int colEnd = MVMU_DIM;
+    if(elideZeroRegions_) {
+        rowBegin = MVMU_DIM;
+        rowEnd = 0;
+        colBegin = MVMU_DIM;
+        colEnd = 0;
+        for(unsigned int row = 0; row < MVMU_DIM; ++row) {
+            for(unsigned int col = 0; col < MVMU_DIM; ++col) {
+                if(crossbar[row*MVMU_DIM + col] != 0.0f) {
+                    rowBegin = std::min(rowBegin, row);
+                    rowEnd = std::max(rowEnd, row + 1);
+                    colBegin = std::min(colBegin, col);
+                    colEnd = std::max(colEnd, col + 1);
+                }
+            }
+        }
+        if(rowBegin >= rowEnd) {
+            // All-zero crossbar, store an empty block
+            rowBegin = rowEnd = colBegin = colEnd = 0;
+        }
+    }
+
+    pad();
+    Entry entry = { pTile, pCore, pMVMU, (uint16_t) rowBegin, (uint16_t) rowEnd, (uint16_t) colBegin, (uint16_t) colEnd, transposed, offset_ };
+    entries_.push_back(entry);
+
+    buffer_.clear();
+    for(unsigned int row = rowBegin; row < rowEnd; ++row) {
+        for(unsigned int col = colBegin; col < colEnd; ++col) {
+            putF32(buffer_, crossbar[row*MVMU_DIM + col]);
+        }
+    }
+    out_.write((const char*) buffer_.data(), buffer_.size());
+    offset_ += buffer_.size();
+
+}
+
+void WeightImageWriter::close() {
+
+    // Write the index
+    pad();
+    uint64_t indexOffset = offset_;
+    std::sort(entries_.begin(), entries_.end(), [](const Entry& a, const Entry& b) {
+        if(a.pTile != b.pTile) {
+            return a.pTile < b.pTile;
+        } else if(a.pCore != b.pCore) {
+            return a.pCore < b.pCore;
+        } else if(a.pMVMU != b.pMVMU) {
+            return a.pMVMU < b.pMVMU;
+        } else {
+            return a.transposed < b.transposed;
+        }
+    });
+    buffer_.clear();
+    for(Entry& entry : entries_) {
+        putU32(buffer_, entry.pTile);
+        putU32(buffer_, entry.pCore);
+        putU32(buffer_, entry.pMVMU);
+        putU16(buffer_, entry.rowBegin);
+        putU16(buffer_, entry.rowEnd);
+        putU16(buffer_, entry.colBegin);
+        putU16(buffer_, entry.colEnd);
+        putU32(buffer_, entry.transposed);
+        putU64(buffer_, entry.payloadOffset);
+    }
+    assert(buffer_.size() == entries_.size()*WEIGHT_IMAGE_ENTRY_SIZE);
+    out_.write((const char*) buffer_.data(), buffer_.size());
+
+    // Write the header
+    buffer_.clear();
+    const char* magic = "PUMAWGT1";
+    buffer_.insert(buffer_.end(), magic, magic + 8);
+    putU32(buffer_, WEIGHT_IMAGE_VERSION);
+    putU32(buffer_, MVMU_DIM);
+    putU32(buffer_, entries_.size());
+    putU32(buffer_, 0);
+    putU64(buffer_, indexOffset);
+    assert(buffer_.size() == WEIGHT_IMAGE_HEADER_SIZE);
+    out_.seekp(0);
+    out_.write((const char*) buffer_.data(), buffer_.size());
+
+    out_.close();
+
+}
+
+WeightBlockQueue::WeightBlockQueue(unsigned int nBlocks, std::function<void(unsigned int, unsigned int, unsigned int, bool, const float*)> write)
+    : write_(write), nextIndex_(0), finished_(false)
+{
+    assert(nBlocks > 0);
+    for(unsigned int b = 0; b < nBlocks; ++b) {
+        float* block = new float[MVMU_DIM*MVMU_DIM];
+        blocks_.push_back(block);
+        freeBlocks_.push_back(block);
+    }
+    writer_ = std::thread(&WeightBlockQueue::writerLoop, this);
+}
+
+WeightBlockQueue::~WeightBlockQueue() {
+    finish();
+    for(float* block : blocks_) {
+        delete[] block;
+    }
+}
+
+float* WeightBlockQueue::acquire(unsigned int index) {
+    float* block;
+    {
+        // The blocks in use all have indices in the window, so one is free once index is in it
+        std::unique_lock<std::mutex> lock(mutex_);
+        freeBlockAvailable_.wait(lock, [&]() { return index < nextIndex_ + blocks_.size() && !freeBlocks_.empty(); });
+        block = freeBlocks_.back();
+        freeBlocks_.pop_back();
+    }
+    std::fill(block, block + MVMU_DIM*MVMU_DIM, 0.0f);
+    return block;
+}
+
+void WeightBlockQueue::submit(unsigned int index, unsigned int pTile, unsigned int pCore, unsigned int pMVMU, bool transposed, float* block) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        assert(!finished_ && index >= nextIndex_ && !pending_.count(index));
+        pending_[index] = Block{ pTile, pCore, pMVMU, transposed, block };
+    }
+    pendingBlockAvailable_.notify_one();
+}
+
+void WeightBlockQueue::finish() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        finished_ = true;
+    }
+    pendingBlockAvailable_.notify_one();
+    if(writer_.joinable()) {
+        writer_.join();
+    }
+}
+
+void WeightBlockQueue::writerLoop() {
+    while(true) {
+        Block block;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            pendingBlockAvailable_.wait(lock, [&]() { return finished_ || pending_.count(nextIndex_); });
+            if(!pending_.count(nextIndex_)) {
+                assert(pending_.empty() && "Block indices must not have gaps!");
+                return;
+            }
+            block = pending_[nextIndex_];
+            pending_.erase(nextIndex_);
+        }
+        write_(block.pTile, block.pCore, block.pMVMU, block.transposed, block.data);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            freeBlocks_.push_back(block.data);
+            ++nextIndex_;
+        }
+        freeBlockAvailable_.notify_all(); // Producers wait for different indices
+    }
+}
+
@@ -0,0 +1,227 @@
+/*
+ *  Copyright (c) 2019 IMPACT Research Group, University of Illinois.
+ *  All rights reserved.
+ *
+ *  This file is covered by the LICENSE.txt license file in the root directory.
+ *
+ */
+
+#ifndef _WEIGHTS_H_
+#define _WEIGHTS_H_
+
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+#include "puma.h"
+
+/*
+ * Source of the elements of a bound height x width matrix. read() copies the nRows x nCols block starting at
+ * (row, col) into dst, whose rows are stride elements apart, and may be called concurrently.
+ */
+class WeightSource {
+
+    public:
+
+        virtual ~WeightSource() { }
+
+        virtual void read(unsigned int row, unsigned int col, unsigned int nRows, unsigned int nCols, float* dst, unsigned int stride) = 0;
+
+};
+
+class MemoryWeightSource : public WeightSource {
+
+    private:
+
+        float* data_;
+        unsigned int width_;
+
+    public:
+
+        MemoryWeightSource(float* data, unsigned int width);
+
+        void read(unsigned int row, unsigned int col, unsigned int nRows, unsigned int nCols, float* dst, unsigned int stride);
+
+};
+
+class FileWeightSource : public WeightSource {
+
+    private:
+
+        void* mapping_;
+        size_t mappingSize_;
+        const unsigned char* data_;
+        ModelInstance::MatrixLayout layout_;
+        ModelInstance::ElementType type_;
+        unsigned int height_;
+        unsigned int width_;
+
+        float getElement(size_t index);
+
+    public:
+
+        FileWeightSource(std::string fileName, size_t offset, ModelInstance::MatrixLayout layout, ModelInstance::ElementType type, unsigned int height, unsigned int width);
+        ~FileWeightSource();
+
+        void read(unsigned int row, unsigned int col, unsigned int nRows, unsigned int nCols, float* dst, unsigned int stride);
+
+};
+
+/*
+ * Presents the data of a convolutional matrix bound in another kernel layout as the
+ * (kernelHeight*kernelWidth*nOutChannels) x nInChannels matrix of the KL_HWOI layout. The wrapped source is read
+ * as a kernelHeight*kernelWidth*nInChannels x nOutChannels matrix for KL_HWIO and as a
+ * nOutChannels x nInChannels*kernelHeight*kernelWidth matrix for KL_OIHW, and blocks are repacked as they are read.
+ */
+class KernelLayoutWeightSource : public WeightSource {
+
+    private:
+
+        WeightSource* source_;
+        ModelInstance::KernelLayout layout_;
+        unsigned int nKernelPositions_;
+        unsigned int nInChannels_;
+        unsigned int nOutChannels_;
+
+        void readKernelPosition(unsigned int kernelPos, unsigned int outChannel, unsigned int inChannel, unsigned int nRows, unsigned int nCols, float* dst, unsigned int stride);
+
+    public:
+
+        KernelLayoutWeightSource(WeightSource* source, ModelInstance::KernelLayout layout, unsigned int nKernelPositions, unsigned int nInChannels, unsigned int nOutChannels);
+        ~KernelLayoutWeightSource();
+
+        void read(unsigned int row, unsigned int col, unsigned int nRows, unsigned int nCols, float* dst, unsigned int stride);
+
+};
+
+class BlockWeightSource : public WeightSource {
+
+    private:
+
+        ModelInstance::BlockReader reader_;
+
+    public:
+
+        BlockWeightSource(ModelInstance::BlockReader reader);
+
+        void read(unsigned int row, unsigned int col, unsigned int nRows, unsigned int nCols, float* dst, unsigned int stride);
+
+};
+
+// Writes the transpose of the nRows x nCols block src, whose rows are srcStride elements apart, into dst
+void transposeBlock(const float* src, unsigned int srcStride, unsigned int nRows, unsigned int nCols, float* dst, unsigned int dstStride);
+
+/*
+ * Binary weight image holding the crossbars of all MVMUs of a model, designed to be memory-mapped by loaders. All
+ * fields are little-endian.
+ *
+ *   Header (32 bytes at offset 0):
+ *     char     magic[8]        "PUMAWGT1"
+ *     uint32   version         WEIGHT_IMAGE_VERSION
+ *     uint32   mvmuDim         MVMU_DIM
+ *     uint32   nEntries        number of index entries
+ *     uint32   reserved        0
+ *     uint64   indexOffset     offset of the index
+ *
+ *   Index (nEntries entries of 32 bytes at indexOffset, sorted by (pTile, pCore, pMVMU, transposed)):
+ *     uint32   pTile, pCore, pMVMU
+ *     uint16   rowBegin, rowEnd, colBegin, colEnd      only this block of the crossbar is stored, the rest is zero
+ *     uint32   transposed      0 for the crossbar used by MVMs, 1 for the transposed crossbar used by MVM_TRANSPOSE
+ *     uint64   payloadOffset   offset of the block, aligned to WEIGHT_IMAGE_ALIGNMENT
+ *
+ *   Payloads: float32 elements of each stored block in row-major order.
+ *
+ * Payloads follow the header in the order the MVMUs are added, and the index follows the last payload. Data generation
+ * adds them in index order, so the image is the same on every run.
+ */
+
+#define WEIGHT_IMAGE_VERSION    2
+#define WEIGHT_IMAGE_ALIGNMENT  64
+
+class WeightImageWriter {
+
+    private:
+
+        struct Entry {
+            uint32_t pTile;
+            uint32_t pCore;
+            uint32_t pMVMU;
+            uint16_t rowBegin;
+            uint16_t rowEnd;
+            uint16_t colBegin;
+            uint16_t colEnd;
+            uint32_t transposed;
+            uint64_t payloadOffset;
+        };
+
+        std::ofstream out_;
+        bool elideZeroRegions_;
+        uint64_t offset_;
+        std::vector<Entry> entries_;
+        std::vector<unsigned char> buffer_;
+
+        void pad();
+
+    public:
+
+        WeightImageWriter(std::string fileName, bool elideZeroRegions);
+
+        // Adds the MVMU_DIM x MVMU_DIM crossbar of an MVMU, in row-major order
+        void addMVMU(unsigned int pTile, unsigned int pCore, unsigned int pMVMU, bool transposed, const float* crossbar);
+        void close();
+
+};
+
+/*
+ * Bounded pool of MVMU_DIM x MVMU_DIM crossbar blocks shared by the threads assembling crossbars and a writer thread
+ * that consumes them in the order of their indices, which run from 0 without gaps. At most nBlocks blocks exist at any
+ * time, so a producer waits in acquire() until its index is less than nBlocks past the next one to be written. Each
+ * producer must submit a block before acquiring the next one, and indices must be handed out to producers in order.
+ */
+class WeightBlockQueue {
+
+    private:
+
+        struct Block {
+            unsigned int pTile;
+            unsigned int pCore;
+            unsigned int pMVMU;
+            bool transposed;
+            float* data;
+        };
+
+        std::function<void(unsigned int, unsigned int, unsigned int, bool, const float*)> write_;
+        std::vector<float*> blocks_;
+        std::vector<float*> freeBlocks_;
+        std::map<unsigned int, Block> pending_; // Submitted blocks by index
+        unsigned int nextIndex_; // Index of the next block to write
+        bool finished_;
+        std::mutex mutex_;
+        std::condition_variable freeBlockAvailable_;
+        std::condition_variable pendingBlockAvailable_;
+        std::thread writer_;
+
+        void writerLoop();
+
+    public:
+
+        WeightBlockQueue(unsigned int nBlocks, std::function<void(unsigned int, unsigned int, unsigned int, bool, const float*)> write);
+        ~WeightBlockQueue();
+
+        // Returns a zeroed block for the given index
+        float* acquire(unsigned int index);
+        void submit(unsigned int index, unsigned int pTile, unsigned int pCore, unsigned int pMVMU, bool transposed, float* block);
+        // Waits until all submitted blocks are written
+        void finish();
+
+};
+
+#endif
+
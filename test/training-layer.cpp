@@ -0,0 +1,49 @@
+/*
+ *  Copyright (c) 2019 IMPACT Research Group, University of Illinois.
+ *  All rights reserved.
+ *
+ *  This file is covered by the LICENSE.txt license file in the root directory.
+ *
+ */
+
+#include "puma.h"
+#include "training-layer.h"
+
+int main(int argc, char** argv) {
+
+    Model model = Model::create("training-layer");
+
+    // Process parameters
+    unsigned int in_size = 256;
+    unsigned int out_size = 256;
+    if(argc == 3) {
+        in_size = atoi(argv[1]);
+        out_size = atoi(argv[2]);
+    }
+
+    // Input
+    auto in = InputVector::create(model, "in", in_size);
+    auto target = InputVector::create(model, "target", out_size);
+
+    // Output
+    auto in_delta = OutputVector::create(model, "in_delta", in_size);
+
+    // Layer
+    in_delta = training_layer(model, "", in_size, out_size, 0.01, in, target);
+
+    // Compile
+    model.compile();
+
+    // Bind data
+    ModelInstance modelInstance = ModelInstance::create(model);
+    float* weights = new float[in_size*out_size];
+    training_layer_bind(modelInstance, "", weights);
+    modelInstance.generateData();
+
+    // Destroy model
+    model.destroy();
+    delete[] weights;
+
+    return 0;
+
+}
@@ -0,0 +1,38 @@
+/*
+ *  Copyright (c) 2019 IMPACT Research Group, University of Illinois.
+ *  All rights reserved.
+ *
+ *  This file is covered by the LICENSE.txt license file in the root directory.
+ *
+ */
+
+#ifndef _PUMA_TEST_TRAINING_LAYER_
+#define _PUMA_TEST_TRAINING_LAYER_
+
+#include "puma.h"
+
+// Runs one training step of a sigmoid layer and returns the error propagated back to its input
+static Vector training_layer(Model model, std::string layerName, unsigned int in_size, unsigned int out_size, float learning_rate, Vector in, Vector target) {
+
+    TrainingMatrix mat = TrainingMatrix::create(model, layerName + "mat", in_size, out_size);
+
+    // Forward pass
+    Vector out = sig(mat*in);
+
+    // Backward pass (the error of a sigmoid output under cross-entropy loss is its difference from the target)
+    Vector delta = out - target;
+    Vector in_delta = Transpose(mat)*delta;
+
+    // Weight update
+    mat -= OuterProduct(learning_rate*delta, in);
+
+    return in_delta;
+
+}
+
+static void training_layer_bind(ModelInstance modelInstance, std::string layerName, float* weights) {
+    modelInstance.bind(layerName + "mat", weights);
+}
+
+#endif
+